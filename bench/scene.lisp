@@ -0,0 +1,13 @@
+(color 4473924
+       (color 5588019
+	      (position 1 2
+			(size 10 10 (rectangle))
+			(size 20 20
+			      (position 10 5
+					(rectangle)
+					(size 1 1
+					      (scale 1 2 1
+						     (translate 10 0 10
+								(rotate 0 0 1 45
+									(rectangle)
+									(polygon 1 0 0 0 1 0 0 0 0))))))))))
@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Arena.
+// A list of memory blocks with a bump pointer. Rewinding moves the pointer
+// back, the blocks are kept so the next evaluation does not allocate again.
+// Symbol values are restored from an undo log with the value of each symbol
+// before its first change, so a rewind costs the number of symbols changed.
+
+#define ARENA_MIN_BLOCK 4096
+#define ARENA_ALIGN 16
+
+// bump allocates from any arena, also the ones that are never rewound.
+void * jamlisp_block_alloc(jamlisp_arena * arena, size_t size){
+  size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  var block = arena->current;
+  while(block == NULL || block->offset + size > block->size){
+    if(block != NULL && block->next != NULL && block->next->size >= size){
+      block = block->next;
+      block->offset = 0;
+      continue;
+    }
+    size_t block_size = MAX(size, block == NULL ? ARENA_MIN_BLOCK : block->size * 2);
+    jamlisp_arena_block * new_block = alloc0(sizeof(*new_block) + block_size);
+    new_block->size = block_size;
+    if(block == NULL){
+      new_block->next = arena->first;
+      arena->first = new_block;
+    }else{
+      new_block->next = block->next;
+      block->next = new_block;
+    }
+    block = new_block;
+  }
+  arena->current = block;
+  void * out = block->data + block->offset;
+  block->offset += size;
+  return out;
+}
+
+void * jamlisp_arena_alloc(jamlisp_context * ctx, size_t size){
+  ASSERT(ctx->arena.depth > 0);
+  return jamlisp_block_alloc(&ctx->arena, size);
+}
+
+jamlisp_checkpoint jamlisp_arena_begin(jamlisp_context * ctx){
+  var heap = &ctx->heap;
+  jamlisp_checkpoint cp = {0};
+  cp.arena_base = heap->arena_base;
+  if(heap->arena_base == 0)
+    heap->arena_base = heap->used = MAX(heap->used, 1);
+  ctx->arena.depth += 1;
+
+  cp.block = ctx->arena.current;
+  cp.offset = cp.block == NULL ? 0 : cp.block->offset;
+  cp.cons_used = heap->used;
+  cp.value_stack_count = ctx->value_stack.count;
+  cp.symbol_value_stack_count = ctx->symbol_value_stack.count;
+  cp.frame_index = ctx->frame_index;
+  cp.cframe_count = ctx->cframe_count;
+  cp.bignum_block = ctx->bignums.current;
+  cp.bignum_offset = cp.bignum_block == NULL ? 0 : cp.bignum_block->offset;
+  cp.symbol_undo_count = ctx->symbol_undo_count;
+  cp.undo_epoch = ctx->undo_epoch;
+  // every symbol saves its value again in the new epoch.
+  ctx->undo_epoch = ++ctx->undo_epoch_counter;
+  return cp;
+}
+
+static void arena_set_position(jamlisp_arena * arena, jamlisp_arena_block * block, size_t offset){
+  if(block == NULL){
+    block = arena->first;
+    offset = 0;
+  }
+  arena->current = block;
+  if(block != NULL)
+    block->offset = offset;
+}
+
+void jamlisp_arena_rewind(jamlisp_context * ctx, const jamlisp_checkpoint * cp){
+  arena_set_position(&ctx->arena, cp->block, cp->offset);
+  arena_set_position(&ctx->bignums, cp->bignum_block, cp->bignum_offset);
+  ctx->heap.used = cp->cons_used;
+  ctx->value_stack.count = cp->value_stack_count;
+  ctx->symbol_value_stack.count = cp->symbol_value_stack_count;
+  ctx->frame_index = cp->frame_index;
+  ctx->cframe_count = cp->cframe_count;
+
+  // the symbols changed since the checkpoint get their old value back, a
+  // symbol saved more than once ends with the oldest value.
+  for(size_t i = ctx->symbol_undo_count; i > cp->symbol_undo_count; i--){
+    var undo = ctx->symbol_undo[i - 1];
+    ctx->symbol_values[JAMLISP_SYMBOL_ID(undo.symbol)] = undo.value;
+  }
+  ctx->symbol_undo_count = cp->symbol_undo_count;
+  ctx->undo_epoch = ++ctx->undo_epoch_counter;
+  // functions defined in the arena are gone.
+  ctx->symbol_version += 1;
+}
+
+void jamlisp_arena_end(jamlisp_context * ctx, const jamlisp_checkpoint * cp){
+  ASSERT(ctx->arena.depth > 0);
+  jamlisp_arena_rewind(ctx, cp);
+  ctx->undo_epoch = cp->undo_epoch;
+  ctx->arena.depth -= 1;
+  ctx->heap.arena_base = cp->arena_base;
+  if(ctx->arena.depth == 0){
+    for(size_t i = 0; i < ctx->parser_writer_count; i++)
+      io_writer_clear(ctx->parser_writers + i);
+    ctx->parser_writer_count = 0;
+  }
+}
@@ -0,0 +1,524 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Arrays.
+// Primitives working on whole F32, F64 and INT64 arrays. The kernels are
+// written once with GCC vector extensions and compiled for each
+// jamlisp_simd_level, the vector width being 1 for the scalar fallback.
+// jamlisp_new picks the highest level the cpu supports. Integer arrays wrap
+// around on overflow. The result arrays are allocated like any other array,
+// in the arena if one is active.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ARRAYS_X86 1
+#else
+#define ARRAYS_X86 0
+#endif
+
+#define LOAD(v, p) memcpy(&(v), (p), sizeof(v))
+#define STORE(p, v) memcpy((p), &(v), sizeof(v))
+
+// add, mul, fma, dot and sum for NAME##_vec, LANES elements of T.
+#define ARITH_KERNELS(NAME, T, LANES, ATTR)				\
+  typedef T NAME##_vec __attribute__((vector_size(sizeof(T) * (LANES)))); \
+  ARITH_BINARY(NAME, T, LANES, ATTR, add, +)				\
+  ARITH_BINARY(NAME, T, LANES, ATTR, mul, *)				\
+  ATTR static void NAME##_fma(void * r, const void * a, const void * b, const void * c, size_t n){ \
+    T * out = r;							\
+    const T * x = a, * y = b, * z = c;					\
+    size_t i = 0;							\
+    for(; i + (LANES) <= n; i += (LANES)){				\
+      NAME##_vec u, v, w;						\
+      LOAD(u, x + i); LOAD(v, y + i); LOAD(w, z + i);			\
+      u = u * v + w;							\
+      STORE(out + i, u);						\
+    }									\
+    for(; i < n; i++)							\
+      out[i] = x[i] * y[i] + z[i];					\
+  }									\
+  ATTR static void NAME##_dot(void * r, const void * a, const void * b, size_t n){ \
+    const T * x = a, * y = b;						\
+    /* two accumulators, so the adds do not wait on each other. */	\
+    NAME##_vec acc0 = {0}, acc1 = {0};					\
+    size_t i = 0;							\
+    for(; i + 2 * (LANES) <= n; i += 2 * (LANES)){			\
+      NAME##_vec u0, v0, u1, v1;					\
+      LOAD(u0, x + i); LOAD(v0, y + i);					\
+      LOAD(u1, x + i + (LANES)); LOAD(v1, y + i + (LANES));		\
+      acc0 += u0 * v0;							\
+      acc1 += u1 * v1;							\
+    }									\
+    acc0 += acc1;							\
+    T s = 0;								\
+    for(int l = 0; l < (LANES); l++)					\
+      s += acc0[l];							\
+    for(; i < n; i++)							\
+      s += x[i] * y[i];							\
+    memcpy(r, &s, sizeof(s));						\
+  }									\
+  ATTR static void NAME##_sum(void * r, const void * a, size_t n){	\
+    const T * x = a;							\
+    NAME##_vec acc0 = {0}, acc1 = {0};					\
+    size_t i = 0;							\
+    for(; i + 2 * (LANES) <= n; i += 2 * (LANES)){			\
+      NAME##_vec u0, u1;						\
+      LOAD(u0, x + i); LOAD(u1, x + i + (LANES));			\
+      acc0 += u0;							\
+      acc1 += u1;							\
+    }									\
+    acc0 += acc1;							\
+    T s = 0;								\
+    for(int l = 0; l < (LANES); l++)					\
+      s += acc0[l];							\
+    for(; i < n; i++)							\
+      s += x[i];							\
+    memcpy(r, &s, sizeof(s));						\
+  }
+
+#define ARITH_BINARY(NAME, T, LANES, ATTR, OPNAME, OP)			\
+  ATTR static void NAME##_##OPNAME(void * r, const void * a, const void * b, size_t n){ \
+    T * out = r;							\
+    const T * x = a, * y = b;						\
+    size_t i = 0;							\
+    for(; i + (LANES) <= n; i += (LANES)){				\
+      NAME##_vec u, v;							\
+      LOAD(u, x + i); LOAD(v, y + i);					\
+      u = u OP v;							\
+      STORE(out + i, u);						\
+    }									\
+    for(; i < n; i++)							\
+      out[i] = x[i] OP y[i];						\
+  }
+
+// min and max, n is at least 1.
+#define ORDER_KERNELS(NAME, T, LANES, ATTR)				\
+  typedef T NAME##_ovec __attribute__((vector_size(sizeof(T) * (LANES)))); \
+  ORDER_REDUCE(NAME, T, LANES, ATTR, min, <)				\
+  ORDER_REDUCE(NAME, T, LANES, ATTR, max, >)
+
+#define ORDER_REDUCE(NAME, T, LANES, ATTR, OPNAME, CMP)			\
+  ATTR static void NAME##_##OPNAME(void * r, const void * a, size_t n){ \
+    const T * x = a;							\
+    T s = x[0];								\
+    size_t i = 0;							\
+    if(n >= (LANES)){							\
+      NAME##_ovec acc;							\
+      LOAD(acc, x);							\
+      for(i = (LANES); i + (LANES) <= n; i += (LANES)){			\
+	NAME##_ovec u;							\
+	LOAD(u, x + i);							\
+	for(int l = 0; l < (LANES); l++)				\
+	  acc[l] = u[l] CMP acc[l] ? u[l] : acc[l];			\
+      }									\
+      s = acc[0];							\
+      for(int l = 1; l < (LANES); l++)					\
+	s = acc[l] CMP s ? acc[l] : s;					\
+    }									\
+    for(; i < n; i++)							\
+      s = x[i] CMP s ? x[i] : s;					\
+    memcpy(r, &s, sizeof(s));						\
+  }
+
+// the columns of the matrix are vectors of 4, so a vector is transformed
+// with 4 multiplies and adds of them.
+#define TRANSFORM_KERNEL(NAME, T, ATTR)					\
+  typedef T NAME##_vec4 __attribute__((vector_size(sizeof(T) * 4)));	\
+  ATTR static void NAME##_transform(void * r, const void * m, const void * v, size_t count, u32 width){ \
+    const T * mat = m, * in = v;					\
+    T * out = r;							\
+    NAME##_vec4 col[4];							\
+    for(int k = 0; k < 4; k++)						\
+      col[k] = (NAME##_vec4){mat[k], mat[4 + k], mat[8 + k], mat[12 + k]}; \
+    if(width == 4){							\
+      for(size_t i = 0; i < count; i++){				\
+	const T * p = in + i * 4;					\
+	NAME##_vec4 res = col[0] * p[0] + col[1] * p[1] + col[2] * p[2] + col[3] * p[3]; \
+	STORE(out + i * 4, res);					\
+      }									\
+      return;								\
+    }									\
+    for(size_t i = 0; i < count; i++){					\
+      const T * p = in + i * 3;						\
+      NAME##_vec4 res = col[0] * p[0] + col[1] * p[1] + col[2] * p[2] + col[3]; \
+      memcpy(out + i * 3, &res, sizeof(T) * 3);			\
+    }									\
+  }
+
+// the same sums in the same order as TRANSFORM_KERNEL.
+#define SCALAR_TRANSFORM(NAME, T, ATTR)					\
+  ATTR static void NAME##_transform(void * r, const void * m, const void * v, size_t count, u32 width){ \
+    const T * mat = m, * in = v;					\
+    T * out = r;							\
+    for(size_t i = 0; i < count; i++){					\
+      const T * p = in + i * width;					\
+      T w = width == 4 ? p[3] : 1;					\
+      for(u32 row = 0; row < width; row++){				\
+	const T * c = mat + row * 4;					\
+	out[i * width + row] = c[0] * p[0] + c[1] * p[1] + c[2] * p[2] + c[3] * w; \
+      }									\
+    }									\
+  }
+
+// integers use unsigned arithmetic, so overflow wraps.
+#define LEVEL_KERNELS(LEVEL, F32_LANES, F64_LANES, I64_LANES, ATTR)	\
+  ARITH_KERNELS(f32_##LEVEL, f32, F32_LANES, ATTR)			\
+  ORDER_KERNELS(f32_##LEVEL, f32, F32_LANES, ATTR)			\
+  ARITH_KERNELS(f64_##LEVEL, f64, F64_LANES, ATTR)			\
+  ORDER_KERNELS(f64_##LEVEL, f64, F64_LANES, ATTR)			\
+  ARITH_KERNELS(i64_##LEVEL, u64, I64_LANES, ATTR)			\
+  ORDER_KERNELS(i64_##LEVEL, i64, I64_LANES, ATTR)
+
+#define KERNEL_TABLE(NAME, TRANSFORM) {NAME##_add, NAME##_mul, NAME##_fma, NAME##_dot, NAME##_sum, NAME##_min, NAME##_max, TRANSFORM}
+#define LEVEL_TABLE(LEVEL)						\
+  {									\
+    [JAMLISP_ARRAY_F32] = KERNEL_TABLE(f32_##LEVEL, f32_##LEVEL##_transform), \
+    [JAMLISP_ARRAY_F64] = KERNEL_TABLE(f64_##LEVEL, f64_##LEVEL##_transform), \
+    [JAMLISP_ARRAY_I64] = KERNEL_TABLE(i64_##LEVEL, NULL),		\
+  }
+
+// the scalar code is kept scalar, it is the baseline the others are measured against.
+#define SCALAR_ATTR __attribute__((optimize("no-tree-vectorize")))
+LEVEL_KERNELS(scalar, 1, 1, 1, SCALAR_ATTR)
+SCALAR_TRANSFORM(f32_scalar, f32, SCALAR_ATTR)
+SCALAR_TRANSFORM(f64_scalar, f64, SCALAR_ATTR)
+
+#if ARRAYS_X86
+#define SSE_ATTR __attribute__((target("sse4.2")))
+LEVEL_KERNELS(sse, 4, 2, 2, SSE_ATTR)
+TRANSFORM_KERNEL(f32_sse, f32, SSE_ATTR)
+TRANSFORM_KERNEL(f64_sse, f64, SSE_ATTR)
+
+#define AVX2_ATTR __attribute__((target("avx2,fma")))
+LEVEL_KERNELS(avx2, 8, 4, 4, AVX2_ATTR)
+TRANSFORM_KERNEL(f32_avx2, f32, AVX2_ATTR)
+TRANSFORM_KERNEL(f64_avx2, f64, AVX2_ATTR)
+#endif
+
+static const jamlisp_array_kernels array_kernels[JAMLISP_SIMD_LEVELS][JAMLISP_ARRAY_ELEMENTS] = {
+  [JAMLISP_SIMD_SCALAR] = LEVEL_TABLE(scalar),
+#if ARRAYS_X86
+  [JAMLISP_SIMD_SSE] = LEVEL_TABLE(sse),
+  [JAMLISP_SIMD_AVX2] = LEVEL_TABLE(avx2),
+#endif
+};
+
+static const char * simd_names[JAMLISP_SIMD_LEVELS] = {"scalar", "sse", "avx2"};
+
+jamlisp_simd_level jamlisp_simd_detect(){
+#if ARRAYS_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return JAMLISP_SIMD_AVX2;
+  if(__builtin_cpu_supports("sse4.2"))
+    return JAMLISP_SIMD_SSE;
+#endif
+  return JAMLISP_SIMD_SCALAR;
+}
+
+bool jamlisp_simd_set(jamlisp_context * ctx, jamlisp_simd_level level){
+  if(level >= JAMLISP_SIMD_LEVELS || level > jamlisp_simd_detect())
+    return false;
+  ctx->simd_level = level;
+  ctx->array_kernels = array_kernels[level];
+  return true;
+}
+
+const char * jamlisp_simd_name(jamlisp_simd_level level){
+  return level < JAMLISP_SIMD_LEVELS ? simd_names[level] : "unknown";
+}
+
+static size_t element_size(jamlisp_type type){
+  switch(type){
+  case JAMLISP_F32:
+  case JAMLISP_INT32:
+    return 4;
+  case JAMLISP_F64:
+  case JAMLISP_INT64:
+    return 8;
+  default:
+    return 1;
+  }
+}
+
+size_t jamlisp_array_count(const jamlisp_array * array){
+  return array->size / element_size(array->type);
+}
+
+static const jamlisp_type element_types[JAMLISP_ARRAY_ELEMENTS] = {
+  [JAMLISP_ARRAY_F32] = JAMLISP_F32,
+  [JAMLISP_ARRAY_F64] = JAMLISP_F64,
+  [JAMLISP_ARRAY_I64] = JAMLISP_INT64,
+};
+
+// the array in obj and its element kind, NULL if it has no kernels.
+static jamlisp_array * array_arg(const char * name, jamlisp_object obj, jamlisp_array_element * element){
+  if(JAMLISP_IS(obj, JAMLISP_ARRAY)){
+    var a = JAMLISP_PTR(obj);
+    for(int i = 0; i < JAMLISP_ARRAY_ELEMENTS; i++){
+      if(a->type == element_types[i]){
+	*element = i;
+	return a;
+      }
+    }
+  }
+  ERROR("%s: not a f32, f64 or i64 array\n", name);
+  return NULL;
+}
+
+static jamlisp_array * array_alloc(jamlisp_context * ctx, jamlisp_array_element element, size_t count){
+  var type = element_types[element];
+  return jamlisp_array_new(ctx, type, NULL, count * element_size(type));
+}
+
+static jamlisp_object element_get(jamlisp_context * ctx, jamlisp_array_element element, const void * p){
+  switch(element){
+  case JAMLISP_ARRAY_F32:{
+      f32 v;
+      memcpy(&v, p, sizeof(v));
+      return jamlisp_f32(v);
+    }
+  case JAMLISP_ARRAY_F64:{
+      f64 v;
+      memcpy(&v, p, sizeof(v));
+      return jamlisp_f64(v);
+    }
+  case JAMLISP_ARRAY_I64:{
+      i64 v;
+      memcpy(&v, p, sizeof(v));
+      return jamlisp_integer(ctx, v);
+    }
+  default:
+    return jamlisp_nil();
+  }
+}
+
+static bool element_set(jamlisp_array_element element, void * p, jamlisp_object obj){
+  if(!jamlisp_numberp(obj)){
+    ERROR("Not a number: %i\n", JAMLISP_TYPE(obj));
+    return false;
+  }
+  switch(element){
+  case JAMLISP_ARRAY_F32:{
+      f32 v = jamlisp_to_f64(obj);
+      memcpy(p, &v, sizeof(v));
+      return true;
+    }
+  case JAMLISP_ARRAY_F64:{
+      f64 v = jamlisp_to_f64(obj);
+      memcpy(p, &v, sizeof(v));
+      return true;
+    }
+  case JAMLISP_ARRAY_I64:{
+      i64 v;
+      if(JAMLISP_IS(obj, JAMLISP_INT64))
+	v = JAMLISP_INT64(obj);
+      else if(JAMLISP_IS(obj, JAMLISP_INT32) || JAMLISP_IS(obj, JAMLISP_FIXNUM))
+	v = JAMLISP_FIXNUM(obj);
+      else{
+	ERROR("Not an i64: %i\n", JAMLISP_TYPE(obj));
+	return false;
+      }
+      memcpy(p, &v, sizeof(v));
+      return true;
+    }
+  default:
+    return false;
+  }
+}
+
+static jamlisp_object make_array(jamlisp_context * ctx, jamlisp_array_element element, const jamlisp_object * args, u32 count){
+  var a = array_alloc(ctx, element, count);
+  size_t size = element_size(a->type);
+  for(u32 i = 0; i < count; i++){
+    if(!element_set(element, (u8 *) a->data + i * size, args[i])){
+      // nothing refers to the array yet. In an arena the rewind drops it.
+      if(ctx->arena.depth == 0){
+	free(a->data);
+	free(a);
+      }
+      return jamlisp_nil();
+    }
+  }
+  return JAMLISP_MAKE_ARRAY(a);
+}
+
+static jamlisp_object prim_f32_array(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  return make_array(ctx, JAMLISP_ARRAY_F32, args, count);
+}
+
+static jamlisp_object prim_f64_array(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  return make_array(ctx, JAMLISP_ARRAY_F64, args, count);
+}
+
+static jamlisp_object prim_i64_array(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  return make_array(ctx, JAMLISP_ARRAY_I64, args, count);
+}
+
+static jamlisp_object prim_array_length(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  if(!JAMLISP_IS(args[0], JAMLISP_ARRAY)){
+    ERROR("array-length: not an array\n");
+    return jamlisp_nil();
+  }
+  return jamlisp_integer(ctx, jamlisp_array_count(JAMLISP_PTR(args[0])));
+}
+
+static jamlisp_object prim_array_ref(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  jamlisp_array_element element;
+  var a = array_arg("array-ref", args[0], &element);
+  if(a == NULL)
+    return jamlisp_nil();
+  if(!JAMLISP_IS(args[1], JAMLISP_INT64) || JAMLISP_INT64(args[1]) < 0 || (u64)JAMLISP_INT64(args[1]) >= jamlisp_array_count(a)){
+    ERROR("array-ref: invalid index\n");
+    return jamlisp_nil();
+  }
+  return element_get(ctx, element, (u8 *) a->data + JAMLISP_INT64(args[1]) * element_size(a->type));
+}
+
+// 'count' arrays of the same type and length, returns the first.
+static jamlisp_array * same_arrays(const char * name, const jamlisp_object * args, u32 count, jamlisp_array_element * element){
+  var first = array_arg(name, args[0], element);
+  if(first == NULL)
+    return NULL;
+  for(u32 i = 1; i < count; i++){
+    jamlisp_array_element e;
+    var a = array_arg(name, args[i], &e);
+    if(a == NULL)
+      return NULL;
+    if(e != *element || a->size != first->size){
+      ERROR("%s: the arrays differ in type or length\n", name);
+      return NULL;
+    }
+  }
+  return first;
+}
+
+static jamlisp_object prim_array_add(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  jamlisp_array_element element;
+  var a = same_arrays("array-add", args, 2, &element);
+  if(a == NULL)
+    return jamlisp_nil();
+  size_t n = jamlisp_array_count(a);
+  var r = array_alloc(ctx, element, n);
+  ctx->array_kernels[element].add(r->data, a->data, JAMLISP_PTR(args[1])->data, n);
+  return JAMLISP_MAKE_ARRAY(r);
+}
+
+static jamlisp_object prim_array_mul(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  jamlisp_array_element element;
+  var a = same_arrays("array-mul", args, 2, &element);
+  if(a == NULL)
+    return jamlisp_nil();
+  size_t n = jamlisp_array_count(a);
+  var r = array_alloc(ctx, element, n);
+  ctx->array_kernels[element].mul(r->data, a->data, JAMLISP_PTR(args[1])->data, n);
+  return JAMLISP_MAKE_ARRAY(r);
+}
+
+// (array-fma a b c) is a * b + c.
+static jamlisp_object prim_array_fma(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  jamlisp_array_element element;
+  var a = same_arrays("array-fma", args, 3, &element);
+  if(a == NULL)
+    return jamlisp_nil();
+  size_t n = jamlisp_array_count(a);
+  var r = array_alloc(ctx, element, n);
+  ctx->array_kernels[element].fma(r->data, a->data, JAMLISP_PTR(args[1])->data, JAMLISP_PTR(args[2])->data, n);
+  return JAMLISP_MAKE_ARRAY(r);
+}
+
+static jamlisp_object prim_array_dot(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  jamlisp_array_element element;
+  var a = same_arrays("array-dot", args, 2, &element);
+  if(a == NULL)
+    return jamlisp_nil();
+  u64 r;
+  ctx->array_kernels[element].dot(&r, a->data, JAMLISP_PTR(args[1])->data, jamlisp_array_count(a));
+  return element_get(ctx, element, &r);
+}
+
+static jamlisp_object prim_array_sum(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  jamlisp_array_element element;
+  var a = array_arg("array-sum", args[0], &element);
+  if(a == NULL)
+    return jamlisp_nil();
+  u64 r;
+  ctx->array_kernels[element].sum(&r, a->data, jamlisp_array_count(a));
+  return element_get(ctx, element, &r);
+}
+
+// the smallest or largest element, nil for an empty array.
+static jamlisp_object array_order(jamlisp_context * ctx, const jamlisp_object * args, bool max){
+  jamlisp_array_element element;
+  var a = array_arg(max ? "array-max" : "array-min", args[0], &element);
+  if(a == NULL || a->size == 0)
+    return jamlisp_nil();
+  u64 r;
+  var k = ctx->array_kernels + element;
+  (max ? k->max : k->min)(&r, a->data, jamlisp_array_count(a));
+  return element_get(ctx, element, &r);
+}
+
+static jamlisp_object prim_array_min(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  return array_order(ctx, args, false);
+}
+
+static jamlisp_object prim_array_max(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  return array_order(ctx, args, true);
+}
+
+// (array-transform m v [width]) multiplies each vec3 or vec4 (the default) in
+// v by the 4x4 matrix m, given row by row. A vec3 has w = 1.
+static jamlisp_object prim_array_transform(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  jamlisp_array_element element, m_element;
+  var m = array_arg("array-transform", args[0], &m_element);
+  var v = array_arg("array-transform", args[1], &element);
+  if(m == NULL || v == NULL)
+    return jamlisp_nil();
+  i64 width = 4;
+  if(count > 2)
+    width = JAMLISP_IS(args[2], JAMLISP_INT64) ? JAMLISP_INT64(args[2]) : 0;
+  size_t n = jamlisp_array_count(v);
+  var transform = ctx->array_kernels[element].transform;
+  if(transform == NULL || m_element != element || jamlisp_array_count(m) != 16 || (width != 3 && width != 4) || n % width != 0){
+    ERROR("array-transform: expected a 4x4 matrix and vec3 or vec4 of the same float type\n");
+    return jamlisp_nil();
+  }
+  var r = array_alloc(ctx, element, n);
+  transform(r->data, m->data, v->data, n / width, width);
+  return JAMLISP_MAKE_ARRAY(r);
+}
+
+void jamlisp_load_array_primitives(jamlisp_context * ctx){
+  jamlisp_load_primitive(ctx, "f32-array", prim_f32_array, 0, JAMLISP_VARIADIC, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "f64-array", prim_f64_array, 0, JAMLISP_VARIADIC, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "i64-array", prim_i64_array, 0, JAMLISP_VARIADIC, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-length", prim_array_length, 1, 1, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-ref", prim_array_ref, 2, 2, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-add", prim_array_add, 2, 2, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-mul", prim_array_mul, 2, 2, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-fma", prim_array_fma, 3, 3, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-dot", prim_array_dot, 2, 2, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-sum", prim_array_sum, 1, 1, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-min", prim_array_min, 1, 1, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-max", prim_array_max, 1, 1, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "array-transform", prim_array_transform, 2, 3, JAMLISP_OPCODE_NONE);
+}
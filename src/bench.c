@@ -0,0 +1,1068 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+#if JAMLISP_GMP
+#include <gmp.h>
+#endif
+
+#include "jamlisp.h"
+
+// Benchmarks.
+// run bench [--csv | --json] [file.lisp ...]
+// Each benchmark is run once to warm up and then BENCH_RUNS times. The best,
+// median and worst time per operation are reported, one record per benchmark.
+// run bench-gen <nodes> writes a synthetic scene program to stdout.
+// startup-source and startup-module are the time to a context with a scene
+// library loaded, from its source and from a module file.
+// Built with GMP=1 the bignum operations are also timed with GMP.
+
+#define BENCH_RUNS 7
+
+typedef enum{
+  BENCH_TEXT,
+  BENCH_CSV,
+  BENCH_JSON
+}bench_format;
+
+typedef struct{
+  bench_format format;
+  int count;
+}bench_suite;
+
+static u64 bench_now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void * a, const void * b){
+  u64 x = *(const u64 *) a, y = *(const u64 *) b;
+  return x < y ? -1 : x > y;
+}
+
+static void bench_report(bench_suite * suite, const char * name, const char * unit, size_t ops, f64 best_ns, f64 median_ns, f64 max_ns){
+  f64 per_second = 1e9 / median_ns;
+  switch(suite->format){
+  case BENCH_CSV:
+    if(suite->count == 0)
+      printf("name,unit,ops,best_ns,median_ns,max_ns,per_second,object_bytes\n");
+    printf("%s,%s,%zu,%.3f,%.3f,%.3f,%.1f,%zu\n", name, unit, ops, best_ns, median_ns, max_ns, per_second, sizeof(jamlisp_object));
+    break;
+  case BENCH_JSON:
+    printf("%s{\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %zu, \"best_ns\": %.3f, \"median_ns\": %.3f, \"max_ns\": %.3f, \"per_second\": %.1f, \"object_bytes\": %zu}",
+	   suite->count == 0 ? "[\n  " : ",\n  ", name, unit, ops, best_ns, median_ns, max_ns, per_second, sizeof(jamlisp_object));
+    break;
+  case BENCH_TEXT:
+    printf("%-40s %12zu %-10s %12.3f ns/%s (best %.3f, max %.3f) %14.1f %s/s\n", name, ops, unit, median_ns, unit, best_ns, max_ns, per_second, unit);
+    break;
+  }
+  suite->count += 1;
+}
+
+static void bench_end(bench_suite * suite){
+  if(suite->format == BENCH_JSON)
+    printf(suite->count == 0 ? "[]\n" : "\n]\n");
+}
+
+// times 'f' and reports the time per operation, 'ops' being the number of operations done by a single call.
+static void bench_run(bench_suite * suite, const char * name, const char * unit, size_t ops, void (* f)(void * userdata), void * userdata){
+  u64 times[BENCH_RUNS];
+  f(userdata);
+  for(int i = 0; i < BENCH_RUNS; i++){
+    u64 t0 = bench_now_ns();
+    f(userdata);
+    times[i] = bench_now_ns() - t0;
+  }
+  qsort(times, BENCH_RUNS, sizeof(times[0]), compare_u64);
+  bench_report(suite, name, unit, ops, (f64)times[0] / ops, (f64)times[BENCH_RUNS / 2] / ops, (f64)times[BENCH_RUNS - 1] / ops);
+}
+
+// simple xorshift, the generated programs are the same on every run.
+static u64 bench_random(u64 * state){
+  u64 x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+// writes a balanced tree of ADDs with INT leaves. Returns the number of nodes.
+static size_t write_add_tree(io_writer * wd, int depth){
+  if(depth == 0){
+    io_write_u8(wd, JAMLISP_OPCODE_INT);
+    io_write_i64_leb(wd, 1);
+    return 1;
+  }
+  io_write_u8(wd, JAMLISP_OPCODE_ADD);
+  size_t a = write_add_tree(wd, depth - 1);
+  size_t b = write_add_tree(wd, depth - 1);
+  return 1 + a + b;
+}
+
+// writes 'count' top level (+ 1 2) calls. Returns the number of nodes.
+static size_t write_calls(jamlisp_context * ctx, io_writer * wd, int count){
+  var sym = jamlisp_symbol(ctx, "+");
+  for(int i = 0; i < count; i++){
+    io_write_u8(wd, JAMLISP_OPCODE_CALL);
+    io_write_u32_leb(wd, JAMLISP_SYMBOL_ID(sym));
+    io_write_u32_leb(wd, 2);
+    for(int j = 1; j <= 2; j++){
+      io_write_u8(wd, JAMLISP_OPCODE_INT);
+      io_write_i64_leb(wd, j);
+    }
+  }
+  return count * 3;
+}
+
+// writes 'depth' nested lets binding 4 variables each, the inits and 4 extra
+// body forms read the variables of the enclosing let. With 'special' the
+// variables are *name* so they are bound dynamically. Returns the number of
+// nodes, not counting BIND / UNBIND.
+static size_t write_let_program(io_writer * wd, int depth, bool special){
+  const char * fmt = special ? "*v%i%c*" : "v%i%c";
+  char name[32], buf[64];
+  size_t nodes = 0;
+  for(int i = 0; i < depth; i++){
+    io_write(wd, "(let (", 6);
+    for(int j = 0; j < 4; j++){
+      snprintf(name, sizeof(name), fmt, i, 'a' + j);
+      int len = snprintf(buf, sizeof(buf), "(%s ", name);
+      io_write(wd, buf, len);
+      if(i == 0){
+        len = snprintf(buf, sizeof(buf), "%i)", j);
+      }else{
+        snprintf(name, sizeof(name), fmt, i - 1, 'a' + (j + 1) % 4);
+        len = snprintf(buf, sizeof(buf), "%s)", name);
+      }
+      io_write(wd, buf, len);
+    }
+    io_write(wd, ") ", 2);
+    for(int j = 0; j < 4; j++){
+      int len = snprintf(buf, sizeof(buf), fmt, i, 'a' + j);
+      io_write(wd, buf, len);
+      io_write_u8(wd, ' ');
+    }
+    // LET, 4 inits and 4 reads.
+    nodes += 9;
+  }
+  int len = snprintf(buf, sizeof(buf), fmt, depth - 1, 'a');
+  io_write(wd, buf, len);
+  nodes += 1;
+  for(int i = 0; i < depth; i++)
+    io_write_u8(wd, ')');
+  io_write_u8(wd, 0);
+  return nodes;
+}
+
+// writes a random tree of + - * on x, y and small integers. Returns the
+// number of nodes.
+static size_t write_arith_expr(io_writer * wd, u64 * rnd, int depth){
+  static const char * leaves[] = {"x", "y", "1", "2", "3"};
+  static const char * ops[] = {"(+ ", "(- ", "(* "};
+  if(depth == 0){
+    const char * leaf = leaves[bench_random(rnd) % array_count(leaves)];
+    io_write(wd, leaf, strlen(leaf));
+    return 1;
+  }
+  const char * op = ops[bench_random(rnd) % array_count(ops)];
+  io_write(wd, op, strlen(op));
+  size_t nodes = 1 + write_arith_expr(wd, rnd, depth - 1);
+  io_write_u8(wd, ' ');
+  nodes += write_arith_expr(wd, rnd, depth - 1);
+  io_write_u8(wd, ')');
+  return nodes;
+}
+
+// writes (+ 1 (+ 1 ... 0)) nested 'depth' deep.
+static void write_nested_sum(io_writer * wd, int depth){
+  for(int i = 0; i < depth; i++)
+    io_write(wd, "(+ 1 ", 5);
+  io_write_u8(wd, '0');
+  for(int i = 0; i < depth; i++)
+    io_write_u8(wd, ')');
+}
+
+static void write_scene_node(io_writer * wd, u64 * rnd, size_t * budget, int depth){
+  static const char * leaves[] = {"(rectangle)", "(polygon 1 0 0 0 1 0 0 0 0)", "(circle 5)"};
+  static const struct { const char * name; int args; } groups[] =
+    {{"color", 1}, {"position", 2}, {"size", 2}, {"scale", 3}, {"translate", 3}, {"rotate", 4}};
+  char buf[32];
+  *budget -= MIN(*budget, 1);
+  if(depth == 0 || *budget == 0){
+    const char * leaf = leaves[bench_random(rnd) % array_count(leaves)];
+    io_write(wd, leaf, strlen(leaf));
+    return;
+  }
+  var group = groups[bench_random(rnd) % array_count(groups)];
+  io_write_u8(wd, '(');
+  io_write(wd, group.name, strlen(group.name));
+  for(int i = 0; i < group.args; i++){
+    int len = snprintf(buf, sizeof(buf), " %i", (int)(bench_random(rnd) % 1000));
+    io_write(wd, buf, len);
+  }
+  int children = 1 + bench_random(rnd) % 3;
+  for(int i = 0; i < children && *budget > 0; i++){
+    io_write_u8(wd, '\n');
+    for(int j = 0; j < 10 - depth; j++)
+      io_write_u8(wd, ' ');
+    write_scene_node(wd, rnd, budget, depth - 1);
+  }
+  io_write_u8(wd, ')');
+}
+
+// writes a nested color / position / size / .. scene with about 'nodes'
+// nodes, like the one in the lisp loader test.
+void jamlisp_bench_scene(io_writer * wd, size_t nodes, u64 seed){
+  u64 rnd = seed | 1;
+  io_write(wd, "(scene", 6);
+  while(nodes > 0){
+    io_write(wd, "\n ", 2);
+    write_scene_node(wd, &rnd, &nodes, 8);
+  }
+  io_write(wd, ")\n", 2);
+}
+
+// 'functions' defuns of about 'nodes' scene nodes each and a call to the first.
+static void write_scene_library(io_writer * wd, size_t functions, size_t nodes, u64 seed){
+  u64 rnd = seed | 1;
+  char buf[64];
+  for(size_t i = 0; i < functions; i++){
+    int len = snprintf(buf, sizeof(buf), "(defun part-%i ()", (int)i);
+    io_write(wd, buf, len);
+    size_t budget = nodes;
+    while(budget > 0){
+      io_write(wd, "\n ", 2);
+      write_scene_node(wd, &rnd, &budget, 8);
+    }
+    io_write(wd, ")\n", 2);
+  }
+  io_write(wd, "(part-0)\n", 9);
+}
+
+static char * read_file(const char * path){
+  FILE * f = fopen(path, "rb");
+  if(f == NULL)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  size_t size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char * data = alloc0(size + 1);
+  size_t read = fread(data, 1, size, f);
+  fclose(f);
+  data[read] = 0;
+  return data;
+}
+
+typedef struct{
+  jamlisp_context * ctx;
+  const char * code;
+  io_writer prefix;
+  io_writer postfix;
+  io_reader reader;
+  jamlisp_code threaded;
+  jamlisp_reg_code registers;
+  jamlisp_verify_info info;
+  // values left on the stack by one run of the code.
+  u32 results;
+  size_t count;
+  jamlisp_object * objects;
+  const char ** names;
+}bench_state;
+
+static void run_load(void * userdata){
+  bench_state * b = userdata;
+  io_reset(&b->prefix);
+  jamlisp_load_lisp2(b->ctx, &b->prefix, b->code);
+}
+
+static void run_compile(void * userdata){
+  bench_state * b = userdata;
+  io_reset(&b->postfix);
+  io_reader rd = io_from_bytes(b->prefix.data, b->prefix.offset);
+  jamlisp_compile_postfix(b->ctx, &rd, &b->postfix);
+}
+
+typedef struct{
+  const char * code;
+  size_t size;
+  jamlisp_simd_level level;
+  size_t tokens;
+}lex_bench_state;
+
+static void run_lex(void * userdata){
+  lex_bench_state * b = userdata;
+  jamlisp_token tokens[1024];
+  jamlisp_lexer lx;
+  jamlisp_lexer_init(&lx, b->code, b->size, b->level);
+  b->tokens = 0;
+  while(!lx.done)
+    b->tokens += jamlisp_lex(&lx, tokens, array_count(tokens));
+}
+
+// only the lexer, on each simd level.
+static void bench_lex(bench_suite * suite, const char * name, const char * code){
+  char buf[256];
+  lex_bench_state b = {.code = code, .size = strlen(code)};
+  for(b.level = 0; b.level <= jamlisp_simd_detect(); b.level++){
+    snprintf(buf, sizeof(buf), "lex-%s/%s", jamlisp_simd_name(b.level), name);
+    bench_run(suite, buf, "byte", b.size, run_lex, &b);
+  }
+}
+
+static void stream_form(void * userdata, const void * code, size_t size){
+  UNUSED(code);
+  *(size_t *) userdata += size;
+}
+
+// the source fed to a jamlisp_stream in 4 KB chunks.
+static void run_stream(void * userdata){
+  bench_state * b = userdata;
+  size_t code_size = 0;
+  jamlisp_stream stream;
+  jamlisp_stream_init(&stream, b->ctx, stream_form, &code_size);
+  size_t size = strlen(b->code);
+  for(size_t i = 0; i < size; i += 4096)
+    jamlisp_stream_feed(&stream, b->code + i, MIN(size - i, (size_t)4096));
+  jamlisp_stream_end(&stream);
+  jamlisp_stream_clear(&stream);
+}
+
+static void bench_load(bench_suite * suite, const char * name, const char * code){
+  char buf[256];
+  bench_state b = {.ctx = jamlisp_new(), .code = code};
+  size_t size = strlen(code);
+  snprintf(buf, sizeof(buf), "load/%s", name);
+  bench_run(suite, buf, "byte", size, run_load, &b);
+  snprintf(buf, sizeof(buf), "stream/%s", name);
+  bench_run(suite, buf, "byte", size, run_stream, &b);
+  snprintf(buf, sizeof(buf), "compile-postfix/%s", name);
+  bench_run(suite, buf, "byte", size, run_compile, &b);
+  io_writer_clear(&b.prefix);
+  io_writer_clear(&b.postfix);
+}
+
+typedef struct{
+  const char * code;
+  size_t size;
+  const char * path;
+}startup_bench_state;
+
+static void startup_form(void * userdata, const void * code, size_t size){
+  io_write(userdata, code, size);
+}
+
+// a new context with the source loaded, the code of the top level forms is
+// written to 'main'.
+static jamlisp_context * startup_source(const char * code, size_t size, io_writer * main){
+  var ctx = jamlisp_new();
+  jamlisp_stream stream;
+  jamlisp_stream_init(&stream, ctx, startup_form, main);
+  jamlisp_stream_feed(&stream, code, size);
+  jamlisp_stream_end(&stream);
+  jamlisp_stream_clear(&stream);
+  return ctx;
+}
+
+static void run_startup_source(void * userdata){
+  startup_bench_state * b = userdata;
+  io_writer main = {0};
+  startup_source(b->code, b->size, &main);
+  io_writer_clear(&main);
+}
+
+static void run_startup_module(void * userdata){
+  startup_bench_state * b = userdata;
+  var ctx = jamlisp_new();
+  jamlisp_module module;
+  if(!jamlisp_module_map(ctx, &module, b->path)){
+    ERROR("Unable to load %s\n", b->path);
+    return;
+  }
+  jamlisp_module_unload(ctx, &module);
+}
+
+// the same library parsed from source and mapped from a module file.
+static void bench_startup(bench_suite * suite, const char * name, const char * code){
+  char buf[256];
+  char path[] = "/tmp/jamlisp-bench-XXXXXX";
+  startup_bench_state b = {.code = code, .size = strlen(code), .path = path};
+  io_writer main = {0}, module = {0};
+  var ctx = startup_source(code, b.size, &main);
+  int fd = mkstemp(path);
+  if(fd < 0 || !jamlisp_module_write(ctx, &module, main.data, main.offset)
+     || write(fd, module.data, module.offset) != (ssize_t) module.offset){
+    ERROR("Unable to write the module of %s\n", name);
+  }else{
+    snprintf(buf, sizeof(buf), "startup-source/%s", name);
+    bench_run(suite, buf, "byte", b.size, run_startup_source, &b);
+    snprintf(buf, sizeof(buf), "startup-module/%s", name);
+    bench_run(suite, buf, "byte", b.size, run_startup_module, &b);
+    if(suite->format == BENCH_TEXT)
+      printf("%-40s %12zu source bytes %12zu module bytes\n", name, b.size, (size_t) module.offset);
+  }
+  if(fd >= 0){
+    close(fd);
+    unlink(path);
+  }
+  io_writer_clear(&main);
+  io_writer_clear(&module);
+}
+
+static void run_prefix(void * userdata){
+  bench_state * b = userdata;
+  for(size_t i = 0; i < b->count; i++){
+    io_reader rd = io_from_bytes(b->prefix.data, b->prefix.offset);
+    jamlisp_iterate(b->ctx, &rd);
+    b->ctx->value_stack.count -= b->results;
+  }
+}
+
+static void run_verified(void * userdata){
+  bench_state * b = userdata;
+  for(size_t i = 0; i < b->count; i++){
+    io_reader rd = io_from_bytes(b->prefix.data, b->prefix.offset);
+    jamlisp_iterate_verified(b->ctx, &rd, &b->info);
+    b->ctx->value_stack.count -= b->results;
+  }
+}
+
+static void run_postfix(void * userdata){
+  bench_state * b = userdata;
+  for(size_t i = 0; i < b->count; i++){
+    io_reader rd = io_from_bytes(b->postfix.data, b->postfix.offset);
+    jamlisp_iterate_postfix(b->ctx, &rd);
+    b->ctx->value_stack.count -= b->results;
+  }
+}
+
+static void run_threaded(void * userdata){
+  bench_state * b = userdata;
+  for(size_t i = 0; i < b->count; i++){
+    jamlisp_code_iterate(b->ctx, &b->threaded);
+    b->ctx->value_stack.count -= b->results;
+  }
+}
+
+static void run_registers(void * userdata){
+  bench_state * b = userdata;
+  for(size_t i = 0; i < b->count; i++){
+    jamlisp_reg_iterate(b->ctx, &b->registers);
+    b->ctx->value_stack.count -= b->results;
+  }
+}
+
+// true if the register compiler left nothing to run but the moves of the
+// results, the whole program was done while compiling.
+static bool reg_code_empty(const jamlisp_reg_code * code){
+  for(size_t i = 0; i < code->count; i++)
+    if(code->insns[i].opcode != JAMLISP_REG_MOVE && code->insns[i].opcode != JAMLISP_REG_END)
+      return false;
+  return true;
+}
+
+// runs the same prefix byte code through each of the execution modes.
+static void bench_iterate(bench_suite * suite, const char * name, const char * unit, bench_state * b, size_t nodes){
+  char buf[256];
+  io_reader rd = io_from_bytes(b->prefix.data, b->prefix.offset);
+  if(!jamlisp_code_load(b->ctx, &b->threaded, &rd)){
+    ERROR("Unable to load %s\n", name);
+    return;
+  }
+  rd = io_from_bytes(b->prefix.data, b->prefix.offset);
+  jamlisp_compile_postfix(b->ctx, &rd, &b->postfix);
+
+  snprintf(buf, sizeof(buf), "iterate-prefix/%s", name);
+  bench_run(suite, buf, unit, nodes * b->count, run_prefix, b);
+  // the same code verified once, run without the stack checks.
+  if(jamlisp_verify(b->ctx, b->prefix.data, b->prefix.offset, &b->info)){
+    snprintf(buf, sizeof(buf), "iterate-verified/%s", name);
+    bench_run(suite, buf, unit, nodes * b->count, run_verified, b);
+  }
+  snprintf(buf, sizeof(buf), "iterate-postfix/%s", name);
+  bench_run(suite, buf, unit, nodes * b->count, run_postfix, b);
+  // the same threaded code without and then with quickening.
+  b->ctx->quicken = false;
+  snprintf(buf, sizeof(buf), "iterate-generic/%s", name);
+  bench_run(suite, buf, unit, nodes * b->count, run_threaded, b);
+  b->ctx->quicken = true;
+  snprintf(buf, sizeof(buf), "iterate-threaded/%s", name);
+  bench_run(suite, buf, unit, nodes * b->count, run_threaded, b);
+  // register code without and then with constant folding. There is no row
+  // if copy propagation and folding leave nothing to run.
+  for(int fold = 0; fold < 2; fold++){
+    b->ctx->register_fold = fold;
+    rd = io_from_bytes(b->prefix.data, b->prefix.offset);
+    if(jamlisp_reg_compile(b->ctx, &b->registers, &rd) && !reg_code_empty(&b->registers)){
+      snprintf(buf, sizeof(buf), fold ? "iterate-register/%s" : "iterate-register-unfolded/%s", name);
+      bench_run(suite, buf, unit, nodes * b->count, run_registers, b);
+    }
+  }
+  jamlisp_reg_code_free(&b->registers);
+  jamlisp_code_free(&b->threaded);
+  io_writer_clear(&b->postfix);
+}
+
+static void run_cons_churn(void * userdata){
+  bench_state * b = userdata;
+  for(int j = 0; j < 100; j++){
+    for(size_t i = 0; i < b->count; i++)
+      b->objects[i] = jamlisp_new_cons(b->ctx);
+    for(size_t i = 0; i < b->count; i++)
+      jamlisp_free_cons(b->ctx, &b->objects[i]);
+  }
+}
+
+static void run_list_walk(void * userdata){
+  bench_state * b = userdata;
+  i64 sum = 0;
+  for(var list = b->objects[0]; jamlisp_consp(list); list = jamlisp_cdr(b->ctx, list))
+    sum += JAMLISP_INT64(jamlisp_car(b->ctx, list));
+  ASSERT(sum == (i64)(b->count * (b->count - 1) / 2));
+}
+
+static void run_list_length(void * userdata){
+  bench_state * b = userdata;
+  size_t length = 0;
+  for(var list = b->objects[0]; jamlisp_consp(list); list = jamlisp_cdr(b->ctx, list))
+    length += 1;
+  ASSERT(length == b->count);
+}
+
+// the warmup run adds the symbols, the timed runs look up existing names.
+static void run_symbol_intern(void * userdata){
+  bench_state * b = userdata;
+  for(size_t i = 0; i < b->count; i++)
+    jamlisp_symbol(b->ctx, b->names[i]);
+}
+
+static void run_symbol_bind(void * userdata){
+  bench_state * b = userdata;
+  for(int j = 0; j < 100; j++){
+    for(size_t i = 0; i < b->count; i++)
+      jamlisp_push_symbol_value(b->ctx, b->objects[i], jamlisp_i64(i));
+    for(size_t i = b->count; i > 0; i--)
+      jamlisp_pop_symbol_value(b->ctx, b->objects[i - 1]);
+  }
+}
+
+static void run_value_stack(void * userdata){
+  bench_state * b = userdata;
+  i64 sum = 0;
+  for(int j = 0; j < 100; j++){
+    for(size_t i = 0; i < b->count; i++)
+      jamlisp_push(b->ctx, jamlisp_i64(i));
+    for(size_t i = 0; i < b->count; i++)
+      sum += JAMLISP_INT64(jamlisp_pop(b->ctx));
+  }
+  ASSERT(sum == (i64)(100 * b->count * (b->count - 1) / 2));
+}
+
+static void bench_objects(bench_suite * suite){
+  bench_state b = {.ctx = jamlisp_new(), .count = 1024};
+  b.objects = alloc0(sizeof(b.objects[0]) * b.count);
+  bench_run(suite, "cons-churn/1024", "object", b.count * 2 * 100, run_cons_churn, &b);
+
+  {
+    // the cells are linked in allocation order, so this mostly measures the size of a cons cell.
+    bench_state l = {.ctx = jamlisp_new(), .count = 1 << 20};
+    jamlisp_object list = jamlisp_nil();
+    for(size_t i = l.count; i > 0; i--)
+      list = jamlisp_cons(l.ctx, jamlisp_i64(i - 1), list);
+    l.objects = &list;
+    bench_run(suite, "list-walk/1M", "cons", l.count, run_list_walk, &l);
+    bench_run(suite, "list-length/1M", "cons", l.count, run_list_length, &l);
+  }
+  
+  char buf[32];
+  b.names = alloc0(sizeof(b.names[0]) * b.count);
+  for(size_t i = 0; i < b.count; i++){
+    snprintf(buf, sizeof(buf), "symbol-%zu", i);
+    b.names[i] = strdup(buf);
+  }
+  bench_run(suite, "symbol-intern/1024", "symbol", b.count, run_symbol_intern, &b);
+
+  for(size_t i = 0; i < b.count; i++)
+    b.objects[i] = jamlisp_symbol(b.ctx, b.names[i]);
+  bench_run(suite, "symbol-bind/1024", "binding", b.count * 2 * 100, run_symbol_bind, &b);
+  bench_run(suite, "value-stack/1024", "object", b.count * 2 * 100, run_value_stack, &b);
+  for(size_t i = 0; i < b.count; i++)
+    free((void *) b.names[i]);
+  free(b.names);
+  free(b.objects);
+}
+
+typedef struct{
+  jamlisp_context * ctx;
+  jamlisp_object table;
+  u64 * pauses;
+  size_t pause_count;
+  size_t pause_capacity;
+}gc_bench_state;
+
+// builds short lists, every 16th one replaces an entry in a long lived table.
+static void run_gc_alloc(void * userdata){
+  gc_bench_state * b = userdata;
+  var ctx = b->ctx;
+  u64 collections = ctx->gc.collections;
+  var entry = b->table;
+  for(int i = 0; i < 10000; i++){
+    jamlisp_object list = jamlisp_nil();
+    for(int j = 0; j < 16; j++)
+      list = jamlisp_cons(ctx, jamlisp_i64(j), list);
+    if(ctx->gc.mode == JAMLISP_GC_MANUAL){
+      while(!jamlisp_nilp(list)){
+	var next = jamlisp_cdr(ctx, list);
+	jamlisp_free_cons(ctx, &list);
+	list = next;
+      }
+    }else if(i % 16 == 0){
+      jamlisp_set_car(ctx, entry, list);
+      entry = jamlisp_cdr(ctx, entry);
+      if(jamlisp_nilp(entry))
+	entry = b->table;
+    }
+    if(ctx->gc.collections != collections){
+      collections = ctx->gc.collections;
+      u64 * pause = alloc_elems((void **) &b->pauses, sizeof(b->pauses[0]), &b->pause_count, &b->pause_capacity, 1);
+      *pause = ctx->gc.pause_last_ns;
+    }
+  }
+}
+
+#define LATENCY_BUCKETS 4096
+
+static u64 latency_percentile(const u32 * histogram, size_t count, f64 p){
+  size_t rank = (size_t)(count * p), seen = 0;
+  for(size_t i = 0; i < LATENCY_BUCKETS; i++){
+    seen += histogram[i];
+    if(seen > rank)
+      return i;
+  }
+  return LATENCY_BUCKETS - 1;
+}
+
+// times every single allocation while the heap grows to 'count' conses.
+// Growing used to copy the whole heap, so the slow tail is what matters here.
+static void bench_alloc_latency(bench_suite * suite, size_t count, const char * name){
+  jamlisp_context * ctx = jamlisp_new();
+  // latencies are counted per ns, everything from LATENCY_BUCKETS ns up goes in the last one.
+  u32 * histogram = alloc0(sizeof(histogram[0]) * LATENCY_BUCKETS);
+  u64 max_ns = 0;
+  for(size_t i = 0; i < count; i++){
+    u64 t0 = bench_now_ns();
+    jamlisp_new_cons(ctx);
+    u64 t = bench_now_ns() - t0;
+    histogram[MIN(t, LATENCY_BUCKETS - 1)] += 1;
+    max_ns = MAX(max_ns, t);
+  }
+  // one row per percentile, the latency is in all three columns.
+  const char * names[] = {"p50", "p99", "p999"};
+  f64 percentiles[] = {0.5, 0.99, 0.999};
+  char buf[64];
+  for(size_t i = 0; i < array_count(names); i++){
+    u64 ns = latency_percentile(histogram, count, percentiles[i]);
+    snprintf(buf, sizeof(buf), "alloc-latency-%s/%s", names[i], name);
+    bench_report(suite, buf, "cons", count, ns, ns, ns);
+  }
+  snprintf(buf, sizeof(buf), "alloc-latency-max/%s", name);
+  bench_report(suite, buf, "cons", count, max_ns, max_ns, max_ns);
+  for(size_t i = 0; i < ctx->heap.page_count; i++)
+    free(ctx->heap.pages[i]);
+  ctx->heap = (cons_heap){0};
+  free(histogram);
+}
+
+typedef struct{
+  jamlisp_context * ctx;
+  jamlisp_object result;
+  jamlisp_checkpoint checkpoint;
+  bool arena;
+}script_bench_state;
+
+// many short evaluations that each build a list, bind it and are thrown away.
+static void run_scripts(void * userdata){
+  script_bench_state * b = userdata;
+  var ctx = b->ctx;
+  for(int i = 0; i < 1000; i++){
+    jamlisp_object list = jamlisp_nil();
+    for(int j = 0; j < 64; j++)
+      list = jamlisp_cons(ctx, jamlisp_i64(j), list);
+    symbol_set_value(ctx, b->result, list);
+    if(b->arena)
+      jamlisp_arena_rewind(ctx, &b->checkpoint);
+    else
+      symbol_set_value(ctx, b->result, jamlisp_nil());
+  }
+}
+
+static void bench_scripts(bench_suite * suite){
+  script_bench_state b = {.ctx = jamlisp_new()};
+  jamlisp_gc_set_mode(b.ctx, JAMLISP_GC_MARK_SWEEP);
+  b.result = jamlisp_symbol(b.ctx, "result");
+  bench_run(suite, "scripts/mark-sweep", "cons", 1000 * 64, run_scripts, &b);
+  b.arena = true;
+  b.checkpoint = jamlisp_arena_begin(b.ctx);
+  bench_run(suite, "scripts/arena", "cons", 1000 * 64, run_scripts, &b);
+  jamlisp_arena_end(b.ctx, &b.checkpoint);
+}
+
+static void bench_gc(bench_suite * suite, const char * name, jamlisp_gc_mode mode){
+  char buf[256];
+  gc_bench_state b = {.ctx = jamlisp_new()};
+  jamlisp_gc_set_mode(b.ctx, mode);
+  b.table = jamlisp_nil();
+  for(int i = 0; i < 256; i++)
+    b.table = jamlisp_cons(b.ctx, jamlisp_nil(), b.table);
+  symbol_set_value(b.ctx, jamlisp_symbol(b.ctx, "table"), b.table);
+  
+  snprintf(buf, sizeof(buf), "gc-alloc/%s", name);
+  bench_run(suite, buf, "cons", 10000 * 16, run_gc_alloc, &b);
+  if(b.pause_count > 0){
+    qsort(b.pauses, b.pause_count, sizeof(b.pauses[0]), compare_u64);
+    snprintf(buf, sizeof(buf), "gc-pause/%s", name);
+    bench_report(suite, buf, "pause", b.pause_count, b.pauses[0], b.pauses[b.pause_count / 2], b.pauses[b.pause_count - 1]);
+  }
+  free(b.pauses);
+}
+
+// the number of calls made by the lisp functions in bench_functions.
+static size_t fib_calls(int n){
+  return n < 2 ? 1 : 1 + fib_calls(n - 1) + fib_calls(n - 2);
+}
+
+static i64 ack_calls(i64 m, i64 n, size_t * calls){
+  *calls += 1;
+  if(m == 0)
+    return n + 1;
+  if(n == 0)
+    return ack_calls(m - 1, 1, calls);
+  return ack_calls(m - 1, ack_calls(m, n - 1, calls), calls);
+}
+
+// recursive lisp functions, counted in calls to them. The calls to + - and <
+// are not counted. count is tail recursive.
+static void bench_functions(bench_suite * suite){
+  static const char * functions[] = {
+    "(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))",
+    "(defun ack (m n) (if (< m 1) (+ n 1) (if (< n 1) (ack (- m 1) 1) (ack (- m 1) (ack m (- n 1))))))",
+    "(defun count (n acc) (if (< n 1) acc (count (- n 1) (+ acc 1))))"
+  };
+  size_t ack = 0;
+  ack_calls(2, 200, &ack);
+  struct { const char * name; const char * code; size_t calls; } programs[] = {
+    {"fib-20", "(fib 20)", fib_calls(20)},
+    {"ack-2-200", "(ack 2 200)", ack},
+    {"count-100000", "(count 100000 0)", 100001}
+  };
+  bench_state b = {.ctx = jamlisp_new(), .results = 1, .count = 1};
+  for(size_t i = 0; i < array_count(functions); i++){
+    jamlisp_load_lisp2(b.ctx, &b.prefix, functions[i]);
+    io_reset(&b.prefix);
+  }
+  for(size_t i = 0; i < array_count(programs); i++){
+    io_reset(&b.prefix);
+    jamlisp_load_lisp2(b.ctx, &b.prefix, programs[i].code);
+    b.ctx->call_stats = (jamlisp_call_stats){0};
+    bench_iterate(suite, programs[i].name, "call", &b, programs[i].calls);
+    if(suite->format == BENCH_TEXT)
+      printf("%-40s %12llu hits %12llu misses\n", programs[i].name, (unsigned long long) b.ctx->call_stats.cache_hits, (unsigned long long) b.ctx->call_stats.cache_misses);
+  }
+  io_writer_clear(&b.prefix);
+}
+
+typedef enum{
+  BIGNUM_ADD,
+  BIGNUM_MUL,
+  BIGNUM_DIV
+}bignum_op;
+
+typedef struct{
+  jamlisp_context * ctx;
+  jamlisp_checkpoint checkpoint;
+  bignum_op op;
+  jamlisp_object a, b;
+  jamlisp_code fact;
+#if JAMLISP_GMP
+  mpz_t ga, gb, gr;
+#endif
+}bignum_bench_state;
+
+#define BIGNUM_REPS 100
+
+// the results are dropped by rewinding the bignum arena.
+static void run_bignum(void * userdata){
+  bignum_bench_state * b = userdata;
+  for(int i = 0; i < BIGNUM_REPS; i++){
+    switch(b->op){
+    case BIGNUM_ADD: jamlisp_integer_add(b->ctx, b->a, b->b); break;
+    case BIGNUM_MUL: jamlisp_integer_mul(b->ctx, b->a, b->b); break;
+    case BIGNUM_DIV: jamlisp_integer_div(b->ctx, b->a, b->b); break;
+    }
+    jamlisp_arena_rewind(b->ctx, &b->checkpoint);
+  }
+}
+
+#if JAMLISP_GMP
+static void run_gmp(void * userdata){
+  bignum_bench_state * b = userdata;
+  for(int i = 0; i < BIGNUM_REPS; i++){
+    switch(b->op){
+    case BIGNUM_ADD: mpz_add(b->gr, b->ga, b->gb); break;
+    case BIGNUM_MUL: mpz_mul(b->gr, b->ga, b->gb); break;
+    case BIGNUM_DIV: mpz_tdiv_q(b->gr, b->ga, b->gb); break;
+    }
+  }
+}
+#endif
+
+static void run_fact(void * userdata){
+  bignum_bench_state * b = userdata;
+  jamlisp_code_iterate(b->ctx, &b->fact);
+  jamlisp_arena_rewind(b->ctx, &b->checkpoint);
+}
+
+// a random number with 'limbs' 64 bit limbs, as decimal digits.
+static char * bignum_digits(u64 * rnd, size_t limbs){
+  size_t count = limbs * 64 * 0.30103;
+  char * digits = malloc(count + 1);
+  for(size_t i = 0; i < count; i++)
+    digits[i] = '0' + bench_random(rnd) % 10;
+  digits[0] = '1' + digits[0] % 9;
+  digits[count] = 0;
+  return digits;
+}
+
+// bignum operations on operands of the given sizes in limbs and (fact 1000)
+// in threaded code, which multiplies a growing bignum by fixnums.
+static void bench_bignums(bench_suite * suite){
+  struct { const char * name; bignum_op op; size_t a_limbs, b_limbs; } ops[] = {
+    {"add-1000", BIGNUM_ADD, 1000, 1000},
+    {"mul-100", BIGNUM_MUL, 100, 100},
+    {"mul-1000", BIGNUM_MUL, 1000, 1000},
+    {"div-2000-1000", BIGNUM_DIV, 2000, 1000},
+  };
+  char buf[256];
+  u64 rnd = 1;
+  bignum_bench_state b = {.ctx = jamlisp_new()};
+  for(size_t i = 0; i < array_count(ops); i++){
+    char * da = bignum_digits(&rnd, ops[i].a_limbs);
+    char * db = bignum_digits(&rnd, ops[i].b_limbs);
+    b.op = ops[i].op;
+    b.a = jamlisp_integer_parse(b.ctx, da, strlen(da));
+    b.b = jamlisp_integer_parse(b.ctx, db, strlen(db));
+    b.checkpoint = jamlisp_arena_begin(b.ctx);
+    snprintf(buf, sizeof(buf), "bignum/%s", ops[i].name);
+    bench_run(suite, buf, "op", BIGNUM_REPS, run_bignum, &b);
+    jamlisp_arena_end(b.ctx, &b.checkpoint);
+#if JAMLISP_GMP
+    mpz_inits(b.ga, b.gb, b.gr, NULL);
+    mpz_set_str(b.ga, da, 10);
+    mpz_set_str(b.gb, db, 10);
+    snprintf(buf, sizeof(buf), "gmp/%s", ops[i].name);
+    bench_run(suite, buf, "op", BIGNUM_REPS, run_gmp, &b);
+    mpz_clears(b.ga, b.gb, b.gr, NULL);
+#endif
+    free(da);
+    free(db);
+  }
+  io_writer wd = {0};
+  jamlisp_load_lisp2(b.ctx, &wd, "(defun fact (n) (if (< n 2) 1 (* n (fact (- n 1)))))");
+  io_reset(&wd);
+  jamlisp_load_lisp2(b.ctx, &wd, "(fact 1000)");
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  if(jamlisp_code_load(b.ctx, &b.fact, &rd)){
+    b.checkpoint = jamlisp_arena_begin(b.ctx);
+    bench_run(suite, "bignum/fact-1000", "call", 1000, run_fact, &b);
+    jamlisp_arena_end(b.ctx, &b.checkpoint);
+    jamlisp_code_free(&b.fact);
+  }
+  io_writer_clear(&wd);
+}
+
+typedef struct{
+  jamlisp_context * ctx;
+  jamlisp_checkpoint checkpoint;
+  jamlisp_code code;
+}array_bench_state;
+
+static void run_array_code(void * userdata){
+  array_bench_state * b = userdata;
+  jamlisp_code_iterate(b->ctx, &b->code);
+  jamlisp_arena_rewind(b->ctx, &b->checkpoint);
+}
+
+// times 'code' in threaded code, the arrays it makes are dropped by rewinding.
+static void bench_array_code(bench_suite * suite, array_bench_state * b, const char * name, size_t ops, const char * code){
+  io_writer wd = {0};
+  jamlisp_load_lisp2(b->ctx, &wd, code);
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  if(jamlisp_code_load(b->ctx, &b->code, &rd)){
+    b->checkpoint = jamlisp_arena_begin(b->ctx);
+    bench_run(suite, name, "element", ops, run_array_code, b);
+    jamlisp_arena_end(b->ctx, &b->checkpoint);
+    jamlisp_code_free(&b->code);
+  }
+  io_writer_clear(&wd);
+}
+
+// the array primitives with each simd level and the same dot product as a
+// lisp loop over array-ref.
+static void bench_arrays(bench_suite * suite){
+  enum { N = 4096 };
+  char buf[256];
+  array_bench_state b = {.ctx = jamlisp_new()};
+  f32 * data = malloc(N * sizeof(f32));
+  u64 rnd = 1;
+  for(size_t i = 0; i < N; i++)
+    data[i] = (f32)(bench_random(&rnd) % 1000) / 100.0f;
+  symbol_set_value(b.ctx, jamlisp_symbol(b.ctx, "a"), JAMLISP_MAKE_ARRAY(jamlisp_array_new(b.ctx, JAMLISP_F32, data, N * sizeof(f32))));
+  for(size_t i = 0; i < N; i++)
+    data[i] = (f32)(bench_random(&rnd) % 1000) / 100.0f;
+  symbol_set_value(b.ctx, jamlisp_symbol(b.ctx, "b"), JAMLISP_MAKE_ARRAY(jamlisp_array_new(b.ctx, JAMLISP_F32, data, N * sizeof(f32))));
+  f32 m[16] = {0.5f, 0, 0, 1, 0, 0.5f, 0, 2, 0, 0, 0.5f, 3, 0, 0, 0, 1};
+  symbol_set_value(b.ctx, jamlisp_symbol(b.ctx, "m"), JAMLISP_MAKE_ARRAY(jamlisp_array_new(b.ctx, JAMLISP_F32, m, sizeof(m))));
+  free(data);
+
+  struct { const char * name; const char * code; } ops[] = {
+    {"add", "(array-add a b)"},
+    {"fma", "(array-fma a b a)"},
+    {"dot", "(array-dot a b)"},
+    {"sum", "(array-sum a)"},
+    {"max", "(array-max a)"},
+    {"transform-vec4", "(array-transform m a)"},
+  };
+  for(jamlisp_simd_level level = 0; level <= jamlisp_simd_detect(); level++){
+    jamlisp_simd_set(b.ctx, level);
+    for(size_t i = 0; i < array_count(ops); i++){
+      snprintf(buf, sizeof(buf), "array-%s/%s", jamlisp_simd_name(level), ops[i].name);
+      bench_array_code(suite, &b, buf, N, ops[i].code);
+    }
+  }
+  io_writer wd = {0};
+  jamlisp_load_lisp2(b.ctx, &wd, "(defun dot-loop (a b i n acc) (if (< i n) (dot-loop a b (+ i 1) n (+ acc (* (array-ref a i) (array-ref b i)))) acc))");
+  io_writer_clear(&wd);
+  snprintf(buf, sizeof(buf), "(dot-loop a b 0 %i 0)", N);
+  bench_array_code(suite, &b, "array-lisp/dot", N, buf);
+}
+
+void run_benchmarks(int argc, char ** argv){
+  bench_suite suite = {0};
+  if(argc > 0 && strcmp(argv[0], "--csv") == 0){
+    suite.format = BENCH_CSV;
+    argc--; argv++;
+  }else if(argc > 0 && strcmp(argv[0], "--json") == 0){
+    suite.format = BENCH_JSON;
+    argc--; argv++;
+  }
+  
+  {
+    bench_state b = {.ctx = jamlisp_new(), .results = 1, .count = 10};
+    size_t nodes = write_add_tree(&b.prefix, 12);
+    bench_iterate(&suite, "add-tree", "node", &b, nodes);
+    io_writer_clear(&b.prefix);
+  }
+  {
+    bench_state b = {.ctx = jamlisp_new(), .results = 2000, .count = 10};
+    size_t nodes = write_calls(b.ctx, &b.prefix, b.results);
+    bench_iterate(&suite, "call", "node", &b, nodes);
+    io_writer_clear(&b.prefix);
+  }
+  for(int special = 0; special < 2; special++){
+    bench_state b = {.ctx = jamlisp_new(), .results = 1, .count = 100};
+    io_writer code = {0};
+    size_t nodes = write_let_program(&code, 64, special);
+    jamlisp_load_lisp2(b.ctx, &b.prefix, code.data);
+    bench_iterate(&suite, special ? "let-special" : "let-lexical", "node", &b, nodes);
+    io_writer_clear(&code);
+    io_writer_clear(&b.prefix);
+  }
+  {
+    bench_state b = {.ctx = jamlisp_new(), .results = 1, .count = 10};
+    io_writer code = {0};
+    u64 rnd = 1;
+    // x and y are not constants, so only the subtrees without them fold.
+    symbol_set_value(b.ctx, jamlisp_symbol(b.ctx, "x0"), jamlisp_i64(3));
+    symbol_set_value(b.ctx, jamlisp_symbol(b.ctx, "y0"), jamlisp_i64(5));
+    io_write(&code, "(let ((x x0) (y y0)) ", 21);
+    size_t nodes = write_arith_expr(&code, &rnd, 12);
+    io_write(&code, ")", 2);
+    jamlisp_load_lisp2(b.ctx, &b.prefix, code.data);
+    bench_iterate(&suite, "arith", "node", &b, nodes);
+    io_writer_clear(&code);
+    io_writer_clear(&b.prefix);
+  }
+  bench_functions(&suite);
+  bench_bignums(&suite);
+  bench_arrays(&suite);
+  bench_objects(&suite);
+  bench_gc(&suite, "manual", JAMLISP_GC_MANUAL);
+  bench_gc(&suite, "mark-sweep", JAMLISP_GC_MARK_SWEEP);
+  bench_gc(&suite, "generational", JAMLISP_GC_GENERATIONAL);
+  bench_scripts(&suite);
+  bench_alloc_latency(&suite, 1 << 24, "16M");
+  {
+    static const size_t scenes[] = {20000, 400000};
+    for(size_t i = 0; i < array_count(scenes); i++){
+      char name[32];
+      io_writer wd = {0};
+      jamlisp_bench_scene(&wd, scenes[i], 1);
+      io_write_u8(&wd, 0);
+      snprintf(name, sizeof(name), "scene-%i", (int)scenes[i]);
+      bench_load(&suite, name, wd.data);
+      bench_lex(&suite, name, wd.data);
+      io_writer_clear(&wd);
+    }
+  }
+  {
+    static const struct { size_t functions; size_t nodes; } libraries[] = {{100, 200}, {1000, 400}};
+    for(size_t i = 0; i < array_count(libraries); i++){
+      char name[32];
+      io_writer wd = {0};
+      write_scene_library(&wd, libraries[i].functions, libraries[i].nodes, 1);
+      io_write_u8(&wd, 0);
+      snprintf(name, sizeof(name), "library-%i", (int)(libraries[i].functions * libraries[i].nodes));
+      bench_startup(&suite, name, wd.data);
+      io_writer_clear(&wd);
+    }
+  }
+  // the parse time of deeply nested code should grow linearly with the depth.
+  for(int depth = 1000; depth <= 8000; depth *= 2){
+    char name[32];
+    io_writer wd = {0};
+    write_nested_sum(&wd, depth);
+    io_write_u8(&wd, 0);
+    snprintf(name, sizeof(name), "nested-%i", depth);
+    bench_load(&suite, name, wd.data);
+    io_writer_clear(&wd);
+  }
+  for(int i = 0; i < argc; i++){
+    char * code = read_file(argv[i]);
+    if(code == NULL){
+      ERROR("Unable to read %s\n", argv[i]);
+      continue;
+    }
+    bench_load(&suite, argv[i], code);
+    bench_lex(&suite, argv[i], code);
+    free(code);
+  }
+  bench_end(&suite);
+}
+
+void run_bench_gen(int argc, char ** argv){
+  size_t nodes = argc > 0 ? strtoull(argv[0], NULL, 10) : 1000;
+  io_writer wd = {0};
+  jamlisp_bench_scene(&wd, nodes, 1);
+  fwrite(wd.data, 1, wd.offset, stdout);
+  io_writer_clear(&wd);
+}
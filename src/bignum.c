@@ -0,0 +1,812 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Bignums.
+// Integers that do not fit in INT64 (48 bits with JAMLISP_TAGGED) and
+// bigfloats. Both are a sign and a magnitude of 64 bit limbs, a bigfloat also
+// has a binary exponent and a mantissa of ctx->bigfloat_precision bits.
+// Objects are immutable. They are collected, except in an arena where they
+// are bump allocated from ctx->bignums. Intermediate limbs go to
+// ctx->bignum_scratch. An integer result that fits is returned as
+// INT64, so small numbers never allocate.
+//
+// Multiplication switches from schoolbook to Karatsuba at
+// KARATSUBA_THRESHOLD limbs, division is Knuth's algorithm D.
+
+typedef u64 limb;
+typedef unsigned __int128 dlimb;
+
+#define KARATSUBA_THRESHOLD 32
+// 10^19, the largest power of 10 in a limb.
+#define DECIMAL_BASE 10000000000000000000ULL
+#define DECIMAL_DIGITS 19
+
+// Scratch limbs are taken like a stack. Growing moves them, so room for a
+// whole operation is made before it starts.
+static void scratch_reserve(jamlisp_context * ctx, size_t n){
+  ASSERT(ctx->bignum_scratch_used == 0);
+  if(n > ctx->bignum_scratch_capacity){
+    free(ctx->bignum_scratch);
+    ctx->bignum_scratch_capacity = MAX(n, ctx->bignum_scratch_capacity * 2);
+    ctx->bignum_scratch = malloc(sizeof(limb) * ctx->bignum_scratch_capacity);
+  }
+}
+
+static limb * scratch_alloc(jamlisp_context * ctx, size_t n){
+  ASSERT(ctx->bignum_scratch_used + n <= ctx->bignum_scratch_capacity);
+  limb * out = ctx->bignum_scratch + ctx->bignum_scratch_used;
+  ctx->bignum_scratch_used += n;
+  return out;
+}
+
+// Magnitudes.
+// a limb array and a count, the top limbs can be 0 unless noted.
+
+static size_t mag_trim(const limb * a, size_t n){
+  while(n > 0 && a[n - 1] == 0)
+    n--;
+  return n;
+}
+
+static size_t mag_bits(const limb * a, size_t n){
+  n = mag_trim(a, n);
+  if(n == 0)
+    return 0;
+  return n * 64 - __builtin_clzll(a[n - 1]);
+}
+
+static int mag_cmp(const limb * a, size_t an, const limb * b, size_t bn){
+  an = mag_trim(a, an);
+  bn = mag_trim(b, bn);
+  if(an != bn)
+    return an < bn ? -1 : 1;
+  for(size_t i = an; i-- > 0;)
+    if(a[i] != b[i])
+      return a[i] < b[i] ? -1 : 1;
+  return 0;
+}
+
+// r = a + b for an >= bn. r has an limbs and can be a, returns the carry.
+static limb mag_add(limb * r, const limb * a, size_t an, const limb * b, size_t bn){
+  limb carry = 0;
+  for(size_t i = 0; i < bn; i++){
+    dlimb s = (dlimb)a[i] + b[i] + carry;
+    r[i] = (limb)s;
+    carry = (limb)(s >> 64);
+  }
+  for(size_t i = bn; i < an; i++){
+    dlimb s = (dlimb)a[i] + carry;
+    r[i] = (limb)s;
+    carry = (limb)(s >> 64);
+  }
+  return carry;
+}
+
+// r = a - b for an >= bn. r has an limbs and can be a, returns the borrow.
+static limb mag_sub(limb * r, const limb * a, size_t an, const limb * b, size_t bn){
+  limb borrow = 0;
+  for(size_t i = 0; i < bn; i++){
+    limb x = a[i], y = b[i];
+    limb d = x - y;
+    r[i] = d - borrow;
+    borrow = (x < y) | (d < borrow);
+  }
+  for(size_t i = bn; i < an; i++){
+    limb x = a[i];
+    r[i] = x - borrow;
+    borrow = x < borrow;
+  }
+  return borrow;
+}
+
+// r = r * m + add, returns the carry.
+static limb mag_mul_small(limb * r, size_t n, limb m, limb add){
+  limb carry = add;
+  for(size_t i = 0; i < n; i++){
+    dlimb p = (dlimb)r[i] * m + carry;
+    r[i] = (limb)p;
+    carry = (limb)(p >> 64);
+  }
+  return carry;
+}
+
+// q = a / d, returns the remainder. q can be a.
+static limb mag_div_small(limb * q, const limb * a, size_t an, limb d){
+  dlimb rem = 0;
+  for(size_t i = an; i-- > 0;){
+    dlimb cur = (rem << 64) | a[i];
+    q[i] = (limb)(cur / d);
+    rem = cur % d;
+  }
+  return (limb)rem;
+}
+
+// r = a << bits. r has an + bits / 64 + 1 limbs and does not overlap a.
+static size_t mag_shl(limb * r, const limb * a, size_t an, size_t bits){
+  size_t limbs = bits / 64;
+  int s = bits % 64;
+  memset(r, 0, sizeof(limb) * limbs);
+  limb carry = 0;
+  for(size_t i = 0; i < an; i++){
+    r[i + limbs] = (a[i] << s) | carry;
+    carry = s == 0 ? 0 : a[i] >> (64 - s);
+  }
+  r[an + limbs] = carry;
+  return an + limbs + 1;
+}
+
+// r = a >> bits, returns the number of limbs in r. r can be a.
+static size_t mag_shr(limb * r, const limb * a, size_t an, size_t bits){
+  size_t limbs = bits / 64;
+  int s = bits % 64;
+  if(limbs >= an)
+    return 0;
+  size_t n = an - limbs;
+  for(size_t i = 0; i < n; i++){
+    limb hi = i + limbs + 1 < an && s != 0 ? a[i + limbs + 1] << (64 - s) : 0;
+    r[i] = (a[i + limbs] >> s) | hi;
+  }
+  return n;
+}
+
+// r = a * b. r has an + bn limbs and does not overlap a or b.
+static void mag_mul_school(limb * r, const limb * a, size_t an, const limb * b, size_t bn){
+  memset(r, 0, sizeof(limb) * (an + bn));
+  for(size_t i = 0; i < an; i++){
+    if(a[i] == 0)
+      continue;
+    limb carry = 0;
+    for(size_t j = 0; j < bn; j++){
+      dlimb p = (dlimb)a[i] * b[j] + r[i + j] + carry;
+      r[i + j] = (limb)p;
+      carry = (limb)(p >> 64);
+    }
+    r[i + bn] = carry;
+  }
+}
+
+// r[0, rn) += a[0, an), the result must fit in rn limbs.
+static void mag_add_to(limb * r, size_t rn, const limb * a, size_t an){
+  limb carry = mag_add(r, r, an, a, an);
+  for(size_t i = an; carry != 0 && i < rn; i++){
+    r[i] += 1;
+    carry = r[i] == 0;
+  }
+}
+
+// r = a * b like mag_mul_school. Splits a = a1 B^h + a0 and b = b1 B^h + b0
+// and gets the middle a0 b1 + a1 b0 from (a0 + a1)(b0 + b1) - a0 b0 - a1 b1.
+// Scratch use is at most 6 (an + bn) + 512 limbs.
+static void mag_mul(jamlisp_context * ctx, limb * r, const limb * a, size_t an, const limb * b, size_t bn){
+  if(an < bn){
+    const limb * t = a; a = b; b = t;
+    size_t tn = an; an = bn; bn = tn;
+  }
+  if(bn < KARATSUBA_THRESHOLD){
+    mag_mul_school(r, a, an, b, bn);
+    return;
+  }
+  size_t mark = ctx->bignum_scratch_used;
+  size_t h = (an + 1) / 2;
+  if(bn <= h){
+    // too unbalanced to split, a is multiplied in pieces of bn limbs.
+    memset(r, 0, sizeof(limb) * (an + bn));
+    limb * t = scratch_alloc(ctx, 2 * bn);
+    for(size_t i = 0; i < an; i += bn){
+      size_t n = MIN(bn, an - i);
+      mag_mul(ctx, t, a + i, n, b, bn);
+      mag_add_to(r + i, an + bn - i, t, n + bn);
+    }
+    ctx->bignum_scratch_used = mark;
+    return;
+  }
+  size_t a1n = an - h, b1n = bn - h;
+  // a0 b0 and a1 b1 go to the low and high part of r.
+  mag_mul(ctx, r, a, h, b, h);
+  mag_mul(ctx, r + 2 * h, a + h, a1n, b + h, b1n);
+  limb * sa = scratch_alloc(ctx, h + 1);
+  limb * sb = scratch_alloc(ctx, h + 1);
+  limb * mid = scratch_alloc(ctx, 2 * h + 2);
+  sa[h] = mag_add(sa, a, h, a + h, a1n);
+  sb[h] = mag_add(sb, b, h, b + h, b1n);
+  mag_mul(ctx, mid, sa, h + 1, sb, h + 1);
+  mag_sub(mid, mid, 2 * h + 2, r, 2 * h);
+  mag_sub(mid, mid, 2 * h + 2, r + 2 * h, a1n + b1n);
+  mag_add_to(r + h, an + bn - h, mid, mag_trim(mid, 2 * h + 2));
+  ctx->bignum_scratch_used = mark;
+}
+
+// q = a / b and r = a % b (if r is not NULL) with b trimmed and an >= bn.
+// q has an - bn + 1 limbs and r has bn.
+static void mag_divmod(jamlisp_context * ctx, limb * q, limb * r, const limb * a, size_t an, const limb * b, size_t bn){
+  if(bn == 1){
+    limb rem = mag_div_small(q, a, an, b[0]);
+    if(r != NULL)
+      r[0] = rem;
+    return;
+  }
+  size_t mark = ctx->bignum_scratch_used;
+  int s = __builtin_clzll(b[bn - 1]);
+  limb * vn = scratch_alloc(ctx, bn);
+  limb * un = scratch_alloc(ctx, an + 1);
+  // shifted so the top limb of the divisor has its high bit set, which makes
+  // the estimated quotient limb at most two too large.
+  for(size_t i = bn - 1; i > 0; i--)
+    vn[i] = s == 0 ? b[i] : (b[i] << s) | (b[i - 1] >> (64 - s));
+  vn[0] = b[0] << s;
+  un[an] = s == 0 ? 0 : a[an - 1] >> (64 - s);
+  for(size_t i = an - 1; i > 0; i--)
+    un[i] = s == 0 ? a[i] : (a[i] << s) | (a[i - 1] >> (64 - s));
+  un[0] = a[0] << s;
+
+  for(size_t j = an - bn + 1; j-- > 0;){
+    dlimb num = ((dlimb)un[j + bn] << 64) | un[j + bn - 1];
+    dlimb qhat = num / vn[bn - 1];
+    dlimb rhat = num % vn[bn - 1];
+    while((qhat >> 64) != 0 || qhat * vn[bn - 2] > ((rhat << 64) | un[j + bn - 2])){
+      qhat -= 1;
+      rhat += vn[bn - 1];
+      if((rhat >> 64) != 0)
+        break;
+    }
+    // un[j, j + bn] -= qhat * vn
+    __int128 k = 0, t;
+    for(size_t i = 0; i < bn; i++){
+      dlimb p = qhat * vn[i];
+      t = (__int128)un[i + j] - k - (__int128)(limb)p;
+      un[i + j] = (limb)t;
+      k = (__int128)(p >> 64) - (t >> 64);
+    }
+    t = (__int128)un[j + bn] - k;
+    un[j + bn] = (limb)t;
+    q[j] = (limb)qhat;
+    if(t < 0){
+      // qhat was one too large, the divisor is added back.
+      q[j] -= 1;
+      dlimb carry = 0;
+      for(size_t i = 0; i < bn; i++){
+        carry += (dlimb)un[i + j] + vn[i];
+        un[i + j] = (limb)carry;
+        carry >>= 64;
+      }
+      un[j + bn] += (limb)carry;
+    }
+  }
+  if(r != NULL){
+    for(size_t i = 0; i < bn; i++)
+      r[i] = s == 0 ? un[i] : (un[i] >> s) | (un[i + 1] << (64 - s));
+  }
+  ctx->bignum_scratch_used = mark;
+}
+
+static f64 mag_to_f64(const limb * a, size_t n){
+  n = mag_trim(a, n);
+  // the top three limbs hold more bits than a double.
+  size_t skip = n > 3 ? n - 3 : 0;
+  f64 v = 0;
+  for(size_t i = n; i-- > skip;)
+    v = v * 0x1p64 + (f64)a[i];
+  return ldexp(v, 64 * skip);
+}
+
+// Numbers as sign, magnitude and exponent.
+
+typedef struct{
+  const limb * limbs;
+  size_t count;
+  bool negative;
+  i64 exponent;
+  // holds the magnitude of INT64 and float values, so a view can not be copied.
+  limb small[1];
+}num_view;
+
+static void view_init(num_view * v, jamlisp_object obj){
+  *v = (num_view){0};
+  if(JAMLISP_IS(obj, JAMLISP_BIGNUM) || JAMLISP_IS(obj, JAMLISP_BIGFLOAT)){
+    var b = JAMLISP_BIGNUM_PTR(obj);
+    v->limbs = b->limbs;
+    v->count = b->count;
+    v->negative = b->negative;
+    v->exponent = b->exponent;
+    return;
+  }
+  v->limbs = v->small;
+  if(JAMLISP_IS(obj, JAMLISP_F32) || JAMLISP_IS(obj, JAMLISP_F64)){
+    f64 f = jamlisp_to_f64(obj);
+    if(!isfinite(f)){
+      ERROR("%f is not a bigfloat\n", f);
+      return;
+    }
+    // exact, a double has 53 mantissa bits.
+    int e;
+    f64 m = frexp(fabs(f), &e);
+    v->small[0] = (limb)ldexp(m, 53);
+    v->exponent = e - 53;
+    v->negative = f < 0;
+    v->count = v->small[0] != 0;
+    return;
+  }
+  i64 x = JAMLISP_IS(obj, JAMLISP_INT64) ? JAMLISP_INT64(obj) : JAMLISP_FIXNUM(obj);
+  v->negative = x < 0;
+  v->small[0] = x < 0 ? 0 - (u64)x : (u64)x;
+  v->count = v->small[0] != 0;
+}
+
+static jamlisp_object bignum_new(jamlisp_context * ctx, jamlisp_type type, const limb * limbs, size_t n, bool negative, i64 exponent){
+  size_t size = sizeof(jamlisp_bignum) + n * sizeof(limb);
+  bool arena = ctx->arena.depth > 0;
+  jamlisp_bignum * b = arena ? jamlisp_block_alloc(&ctx->bignums, size) : jamlisp_gc_bignum_alloc(ctx, size);
+  b->exponent = exponent;
+  b->count = n;
+  b->negative = negative && n > 0;
+  b->marked = false;
+  if(n > 0)
+    memcpy(b->limbs, limbs, n * sizeof(limb));
+  var result = JAMLISP_MAKE_BIGNUM(type, b);
+  if(!arena)
+    jamlisp_gc_on_bignum(ctx, result);
+  return result;
+}
+
+static jamlisp_object make_integer(jamlisp_context * ctx, const limb * limbs, size_t n, bool negative){
+  n = mag_trim(limbs, n);
+  if(n == 0)
+    return JAMLISP_MAKE_INT64(0);
+  if(n == 1 && limbs[0] <= (u64)INT64_MAX + negative){
+    i64 v = negative ? (i64)(0 - limbs[0]) : (i64)limbs[0];
+    if(JAMLISP_INT64_FITS(v))
+      return JAMLISP_MAKE_INT64(v);
+  }
+  return bignum_new(ctx, JAMLISP_BIGNUM, limbs, n, negative, 0);
+}
+
+static bool integer_check(jamlisp_object obj){
+  if(JAMLISP_IS(obj, JAMLISP_INT64) || JAMLISP_IS(obj, JAMLISP_BIGNUM) || JAMLISP_IS(obj, JAMLISP_INT32) || JAMLISP_IS(obj, JAMLISP_FIXNUM))
+    return true;
+  ERROR("Not an integer: %i\n", JAMLISP_TYPE(obj));
+  return false;
+}
+
+// a + b, or a - b if negate_b. The views are integers without exponent.
+static jamlisp_object integer_add(jamlisp_context * ctx, const num_view * a, const num_view * b, bool negate_b){
+  bool aneg = a->negative, bneg = b->negative != negate_b;
+  if(b->count == 0)
+    return make_integer(ctx, a->limbs, a->count, aneg);
+  if(mag_cmp(a->limbs, a->count, b->limbs, b->count) < 0){
+    const num_view * t = a; a = b; b = t;
+    bool tn = aneg; aneg = bneg; bneg = tn;
+  }
+  // |a| >= |b| from here.
+  limb * r = scratch_alloc(ctx, a->count + 1);
+  if(aneg == bneg){
+    r[a->count] = mag_add(r, a->limbs, a->count, b->limbs, b->count);
+    return make_integer(ctx, r, a->count + 1, aneg);
+  }
+  mag_sub(r, a->limbs, a->count, b->limbs, b->count);
+  return make_integer(ctx, r, a->count, aneg);
+}
+
+static jamlisp_object integer_add_sub(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b, bool negate_b){
+  if(!integer_check(a) || !integer_check(b))
+    return jamlisp_nil();
+  num_view va, vb;
+  view_init(&va, a);
+  view_init(&vb, b);
+  scratch_reserve(ctx, MAX(va.count, vb.count) + 1);
+  var r = integer_add(ctx, &va, &vb, negate_b);
+  ctx->bignum_scratch_used = 0;
+  return r;
+}
+
+jamlisp_object jamlisp_integer_add(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  return integer_add_sub(ctx, a, b, false);
+}
+
+jamlisp_object jamlisp_integer_sub(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  return integer_add_sub(ctx, a, b, true);
+}
+
+jamlisp_object jamlisp_integer_mul(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  if(!integer_check(a) || !integer_check(b))
+    return jamlisp_nil();
+  num_view va, vb;
+  view_init(&va, a);
+  view_init(&vb, b);
+  size_t n = va.count + vb.count;
+  scratch_reserve(ctx, 7 * n + 512);
+  limb * r = scratch_alloc(ctx, n);
+  mag_mul(ctx, r, va.limbs, va.count, vb.limbs, vb.count);
+  var result = make_integer(ctx, r, n, va.negative != vb.negative);
+  ctx->bignum_scratch_used = 0;
+  return result;
+}
+
+// the quotient is truncated towards zero.
+jamlisp_object jamlisp_integer_div(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  if(!integer_check(a) || !integer_check(b))
+    return jamlisp_nil();
+  num_view va, vb;
+  view_init(&va, a);
+  view_init(&vb, b);
+  if(vb.count == 0){
+    ERROR("Division by zero\n");
+    return jamlisp_nil();
+  }
+  if(mag_cmp(va.limbs, va.count, vb.limbs, vb.count) < 0)
+    return JAMLISP_MAKE_INT64(0);
+  size_t qn = va.count - vb.count + 1;
+  scratch_reserve(ctx, qn + va.count + vb.count + 1);
+  limb * q = scratch_alloc(ctx, qn);
+  mag_divmod(ctx, q, NULL, va.limbs, va.count, vb.limbs, vb.count);
+  var result = make_integer(ctx, q, qn, va.negative != vb.negative);
+  ctx->bignum_scratch_used = 0;
+  return result;
+}
+
+int jamlisp_integer_compare(jamlisp_object a, jamlisp_object b){
+  num_view va, vb;
+  view_init(&va, a);
+  view_init(&vb, b);
+  if(va.negative != vb.negative)
+    return va.negative ? -1 : 1;
+  int c = mag_cmp(va.limbs, va.count, vb.limbs, vb.count);
+  return va.negative ? -c : c;
+}
+
+// an INT64, or a BIGNUM for a value outside the tagged range.
+jamlisp_object jamlisp_integer(jamlisp_context * ctx, i64 v){
+  if(JAMLISP_INT64_FITS(v))
+    return JAMLISP_MAKE_INT64(v);
+  limb m = v < 0 ? 0 - (u64)v : (u64)v;
+  return bignum_new(ctx, JAMLISP_BIGNUM, &m, 1, v < 0, 0);
+}
+
+// decimal digits with an optional leading '-'.
+jamlisp_object jamlisp_integer_parse(jamlisp_context * ctx, const char * digits, size_t length){
+  bool negative = length > 0 && digits[0] == '-';
+  size_t i = negative ? 1 : 0;
+  scratch_reserve(ctx, length / DECIMAL_DIGITS + 2);
+  limb * r = scratch_alloc(ctx, length / DECIMAL_DIGITS + 2);
+  size_t n = 0;
+  while(i < length){
+    size_t chunk = MIN(length - i, (size_t)DECIMAL_DIGITS);
+    limb scale = 1, value = 0;
+    for(size_t j = 0; j < chunk; j++){
+      char c = digits[i + j];
+      if(c < '0' || c > '9'){
+        ERROR("Invalid digit '%c'\n", c);
+        ctx->bignum_scratch_used = 0;
+        return jamlisp_nil();
+      }
+      scale *= 10;
+      value = value * 10 + (c - '0');
+    }
+    limb carry = mag_mul_small(r, n, scale, value);
+    if(carry != 0)
+      r[n++] = carry;
+    i += chunk;
+  }
+  var result = make_integer(ctx, r, n, negative);
+  ctx->bignum_scratch_used = 0;
+  return result;
+}
+
+// Bigfloats.
+
+static size_t precision_limbs(jamlisp_context * ctx){
+  return (ctx->bigfloat_precision + 63) / 64 + 1;
+}
+
+// rounds the magnitude to the nearest number with bigfloat_precision bits.
+// Needs precision_limbs of scratch.
+static jamlisp_object make_bigfloat(jamlisp_context * ctx, const limb * m, size_t n, bool negative, i64 exponent){
+  n = mag_trim(m, n);
+  if(n == 0)
+    return bignum_new(ctx, JAMLISP_BIGFLOAT, NULL, 0, false, 0);
+  size_t p = ctx->bigfloat_precision;
+  size_t bits = mag_bits(m, n);
+  limb * out = scratch_alloc(ctx, precision_limbs(ctx));
+  size_t out_n;
+  if(bits > p){
+    size_t shift = bits - p;
+    bool round = (m[(shift - 1) / 64] >> ((shift - 1) % 64)) & 1;
+    out_n = mag_shr(out, m, n, shift);
+    exponent += shift;
+    if(round){
+      limb one = 1;
+      if(mag_add(out, out, out_n, &one, 1) != 0 || mag_bits(out, out_n) > p){
+        // rounded up to 2^p.
+        memset(out, 0, sizeof(limb) * out_n);
+        out[(p - 1) / 64] = 1ULL << ((p - 1) % 64);
+        exponent += 1;
+      }
+    }
+  }else{
+    out_n = mag_shl(out, m, n, p - bits);
+    exponent -= p - bits;
+  }
+  return bignum_new(ctx, JAMLISP_BIGFLOAT, out, mag_trim(out, out_n), negative, exponent);
+}
+
+jamlisp_object jamlisp_bigfloat(jamlisp_context * ctx, jamlisp_object number){
+  if(JAMLISP_IS(number, JAMLISP_BIGFLOAT))
+    return number;
+  if(!jamlisp_numberp(number)){
+    ERROR("Not a number: %i\n", JAMLISP_TYPE(number));
+    return jamlisp_nil();
+  }
+  num_view v;
+  view_init(&v, number);
+  scratch_reserve(ctx, precision_limbs(ctx));
+  var result = make_bigfloat(ctx, v.limbs, v.count, v.negative, v.exponent);
+  ctx->bignum_scratch_used = 0;
+  return result;
+}
+
+typedef struct{
+  limb * limbs;
+  size_t count;
+  bool negative;
+  i64 exponent;
+}raw_sum;
+
+// the exact a + b (a - b if negate_b), unless one of them is too small to
+// change the rounded result, then it is the other one.
+static raw_sum bigfloat_sum(jamlisp_context * ctx, const num_view * a, const num_view * b, bool negate_b){
+  bool aneg = a->negative, bneg = b->negative != negate_b;
+  i64 atop = a->exponent + (i64)mag_bits(a->limbs, a->count);
+  i64 btop = b->exponent + (i64)mag_bits(b->limbs, b->count);
+  i64 gap = ctx->bigfloat_precision + 2;
+  bool use_a = b->count == 0 || (a->count != 0 && atop > btop + gap);
+  bool use_b = !use_a && (a->count == 0 || btop > atop + gap);
+  if(use_a || use_b){
+    var v = use_a ? a : b;
+    size_t n = mag_trim(v->limbs, v->count);
+    raw_sum r = {.limbs = scratch_alloc(ctx, n), .count = n, .negative = use_a ? aneg : bneg, .exponent = v->exponent};
+    memcpy(r.limbs, v->limbs, n * sizeof(limb));
+    return r;
+  }
+  // both are shifted to the smaller exponent.
+  i64 e = MIN(a->exponent, b->exponent);
+  limb * x = scratch_alloc(ctx, a->count + (a->exponent - e) / 64 + 1);
+  size_t xn = mag_shl(x, a->limbs, a->count, a->exponent - e);
+  limb * y = scratch_alloc(ctx, b->count + (b->exponent - e) / 64 + 1);
+  size_t yn = mag_shl(y, b->limbs, b->count, b->exponent - e);
+  if(mag_cmp(x, xn, y, yn) < 0){
+    limb * t = x; x = y; y = t;
+    size_t tn = xn; xn = yn; yn = tn;
+    bool tneg = aneg; aneg = bneg; bneg = tneg;
+  }
+  xn = MAX(xn, yn);
+  yn = mag_trim(y, yn);
+  raw_sum r = {.limbs = scratch_alloc(ctx, xn + 1), .negative = aneg, .exponent = e};
+  if(aneg == bneg){
+    r.limbs[xn] = mag_add(r.limbs, x, xn, y, yn);
+    r.count = xn + 1;
+  }else{
+    mag_sub(r.limbs, x, xn, y, yn);
+    r.count = xn;
+  }
+  return r;
+}
+
+// scratch for bigfloat_sum of the two and the rounding.
+static size_t sum_scratch(jamlisp_context * ctx, const num_view * a, const num_view * b){
+  i64 d = a->exponent > b->exponent ? a->exponent - b->exponent : b->exponent - a->exponent;
+  size_t shift = d > (i64)(a->count + b->count + precision_limbs(ctx)) * 64 ? 0 : d / 64;
+  return 3 * (a->count + b->count + shift) + precision_limbs(ctx) + 8;
+}
+
+static jamlisp_object bigfloat_add_sub(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b, bool negate_b){
+  if(!jamlisp_numberp(a) || !jamlisp_numberp(b)){
+    ERROR("Not a number\n");
+    return jamlisp_nil();
+  }
+  num_view va, vb;
+  view_init(&va, a);
+  view_init(&vb, b);
+  scratch_reserve(ctx, sum_scratch(ctx, &va, &vb));
+  var s = bigfloat_sum(ctx, &va, &vb, negate_b);
+  var result = make_bigfloat(ctx, s.limbs, s.count, s.negative, s.exponent);
+  ctx->bignum_scratch_used = 0;
+  return result;
+}
+
+jamlisp_object jamlisp_bigfloat_add(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  return bigfloat_add_sub(ctx, a, b, false);
+}
+
+jamlisp_object jamlisp_bigfloat_sub(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  return bigfloat_add_sub(ctx, a, b, true);
+}
+
+jamlisp_object jamlisp_bigfloat_mul(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  if(!jamlisp_numberp(a) || !jamlisp_numberp(b)){
+    ERROR("Not a number\n");
+    return jamlisp_nil();
+  }
+  num_view va, vb;
+  view_init(&va, a);
+  view_init(&vb, b);
+  size_t n = va.count + vb.count;
+  scratch_reserve(ctx, 7 * n + 512 + precision_limbs(ctx));
+  limb * r = scratch_alloc(ctx, n);
+  mag_mul(ctx, r, va.limbs, va.count, vb.limbs, vb.count);
+  var result = make_bigfloat(ctx, r, n, va.negative != vb.negative, va.exponent + vb.exponent);
+  ctx->bignum_scratch_used = 0;
+  return result;
+}
+
+jamlisp_object jamlisp_bigfloat_div(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  if(!jamlisp_numberp(a) || !jamlisp_numberp(b)){
+    ERROR("Not a number\n");
+    return jamlisp_nil();
+  }
+  num_view va, vb;
+  view_init(&va, a);
+  view_init(&vb, b);
+  size_t bn = mag_trim(vb.limbs, vb.count);
+  if(bn == 0){
+    ERROR("Division by zero\n");
+    return jamlisp_nil();
+  }
+  // a is shifted so the quotient has one bit more than the precision.
+  i64 shift = (i64)ctx->bigfloat_precision + (i64)mag_bits(vb.limbs, bn) - (i64)mag_bits(va.limbs, va.count) + 1;
+  shift = MAX(shift, 0);
+  size_t xn = va.count + shift / 64 + 1;
+  scratch_reserve(ctx, 3 * xn + bn + precision_limbs(ctx) + 8);
+  limb * x = scratch_alloc(ctx, xn);
+  mag_shl(x, va.limbs, va.count, shift);
+  xn = mag_trim(x, xn);
+  jamlisp_object result;
+  if(xn < bn){
+    result = make_bigfloat(ctx, NULL, 0, false, 0);
+  }else{
+    limb * q = scratch_alloc(ctx, xn - bn + 1);
+    mag_divmod(ctx, q, NULL, x, xn, vb.limbs, bn);
+    result = make_bigfloat(ctx, q, xn - bn + 1, va.negative != vb.negative, va.exponent - vb.exponent - shift);
+  }
+  ctx->bignum_scratch_used = 0;
+  return result;
+}
+
+int jamlisp_bigfloat_compare(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  num_view va, vb;
+  view_init(&va, a);
+  view_init(&vb, b);
+  scratch_reserve(ctx, sum_scratch(ctx, &va, &vb));
+  var s = bigfloat_sum(ctx, &va, &vb, true);
+  ctx->bignum_scratch_used = 0;
+  if(mag_trim(s.limbs, s.count) == 0)
+    return 0;
+  return s.negative ? -1 : 1;
+}
+
+f64 jamlisp_bignum_to_f64(jamlisp_object obj){
+  var b = JAMLISP_BIGNUM_PTR(obj);
+  f64 v = ldexp(mag_to_f64(b->limbs, b->count), b->exponent);
+  return b->negative ? -v : v;
+}
+
+// Text.
+
+// writes the magnitude in decimal, a is changed.
+static void write_decimal(io_writer * writer, limb * a, size_t n){
+  n = mag_trim(a, n);
+  if(n == 0){
+    io_write(writer, "0", 1);
+    return;
+  }
+  limb * chunks = malloc(sizeof(limb) * (2 * n + 1));
+  size_t count = 0;
+  while(n > 0){
+    chunks[count++] = mag_div_small(a, a, n, DECIMAL_BASE);
+    n = mag_trim(a, n);
+  }
+  char buf[32];
+  int len = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)chunks[count - 1]);
+  io_write(writer, buf, len);
+  for(size_t i = count - 1; i-- > 0;){
+    len = snprintf(buf, sizeof(buf), "%019llu", (unsigned long long)chunks[i]);
+    io_write(writer, buf, len);
+  }
+  free(chunks);
+}
+
+// m 2^e with e < 0 as a decimal fraction. Digits are printed up to the
+// precision of the mantissa, the rest is truncated.
+static void write_fraction(io_writer * writer, const limb * m, size_t n, i64 e){
+  size_t bits = mag_bits(m, n);
+  i64 top = e + (i64)bits;
+  size_t decimals = bits * 0.30103 + 2 + (top < 0 ? -top * 0.30103 + 1 : 0);
+  // t = m 10^decimals >> -e
+  size_t tn = n + decimals / DECIMAL_DIGITS + 2;
+  limb * t = calloc(tn, sizeof(limb));
+  memcpy(t, m, n * sizeof(limb));
+  size_t used = n;
+  for(size_t left = decimals; left > 0;){
+    size_t step = MIN(left, (size_t)DECIMAL_DIGITS);
+    limb scale = 1;
+    for(size_t i = 0; i < step; i++)
+      scale *= 10;
+    limb carry = mag_mul_small(t, used, scale, 0);
+    if(carry != 0)
+      t[used++] = carry;
+    left -= step;
+  }
+  used = mag_shr(t, t, used, -e);
+  io_writer digits = {0};
+  write_decimal(&digits, t, used);
+  const char * d = digits.data;
+  size_t len = digits.offset;
+  // the integer part, then the fraction without trailing zeros.
+  if(len > decimals)
+    io_write(writer, d, len - decimals);
+  else
+    io_write(writer, "0", 1);
+  io_write(writer, ".", 1);
+  size_t zeros = len < decimals ? decimals - len : 0;
+  const char * frac = len > decimals ? d + len - decimals : d;
+  size_t frac_len = decimals - zeros;
+  while(frac_len > 0 && frac[frac_len - 1] == '0')
+    frac_len--;
+  if(frac_len == 0){
+    io_write(writer, "0", 1);
+  }else{
+    for(size_t i = 0; i < zeros; i++)
+      io_write(writer, "0", 1);
+    io_write(writer, frac, frac_len);
+  }
+  io_writer_clear(&digits);
+  free(t);
+}
+
+// numbers as text, INT64 and BIGNUM in decimal and BIGFLOAT as a decimal
+// fraction.
+void jamlisp_number_write(io_writer * writer, jamlisp_object obj){
+  char buf[64];
+  int len;
+  switch(JAMLISP_TYPE(obj)){
+  case JAMLISP_INT64:
+    len = snprintf(buf, sizeof(buf), "%lld", (long long)JAMLISP_INT64(obj));
+    io_write(writer, buf, len);
+    return;
+  case JAMLISP_F32:
+  case JAMLISP_F64:
+    len = snprintf(buf, sizeof(buf), "%f", jamlisp_to_f64(obj));
+    io_write(writer, buf, len);
+    return;
+  case JAMLISP_BIGNUM:
+  case JAMLISP_BIGFLOAT:
+    break;
+  default:
+    ERROR("Not a number: %i\n", JAMLISP_TYPE(obj));
+    return;
+  }
+  var b = JAMLISP_BIGNUM_PTR(obj);
+  if(b->negative)
+    io_write(writer, "-", 1);
+  if(b->exponent < 0){
+    write_fraction(writer, b->limbs, b->count, b->exponent);
+    return;
+  }
+  size_t n = b->count + b->exponent / 64 + 1;
+  limb * t = malloc(sizeof(limb) * n);
+  n = mag_shl(t, b->limbs, b->count, b->exponent);
+  write_decimal(writer, t, n);
+  if(JAMLISP_IS(obj, JAMLISP_BIGFLOAT))
+    io_write(writer, ".0", 2);
+  free(t);
+}
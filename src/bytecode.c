@@ -16,39 +16,156 @@
 
 typedef jamlisp_object object;
 
+#if JAMLISP_SOA_HEAP
+#if JAMLISP_TAGGED
+#define PAGE_TYPES(page) NULL
+
+static inline jamlisp_object soa_load(const u64 * payloads, const u8 * types, u32 slot, int shift){
+  UNUSED(types);
+  UNUSED(shift);
+  return payloads[slot];
+}
+
+static inline void soa_store(u64 * payloads, u8 * types, u32 slot, int shift, jamlisp_object value){
+  UNUSED(types);
+  UNUSED(shift);
+  payloads[slot] = value;
+}
+#else
+#define PAGE_TYPES(page) ((page)->types)
+
+static inline jamlisp_object soa_load(const u64 * payloads, const u8 * types, u32 slot, int shift){
+  return (jamlisp_object){.int64 = (i64) payloads[slot], .type = (types[slot] >> shift) & 0xF};
+}
+
+static inline void soa_store(u64 * payloads, u8 * types, u32 slot, int shift, jamlisp_object value){
+  payloads[slot] = (u64) value.int64;
+  types[slot] = (types[slot] & ~(0xF << shift)) | (value.type << shift);
+}
+#endif
+
+jamlisp_object cons_car(const cons_heap * heap, jamlisp_object_index idx){
+  var page = heap->pages[JAMLISP_HEAP_PAGE(idx)];
+  return soa_load(page->cars, PAGE_TYPES(page), JAMLISP_HEAP_SLOT(idx), 0);
+}
+
+jamlisp_object cons_cdr(const cons_heap * heap, jamlisp_object_index idx){
+  var page = heap->pages[JAMLISP_HEAP_PAGE(idx)];
+  return soa_load(page->cdrs, PAGE_TYPES(page), JAMLISP_HEAP_SLOT(idx), 4);
+}
+
+void cons_set_car(cons_heap * heap, jamlisp_object_index idx, jamlisp_object value){
+  var page = heap->pages[JAMLISP_HEAP_PAGE(idx)];
+  soa_store(page->cars, PAGE_TYPES(page), JAMLISP_HEAP_SLOT(idx), 0, value);
+}
+
+void cons_set_cdr(cons_heap * heap, jamlisp_object_index idx, jamlisp_object value){
+  var page = heap->pages[JAMLISP_HEAP_PAGE(idx)];
+  soa_store(page->cdrs, PAGE_TYPES(page), JAMLISP_HEAP_SLOT(idx), 4, value);
+}
+
+cons cons_get(const cons_heap * heap, jamlisp_object_index idx){
+  return (cons){.car = cons_car(heap, idx), .cdr = cons_cdr(heap, idx)};
+}
+#else
+static inline cons * cons_ptr(const cons_heap * heap, jamlisp_object_index idx){
+  return heap->pages[JAMLISP_HEAP_PAGE(idx)]->conses + JAMLISP_HEAP_SLOT(idx);
+}
+
+jamlisp_object cons_car(const cons_heap * heap, jamlisp_object_index idx){
+  return cons_ptr(heap, idx)->car;
+}
+
+jamlisp_object cons_cdr(const cons_heap * heap, jamlisp_object_index idx){
+  return cons_ptr(heap, idx)->cdr;
+}
+
+void cons_set_car(cons_heap * heap, jamlisp_object_index idx, jamlisp_object value){
+  cons_ptr(heap, idx)->car = value;
+}
+
+void cons_set_cdr(cons_heap * heap, jamlisp_object_index idx, jamlisp_object value){
+  cons_ptr(heap, idx)->cdr = value;
+}
+
+cons cons_get(const cons_heap * heap, jamlisp_object_index idx){
+  return *cons_ptr(heap, idx);
+}
+#endif
+
 void free_object(cons_heap * heap, jamlisp_object_index obj){
-  heap->cons_heap[obj].car = jamlisp_nil();
-  heap->cons_heap[obj].cdr.cons = heap->free_object;
-  heap->cons_heap[obj].cdr.type = JAMLISP_CONS;
+  if(heap->arena_base != 0 && obj >= heap->arena_base)
+    return;
+  cons_set_car(heap, obj, jamlisp_nil());
+  cons_set_cdr(heap, obj, JAMLISP_MAKE_CONS(heap->free_object));
   heap->free_object = obj;
+  heap->marks[obj / 64] &= ~(1ULL << (obj % 64));
+}
+
+// adds one page. A page released by the collector is reused first and put in
+// the free list, new pages are handed out by new_object from 'used'.
+void heap_grow(cons_heap * heap){
+  if(heap->released_pages > 0 && heap->arena_base == 0){
+    for(size_t page = 0; page < heap->page_count; page++){
+      if(heap->pages[page] != NULL)
+	continue;
+      heap->pages[page] = alloc0(sizeof(cons_page));
+      heap->released_pages -= 1;
+      // going down so the lowest conses end up first in the free list.
+      for(size_t slot = JAMLISP_HEAP_PAGE_SIZE; slot > 0; slot--)
+	free_object(heap, page * JAMLISP_HEAP_PAGE_SIZE + slot - 1);
+      return;
+    }
+  }
+  ensure_size2((void **) &heap->pages, sizeof(heap->pages[0]), &heap->page_capacity, heap->page_count, 2);
+  heap->pages[heap->page_count++] = alloc0(sizeof(cons_page));
+  heap->heap_size = heap->page_count * JAMLISP_HEAP_PAGE_SIZE;
+  // the mark bits are doubled so they are not copied on every page.
+  if(heap->mark_words < heap->heap_size / 64)
+    ensure_size((void **) &heap->marks, sizeof(heap->marks[0]), &heap->mark_words, MAX(heap->heap_size / 64, heap->mark_words * 2));
+}
+
+bool heap_full(const cons_heap * heap){
+  return (heap->free_object == 0 || heap->arena_base != 0) && heap->used >= heap->heap_size;
 }
 
 jamlisp_object_index new_object(cons_heap * heap){
-  if(heap->free_object == 0){
-    var prev_count = heap->heap_size;
-    u32 new_count = grow_elems((void **) &heap->cons_heap, sizeof(heap->cons_heap[0]), &heap->heap_size);
-    for(size_t i = prev_count; i < new_count; i++){
-      free_object(heap, i);
-    }
+  // index 0 is nil.
+  if(heap->used == 0)
+    heap->used = 1;
+  if(heap_full(heap))
+    heap_grow(heap);
+  if(heap->free_object != 0 && heap->arena_base == 0){
+    jamlisp_object_index out = heap->free_object;
+    heap->free_object = JAMLISP_CONS_INDEX(cons_cdr(heap, out));
+    return out;
   }
-  jamlisp_object_index out = heap->free_object;
-  heap->free_object = heap->cons_heap[out].cdr.cons;
+  jamlisp_object_index out = heap->used++;
+  cons_set_car(heap, out, jamlisp_nil());
+  cons_set_cdr(heap, out, jamlisp_nil());
   return out;
 }
 
-cons cons_get(const cons_heap * heap, jamlisp_object_index idx){
-  return heap->cons_heap[idx];
-}
-
 void jamlisp_free(jamlisp_context * ctx, jamlisp_object_index obj){
   free_object(&ctx->heap, obj);
 }
 
-jamlisp_array * jamlisp_array_new(jamlisp_type t, void * data, size_t size){
-  jamlisp_array * a = alloc0(sizeof(a[0]));
-  a->data = iron_clone(data, size);
+jamlisp_array * jamlisp_array_new(jamlisp_context * ctx, jamlisp_type t, void * data, size_t size){
+  jamlisp_array * a;
+  if(ctx->arena.depth > 0){
+    a = jamlisp_arena_alloc(ctx, sizeof(a[0]) + size);
+    a->data = a + 1;
+    if(data != NULL)
+      memcpy(a->data, data, size);
+    else
+      memset(a->data, 0, size);
+  }else{
+    a = alloc0(sizeof(a[0]));
+    a->data = data != NULL ? iron_clone(data, size) : alloc0(size);
+  }
   a->type = t;
   a->size = size;
+  a->generation = ++ctx->array_generation;
   return a;
 }
 
@@ -82,21 +199,35 @@ void * alloc_elems(void ** ptr, size_t elem_size, size_t * count, size_t * capac
 
 void symbol_set_value(jamlisp_context * ctx, jamlisp_object symbol, jamlisp_object value){
   ASSERT(jamlisp_symbolp(symbol));
-  if(ctx->symbol_values_count < symbol.symbol){
-    ctx->symbol_values = realloc(ctx->symbol_values, sizeof(ctx->symbol_values[0]) * (symbol.symbol + 10));
-    for(u32 i = ctx->symbol_values_count; i < symbol.symbol+10; i++){
-      ctx->symbol_values[i] = (jamlisp_object){0};
+  u32 id = JAMLISP_SYMBOL_ID(symbol);
+  if(ctx->symbol_values_count <= id){
+    ctx->symbol_values = realloc(ctx->symbol_values, sizeof(ctx->symbol_values[0]) * (id + 10));
+    ctx->symbol_undo_epochs = realloc(ctx->symbol_undo_epochs, sizeof(ctx->symbol_undo_epochs[0]) * (id + 10));
+    for(u32 i = ctx->symbol_values_count; i < id+10; i++){
+      ctx->symbol_values[i] = jamlisp_nil();
+      ctx->symbol_undo_epochs[i] = 0;
     }
-    ctx->symbol_values_count = symbol.symbol + 10;
+    ctx->symbol_values_count = id + 10;
+  }
+  // the value at the checkpoint is saved the first time it changes.
+  if(ctx->arena.depth > 0 && ctx->symbol_undo_epochs[id] != ctx->undo_epoch){
+    ctx->symbol_undo_epochs[id] = ctx->undo_epoch;
+    jamlisp_symbol_value * undo = alloc_elems((void **) &ctx->symbol_undo, sizeof(ctx->symbol_undo[0]), &ctx->symbol_undo_count, &ctx->symbol_undo_capacity, 1);
+    *undo = (jamlisp_symbol_value){.symbol = symbol, .value = ctx->symbol_values[id]};
   }
 
-  ctx->symbol_values[symbol.symbol] = value; 
+  // call caches only hold functions, so only changes to or from an array
+  // can make them invalid.
+  if(JAMLISP_IS(value, JAMLISP_ARRAY) || JAMLISP_IS(ctx->symbol_values[id], JAMLISP_ARRAY))
+    ctx->symbol_version += 1;
+  ctx->symbol_values[id] = value; 
 }
 
 jamlisp_object symbol_get_value(jamlisp_context * ctx, jamlisp_object symbol){
   ASSERT(jamlisp_symbolp(symbol));
-  if(ctx->symbol_values_count >= symbol.symbol)
-    return ctx->symbol_values[symbol.symbol];
+  u32 id = JAMLISP_SYMBOL_ID(symbol);
+  if(id < ctx->symbol_values_count)
+    return ctx->symbol_values[id];
   return jamlisp_nil();
 }
 
@@ -105,8 +236,11 @@ void jamlisp_load_fcn_bytecode(jamlisp_context * ctx, jamlisp_object symbol, voi
   if(!jamlisp_nilp(symbol_value))
     ERROR("Function is already defined\n"); // remove this sanity check later.
 
-  symbol_value.type = JAMLISP_ARRAY;
-  symbol_value.ptr = jamlisp_array_new(JAMLISP_BYTE, code, code_size);
+  if(!jamlisp_verify(ctx, code, code_size, NULL)){
+    logd("Invalid function code\n");
+    return;
+  }
+  symbol_value = JAMLISP_MAKE_ARRAY(jamlisp_array_new(ctx, JAMLISP_BYTE, code, code_size));
   symbol_set_value(ctx, symbol, symbol_value);
 }
 
@@ -114,28 +248,49 @@ jamlisp_context * jamlisp_new(){
   jamlisp_context * ctx = alloc0(sizeof(*ctx));
   ctx->opcode_names = ht_create_strkey(sizeof(jamlisp_opcode));
   ctx->symbol_names = ht_create_strkey(sizeof(ctx->symbol_counter));
+  ctx->symbol_version = 1;
+  jamlisp_value_stack_init(&ctx->value_stack, JAMLISP_VALUE_STACK_SIZE);
+  ASSERT(JAMLISP_SYMBOL_ID(jamlisp_symbol(ctx, "t")) == JAMLISP_SYMBOL_T);
+  symbol_set_value(ctx, JAMLISP_MAKE_SYMBOL(JAMLISP_SYMBOL_T), JAMLISP_MAKE_SYMBOL(JAMLISP_SYMBOL_T));
   {
     jamlisp_load_opcode(ctx, JAMLISP_OPCODE_ADD, "ADD", 2);
+    jamlisp_load_opcode(ctx, JAMLISP_OPCODE_SUB, "SUB", 2);
+    jamlisp_load_opcode(ctx, JAMLISP_OPCODE_MUL, "MUL", 2);
+    jamlisp_load_opcode(ctx, JAMLISP_OPCODE_DIV, "DIV", 2);
+    jamlisp_load_opcode(ctx, JAMLISP_OPCODE_LESS, "LESS", 2);
     jamlisp_load_opcode(ctx, JAMLISP_OPCODE_CONS, "CONS", 2);
     jamlisp_load_opcode(ctx, JAMLISP_OPCODE_PRINT, "PRINT", 1);
     jamlisp_load_opcode(ctx, JAMLISP_OPCODE_INT, "INT", 0);
+    jamlisp_load_opcode(ctx, JAMLISP_OPCODE_ADD_I64, "ADD_I64", 2);
+    jamlisp_load_opcode(ctx, JAMLISP_OPCODE_SUB_I64, "SUB_I64", 2);
+    jamlisp_load_opcode(ctx, JAMLISP_OPCODE_MUL_I64, "MUL_I64", 2);
+    jamlisp_load_opcode(ctx, JAMLISP_OPCODE_LESS_I64, "LESS_I64", 2);
   }
-  {
-    u8 code[] = {JAMLISP_OPCODE_ADD, JAMLISP_MAGIC, JAMLISP_OPCODE_LOCAL, 0, JAMLISP_MAGIC,JAMLISP_OPCODE_LOCAL, 1, JAMLISP_MAGIC};
-    jamlisp_load_fcn_bytecode(ctx, jamlisp_symbol(ctx, "+"), code, array_count(code));
-  }
+  ctx->quicken = true;
+  ctx->register_fold = true;
+  ctx->bigfloat_precision = JAMLISP_BIGFLOAT_PRECISION;
+  jamlisp_simd_set(ctx, jamlisp_simd_detect());
+  jamlisp_load_primitives(ctx);
   
   return ctx;
 }
 
 jamlisp_object jamlisp_symbol(jamlisp_context * ctx, const char * name){
-  jamlisp_object out = {0};
-  out.type = JAMLISP_SYMBOL;
-  if(ht_get(ctx->symbol_names, &name, &out.symbol))
-    return out;
-  out.symbol = ++ctx->symbol_counter;
-  ht_set(ctx->symbol_names, &name, &out.symbol);
-  return out;
+  u32 id;
+  if(ht_get(ctx->symbol_names, &name, &id))
+    return JAMLISP_MAKE_SYMBOL(id);
+  id = ++ctx->symbol_counter;
+  ht_set(ctx->symbol_names, &name, &id);
+  if(id >= ctx->symbol_name_capacity)
+    ensure_size((void **) &ctx->symbol_name_table, sizeof(ctx->symbol_name_table[0]), &ctx->symbol_name_capacity, MAX(id + 1, ctx->symbol_name_capacity * 2));
+  ctx->symbol_name_table[id] = iron_clone(name, strlen(name) + 1);
+  return JAMLISP_MAKE_SYMBOL(id);
+}
+
+const char * jamlisp_symbol_name(jamlisp_context * ctx, u32 id){
+  if(id == 0 || id > ctx->symbol_counter)
+    return NULL;
+  return ctx->symbol_name_table[id];
 }
 
 
@@ -146,54 +301,104 @@ void memset(void *, int chr, unsigned long );
 #endif
 
 void jamlisp_push(jamlisp_context * ctx, jamlisp_object obj){
-  stack_push(&ctx->value_stack, &obj, sizeof(obj));
+  ctx->value_stack.objects[ctx->value_stack.count++] = obj;
 }
 
 void jamlisp_push_i64(jamlisp_context * ctx, i64 value){
-  jamlisp_object v =
-    {
-     .type = JAMLISP_INT64,
-     .int64 = value
-    };
-  
-  jamlisp_push(ctx, v);
+  jamlisp_push(ctx, jamlisp_i64(value));
 }
 
 void jamlisp_push_symbol(jamlisp_context * ctx, u32 value){
-  jamlisp_object v =
-    {
-     .type = JAMLISP_SYMBOL,
-     .int64 = value
-    };
-  
-  jamlisp_push(ctx, v);
+  jamlisp_push(ctx, JAMLISP_MAKE_SYMBOL(value));
 }
 
 
 jamlisp_object jamlisp_pop(jamlisp_context * ctx){
-  jamlisp_object idx;
-  stack_pop(&ctx->value_stack, &idx, sizeof(idx));
-  return idx;
+  ASSERT(ctx->value_stack.count > 0);
+  return ctx->value_stack.objects[--ctx->value_stack.count];
+}
+
+jamlisp_object jamlisp_top(jamlisp_context * ctx){
+  return ctx->value_stack.objects[ctx->value_stack.count - 1];
+}
+
+// makes the top of the value stack the base of the local slots and returns the
+// previous base, which must be restored when the code is done.
+size_t jamlisp_enter_locals(jamlisp_context * ctx){
+  size_t prev = ctx->local_base;
+  ctx->local_base = ctx->value_stack.count;
+  return prev;
+}
+
+// end of a LET, the result of the body replaces the slots under it.
+void jamlisp_let_exit(jamlisp_context * ctx, u32 slots){
+  var result = jamlisp_pop(ctx);
+  ASSERT(ctx->value_stack.count >= slots);
+  ctx->value_stack.count -= slots;
+  jamlisp_push(ctx, result);
+}
+
+void jamlisp_push_global(jamlisp_context * ctx, u32 symbol){
+  jamlisp_push(ctx, symbol_get_value(ctx, JAMLISP_MAKE_SYMBOL(symbol)));
+}
+
+// dynamic binding of special variables. The old value is saved on the binding
+// stack by jamlisp_push_symbol_value until the body of the BIND is done, the
+// value stack only holds the value of the body.
+void jamlisp_bind(jamlisp_context * ctx, u32 symbol){
+  var value = jamlisp_pop(ctx);
+  jamlisp_push_symbol_value(ctx, JAMLISP_MAKE_SYMBOL(symbol), value);
+}
+
+void jamlisp_unbind(jamlisp_context * ctx, u32 symbol){
+  jamlisp_pop_symbol_value(ctx, JAMLISP_MAKE_SYMBOL(symbol));
 }
 
 i64 jamlisp_pop_i64(jamlisp_context * ctx){
   var od = jamlisp_pop(ctx);
-  ASSERT(od.type == JAMLISP_INT64);
-  return od.int64;
+  ASSERT(JAMLISP_IS(od, JAMLISP_INT64));
+  return JAMLISP_INT64(od);
 }
 
 bool jamlisp_nilp(jamlisp_object obj){
-  return obj.type == JAMLISP_NIL;
+  return JAMLISP_IS(obj, JAMLISP_NIL);
 }
 
 bool jamlisp_symbolp(jamlisp_object obj){
-  return obj.type == JAMLISP_SYMBOL;
+  return JAMLISP_IS(obj, JAMLISP_SYMBOL);
 }
 
 bool jamlisp_consp(jamlisp_object obj){
-  return obj.type == JAMLISP_CONS;
+  return JAMLISP_IS(obj, JAMLISP_CONS);
 }
 
+#if JAMLISP_TAGGED
+jamlisp_object jamlisp_i64(i64 v){
+  if(v > JAMLISP_INT48_MAX || v < JAMLISP_INT48_MIN)
+    ERROR("Integer %lld does not fit in a tagged object\n", v);
+  return JAMLISP_BOX(JAMLISP_INT64, v); 
+}
+jamlisp_object jamlisp_i32(i32 v){
+  return JAMLISP_BOX(JAMLISP_INT32, (u32)v); 
+}
+jamlisp_object jamlisp_f32(f32 v){
+  u32 bits;
+  memcpy(&bits, &v, sizeof(bits));
+  return JAMLISP_BOX(JAMLISP_F32, bits); 
+}
+jamlisp_object jamlisp_f64(f64 v){
+  u64 bits;
+  // all NaNs become the same positive NaN so they are not mistaken for a boxed object.
+  if(v != v)
+    bits = 0x7FF8000000000000ULL;
+  else
+    memcpy(&bits, &v, sizeof(bits));
+  return bits ^ JAMLISP_NIL_BITS; 
+}
+jamlisp_object jamlisp_nil(){
+  return 0; 
+}
+#else
 jamlisp_object jamlisp_i64(i64 v){
   return (jamlisp_object) {.type = JAMLISP_INT64, .int64 = v}; 
 }
@@ -209,43 +414,86 @@ jamlisp_object jamlisp_f64(f64 v){
 jamlisp_object jamlisp_nil(){
   return (jamlisp_object) {0}; 
 }
+#endif
 jamlisp_object jamlisp_new_object(){
   return jamlisp_nil();
 }
 
 jamlisp_object jamlisp_new_cons(jamlisp_context * ctx){
+  if(heap_full(&ctx->heap) && ctx->heap.arena_base == 0 && ctx->gc.mode != JAMLISP_GC_MANUAL)
+    jamlisp_gc_on_alloc(ctx);
   jamlisp_object_index idx = new_object(&ctx->heap);
-  return (jamlisp_object){.type = JAMLISP_CONS, .cons = idx};
+  return JAMLISP_MAKE_CONS(idx);
+}
+
+jamlisp_object jamlisp_cons(jamlisp_context * ctx, jamlisp_object car, jamlisp_object cdr){
+  if(heap_full(&ctx->heap) && ctx->heap.arena_base == 0 && ctx->gc.mode != JAMLISP_GC_MANUAL){
+    // car and cdr might only be held here.
+    jamlisp_push(ctx, car);
+    jamlisp_push(ctx, cdr);
+    jamlisp_gc_on_alloc(ctx);
+    jamlisp_pop(ctx);
+    jamlisp_pop(ctx);
+  }
+  jamlisp_object c = jamlisp_new_cons(ctx);
+  cons_set_car(&ctx->heap, JAMLISP_CONS_INDEX(c), car);
+  cons_set_cdr(&ctx->heap, JAMLISP_CONS_INDEX(c), cdr);
+  return c;
+}
+
+jamlisp_object jamlisp_car(jamlisp_context * ctx, jamlisp_object c){
+  ASSERT(jamlisp_consp(c));
+  return cons_car(&ctx->heap, JAMLISP_CONS_INDEX(c));
+}
+
+jamlisp_object jamlisp_cdr(jamlisp_context * ctx, jamlisp_object c){
+  ASSERT(jamlisp_consp(c));
+  return cons_cdr(&ctx->heap, JAMLISP_CONS_INDEX(c));
+}
+
+void jamlisp_set_car(jamlisp_context * ctx, jamlisp_object c, jamlisp_object value){
+  ASSERT(jamlisp_consp(c));
+  jamlisp_gc_write_barrier(ctx, JAMLISP_CONS_INDEX(c), value);
+  cons_set_car(&ctx->heap, JAMLISP_CONS_INDEX(c), value);
+}
+
+void jamlisp_set_cdr(jamlisp_context * ctx, jamlisp_object c, jamlisp_object value){
+  ASSERT(jamlisp_consp(c));
+  jamlisp_gc_write_barrier(ctx, JAMLISP_CONS_INDEX(c), value);
+  cons_set_cdr(&ctx->heap, JAMLISP_CONS_INDEX(c), value);
 }
 void jamlisp_free_cons(jamlisp_context * ctx, jamlisp_object * cons){
   ASSERT(jamlisp_consp(*cons));
-  free_object(&ctx->heap, cons->cons);
+  free_object(&ctx->heap, JAMLISP_CONS_INDEX(*cons));
   *cons = jamlisp_nil();
 }
 
 
 
-jamlisp_object jamlisp_add(jamlisp_object a, jamlisp_object b){
-  jamlisp_object v = {0};
-  if(a.type == JAMLISP_INT64 && b.type == JAMLISP_INT64){
-    v.type = a.type;
-    v.int64 = a.int64 + b.int64;
-    return v;
-  }
-  ERROR("Unsupported ADD!\n");
-  return v;
-}
-
 void jamlisp_print(jamlisp_object obj){
-  switch(obj.type){
+  switch(JAMLISP_TYPE(obj)){
   case JAMLISP_INT64:
-    logd("%lld", obj.int64);
+    logd("%lld", JAMLISP_INT64(obj));
     break;
   case JAMLISP_INT32:
-    logd("%i", obj.fixnum);
+    logd("%i", JAMLISP_FIXNUM(obj));
     break;
+  case JAMLISP_F32:
+    logd("%f", JAMLISP_FLOAT32(obj));
+    break;
+  case JAMLISP_F64:
+    logd("%f", JAMLISP_FLOAT64(obj));
+    break;
+  case JAMLISP_BIGNUM:
+  case JAMLISP_BIGFLOAT:{
+      io_writer w = {0};
+      jamlisp_number_write(&w, obj);
+      logd("%.*s", (int)w.offset, (char *)w.data);
+      io_writer_clear(&w);
+      break;
+    }
   default:
-    logd("OBJECT(%i)", obj.type);
+    logd("OBJECT(%i)", JAMLISP_TYPE(obj));
   }
 }
 
@@ -298,64 +546,139 @@ jamlisp_opcode jamlisp_opcode_parse(jamlisp_context * ctx, const char * name){
   return opcode;
 }
 
-void jamlisp_load_frame(jamlisp_context * ctx, io_reader * reader){
-  if(ctx->cframe_count != -1){
-    
-  }
+// verified code runs with the frames for its depth reserved when it starts,
+// so its nodes take frames without checks. The frames from frame_index on
+// are the ones the code uses. The value stack does not grow, a verified body
+// that would not fit is found here and not on the guard page.
+static void reserve_stacks(jamlisp_context * ctx, const jamlisp_verify_info * info){
+  size_t frames = ctx->frame_index + info->max_frames + 1;
+  if(frames >= ctx->frames_capacity)
+    ensure_size((void **) &ctx->frames, sizeof(ctx->frames[0]), &ctx->frames_capacity, MAX(frames + 1, ctx->frames_capacity * 2));
+  if(ctx->value_stack.count + info->max_stack > ctx->value_stack.capacity)
+    ERROR("Value stack overflow\n");
 }
 
-void jamlisp_iterate_internal(jamlisp_context * ctx, io_reader * reader){
-  
+static inline void value_push(jamlisp_context * ctx, jamlisp_object obj){
+  ctx->value_stack.objects[ctx->value_stack.count++] = obj;
+}
+
+static inline jamlisp_object value_pop(jamlisp_context * ctx){
+  return ctx->value_stack.objects[--ctx->value_stack.count];
+}
+
+typedef jamlisp_object (* binary_fcn)(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+
+// the operands are the two top slots, the result replaces them in place. Both
+// stay on the stack while the operation runs, in case it collects.
+static inline void binary_in_place(jamlisp_context * ctx, binary_fcn fcn){
+  jamlisp_object * sp = ctx->value_stack.objects + ctx->value_stack.count - 2;
+  sp[0] = fcn(ctx, sp[0], sp[1]);
+  ctx->value_stack.count -= 1;
+}
+
+static void jamlisp_iterate_internal(jamlisp_context * ctx, io_reader * reader, const jamlisp_verify_info * info){
+  size_t prev_locals = jamlisp_enter_locals(ctx);
+  int cframe_base = ctx->cframe_count;
+  bool reserved = info != NULL;
+  if(reserved)
+    reserve_stacks(ctx, info);
   while(true){
-    ensure_size2((void **) &ctx->frames, sizeof(ctx->frames[0]), &ctx->frames_capacity, ctx->frame_index, 1.5);
-    logd("frame index: %i\n", ctx->frame_index);
+    if(!reserved)
+      ensure_size2((void **) &ctx->frames, sizeof(ctx->frames[0]), &ctx->frames_capacity, ctx->frame_index, 1.5);
+    JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "frame index: %i\n", ctx->frame_index);
     var frame = ctx->frames + ctx->frame_index;
     frame[0] = (stack_frame){0};
     frame->node_id = reader->offset;
     if(reader->offset == reader->size)
       break;
-    ctx->current_opcode = frame->opcode = io_read_u64_leb(reader);
-    logd("OPCODE %u\n", frame->opcode);
+    u8 byte = io_read_u8(reader);
+    // the compact forms run as the opcode they stand for.
+    if(byte >= JAMLISP_CODE_INT_SMALL){
+      if(byte >= JAMLISP_CODE_TAILCALL_SMALL)
+	frame->opcode = JAMLISP_OPCODE_TAILCALL;
+      else if(byte >= JAMLISP_CODE_CALL_SMALL)
+	frame->opcode = JAMLISP_OPCODE_CALL;
+      else if(byte >= JAMLISP_CODE_LOCAL_SMALL)
+	frame->opcode = JAMLISP_OPCODE_LOCAL;
+      else
+	frame->opcode = JAMLISP_OPCODE_INT;
+    }else{
+      frame->opcode = byte;
+    }
+    ctx->current_opcode = frame->opcode;
+    JAMLISP_TRACE_NODE(ctx, frame->node_id, frame->opcode);
+    JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "OPCODE %u\n", frame->opcode);
     if(frame->opcode == JAMLISP_OPCODE_NONE){
       break;
     }
 
-    frame->child_count = ctx->opcodedefs[frame->opcode].arg_count;
-    
-    switch(frame->opcode){
+    switch(byte){
     case JAMLISP_OPCODE_NONE:
       ERROR("INVALID OPCODE");
+      ctx->local_base = prev_locals;
       return;
     case JAMLISP_OPCODE_ADD:
     case JAMLISP_OPCODE_SUB:
     case JAMLISP_OPCODE_MUL:
     case JAMLISP_OPCODE_DIV:
     case JAMLISP_OPCODE_CONS:
+    case JAMLISP_OPCODE_PRINT:
+    case JAMLISP_OPCODE_LESS:
+      frame->child_count = ctx->opcodedefs[frame->opcode].arg_count;
       break;
     case JAMLISP_OPCODE_INT:
-      logd("ENTER INT\n");
-      jamlisp_push_i64(ctx, io_read_i64_leb(reader));
+      JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "ENTER INT\n");
+      value_push(ctx, jamlisp_i64(io_read_i64_leb(reader)));
       ASSERT(frame->child_count == 0);
       frame->child_count = 0;
       break;
+    case JAMLISP_CODE_INT_SMALL ... JAMLISP_CODE_INT_SMALL + JAMLISP_SMALL_INT_MAX - JAMLISP_SMALL_INT_MIN:
+      value_push(ctx, jamlisp_i64(JAMLISP_SMALL_INT_MIN + (byte - JAMLISP_CODE_INT_SMALL)));
+      break;
+    case JAMLISP_CODE_CALL_SMALL ... JAMLISP_CODE_CALL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+      frame->call = io_read_u32_leb(reader);
+      frame->child_count = frame->child_count0 = byte - JAMLISP_CODE_CALL_SMALL;
+      break;
+    case JAMLISP_CODE_TAILCALL_SMALL ... JAMLISP_CODE_TAILCALL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+      frame->call = io_read_u32_leb(reader);
+      frame->child_count = frame->child_count0 = byte - JAMLISP_CODE_TAILCALL_SMALL;
+      break;
+    case JAMLISP_CODE_LOCAL_SMALL ... JAMLISP_CODE_LOCAL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+      value_push(ctx, JAMLISP_LOCAL(ctx, byte - JAMLISP_CODE_LOCAL_SMALL));
+      break;
     case JAMLISP_OPCODE_CALL:
+    case JAMLISP_OPCODE_TAILCALL:
+    case JAMLISP_OPCODE_PRIMITIVE:
       frame->call = io_read_u32_leb(reader);
       frame->child_count = io_read_u32_leb(reader);
       frame->child_count0 = frame->child_count;
     
-      logd("ENTER CALL %i %i\n", frame->call, frame->child_count);
+      JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "ENTER CALL %i %i\n", frame->call, frame->child_count);
       
+      break;
+    case JAMLISP_OPCODE_LOCAL:
+      value_push(ctx, JAMLISP_LOCAL(ctx, io_read_u32_leb(reader)));
+      break;
+    case JAMLISP_OPCODE_GLOBAL:
+      value_push(ctx, symbol_get_value(ctx, JAMLISP_MAKE_SYMBOL(io_read_u32_leb(reader))));
+      break;
+    case JAMLISP_OPCODE_LET:
+      frame->child_count = frame->child_count0 = io_read_u32_leb(reader);
+      break;
+    case JAMLISP_OPCODE_BIND:
+      frame->call = io_read_u32_leb(reader);
+      frame->child_count = 2;
+      break;
+    case JAMLISP_OPCODE_IF:
+      // the sizes of the then and else branches, one of them is skipped.
+      frame->call = io_read_u32_leb(reader);
+      frame->child_count0 = io_read_u32_leb(reader);
+      frame->child_count = 3;
       break;
     default:
       ERROR("No Handler for opcode!");  
     }
     
-    var magic = io_read_u64_leb(reader);
-    if(magic != JAMLISP_MAGIC){
-      logd("ERROR Expected magic! got: %i\n", magic);
-      break;
-    }
-    
     // if children >
     while(true){
       if(frame->child_count > 0){
@@ -368,64 +691,123 @@ void jamlisp_iterate_internal(jamlisp_context * ctx, io_reader * reader){
 	  
 	  switch(frame->opcode){
 	  case JAMLISP_OPCODE_ADD:
-	    {
-	      var a = jamlisp_pop(ctx);
-	      var b = jamlisp_pop(ctx);
-	      var c = jamlisp_add(a, b);
-	      jamlisp_push(ctx, c);
-	      logd("Add exit\n");
-	    }
+	    binary_in_place(ctx, jamlisp_add);
+	    JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "Add exit\n");
+	    break;
+	  case JAMLISP_OPCODE_SUB:
+	    binary_in_place(ctx, jamlisp_sub);
+	    break;
+	  case JAMLISP_OPCODE_LESS:
+	    binary_in_place(ctx, jamlisp_less);
+	    break;
+	  case JAMLISP_OPCODE_MUL:
+	    binary_in_place(ctx, jamlisp_mul);
+	    break;
+	  case JAMLISP_OPCODE_DIV:
+	    binary_in_place(ctx, jamlisp_div);
+	    break;
+	  case JAMLISP_OPCODE_CONS:
+	    binary_in_place(ctx, jamlisp_cons);
+	    break;
+	  case JAMLISP_OPCODE_PRIMITIVE:
+	    jamlisp_call_primitive(ctx, frame->call, frame->child_count0);
 	    break;
 	  case JAMLISP_OPCODE_CALL:
+	  case JAMLISP_OPCODE_TAILCALL:
+	    if(frame->body){
+	      JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "RETURN %i\n", frame->call);
+	      var cf = jamlisp_call_return(ctx);
+	      *reader = cf->reader;
+	      reserved = cf->reserved;
+	      break;
+	    }
 	    {
-	      logd("EXIT CALL %i   %i   %i\n", frame->call, frame->child_count, frame->child_count);
-	      jamlisp_object s = {.type = JAMLISP_SYMBOL, .symbol = frame->call};
-	      s = symbol_get_value(ctx, s);
-	      logd("EXIT CALL %i %i\n", s.type, s.ptr->type);
-	      //io_reader rd2 = {.offset = 0, .data = s.ptr->data, .size = s.ptr->size};
-	      {
-		logd("AH\n");
-		jamlisp_object vars[frame->child_count0];
-		for(size_t i = 0; i < frame->child_count0; i++){
-		  vars[frame->child_count0 - 1 - i] = jamlisp_pop(ctx);
-		}
-		for(size_t i = 0; i < frame->child_count0; i++){
-		  logd("Arg %i\n", vars[i].symbol);
-		}
+	      JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "EXIT CALL %i %i\n", frame->call, frame->child_count0);
+	      var function = jamlisp_function_get(ctx, frame->call);
+	      if(function == NULL || !jamlisp_function_takes(function, frame->child_count0)){
+		jamlisp_call_native(ctx, frame->call, frame->child_count0);
+		break;
 	      }
-	      //jamlisp_iterate_internal(ctx, &rd2);
-	      
+	      if(frame->opcode == JAMLISP_OPCODE_TAILCALL && ctx->cframe_count > cframe_base){
+		// continue in the CALL frame of the running function.
+		jamlisp_tail_call(ctx, frame->child_count0);
+		ctx->frame_index = ctx->cframes[ctx->cframe_count - 1].frame_index;
+		frame = ctx->frames + ctx->frame_index;
+	      }else{
+		var cf = jamlisp_call_enter(ctx, frame->child_count0);
+		cf->reader = *reader;
+		cf->frame_index = ctx->frame_index;
+		cf->reserved = reserved;
+		frame->body = true;
+	      }
+	      *reader = io_from_bytes(function->source->data, function->source->size);
+	      reserved = function->verified;
+	      if(reserved){
+		reserve_stacks(ctx, &function->info);
+		frame = ctx->frames + ctx->frame_index;
+	      }
+	      // the function body is the only child left.
+	      frame->child_count = 1;
 	    }
-	    break;
+	    continue;
 	  case JAMLISP_OPCODE_INT:{
-	    logd("INT EXIT\n");
+	    JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "INT EXIT\n");
 	    break;
 	  }
 
 	  case JAMLISP_OPCODE_PRINT:
-	    {
-	      var a = jamlisp_pop(ctx);
-	      jamlisp_print(a);
-	    }
+	    // the value of print is its argument.
+	    jamlisp_print(jamlisp_top(ctx));
+	    break;
+	  case JAMLISP_OPCODE_LET:
+	    jamlisp_let_exit(ctx, frame->child_count0 - 1);
+	    break;
+	  case JAMLISP_OPCODE_BIND:
+	    jamlisp_unbind(ctx, frame->call);
+	    break;
+	  case JAMLISP_OPCODE_IF:
+	    reader->offset += frame->child_count0;
 	    break;
 	  default:
 	    break;
 	  }
 	  
 	  if(frame == ctx->frames){
-	    logd("Exit frame %i\n", frame->opcode);
+	    JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "Exit frame %i\n", frame->opcode);
 	    break;
 	  }
 	frame = frame - 1;
 	frame->child_count -= 1;
 	ctx->frame_index -= 1;
+	// the value of a BIND is done, the body runs with it bound.
+	if(frame->opcode == JAMLISP_OPCODE_BIND && frame->child_count == 1)
+	  jamlisp_bind(ctx, frame->call);
+	// the condition of an IF is done, skip the branch not taken.
+	if(frame->opcode == JAMLISP_OPCODE_IF && frame->child_count == 2){
+	  frame->child_count = 1;
+	  if(jamlisp_nilp(value_pop(ctx))){
+	    reader->offset += frame->call;
+	    frame->child_count0 = 0;
+	  }
+	}
       }
     }
   }
+  ctx->local_base = prev_locals;
 }
 
 void jamlisp_iterate(jamlisp_context * reg, io_reader * reader){
-  jamlisp_iterate_internal(reg, reader);
+  if(reg->registers){
+    jamlisp_reg_eval(reg, reader);
+    return;
+  }
+  jamlisp_iterate_internal(reg, reader, NULL);
+}
+
+void jamlisp_iterate_verified(jamlisp_context * ctx, io_reader * reader, const jamlisp_verify_info * info){
+  if(info->arg_count > 0)
+    ERROR("Top level code reads arguments\n");
+  jamlisp_iterate_internal(ctx, reader, info);
 }
 		   
 void jamlisp_test_load(jamlisp_context * ctx, io_writer * wd){
@@ -433,28 +815,24 @@ void jamlisp_test_load(jamlisp_context * ctx, io_writer * wd){
   jamlisp_opcode JAMLISP_INT = jamlisp_opcode_parse(ctx, "INT");
   ASSERT(JAMLISP_ADD == JAMLISP_OPCODE_ADD);
   io_write_u8(wd, JAMLISP_OPCODE_PRINT);
-  io_write_u8(wd, JAMLISP_MAGIC);
   io_write_u8(wd, JAMLISP_ADD);
-  io_write_u8(wd, JAMLISP_MAGIC);
   io_write_u8(wd, JAMLISP_INT);
   io_write_i32_leb(wd, 10);
-  io_write_u8(wd, JAMLISP_MAGIC);
   io_write_u8(wd, JAMLISP_INT);
   io_write_i32_leb(wd, 10);
-  io_write_u8(wd, JAMLISP_MAGIC);
   wd->size = wd->offset;
   wd->offset = 0;
 }
 
 void jamlisp_push_symbol_value(jamlisp_context * ctx, jamlisp_object sym, jamlisp_object value){
   jamlisp_symbol_value val = {.symbol = sym, .value = symbol_get_value(ctx, sym)};
-  stack_push(&ctx->value_stack, &val, sizeof(val));
+  stack_push(&ctx->symbol_value_stack, &val, sizeof(val));
   symbol_set_value(ctx, sym, value);
 }
 
 void jamlisp_pop_symbol_value(jamlisp_context * ctx, jamlisp_object sym){
   jamlisp_symbol_value val = {0};
-  stack_pop(&ctx->value_stack, &val, sizeof(val));
-  ASSERT(val.symbol.symbol == sym.symbol);
+  stack_pop(&ctx->symbol_value_stack, &val, sizeof(val));
+  ASSERT(JAMLISP_SYMBOL_ID(val.symbol) == JAMLISP_SYMBOL_ID(sym));
   symbol_set_value(ctx, sym, val.value);
 }
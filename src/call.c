@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Calls.
+// A function is the byte code stored in the value of its symbol. Calling it
+// pushes a control frame with where the caller continues and moves local_base
+// to the first argument, so the arguments are LOCAL 0 .. n-1. Returning puts
+// the result in place of the arguments. Every execution mode does this in its
+// own loop, there is no C recursion per call.
+
+jamlisp_array * jamlisp_function_code(jamlisp_context * ctx, u32 symbol){
+  var value = symbol_get_value(ctx, JAMLISP_MAKE_SYMBOL(symbol));
+  if(!JAMLISP_IS(value, JAMLISP_ARRAY) || JAMLISP_PTR(value)->type != JAMLISP_BYTE)
+    return NULL;
+  return JAMLISP_PTR(value);
+}
+
+static void reg_code_list_free(jamlisp_reg_code ** list, size_t * count){
+  for(size_t i = 0; i < *count; i++){
+    jamlisp_reg_code_free(list[i]);
+    free(list[i]);
+  }
+  *count = 0;
+}
+
+// drops the compiled forms of a function. A function can be redefined by
+// code it called, so its code is only freed once no call is running. Until
+// then it is retired, the frames and call caches that point into it stay
+// valid.
+void jamlisp_function_clear(jamlisp_context * ctx, jamlisp_function * f){
+  if(ctx->cframe_count == 0){
+    for(size_t i = 0; i < f->retired_threaded_count; i++)
+      jamlisp_code_free(f->retired_threaded + i);
+    f->retired_threaded_count = 0;
+    for(size_t i = 0; i < f->retired_postfix_count; i++)
+      io_writer_clear(f->retired_postfix + i);
+    f->retired_postfix_count = 0;
+    jamlisp_code_free(&f->threaded);
+    io_writer_clear(&f->postfix);
+    reg_code_list_free(f->retired, &f->retired_count);
+    reg_code_list_free(f->registers, &f->register_count);
+    return;
+  }
+  if(f->threaded.insns != NULL){
+    *(jamlisp_code *) alloc_elems((void **) &f->retired_threaded, sizeof(f->retired_threaded[0]), &f->retired_threaded_count, &f->retired_threaded_capacity, 1) = f->threaded;
+    f->threaded = (jamlisp_code){0};
+  }
+  if(f->postfix.data != NULL){
+    *(io_writer *) alloc_elems((void **) &f->retired_postfix, sizeof(f->retired_postfix[0]), &f->retired_postfix_count, &f->retired_postfix_capacity, 1) = f->postfix;
+    f->postfix = (io_writer){0};
+  }
+  for(size_t i = 0; i < f->register_count; i++)
+    *(jamlisp_reg_code **) alloc_elems((void **) &f->retired, sizeof(f->retired[0]), &f->retired_count, &f->retired_capacity, 1) = f->registers[i];
+  f->register_count = 0;
+}
+
+// the cached function, recompiled if the symbol got a new value. The lookup
+// is only redone when symbol_version changed.
+static jamlisp_function * function_lookup(jamlisp_context * ctx, u32 symbol){
+  if(symbol < ctx->functions_capacity && ctx->functions[symbol].version == ctx->symbol_version)
+    return ctx->functions + symbol;
+  var source = jamlisp_function_code(ctx, symbol);
+  if(source == NULL)
+    return NULL;
+  if(symbol >= ctx->functions_capacity)
+    ensure_size((void **) &ctx->functions, sizeof(ctx->functions[0]), &ctx->functions_capacity, MAX(symbol + 1, ctx->functions_capacity * 2));
+  var f = ctx->functions + symbol;
+  if(f->source != source || f->generation != source->generation){
+    jamlisp_function_clear(ctx, f);
+    f->source = source;
+    f->generation = source->generation;
+    // once per source, code that does not pass runs checked.
+    f->verified = jamlisp_verify(ctx, source->data, source->size, &f->info);
+  }
+  f->version = ctx->symbol_version;
+  return f;
+}
+
+jamlisp_function * jamlisp_function_get(jamlisp_context * ctx, u32 symbol){
+  if(symbol < ctx->functions_capacity && ctx->functions[symbol].version == ctx->symbol_version){
+    ctx->call_stats.cache_hits += 1;
+    return ctx->functions + symbol;
+  }
+  ctx->call_stats.cache_misses += 1;
+  return function_lookup(ctx, symbol);
+}
+
+// a verified function reads info.arg_count arguments, with fewer it would
+// read past the top of the value stack.
+bool jamlisp_function_takes(const jamlisp_function * f, u32 arg_count){
+  return !f->verified || arg_count >= f->info.arg_count;
+}
+
+bool jamlisp_function_postfix(jamlisp_context * ctx, u32 symbol, u32 arg_count, io_reader * reader){
+  var f = jamlisp_function_get(ctx, symbol);
+  if(f == NULL || !jamlisp_function_takes(f, arg_count))
+    return false;
+  if(f->postfix.offset == 0){
+    io_reader rd = io_from_bytes(f->source->data, f->source->size);
+    if(!jamlisp_compile_postfix(ctx, &rd, &f->postfix))
+      ERROR("Invalid function code\n");
+  }
+  *reader = io_from_bytes(f->postfix.data, f->postfix.offset);
+  return true;
+}
+
+// the slow path of a CALL in threaded code. Points the inline cache to the
+// threaded code of the function, a failed lookup is not cached. The argument
+// count of a call site does not change, so it is checked here once.
+bool jamlisp_call_cache_fill(jamlisp_context * ctx, jamlisp_call_cache * cache, u32 symbol, u32 arg_count){
+  ctx->call_stats.cache_misses += 1;
+  var f = function_lookup(ctx, symbol);
+  if(f == NULL || !jamlisp_function_takes(f, arg_count))
+    return false;
+  if(f->threaded.count == 0){
+    io_reader rd = io_from_bytes(f->source->data, f->source->size);
+    if(!jamlisp_code_load(ctx, &f->threaded, &rd))
+      ERROR("Invalid function code\n");
+  }
+  *cache = (jamlisp_call_cache){.version = ctx->symbol_version, .insns = f->threaded.insns, .caches = f->threaded.caches};
+  return true;
+}
+
+// the register code of a function for a number of arguments, compiled the
+// first time it is called with that many. The registers of a function body
+// depend on the number of arguments.
+jamlisp_reg_code * jamlisp_function_registers(jamlisp_context * ctx, u32 symbol, u32 arg_count){
+  var f = function_lookup(ctx, symbol);
+  if(f == NULL)
+    return NULL;
+  for(size_t i = 0; i < f->register_count; i++)
+    if(f->registers[i]->arg_count == arg_count)
+      return f->registers[i];
+  jamlisp_reg_code * code = alloc0(sizeof(code[0]));
+  if(!jamlisp_reg_compile_function(ctx, code, f->source->data, f->source->size, arg_count))
+    ERROR("Invalid function code\n");
+  *(jamlisp_reg_code **) alloc_elems((void **) &f->registers, sizeof(f->registers[0]), &f->register_count, &f->register_capacity, 1) = code;
+  return code;
+}
+
+// the same for register code.
+bool jamlisp_reg_cache_fill(jamlisp_context * ctx, jamlisp_reg_cache * cache, u32 symbol, u32 arg_count){
+  ctx->call_stats.cache_misses += 1;
+  var f = function_lookup(ctx, symbol);
+  if(f == NULL || !jamlisp_function_takes(f, arg_count))
+    return false;
+  var code = jamlisp_function_registers(ctx, symbol, arg_count);
+  if(code == NULL)
+    return false;
+  *cache = (jamlisp_reg_cache){.version = ctx->symbol_version, .code = code};
+  return true;
+}
+
+// a call that does not enter byte code: a primitive, an undefined function or
+// a function given fewer arguments than it reads. The last two are nil.
+void jamlisp_call_native(jamlisp_context * ctx, u32 symbol, u32 arg_count){
+  var value = symbol_get_value(ctx, JAMLISP_MAKE_SYMBOL(symbol));
+  if(JAMLISP_IS(value, JAMLISP_FUNCTION)){
+    jamlisp_call_primitive(ctx, JAMLISP_PRIMITIVE_INDEX(value), arg_count);
+    return;
+  }
+  if(jamlisp_function_code(ctx, symbol) != NULL)
+    ERROR("Too few arguments for %i\n", symbol);
+  else
+    ERROR("Undefined function %i\n", symbol);
+  ctx->value_stack.count -= arg_count;
+  jamlisp_push(ctx, jamlisp_nil());
+}
+
+// the arguments are on top of the value stack. The caller fills in where it continues.
+jamlisp_control_frame * jamlisp_call_enter(jamlisp_context * ctx, u32 arg_count){
+  ensure_size2((void **) &ctx->cframes, sizeof(ctx->cframes[0]), &ctx->cframes_capacity, ctx->cframe_count, 1.5);
+  var cf = ctx->cframes + ctx->cframe_count;
+  ctx->cframe_count += 1;
+  *cf = (jamlisp_control_frame){.local_base = ctx->local_base};
+  ctx->local_base = ctx->value_stack.count - arg_count;
+  return cf;
+}
+
+jamlisp_control_frame * jamlisp_call_return(jamlisp_context * ctx){
+  ASSERT(ctx->cframe_count > 0);
+  var result = jamlisp_pop(ctx);
+  ctx->value_stack.count = ctx->local_base;
+  jamlisp_push(ctx, result);
+  ctx->cframe_count -= 1;
+  var cf = ctx->cframes + ctx->cframe_count;
+  ctx->local_base = cf->local_base;
+  return cf;
+}
+
+// replaces the arguments of the running function with the new ones on top of
+// the stack, the control frame is reused so tail recursion does not grow.
+void jamlisp_tail_call(jamlisp_context * ctx, u32 arg_count){
+  ASSERT(ctx->cframe_count > 0);
+  jamlisp_object * objects = ctx->value_stack.objects;
+  size_t top = ctx->value_stack.count;
+  memmove(objects + ctx->local_base, objects + top - arg_count, arg_count * sizeof(jamlisp_object));
+  ctx->value_stack.count = ctx->local_base + arg_count;
+}
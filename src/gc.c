@@ -0,0 +1,292 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Garbage collection.
+// Mark and sweep over the cons heap. The mark bits live in heap->marks and
+// the sweep rebuilds the free list from every unmarked cons and releases
+// pages that are completely empty.
+//
+// In generational mode the mark bits are kept after a collection, so a cons
+// that survived one collection is old. A minor collection stops tracing at old
+// conses and only reclaims the young ones. Old conses written to since the last
+// collection are recorded by the write barrier and traced as extra roots.
+//
+// Bignums outside of an arena are malloc'd and listed in gc->bignums. Tracing
+// marks the ones it reaches, a major collection frees the others. Minor
+// collections do not see the bignums held by old conses, so they keep all.
+
+// minor collections between each major collection in generational mode.
+#define GC_MINOR_PER_MAJOR 8
+// bignum bytes made before the first collection they start.
+#define GC_BIGNUM_MIN_BYTES (1 << 20)
+
+static u64 gc_now_ns(){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool jamlisp_gc_marked(const cons_heap * heap, jamlisp_object_index obj){
+  return (heap->marks[obj / 64] >> (obj % 64)) & 1;
+}
+
+static void gc_push(jamlisp_gc * gc, jamlisp_object obj, size_t * count){
+  if(JAMLISP_IS(obj, JAMLISP_BIGNUM) || JAMLISP_IS(obj, JAMLISP_BIGFLOAT)){
+    JAMLISP_BIGNUM_PTR(obj)->marked = true;
+    return;
+  }
+  if(!JAMLISP_IS(obj, JAMLISP_CONS) && !JAMLISP_IS(obj, JAMLISP_CONS_CONST))
+    return;
+  ensure_size2((void **) &gc->mark_stack, sizeof(gc->mark_stack[0]), &gc->mark_stack_capacity, *count, 1.5);
+  gc->mark_stack[*count] = JAMLISP_CONS_INDEX(obj);
+  *count += 1;
+}
+
+static void gc_push_objects(jamlisp_gc * gc, const void * data, size_t bytes, size_t * count){
+  // the binding stack holds symbol value records, which are made of objects.
+  const jamlisp_object * objects = data;
+  for(size_t i = 0; i < bytes / sizeof(jamlisp_object); i++)
+    gc_push(gc, objects[i], count);
+}
+
+static void gc_trace(jamlisp_context * ctx, size_t count){
+  var gc = &ctx->gc;
+  var heap = &ctx->heap;
+  while(count > 0){
+    jamlisp_object_index idx = gc->mark_stack[--count];
+    u64 bit = 1ULL << (idx % 64);
+    if(heap->marks[idx / 64] & bit)
+      continue;
+    heap->marks[idx / 64] |= bit;
+    gc_push(gc, cons_car(heap, idx), &count);
+    gc_push(gc, cons_cdr(heap, idx), &count);
+  }
+}
+
+static void gc_mark_roots(jamlisp_context * ctx){
+  var gc = &ctx->gc;
+  size_t count = 0;
+  gc_push_objects(gc, ctx->symbol_values, ctx->symbol_values_count * sizeof(jamlisp_object), &count);
+  gc_trace(ctx, count);
+  gc_push_objects(gc, ctx->value_stack.objects, ctx->value_stack.count * sizeof(jamlisp_object), &count);
+  gc_trace(ctx, count);
+  gc_push_objects(gc, ctx->symbol_value_stack.elements, ctx->symbol_value_stack.count, &count);
+  gc_trace(ctx, count);
+  // the values an arena rewind restores.
+  gc_push_objects(gc, ctx->symbol_undo, ctx->symbol_undo_count * sizeof(jamlisp_symbol_value), &count);
+  gc_trace(ctx, count);
+  // the frame stack holds no objects.
+}
+
+static void gc_clear_remembered(jamlisp_gc * gc){
+  for(size_t i = 0; i < gc->remembered_count; i++){
+    var idx = gc->remembered[i];
+    gc->remembered_bits[idx / 64] &= ~(1ULL << (idx % 64));
+  }
+  gc->remembered_count = 0;
+}
+
+// pages without any live conses are released as long as the heap stays at
+// least twice the size of the live conses.
+static size_t gc_releasable_pages(const cons_heap * heap){
+  size_t live = 0;
+  for(size_t w = 0; w < heap->mark_words; w++)
+    live += __builtin_popcountll(heap->marks[w]);
+  size_t size = heap->heap_size - heap->released_pages * JAMLISP_HEAP_PAGE_SIZE;
+  if(heap->arena_base != 0 || size <= live * 2)
+    return 0;
+  return (size - live * 2) / JAMLISP_HEAP_PAGE_SIZE;
+}
+
+static bool gc_page_empty(const cons_heap * heap, size_t page){
+  const u64 * marks = heap->marks + page * (JAMLISP_HEAP_PAGE_SIZE / 64);
+  for(size_t w = 0; w < JAMLISP_HEAP_PAGE_SIZE / 64; w++)
+    if(marks[w] != 0)
+      return false;
+  return true;
+}
+
+static size_t gc_sweep(cons_heap * heap){
+  size_t freed = 0;
+  size_t releasable = gc_releasable_pages(heap);
+  heap->free_object = 0;
+  // going down so the lowest free conses end up first in the free list.
+  for(size_t page = heap->page_count; page-- > 0;){
+    size_t first = page * JAMLISP_HEAP_PAGE_SIZE;
+    if(heap->pages[page] == NULL || first >= heap->used)
+      continue;
+    // page 0 holds nil and the page holding 'used' is still being filled.
+    if(releasable > 0 && page > 0 && first + JAMLISP_HEAP_PAGE_SIZE <= heap->used && gc_page_empty(heap, page)){
+      free(heap->pages[page]);
+      heap->pages[page] = NULL;
+      heap->released_pages += 1;
+      releasable -= 1;
+      freed += JAMLISP_HEAP_PAGE_SIZE;
+      continue;
+    }
+    for(size_t w = first / 64 + JAMLISP_HEAP_PAGE_SIZE / 64; w > first / 64; w--){
+      u64 marks = heap->marks[w - 1];
+      if(marks == ~0ULL)
+	continue;
+      for(size_t b = 64; b > 0; b--){
+	size_t idx = (w - 1) * 64 + b - 1;
+	if(idx == 0 || idx >= heap->used || (marks >> (b - 1)) & 1)
+	  continue;
+	free_object(heap, idx);
+	freed += 1;
+      }
+    }
+  }
+  return freed;
+}
+
+static void gc_finish(jamlisp_context * ctx, u64 t0){
+  var gc = &ctx->gc;
+  var heap = &ctx->heap;
+  gc->last_freed = gc_sweep(heap);
+  gc_clear_remembered(gc);
+  gc->collections += 1;
+  u64 pause = gc_now_ns() - t0;
+  gc->pause_last_ns = pause;
+  gc->pause_total_ns += pause;
+  gc->pause_max_ns = MAX(gc->pause_max_ns, pause);
+  JAMLISP_TRACE(JAMLISP_TRACE_DEBUG, "GC: freed %i of %i conses in %i ns\n", gc->last_freed, heap->heap_size, pause);
+}
+
+static size_t bignum_size(const jamlisp_bignum * b){
+  return sizeof(*b) + b->count * sizeof(b->limbs[0]);
+}
+
+static void gc_sweep_bignums(jamlisp_gc * gc){
+  size_t live = 0;
+  gc->bignum_bytes = 0;
+  for(size_t i = 0; i < gc->bignum_count; i++){
+    var b = gc->bignums[i];
+    if(!b->marked){
+      free(b);
+      continue;
+    }
+    gc->bignums[live++] = b;
+    gc->bignum_bytes += bignum_size(b);
+  }
+  gc->bignum_count = live;
+  gc->bignum_limit = MAX(gc->bignum_bytes * 2, (size_t) GC_BIGNUM_MIN_BYTES);
+}
+
+void jamlisp_gc_collect(jamlisp_context * ctx){
+  u64 t0 = gc_now_ns();
+  var heap = &ctx->heap;
+  if(heap->marks != NULL)
+    memset(heap->marks, 0, heap->mark_words * sizeof(heap->marks[0]));
+  // minor collections leave marks on the bignums they reached.
+  for(size_t i = 0; i < ctx->gc.bignum_count; i++)
+    ctx->gc.bignums[i]->marked = false;
+  gc_mark_roots(ctx);
+  gc_sweep_bignums(&ctx->gc);
+  ctx->gc.major_collections += 1;
+  ctx->gc.minor_since_major = 0;
+  gc_finish(ctx, t0);
+}
+
+void jamlisp_gc_minor(jamlisp_context * ctx){
+  var gc = &ctx->gc;
+  if(gc->minor_since_major >= GC_MINOR_PER_MAJOR){
+    jamlisp_gc_collect(ctx);
+    return;
+  }
+  u64 t0 = gc_now_ns();
+  // old conses pointing at young ones.
+  size_t count = 0;
+  for(size_t i = 0; i < gc->remembered_count; i++){
+    gc_push(gc, cons_car(&ctx->heap, gc->remembered[i]), &count);
+    gc_push(gc, cons_cdr(&ctx->heap, gc->remembered[i]), &count);
+  }
+  gc_trace(ctx, count);
+  gc_mark_roots(ctx);
+  gc->minor_since_major += 1;
+  gc_finish(ctx, t0);
+}
+
+jamlisp_bignum * jamlisp_gc_bignum_alloc(jamlisp_context * ctx, size_t size){
+  var gc = &ctx->gc;
+  jamlisp_bignum * b = malloc(size);
+  *(jamlisp_bignum **) alloc_elems((void **) &gc->bignums, sizeof(gc->bignums[0]), &gc->bignum_count, &gc->bignum_capacity, 1) = b;
+  gc->bignum_bytes += size;
+  return b;
+}
+
+// called with a bignum from jamlisp_gc_bignum_alloc once it is filled in, the
+// operands of the operation that made it are not read again. Collects when
+// the bignums made since the last collection pass the limit.
+void jamlisp_gc_on_bignum(jamlisp_context * ctx, jamlisp_object bignum){
+  var gc = &ctx->gc;
+  if(gc->mode == JAMLISP_GC_MANUAL || gc->bignum_bytes < MAX(gc->bignum_limit, (size_t) GC_BIGNUM_MIN_BYTES))
+    return;
+  jamlisp_push(ctx, bignum);
+  jamlisp_gc_collect(ctx);
+  jamlisp_pop(ctx);
+}
+
+// called when the free list is empty. Grows the heap if the collection did
+// not free at least a quarter of it.
+void jamlisp_gc_on_alloc(jamlisp_context * ctx){
+  var heap = &ctx->heap;
+  if(heap->heap_size == 0)
+    return;
+  if(ctx->gc.mode == JAMLISP_GC_GENERATIONAL)
+    jamlisp_gc_minor(ctx);
+  else
+    jamlisp_gc_collect(ctx);
+  if(ctx->gc.last_freed * 4 <= heap->heap_size){
+    if(ctx->gc.mode == JAMLISP_GC_GENERATIONAL)
+      // the old generation is filling up, make the next collection a major one.
+      ctx->gc.minor_since_major = GC_MINOR_PER_MAJOR;
+    // grow by half so the collections do not get more frequent as the heap grows.
+    for(size_t pages = MAX(heap->page_count / 2, 1); pages > 0; pages--)
+      heap_grow(heap);
+  }
+}
+
+void jamlisp_gc_write_barrier(jamlisp_context * ctx, jamlisp_object_index target, jamlisp_object value){
+  var gc = &ctx->gc;
+  if(gc->mode != JAMLISP_GC_GENERATIONAL || (!JAMLISP_IS(value, JAMLISP_CONS) && !JAMLISP_IS(value, JAMLISP_CONS_CONST)))
+    return;
+  var heap = &ctx->heap;
+  if(!jamlisp_gc_marked(heap, target) || jamlisp_gc_marked(heap, JAMLISP_CONS_INDEX(value)))
+    return;
+  u64 bit = 1ULL << (target % 64);
+  if(gc->remembered_words <= target / 64)
+    ensure_size((void **) &gc->remembered_bits, sizeof(gc->remembered_bits[0]), &gc->remembered_words, heap->mark_words);
+  if(gc->remembered_bits[target / 64] & bit)
+    return;
+  gc->remembered_bits[target / 64] |= bit;
+  jamlisp_object_index * slot = alloc_elems((void **) &gc->remembered, sizeof(gc->remembered[0]), &gc->remembered_count, &gc->remembered_capacity, 1);
+  *slot = target;
+}
+
+void jamlisp_gc_set_mode(jamlisp_context * ctx, jamlisp_gc_mode mode){
+  // start over from a full collection so the mark bits agree with the new mode.
+  if(ctx->gc.mode != JAMLISP_GC_MANUAL && mode != ctx->gc.mode && ctx->heap.heap_size > 0)
+    jamlisp_gc_collect(ctx);
+  ctx->gc.mode = mode;
+}
+
+size_t jamlisp_heap_free_count(const cons_heap * heap){
+  // the conses that were never used are free too.
+  size_t count = heap->heap_size - MIN(MAX(heap->used, 1), heap->heap_size);
+  count += heap->released_pages * JAMLISP_HEAP_PAGE_SIZE;
+  for(var idx = heap->free_object; idx != 0; idx = JAMLISP_CONS_INDEX(cons_cdr(heap, idx)))
+    count += 1;
+  return count;
+}
@@ -11,11 +11,41 @@ typedef enum{
 	     JAMLISP_OPCODE_CALL,
 	     JAMLISP_OPCODE_LOCAL,
 	     JAMLISP_OPCODE_LET,
-	     JAMLISP_MAGIC = 0x5a,
+	     JAMLISP_OPCODE_GLOBAL,
+	     JAMLISP_OPCODE_BIND,
+	     // only in postfix code, ends the body of a BIND.
+	     JAMLISP_OPCODE_UNBIND,
+	     JAMLISP_OPCODE_LESS,
+	     JAMLISP_OPCODE_IF,
+	     // a CALL that is the last thing done by a function.
+	     JAMLISP_OPCODE_TAILCALL,
+	     // only in postfix code, jumps over the else branch of an IF.
+	     JAMLISP_OPCODE_JUMP,
+	     // calls a native primitive with the arguments on the stack.
+	     JAMLISP_OPCODE_PRIMITIVE,
+	     // only in threaded code, quickened forms of ADD SUB MUL and LESS
+	     // for two INT64 operands. See jamlisp_code_iterate.
+	     JAMLISP_OPCODE_ADD_I64,
+	     JAMLISP_OPCODE_SUB_I64,
+	     JAMLISP_OPCODE_MUL_I64,
+	     JAMLISP_OPCODE_LESS_I64,
 }jamlisp_opcode;
 
 #define JAMLISP_OPCODE_NONE 0
-#define JAMLISP_MAGIC 0x5a
+
+// Prefix bytecode opcode bytes from 0x80 are compact forms of INT, LOCAL,
+// CALL and TAILCALL with the operand in the byte. They are decoded to the
+// plain opcode, so only the readers of prefix bytecode see them.
+// INT JAMLISP_SMALL_INT_MIN + (byte - JAMLISP_CODE_INT_SMALL).
+#define JAMLISP_CODE_INT_SMALL 0x80
+#define JAMLISP_SMALL_INT_MIN (-16)
+#define JAMLISP_SMALL_INT_MAX 47
+// LOCAL 0 to 3.
+#define JAMLISP_CODE_LOCAL_SMALL 0xc0
+// CALL symbol and TAILCALL symbol with 0 to 3 arguments.
+#define JAMLISP_CODE_CALL_SMALL 0xc4
+#define JAMLISP_CODE_TAILCALL_SMALL 0xc8
+#define JAMLISP_CODE_SMALL_COUNT 4
 typedef enum{
 	     JAMLISP_NIL = 0,
 	     JAMLISP_CONS = 1,
@@ -28,6 +58,7 @@ typedef enum{
 	     JAMLISP_INT64,
 	     JAMLISP_BYTE,
 	     JAMLISP_BIGFLOAT,
+	     JAMLISP_BIGNUM,
 	     JAMLISP_STRING,
 	     JAMLISP_FUNCTION,
 	     JAMLISP_ARRAY,
@@ -44,6 +75,56 @@ typedef u32 jamlisp_object_index;
 
 typedef struct _jamlisp_array jamlisp_array;
 
+typedef struct _jamlisp_bignum jamlisp_bignum;
+
+
+// Objects are accessed through the JAMLISP_ macros below, so the
+// representation can be selected at build time with JAMLISP_TAGGED.
+#ifndef JAMLISP_TAGGED
+#define JAMLISP_TAGGED 0
+#endif
+
+#if JAMLISP_TAGGED
+// 8 byte NaN-boxed objects. A double is stored as itself, every other type
+// is a NaN with the type + 1 in bits 48-51 and a 48 bit payload. The bits are
+// xor'ed with the nil pattern so that zeroed memory is nil.
+// INT64 is limited to 48 bits in this representation. The type needs to fit in
+// 4 bits, so JAMLISP_TYPE and JAMLISP_TYPE_NONE can not be boxed.
+typedef u64 jamlisp_object;
+
+#define JAMLISP_NIL_BITS 0xFFF1000000000000ULL
+#define JAMLISP_PAYLOAD_MASK 0x0000FFFFFFFFFFFFULL
+#define JAMLISP_INT48_MAX ((i64)0x00007FFFFFFFFFFFLL)
+#define JAMLISP_INT48_MIN (-JAMLISP_INT48_MAX - 1)
+#define JAMLISP_BITS(obj) ((u64)(obj) ^ JAMLISP_NIL_BITS)
+#define JAMLISP_TAG(obj) ((u32)(JAMLISP_BITS(obj) >> 48))
+#define JAMLISP_PAYLOAD(obj) (JAMLISP_BITS(obj) & JAMLISP_PAYLOAD_MASK)
+#define JAMLISP_BOX(type, payload) ((((u64)(0xFFF0 | ((type) + 1)) << 48) | ((u64)(payload) & JAMLISP_PAYLOAD_MASK)) ^ JAMLISP_NIL_BITS)
+
+#define JAMLISP_IS(obj, t) ((t) == JAMLISP_F64 ? (JAMLISP_TAG(obj) & 0xFFF0) != 0xFFF0 || (JAMLISP_TAG(obj) & 0xF) == 0 : JAMLISP_TAG(obj) == (0xFFF0 | ((t) + 1)))
+#define JAMLISP_TYPE(obj) ((jamlisp_type)(JAMLISP_IS(obj, JAMLISP_F64) ? JAMLISP_F64 : (JAMLISP_TAG(obj) & 0xF) - 1))
+#define JAMLISP_INT64(obj) ((i64)(JAMLISP_PAYLOAD(obj) << 16) >> 16)
+#define JAMLISP_FIXNUM(obj) ((i32)JAMLISP_PAYLOAD(obj))
+#define JAMLISP_SYMBOL_ID(obj) ((u32)JAMLISP_PAYLOAD(obj))
+#define JAMLISP_CONS_INDEX(obj) ((jamlisp_object_index)JAMLISP_PAYLOAD(obj))
+#define JAMLISP_PTR(obj) ((jamlisp_array *)(uintptr_t)JAMLISP_PAYLOAD(obj))
+#define JAMLISP_FLOAT32(obj) ({ u32 _bits = (u32)JAMLISP_PAYLOAD(obj); f32 _f; memcpy(&_f, &_bits, sizeof(_f)); _f; })
+#define JAMLISP_FLOAT64(obj) ({ u64 _bits = JAMLISP_BITS(obj); f64 _f; memcpy(&_f, &_bits, sizeof(_f)); _f; })
+
+#define JAMLISP_MAKE_CONS(idx) JAMLISP_BOX(JAMLISP_CONS, (idx))
+#define JAMLISP_MAKE_SYMBOL(id) JAMLISP_BOX(JAMLISP_SYMBOL, (id))
+#define JAMLISP_MAKE_ARRAY(p) JAMLISP_BOX(JAMLISP_ARRAY, (uintptr_t)(p))
+#define JAMLISP_BIGNUM_PTR(obj) ((jamlisp_bignum *)(uintptr_t)JAMLISP_PAYLOAD(obj))
+#define JAMLISP_MAKE_BIGNUM(type, p) JAMLISP_BOX((type), (uintptr_t)(p))
+#define JAMLISP_PRIMITIVE_INDEX(obj) ((u32)JAMLISP_PAYLOAD(obj))
+#define JAMLISP_MAKE_PRIMITIVE(index) JAMLISP_BOX(JAMLISP_FUNCTION, (index))
+// v must be checked with JAMLISP_INT64_FITS.
+#define JAMLISP_MAKE_INT64(v) JAMLISP_BOX(JAMLISP_INT64, (v))
+#define JAMLISP_INT64_FITS(v) ((v) >= JAMLISP_INT48_MIN && (v) <= JAMLISP_INT48_MAX)
+// both tags compared with a single branch.
+#define JAMLISP_BOTH_INT64(a, b) ((((JAMLISP_BITS(a) >> 48) ^ (0xFFF0 | (JAMLISP_INT64 + 1))) | ((JAMLISP_BITS(b) >> 48) ^ (0xFFF0 | (JAMLISP_INT64 + 1)))) == 0)
+
+#else
 
 typedef struct _jamlisp_object{
   union{
@@ -54,10 +135,35 @@ typedef struct _jamlisp_object{
     f64 float64;
     jamlisp_object_index cons;
     jamlisp_array * ptr;
+    jamlisp_bignum * bignum;
+    u32 primitive;
   };
   jamlisp_type type;
 }jamlisp_object;
 
+#define JAMLISP_IS(obj, t) ((obj).type == (t))
+#define JAMLISP_TYPE(obj) ((obj).type)
+#define JAMLISP_INT64(obj) ((obj).int64)
+#define JAMLISP_FIXNUM(obj) ((obj).fixnum)
+#define JAMLISP_SYMBOL_ID(obj) ((obj).symbol)
+#define JAMLISP_CONS_INDEX(obj) ((obj).cons)
+#define JAMLISP_PTR(obj) ((obj).ptr)
+#define JAMLISP_FLOAT32(obj) ((obj).float32)
+#define JAMLISP_FLOAT64(obj) ((obj).float64)
+
+#define JAMLISP_MAKE_CONS(idx) ((jamlisp_object){.type = JAMLISP_CONS, .cons = (idx)})
+#define JAMLISP_MAKE_SYMBOL(id) ((jamlisp_object){.type = JAMLISP_SYMBOL, .symbol = (id)})
+#define JAMLISP_MAKE_ARRAY(p) ((jamlisp_object){.type = JAMLISP_ARRAY, .ptr = (p)})
+#define JAMLISP_BIGNUM_PTR(obj) ((obj).bignum)
+#define JAMLISP_MAKE_BIGNUM(t, p) ((jamlisp_object){.type = (t), .bignum = (p)})
+#define JAMLISP_PRIMITIVE_INDEX(obj) ((obj).primitive)
+#define JAMLISP_MAKE_PRIMITIVE(index) ((jamlisp_object){.type = JAMLISP_FUNCTION, .primitive = (index)})
+#define JAMLISP_MAKE_INT64(v) ((jamlisp_object){.type = JAMLISP_INT64, .int64 = (v)})
+#define JAMLISP_INT64_FITS(v) true
+#define JAMLISP_BOTH_INT64(a, b) ((((a).type ^ JAMLISP_INT64) | ((b).type ^ JAMLISP_INT64)) == 0)
+
+#endif
+
 struct _cons{
   jamlisp_object car;
   jamlisp_object cdr;
@@ -69,15 +175,112 @@ struct _jamlisp_array{
   jamlisp_object_index type;
   u32 size;
   void * data;
+  // unique in the context, an array made where another was freed gets
+  // another generation.
+  u64 generation;
 };
 
+// a BIGNUM or BIGFLOAT. The value is the limbs, least significant first,
+// times 2^exponent. The exponent of a BIGNUM is 0 and its top limb is not 0.
+struct _jamlisp_bignum{
+  i64 exponent;
+  u32 count;
+  bool negative;
+  // reached by the running major collection.
+  bool marked;
+  u64 limbs[];
+};
+
+// mantissa bits of a new BIGFLOAT.
+#define JAMLISP_BIGFLOAT_PRECISION 256
+
+
+#ifndef JAMLISP_SOA_HEAP
+#define JAMLISP_SOA_HEAP 0
+#endif
+
+// The heap is a table of fixed size pages, so growing it never moves a cons.
+// A cons index is split into a page and a slot in that page.
+#define JAMLISP_HEAP_PAGE_BITS 12
+#define JAMLISP_HEAP_PAGE_SIZE (1 << JAMLISP_HEAP_PAGE_BITS)
+#define JAMLISP_HEAP_PAGE(idx) ((idx) >> JAMLISP_HEAP_PAGE_BITS)
+#define JAMLISP_HEAP_SLOT(idx) ((idx) & (JAMLISP_HEAP_PAGE_SIZE - 1))
+
+// conses are accessed through cons_car/cons_cdr/cons_set_*, so the layout
+// can be selected at build time with JAMLISP_SOA_HEAP.
+typedef struct{
+#if JAMLISP_SOA_HEAP
+  // car and cdr payloads in separate arrays so a cdr walk does not load the cars.
+  u64 cars[JAMLISP_HEAP_PAGE_SIZE];
+  u64 cdrs[JAMLISP_HEAP_PAGE_SIZE];
+#if !JAMLISP_TAGGED
+  // car type in the low 4 bits, cdr type in the high 4 bits. Tagged objects
+  // carry their own type so this is not needed with JAMLISP_TAGGED.
+  u8 types[JAMLISP_HEAP_PAGE_SIZE];
+#endif
+#else
+  cons conses[JAMLISP_HEAP_PAGE_SIZE];
+#endif
+}cons_page;
 
 typedef struct _cons_heap{
-  cons * cons_heap;
+  // pages released by the collector are NULL until they are needed again.
+  cons_page ** pages;
+  size_t page_count;
+  size_t page_capacity;
+  size_t released_pages;
+  // number of cons indexes, including the released pages.
   size_t heap_size;
   jamlisp_object_index free_object;
+  // conses from here to heap_size have never been used and are handed out
+  // by bumping this before the heap is grown.
+  jamlisp_object_index used;
+  // set while an arena is active. Conses from here are bump allocated,
+  // never freed one by one and dropped together by jamlisp_arena_rewind.
+  jamlisp_object_index arena_base;
+  // one mark bit per cons, kept apart from the conses so marking does not touch them.
+  u64 * marks;
+  size_t mark_words;
 }cons_heap;
 
+typedef enum{
+  // conses are only released by jamlisp_free_cons.
+  JAMLISP_GC_MANUAL = 0,
+  // stop-the-world mark and sweep when the free list runs out.
+  JAMLISP_GC_MARK_SWEEP,
+  // conses surviving a collection become old and are skipped by minor collections.
+  JAMLISP_GC_GENERATIONAL
+}jamlisp_gc_mode;
+
+typedef struct{
+  jamlisp_gc_mode mode;
+  // conses left to trace.
+  jamlisp_object_index * mark_stack;
+  size_t mark_stack_capacity;
+  // old conses written to since the last collection (generational mode).
+  jamlisp_object_index * remembered;
+  size_t remembered_count;
+  size_t remembered_capacity;
+  u64 * remembered_bits;
+  size_t remembered_words;
+  u32 minor_since_major;
+  // BIGNUM and BIGFLOAT objects made outside of an arena, freed by major
+  // collections. A collection starts when bignum_bytes, their size, passes
+  // bignum_limit.
+  jamlisp_bignum ** bignums;
+  size_t bignum_count;
+  size_t bignum_capacity;
+  size_t bignum_bytes;
+  size_t bignum_limit;
+  
+  u64 collections;
+  u64 major_collections;
+  size_t last_freed;
+  u64 pause_last_ns;
+  u64 pause_max_ns;
+  u64 pause_total_ns;
+}jamlisp_gc;
+
 
 typedef struct{
   u32 arg_count;
@@ -85,6 +288,170 @@ typedef struct{
   const char * opcode_name;
 }jamlisp_opcodedef;
 
+#define JAMLISP_VARIADIC UINT32_MAX
+
+// 'args' points into the value stack, it is only valid until something is pushed.
+typedef jamlisp_object (* jamlisp_primitive_fcn)(jamlisp_context * ctx, const jamlisp_object * args, u32 count);
+
+// a native function bound to a symbol. A JAMLISP_FUNCTION object is the index
+// of one of these.
+typedef struct{
+  const char * name;
+  jamlisp_primitive_fcn fcn;
+  u32 min_args;
+  u32 max_args;
+  // the compiler uses this opcode for calls with its arg_count, a variadic
+  // primitive with a binary opcode is folded from the left.
+  jamlisp_opcode opcode;
+}jamlisp_primitive;
+
+// the instruction sets array kernels are compiled for.
+typedef enum{
+  JAMLISP_SIMD_SCALAR,
+  JAMLISP_SIMD_SSE,
+  JAMLISP_SIMD_AVX2,
+  JAMLISP_SIMD_LEVELS
+}jamlisp_simd_level;
+
+// kernels for one element type of an array. n is the number of elements,
+// reductions write one element to r and transform multiplies 'count' vectors
+// of 'width' 3 or 4 elements by a row major 4x4 matrix, w being 1 for vec3.
+typedef struct{
+  void (* add)(void * r, const void * a, const void * b, size_t n);
+  void (* mul)(void * r, const void * a, const void * b, size_t n);
+  void (* fma)(void * r, const void * a, const void * b, const void * c, size_t n);
+  void (* dot)(void * r, const void * a, const void * b, size_t n);
+  void (* sum)(void * r, const void * a, size_t n);
+  void (* min)(void * r, const void * a, size_t n);
+  void (* max)(void * r, const void * a, size_t n);
+  void (* transform)(void * r, const void * m, const void * v, size_t count, u32 width);
+}jamlisp_array_kernels;
+
+// element types of arrays with kernels.
+typedef enum{
+  JAMLISP_ARRAY_F32,
+  JAMLISP_ARRAY_F64,
+  JAMLISP_ARRAY_I64,
+  JAMLISP_ARRAY_ELEMENTS
+}jamlisp_array_element;
+
+// an atom, a string or a single paren of the source given to the lexer.
+typedef struct{
+  u32 offset;
+  u32 length;
+}jamlisp_token;
+
+// the state of jamlisp_lex between calls.
+typedef struct{
+  const char * source;
+  size_t size;
+  // the start of the next block to read.
+  size_t offset;
+  jamlisp_simd_level level;
+  // more source follows 'size', jamlisp_lex stops there and continues
+  // when 'size' has grown.
+  bool partial;
+  // the last block ended inside a string, a comment or an atom starting at
+  // atom_start.
+  bool in_string;
+  bool in_comment;
+  bool in_atom;
+  size_t atom_start;
+  // the end of the source or a NUL was reached.
+  bool done;
+  // a string was not closed.
+  bool error;
+}jamlisp_lexer;
+
+// the space jamlisp_lex needs for the tokens of one block.
+#define JAMLISP_LEX_MIN_TOKENS 65
+
+// gets the bytecode of each top level form read by a jamlisp_stream.
+typedef void (* jamlisp_form_callback)(void * userdata, const void * code, size_t size);
+
+// a parser fed with chunks of source, see jamlisp_stream_feed.
+typedef struct{
+  jamlisp_context * ctx;
+  jamlisp_form_callback form;
+  void * userdata;
+  // the source from the start of the unfinished form.
+  io_writer source;
+  jamlisp_lexer lexer;
+  // the paren depth and start of the unfinished form.
+  u32 depth;
+  size_t form_start;
+  // the bytecode of the last form.
+  io_writer code;
+  size_t forms;
+  bool error;
+}jamlisp_stream;
+
+// Modules.
+// A module is the bytecode of a set of functions and of top level forms,
+// written once so it can be mapped and run without parsing. All offsets are
+// from the start of the module and all tables are 4 byte aligned.
+#define JAMLISP_MODULE_MAGIC 0x444d4c4a
+#define JAMLISP_MODULE_VERSION 2
+
+typedef struct{
+  u32 magic;
+  u32 version;
+  u32 size;
+  // the name of every symbol of the writing context, by its id there. Table
+  // entry i is the offset of the NUL terminated name of symbol i in 'names'.
+  u32 symbol_count;
+  u32 symbols;
+  u32 names;
+  u32 names_size;
+  // jamlisp_module_function entries.
+  u32 function_count;
+  u32 functions;
+  // jamlisp_module_relocation entries.
+  u32 relocation_count;
+  u32 relocations;
+  u32 code;
+  u32 code_size;
+  // the top level forms, an offset into the code.
+  u32 main;
+  u32 main_size;
+}jamlisp_module_header;
+
+typedef struct{
+  u32 symbol;
+  // into the code.
+  u32 offset;
+  u32 size;
+}jamlisp_module_function;
+
+typedef enum{
+  // a symbol id, the operand of CALL TAILCALL GLOBAL and BIND.
+  JAMLISP_RELOCATION_SYMBOL,
+  // the primitive index of PRIMITIVE, taken from the symbol value.
+  JAMLISP_RELOCATION_PRIMITIVE
+}jamlisp_relocation_kind;
+
+// an operand in the code that depends on the context. It is stored as a
+// 5 byte LEB so that it can be rewritten in place.
+typedef struct{
+  u32 offset;
+  u32 kind;
+  u32 symbol;
+}jamlisp_module_relocation;
+
+typedef struct{
+  u8 * data;
+  size_t size;
+  // from jamlisp_module_map, unmapped by jamlisp_module_unload.
+  bool mapped;
+  // the function arrays, their data is in the module.
+  jamlisp_array ** functions;
+  u32 * function_symbols;
+  u32 function_count;
+  // the relocations that had to be rewritten, 0 when the symbols of the
+  // loading context have the same ids as the writing one.
+  size_t patched;
+}jamlisp_module;
+
 
 struct _jamlisp_stack_frame{
   u32 opcode;
@@ -92,13 +459,194 @@ struct _jamlisp_stack_frame{
   u64 node_id;
   u32 call;
   u32 child_count0;
+  // the CALL is running the body of the function.
+  bool body;
 };
 
-typedef struct _jamlisp_control_frame{
+// a decoded byte code node. For CALL, child_count is the argument count.
+// 'call' is the symbol of CALL, GLOBAL and BIND. 'jump' is the number of
+// instructions an IF or JUMP skips forward. 'cache' is the inline cache of a
+// CALL in threaded code.
+typedef struct{
+  u32 opcode;
+  u32 child_count;
+  union{
+    i64 int64;
+    struct{
+      u32 call;
+      u32 cache;
+    };
+    u32 local;
+    u32 jump;
+    // the branch sizes of an IF in prefix bytecode.
+    struct{
+      u32 then_size;
+      u32 else_size;
+    };
+  };
+}jamlisp_insn;
+
+typedef struct _jamlisp_call_cache jamlisp_call_cache;
+
+// threaded code: byte code pre-decoded once into postfix ordered instructions
+// terminated by a NONE instruction.
+typedef struct{
+  jamlisp_insn * insns;
+  size_t count;
+  size_t capacity;
+  // one for each CALL.
+  jamlisp_call_cache * caches;
+  size_t cache_count;
+  size_t cache_capacity;
+}jamlisp_code;
+
+// The function a CALL resolved to. Valid while 'version' is the
+// symbol_version of the context.
+struct _jamlisp_call_cache{
+  u64 version;
+  jamlisp_insn * insns;
+  jamlisp_call_cache * caches;
+};
+
+typedef struct{
+  u64 cache_hits;
+  u64 cache_misses;
+}jamlisp_call_stats;
+
+// Register code.
+// Three address instructions over the registers of a frame, which are the
+// value stack slots from local_base. The arguments of a function are its
+// first registers. See register_code.c.
+typedef enum{
+  // dst = a
+  JAMLISP_REG_MOVE,
+  // dst = a op b
+  JAMLISP_REG_ADD,
+  JAMLISP_REG_SUB,
+  JAMLISP_REG_MUL,
+  JAMLISP_REG_DIV,
+  JAMLISP_REG_LESS,
+  JAMLISP_REG_CONS,
+  // prints a.
+  JAMLISP_REG_PRINT,
+  // dst = the value of symbol a.
+  JAMLISP_REG_GLOBAL,
+  // skips b instructions if a is nil.
+  JAMLISP_REG_IF,
+  // skips b instructions.
+  JAMLISP_REG_JUMP,
+  // binds symbol a to b, UNBIND restores it.
+  JAMLISP_REG_BIND,
+  JAMLISP_REG_UNBIND,
+  // call a with the b arguments in the registers from dst, the result is
+  // put in dst. 'c' is the inline cache of CALL and TAILCALL.
+  JAMLISP_REG_PRIMITIVE,
+  JAMLISP_REG_CALL,
+  JAMLISP_REG_TAILCALL,
+  // returns a from a function.
+  JAMLISP_REG_RETURN,
+  // ends top level code, the value of each of the a forms is left on the
+  // value stack.
+  JAMLISP_REG_END
+}jamlisp_reg_opcode;
+
+// an operand with this bit is an index into the constants, otherwise it is a register.
+#define JAMLISP_REG_CONSTANT 0x80000000
+
+typedef struct{
+  u32 opcode;
+  u32 dst;
+  u32 a;
+  u32 b;
+  u32 c;
+}jamlisp_reg_insn;
+
+typedef struct _jamlisp_reg_cache jamlisp_reg_cache;
+
+typedef struct{
+  jamlisp_reg_insn * insns;
+  size_t count;
+  size_t capacity;
+  jamlisp_object * constants;
+  size_t constant_count;
+  size_t constant_capacity;
+  // one for each CALL and TAILCALL.
+  jamlisp_reg_cache * caches;
+  size_t cache_count;
+  size_t cache_capacity;
+  // the registers of a frame, the first arg_count are the arguments.
+  u32 frame_size;
+  u32 arg_count;
+}jamlisp_reg_code;
 
-  io_reader * reader;
+// the register code a CALL resolved to, valid while 'version' is the
+// symbol_version of the context.
+struct _jamlisp_reg_cache{
+  u64 version;
+  jamlisp_reg_code * code;
+};
+
+// a call into a function. Saves where the caller continues.
+typedef struct _jamlisp_control_frame{
+  io_reader reader;
+  jamlisp_insn * ip;
+  jamlisp_insn * insns;
+  jamlisp_call_cache * caches;
+  // the register code of the caller and its CALL.
+  jamlisp_reg_code * reg_code;
+  jamlisp_reg_insn * reg_ip;
+  size_t local_base;
+  // the CALL frame of jamlisp_iterate.
+  u32 frame_index;
+  // the caller runs verified code in jamlisp_iterate.
+  bool reserved;
 }jamlisp_control_frame;
 
+// what jamlisp_verify finds out about prefix bytecode. The depths are the
+// most objects it adds to the value stack and the most frames of
+// jamlisp_iterate it uses, not counting the functions it calls. arg_count is
+// the number of frame slots below the code that LOCAL reads, the arguments a
+// call has to pass.
+typedef struct{
+  u32 max_stack;
+  u32 max_frames;
+  u32 arg_count;
+}jamlisp_verify_info;
+
+// the function code in each execution format, compiled when it is first called.
+typedef struct{
+  // the byte code array it was compiled from, and its generation. The array
+  // can be freed and its address reused, so the generation tells if the code
+  // is still the one compiled.
+  jamlisp_array * source;
+  u64 generation;
+  // symbol_version when source was looked up.
+  u64 version;
+  jamlisp_code threaded;
+  io_writer postfix;
+  // the register code for each argument count it was called with. Each is
+  // allocated so that call caches can point to it, and is never compiled
+  // again while the source stays the same.
+  jamlisp_reg_code ** registers;
+  size_t register_count;
+  size_t register_capacity;
+  // register code of an earlier source that could still be running in a
+  // frame of the control stack.
+  jamlisp_reg_code ** retired;
+  size_t retired_count;
+  size_t retired_capacity;
+  // the same for threaded and postfix code.
+  jamlisp_code * retired_threaded;
+  size_t retired_threaded_count;
+  size_t retired_threaded_capacity;
+  io_writer * retired_postfix;
+  size_t retired_postfix_count;
+  size_t retired_postfix_capacity;
+  // the source passed jamlisp_verify, jamlisp_iterate runs it unchecked.
+  bool verified;
+  jamlisp_verify_info info;
+}jamlisp_function;
+
 typedef struct _jamlisp_symbol_value{
   jamlisp_object symbol;
   jamlisp_object value;
@@ -111,10 +659,104 @@ typedef struct{
   size_t capacity;
   size_t count;
 }stack;
+
+// The value stack is reserved once with a guard page after it, so it never
+// moves and a push does not check the capacity. The pages are only backed
+// when they are used.
+#ifndef JAMLISP_VALUE_STACK_SIZE
+#define JAMLISP_VALUE_STACK_SIZE (1 << 22)
+#endif
+
+typedef struct{
+  jamlisp_object * objects;
+  // objects on the stack.
+  size_t count;
+  // objects before the guard page.
+  size_t capacity;
+}jamlisp_value_stack;
 typedef struct _hash_table hash_table;
 
 typedef jamlisp_stack_frame stack_frame;
 
+// Tracing.
+// JAMLISP_TRACE messages above JAMLISP_TRACE_LEVEL are compiled away, arguments included.
+#define JAMLISP_TRACE_NONE 0
+#define JAMLISP_TRACE_INFO 1
+#define JAMLISP_TRACE_DEBUG 2
+// per node messages from the interpreter and the parser.
+#define JAMLISP_TRACE_VERBOSE 3
+
+#ifndef JAMLISP_TRACE_LEVEL
+#ifdef DEBUG
+#define JAMLISP_TRACE_LEVEL JAMLISP_TRACE_DEBUG
+#else
+#define JAMLISP_TRACE_LEVEL JAMLISP_TRACE_NONE
+#endif
+#endif
+
+#define JAMLISP_TRACE(level, ...) do{ if((level) <= JAMLISP_TRACE_LEVEL) logd(__VA_ARGS__); }while(0)
+
+// The trace ring records the nodes executed as packed binary records.
+// It is enabled at run time by jamlisp_trace_enable and can be compiled out
+// with -DJAMLISP_TRACE_RING=0.
+#ifndef JAMLISP_TRACE_RING
+#define JAMLISP_TRACE_RING 1
+#endif
+
+// the second word of a record has the opcode in the low 8 bits and the value
+// stack depth in the high 24. It is packed with shifts and not bitfields, so
+// the layout does not depend on the compiler.
+typedef struct{
+  u32 node_id;
+  u32 opcode_depth;
+}jamlisp_trace_record;
+
+#define JAMLISP_TRACE_PACK(opcode, depth) (((u32)(opcode) & 0xff) | ((u32)(depth) << 8))
+#define JAMLISP_TRACE_OPCODE(record) ((record).opcode_depth & 0xff)
+#define JAMLISP_TRACE_DEPTH(record) ((record).opcode_depth >> 8)
+
+typedef struct{
+  jamlisp_trace_record * records;
+  // always a power of two.
+  size_t capacity;
+  // total number of records written, the ring holds the last 'capacity' of them.
+  u64 count;
+}jamlisp_trace_ring;
+
+// arena
+typedef struct _jamlisp_arena_block jamlisp_arena_block;
+struct _jamlisp_arena_block{
+  jamlisp_arena_block * next;
+  size_t size;
+  size_t offset;
+  u8 data[];
+};
+
+typedef struct{
+  // blocks are kept after a rewind and reused by later allocations.
+  jamlisp_arena_block * first;
+  jamlisp_arena_block * current;
+  int depth;
+}jamlisp_arena;
+
+// the state restored by jamlisp_arena_rewind.
+typedef struct{
+  // arena position at jamlisp_arena_begin.
+  jamlisp_arena_block * block;
+  size_t offset;
+  jamlisp_object_index cons_used;
+  jamlisp_object_index arena_base;
+  size_t value_stack_count;
+  size_t symbol_value_stack_count;
+  u32 frame_index;
+  int cframe_count;
+  // length of the symbol undo log and the undo epoch of the enclosing arena.
+  size_t symbol_undo_count;
+  u32 undo_epoch;
+  jamlisp_arena_block * bignum_block;
+  size_t bignum_offset;
+}jamlisp_checkpoint;
+
 struct _jamlisp_context {
   
   jamlisp_opcodedef * opcodedefs;
@@ -125,51 +767,221 @@ struct _jamlisp_context {
 
   hash_table * opcode_names;
   hash_table * symbol_names;
+  // the name of each symbol by id.
+  char ** symbol_name_table;
+  size_t symbol_name_capacity;
   jamlisp_object * symbol_values;
   size_t symbol_values_count;
   u32 symbol_counter;
+  // incremented when a symbol value that could be a function changes.
+  u64 symbol_version;
+  // the generation of the last array made.
+  u64 array_generation;
+  // while an arena is active, the value of each symbol before its first
+  // change since the checkpoint, so a rewind only restores what changed.
+  jamlisp_symbol_value * symbol_undo;
+  size_t symbol_undo_count;
+  size_t symbol_undo_capacity;
+  // by symbol id, the undo_epoch in which its old value was saved.
+  u32 * symbol_undo_epochs;
+  // changed by every checkpoint and rewind, 0 outside of an arena.
+  u32 undo_epoch;
+  u32 undo_epoch_counter;
   //stack_frame * stack;
   //size_t stack_capacity;
   
   cons_heap heap;
+  jamlisp_gc gc;
 
-  stack value_stack;
+  jamlisp_value_stack value_stack;
 
   jamlisp_control_frame * cframes;
   size_t cframes_capacity;
   int cframe_count;
 
+  // the old values of the bound special variables.
   stack symbol_value_stack;
+  // LOCAL n reads object local_base + n of the value stack.
+  size_t local_base;
   
   // control stack.
   stack_frame * frames;
   size_t frames_capacity;
   u32 frame_index;
-  
+
+  // indexed by symbol id.
+  jamlisp_function * functions;
+  size_t functions_capacity;
+  jamlisp_call_stats call_stats;
+
+  jamlisp_primitive * primitives;
+  size_t primitive_count;
+  size_t primitive_capacity;
+
+  // threaded code rewrites arithmetic to the _I64 opcodes, on by default.
+  bool quicken;
+  // jamlisp_iterate compiles the forms to register code and runs them on the
+  // register machine, off by default.
+  bool registers;
+  // register code is compiled with arithmetic on constants and branches on
+  // constant conditions done, on by default.
+  bool register_fold;
+
+  // the kernels of each jamlisp_array_element for simd_level.
+  const jamlisp_array_kernels * array_kernels;
+  jamlisp_simd_level simd_level;
+
+  // BIGNUM and BIGFLOAT objects made in an arena, bump allocated and dropped
+  // by the rewind. The others are collected, see jamlisp_gc.bignums.
+  jamlisp_arena bignums;
+  // intermediate limbs of a bignum operation.
+  u64 * bignum_scratch;
+  size_t bignum_scratch_capacity;
+  size_t bignum_scratch_used;
+  u32 bigfloat_precision;
+
+  jamlisp_trace_ring trace;
+
+  jamlisp_arena arena;
+  // byte writers of the parser kept for the next load while an arena is
+  // active, freed by the outermost jamlisp_arena_end.
+  io_writer * parser_writers;
+  size_t parser_writer_count;
+  size_t parser_writer_capacity;
 };
 
 
 
+#if JAMLISP_TRACE_RING
+#define JAMLISP_TRACE_NODE(ctx, node_id, opcode) do{ if(__builtin_expect((ctx)->trace.records != NULL, 0)) jamlisp_trace_node(ctx, node_id, opcode); }while(0)
+#else
+#define JAMLISP_TRACE_NODE(ctx, node_id, opcode) do{ (void)(node_id); (void)(opcode); }while(0)
+#endif
+
+void jamlisp_trace_enable(jamlisp_context * ctx, size_t capacity);
+void jamlisp_trace_disable(jamlisp_context * ctx);
+void jamlisp_trace_node(jamlisp_context * ctx, u32 node_id, u32 opcode);
+size_t jamlisp_trace_read(jamlisp_context * ctx, jamlisp_trace_record * records, size_t count);
+void jamlisp_trace_write(jamlisp_context * ctx, io_writer * writer);
+
 const char * jamlisp_opcode_name(jamlisp_context * ctx, jamlisp_opcode);
 jamlisp_opcode jamlisp_opcode_parse(jamlisp_context * ctx, const char * name);
 jamlisp_opcode jamlisp_current_opcode(jamlisp_context * ctx);
 jamlisp_context * jamlisp_new();
 void jamlisp_load_opcode(jamlisp_context * ctx, jamlisp_opcode opcode, const char * name, size_t arg_count);
+void jamlisp_load_fcn_bytecode(jamlisp_context * ctx, jamlisp_object symbol, void * code, size_t code_size);
+u32 jamlisp_load_primitive(jamlisp_context * ctx, const char * name, jamlisp_primitive_fcn fcn, u32 min_args, u32 max_args, jamlisp_opcode opcode);
+void jamlisp_load_primitives(jamlisp_context * ctx);
+void jamlisp_load_array_primitives(jamlisp_context * ctx);
+const jamlisp_primitive * jamlisp_symbol_primitive(jamlisp_context * ctx, jamlisp_object symbol, u32 * index);
+void jamlisp_call_primitive(jamlisp_context * ctx, u32 index, u32 arg_count);
 
 jamlisp_opcodedef jamlisp_get_opcodedef(jamlisp_context * ctx, jamlisp_opcode opcode);
 
 void jamlisp_iterate(jamlisp_context * reg, io_reader * reader);
+// runs code that passed jamlisp_verify, the stacks are reserved once for the
+// depths in 'info' and the nodes do not check them.
+void jamlisp_iterate_verified(jamlisp_context * ctx, io_reader * reader, const jamlisp_verify_info * info);
+
+bool jamlisp_code_load(jamlisp_context * ctx, jamlisp_code * code, io_reader * reader);
+void jamlisp_code_iterate(jamlisp_context * ctx, jamlisp_code * code);
+void jamlisp_code_free(jamlisp_code * code);
+
+// compiles the top level forms up to a NONE or the end of the reader, which
+// is left after them. jamlisp_reg_iterate leaves the value of each form on the
+// value stack, like jamlisp_iterate.
+bool jamlisp_reg_compile(jamlisp_context * ctx, jamlisp_reg_code * code, io_reader * reader);
+// compiles a function body called with 'arg_count' arguments.
+bool jamlisp_reg_compile_function(jamlisp_context * ctx, jamlisp_reg_code * code, const void * source, size_t size, u32 arg_count);
+void jamlisp_reg_iterate(jamlisp_context * ctx, jamlisp_reg_code * code);
+void jamlisp_reg_code_free(jamlisp_reg_code * code);
+// compiles and runs the forms, jamlisp_iterate with ctx->registers.
+void jamlisp_reg_eval(jamlisp_context * ctx, io_reader * reader);
+
+bool jamlisp_read_prefix_node(jamlisp_context * ctx, io_reader * reader, jamlisp_insn * insn);
+void jamlisp_write_prefix_node(io_writer * writer, const jamlisp_insn * insn);
+// checks that prefix bytecode is a sequence of complete forms of known
+// opcodes with the right branch sizes and argument counts, jamlisp_iterate
+// does not check it. 'info' can be NULL.
+bool jamlisp_verify(jamlisp_context * ctx, const void * code, size_t size, jamlisp_verify_info * info);
+bool jamlisp_prefix_to_postfix(jamlisp_context * ctx, io_reader * reader, void (* emit)(void * userdata, const jamlisp_insn * insn), void * userdata);
+void jamlisp_write_postfix_node(io_writer * writer, const jamlisp_insn * insn);
+bool jamlisp_read_postfix_node(io_reader * reader, jamlisp_insn * insn);
+bool jamlisp_compile_postfix(jamlisp_context * ctx, io_reader * prefix, io_writer * postfix);
+void jamlisp_iterate_postfix(jamlisp_context * ctx, io_reader * reader);
 
 void jamlisp_free(jamlisp_context * ctx, jamlisp_object_index obj);
+// data can be NULL for a zeroed array.
+jamlisp_array * jamlisp_array_new(jamlisp_context * ctx, jamlisp_type t, void * data, size_t size);
+
+// arrays
+// The highest level this cpu supports, jamlisp_simd_set fails for a level it
+// does not.
+jamlisp_simd_level jamlisp_simd_detect();
+bool jamlisp_simd_set(jamlisp_context * ctx, jamlisp_simd_level level);
+const char * jamlisp_simd_name(jamlisp_simd_level level);
+size_t jamlisp_array_count(const jamlisp_array * array);
 jamlisp_object jamlisp_new_object();
 jamlisp_object jamlisp_pop(jamlisp_context * ctx);
 void jamlisp_push(jamlisp_context * ctx, jamlisp_object obj);
 jamlisp_object jamlisp_top(jamlisp_context * ctx);
 
+// lexical variables are slots on the value stack counted from ctx->local_base.
+#define JAMLISP_LOCAL(ctx, n) ((ctx)->value_stack.objects[(ctx)->local_base + (n)])
+size_t jamlisp_enter_locals(jamlisp_context * ctx);
+void jamlisp_let_exit(jamlisp_context * ctx, u32 slots);
+void jamlisp_push_global(jamlisp_context * ctx, u32 symbol);
+void jamlisp_bind(jamlisp_context * ctx, u32 symbol);
+void jamlisp_unbind(jamlisp_context * ctx, u32 symbol);
+
+// calls
+jamlisp_array * jamlisp_function_code(jamlisp_context * ctx, u32 symbol);
+jamlisp_function * jamlisp_function_get(jamlisp_context * ctx, u32 symbol);
+bool jamlisp_function_takes(const jamlisp_function * f, u32 arg_count);
+bool jamlisp_function_postfix(jamlisp_context * ctx, u32 symbol, u32 arg_count, io_reader * reader);
+bool jamlisp_call_cache_fill(jamlisp_context * ctx, jamlisp_call_cache * cache, u32 symbol, u32 arg_count);
+jamlisp_reg_code * jamlisp_function_registers(jamlisp_context * ctx, u32 symbol, u32 arg_count);
+void jamlisp_function_clear(jamlisp_context * ctx, jamlisp_function * f);
+bool jamlisp_reg_cache_fill(jamlisp_context * ctx, jamlisp_reg_cache * cache, u32 symbol, u32 arg_count);
+void jamlisp_call_native(jamlisp_context * ctx, u32 symbol, u32 arg_count);
+jamlisp_control_frame * jamlisp_call_enter(jamlisp_context * ctx, u32 arg_count);
+jamlisp_control_frame * jamlisp_call_return(jamlisp_context * ctx);
+void jamlisp_tail_call(jamlisp_context * ctx, u32 arg_count);
+
 void jamlisp_push_i64(jamlisp_context * ctx, i64 value);
 i64 jamlisp_pop_i64(jamlisp_context * ctx);
 void jamlisp_print(jamlisp_object obj);
 
+// numbers
+jamlisp_object jamlisp_add(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_sub(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_less(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_mul(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_div(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+bool jamlisp_numberp(jamlisp_object obj);
+f64 jamlisp_to_f64(jamlisp_object obj);
+
+// bignums
+// The integer functions take INT64 and BIGNUM objects, the result is INT64
+// whenever it fits. The bigfloat functions take any number.
+jamlisp_object jamlisp_integer_add(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_integer_sub(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_integer_mul(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_integer_div(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+int jamlisp_integer_compare(jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_integer_parse(jamlisp_context * ctx, const char * digits, size_t length);
+jamlisp_object jamlisp_integer(jamlisp_context * ctx, i64 v);
+jamlisp_object jamlisp_bigfloat(jamlisp_context * ctx, jamlisp_object number);
+jamlisp_object jamlisp_bigfloat_add(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_bigfloat_sub(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_bigfloat_mul(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+jamlisp_object jamlisp_bigfloat_div(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+int jamlisp_bigfloat_compare(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+f64 jamlisp_bignum_to_f64(jamlisp_object obj);
+void jamlisp_number_write(io_writer * writer, jamlisp_object obj);
+// 't' is the first symbol created by jamlisp_new.
+#define JAMLISP_SYMBOL_T 1
+
 jamlisp_object symbol_get_value(jamlisp_context * ctx, jamlisp_object symbol);
 void symbol_set_value(jamlisp_context * ctx, jamlisp_object symbol, jamlisp_object object);
 
@@ -177,7 +989,34 @@ void jamlisp_pop_symbol_value(jamlisp_context * ctx, jamlisp_object sym);
 void jamlisp_push_symbol_value(jamlisp_context * ctx, jamlisp_object sym, jamlisp_object value);
 
 void jamlisp_load_lisp2(jamlisp_context * ctx, io_writer * wd, const char * code);
-void jamlisp_load_lisp(jamlisp_context * ctx, io_writer * wd, io_reader * code);
+void jamlisp_load_lisp(jamlisp_context * ctx, io_reader * code, io_writer * wd);
+// reads the next tokens of the source into 'tokens', returns how many. It
+// returns 0 only when lexer->done is set.
+void jamlisp_lexer_init(jamlisp_lexer * lexer, const char * source, size_t size, jamlisp_simd_level level);
+size_t jamlisp_lex(jamlisp_lexer * lexer, jamlisp_token * tokens, size_t capacity);
+
+// jamlisp_stream_feed takes the next chunk of the source and calls 'form' for
+// every top level form it closes, a chunk can end anywhere. jamlisp_stream_end
+// reads the rest, it fails if a form is not closed. jamlisp_stream_fd feeds
+// everything read from a file, pipe or socket.
+void jamlisp_stream_init(jamlisp_stream * stream, jamlisp_context * ctx, jamlisp_form_callback form, void * userdata);
+bool jamlisp_stream_feed(jamlisp_stream * stream, const void * data, size_t size);
+bool jamlisp_stream_end(jamlisp_stream * stream);
+bool jamlisp_stream_fd(jamlisp_stream * stream, int fd);
+void jamlisp_stream_clear(jamlisp_stream * stream);
+
+// jamlisp_module_write saves every function of the context and the top level
+// bytecode 'main'. jamlisp_module_load binds the functions of a module to the
+// symbols of the same name, the bytecode stays in 'data', which must be
+// writable and outlive the module. jamlisp_module_map loads a file with mmap.
+// The top level forms are run with jamlisp_iterate on jamlisp_module_main,
+// once for every form.
+bool jamlisp_module_write(jamlisp_context * ctx, io_writer * module, const void * main, size_t main_size);
+bool jamlisp_module_load(jamlisp_context * ctx, jamlisp_module * module, void * data, size_t size);
+bool jamlisp_module_map(jamlisp_context * ctx, jamlisp_module * module, const char * path);
+io_reader jamlisp_module_main(const jamlisp_module * module);
+// unbinds the functions still bound to the module code.
+void jamlisp_module_unload(jamlisp_context * ctx, jamlisp_module * module);
 
 jamlisp_object jamlisp_i64(i64 v);
 jamlisp_object jamlisp_i32(i32 v);
@@ -187,12 +1026,57 @@ jamlisp_object jamlisp_nil();
 jamlisp_object jamlisp_new_cons(jamlisp_context * ctx);
 void jamlisp_free_cons(jamlisp_context * ctx, jamlisp_object * cons);
 
+jamlisp_object jamlisp_cons(jamlisp_context * ctx, jamlisp_object car, jamlisp_object cdr);
+jamlisp_object jamlisp_car(jamlisp_context * ctx, jamlisp_object cons);
+jamlisp_object jamlisp_cdr(jamlisp_context * ctx, jamlisp_object cons);
+void jamlisp_set_car(jamlisp_context * ctx, jamlisp_object cons, jamlisp_object value);
+void jamlisp_set_cdr(jamlisp_context * ctx, jamlisp_object cons, jamlisp_object value);
+
+// cons heap
+void free_object(cons_heap * heap, jamlisp_object_index obj);
+jamlisp_object_index new_object(cons_heap * heap);
+void heap_grow(cons_heap * heap);
+cons cons_get(const cons_heap * heap, jamlisp_object_index idx);
+bool heap_full(const cons_heap * heap);
+jamlisp_object cons_car(const cons_heap * heap, jamlisp_object_index idx);
+jamlisp_object cons_cdr(const cons_heap * heap, jamlisp_object_index idx);
+void cons_set_car(cons_heap * heap, jamlisp_object_index idx, jamlisp_object value);
+void cons_set_cdr(cons_heap * heap, jamlisp_object_index idx, jamlisp_object value);
+
+// arena
+// Between jamlisp_arena_begin and jamlisp_arena_end conses, arrays and
+// jamlisp_arena_alloc memory are bump allocated and nothing is collected.
+// jamlisp_arena_rewind drops everything allocated since the checkpoint in
+// O(1) and restores the stacks and symbol values, so a context can be reused
+// for many short evaluations. Objects made in the arena must not be kept
+// after a rewind.
+jamlisp_checkpoint jamlisp_arena_begin(jamlisp_context * ctx);
+void jamlisp_arena_rewind(jamlisp_context * ctx, const jamlisp_checkpoint * checkpoint);
+void jamlisp_arena_end(jamlisp_context * ctx, const jamlisp_checkpoint * checkpoint);
+void * jamlisp_arena_alloc(jamlisp_context * ctx, size_t size);
+void * jamlisp_block_alloc(jamlisp_arena * arena, size_t size);
+
+// garbage collection
+// The roots are the symbol values and the value stack, anything only held
+// from C must be pushed on the value stack to survive a collection.
+void jamlisp_gc_set_mode(jamlisp_context * ctx, jamlisp_gc_mode mode);
+void jamlisp_gc_collect(jamlisp_context * ctx);
+jamlisp_bignum * jamlisp_gc_bignum_alloc(jamlisp_context * ctx, size_t size);
+void jamlisp_gc_on_bignum(jamlisp_context * ctx, jamlisp_object bignum);
+void jamlisp_gc_minor(jamlisp_context * ctx);
+void jamlisp_gc_on_alloc(jamlisp_context * ctx);
+void jamlisp_gc_write_barrier(jamlisp_context * ctx, jamlisp_object_index target, jamlisp_object value);
+bool jamlisp_gc_marked(const cons_heap * heap, jamlisp_object_index obj);
+size_t jamlisp_heap_free_count(const cons_heap * heap);
+
 bool jamlisp_nilp(jamlisp_object obj);
 bool jamlisp_symbolp(jamlisp_object obj);
 bool jamlisp_integerp(jamlisp_object obj);
 bool jamlisp_consp(jamlisp_object obj);
 
 jamlisp_object jamlisp_symbol(jamlisp_context * ctx, const char * symbol_name);
+// NULL for an id that is not a symbol.
+const char * jamlisp_symbol_name(jamlisp_context * ctx, u32 id);
 
 
 
@@ -201,10 +1085,13 @@ void jamlisp_3d_init(jamlisp_context * ctx);
 void jamlisp_load_lisp_string(jamlisp_context * ctx, io_writer * wd, const char * target);
 
 void jamlisp_test_load(jamlisp_context * ctx, io_writer * wd);
+io_reader io_from_bytes(const void * bytes, size_t size);
 
 
 
 void stack_push(stack * stk, const void * data, size_t count);
+void jamlisp_value_stack_init(jamlisp_value_stack * stk, size_t capacity);
+void jamlisp_value_stack_free(jamlisp_value_stack * stk);
 void stack_pop(stack * stk, void * data, size_t count);
 void stack_top(stack * stk, void * data, size_t count);
 
@@ -216,3 +1103,9 @@ void * alloc_elems(void ** ptr, size_t elem_size, size_t * count, size_t * capac
 
 void ensure_size(void ** ptr, size_t elem_size, size_t * count, size_t new_count);
 size_t grow_elems(void ** ptr, size_t elem_size, size_t * count);
+void ensure_size2(void ** ptr, size_t elem_size, size_t * count, size_t new_count, float growth_factor);
+
+// benchmarks
+void run_benchmarks(int argc, char ** argv);
+void run_bench_gen(int argc, char ** argv);
+void jamlisp_bench_scene(io_writer * wd, size_t nodes, u64 seed);
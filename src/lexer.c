@@ -0,0 +1,246 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Lexer.
+// The source is classified 64 bytes at a time into one bit mask per
+// character class: whitespace, parens, quotes and the ends of the code (NUL
+// and the ';' of a comment). The tokens are then read from the masks with
+// bit operations, so the cost is per token and not per byte. A string runs
+// from a quote to the next one, where "" continues it, and is an atom like
+// any other. The classification is done with a table for the scalar level and
+// with a shuffle of the low and high nibble of each byte by SSE and AVX2.
+
+#if defined(__x86_64__) || defined(__i386__)
+#define LEXER_X86 1
+#include <immintrin.h>
+#else
+#define LEXER_X86 0
+#endif
+
+#define LEX_BLOCK 64
+
+typedef struct{
+  u64 whitespace;
+  u64 paren;
+  u64 quote;
+  u64 end;
+}lex_classes;
+
+enum{
+  LEX_WHITESPACE = 1,
+  LEX_PAREN = 2,
+  LEX_QUOTE = 4,
+  LEX_END = 8
+};
+
+static const u8 char_classes[256] = {
+  [' '] = LEX_WHITESPACE, ['\t'] = LEX_WHITESPACE, ['\n'] = LEX_WHITESPACE, ['\r'] = LEX_WHITESPACE,
+  ['('] = LEX_PAREN, [')'] = LEX_PAREN,
+  ['"'] = LEX_QUOTE,
+  [0] = LEX_END, [';'] = LEX_END
+};
+
+static void classify_scalar(const u8 * p, lex_classes * c){
+  lex_classes r = {0};
+  for(int i = 0; i < LEX_BLOCK; i++){
+    u64 cls = char_classes[p[i]];
+    r.whitespace |= (cls & 1) << i;
+    r.paren |= ((cls >> 1) & 1) << i;
+    r.quote |= ((cls >> 2) & 1) << i;
+    r.end |= ((cls >> 3) & 1) << i;
+  }
+  *c = r;
+}
+
+#if LEXER_X86
+// The class of a byte is nibble_low[c & 15] & nibble_high[c >> 4]. Every
+// class bit is only set for the high and low nibbles of its characters:
+// bit 0 '\t' '\n' '\r', bit 1 ' ', bit 2 NUL, bit 3 '(' ')', bit 4 '"', bit 5 ';'.
+#define NIBBLE_WHITESPACE 0x03
+#define NIBBLE_PAREN 0x08
+#define NIBBLE_QUOTE 0x10
+#define NIBBLE_END 0x24
+#define NIBBLE_LOW 0x06, 0, 0x10, 0, 0, 0, 0, 0, 0x08, 0x09, 0x01, 0x20, 0, 0x01, 0, 0
+#define NIBBLE_HIGH 0x05, 0, 0x1a, 0x20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+
+#define SSE_ATTR __attribute__((target("sse4.2")))
+#define AVX2_ATTR __attribute__((target("avx2")))
+
+SSE_ATTR static inline u64 mask_sse(__m128i cls, u8 bits){
+  __m128i none = _mm_cmpeq_epi8(_mm_and_si128(cls, _mm_set1_epi8(bits)), _mm_setzero_si128());
+  return (u16)~_mm_movemask_epi8(none);
+}
+
+SSE_ATTR static void classify_sse(const u8 * p, lex_classes * c){
+  const __m128i low = _mm_setr_epi8(NIBBLE_LOW);
+  const __m128i high = _mm_setr_epi8(NIBBLE_HIGH);
+  const __m128i nibble = _mm_set1_epi8(0x0f);
+  lex_classes r = {0};
+  for(int i = 0; i < LEX_BLOCK; i += 16){
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i cls = _mm_and_si128(_mm_shuffle_epi8(low, _mm_and_si128(v, nibble)),
+				_mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+    r.whitespace |= mask_sse(cls, NIBBLE_WHITESPACE) << i;
+    r.paren |= mask_sse(cls, NIBBLE_PAREN) << i;
+    r.quote |= mask_sse(cls, NIBBLE_QUOTE) << i;
+    r.end |= mask_sse(cls, NIBBLE_END) << i;
+  }
+  *c = r;
+}
+
+AVX2_ATTR static inline u64 mask_avx2(__m256i cls, u8 bits){
+  __m256i none = _mm256_cmpeq_epi8(_mm256_and_si256(cls, _mm256_set1_epi8(bits)), _mm256_setzero_si256());
+  return (u32)~_mm256_movemask_epi8(none);
+}
+
+AVX2_ATTR static void classify_avx2(const u8 * p, lex_classes * c){
+  // the shuffle is done within each 128 bit lane, so both get the table.
+  const __m256i low = _mm256_setr_epi8(NIBBLE_LOW, NIBBLE_LOW);
+  const __m256i high = _mm256_setr_epi8(NIBBLE_HIGH, NIBBLE_HIGH);
+  const __m256i nibble = _mm256_set1_epi8(0x0f);
+  lex_classes r = {0};
+  for(int i = 0; i < LEX_BLOCK; i += 32){
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i cls = _mm256_and_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(v, nibble)),
+				   _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    r.whitespace |= mask_avx2(cls, NIBBLE_WHITESPACE) << i;
+    r.paren |= mask_avx2(cls, NIBBLE_PAREN) << i;
+    r.quote |= mask_avx2(cls, NIBBLE_QUOTE) << i;
+    r.end |= mask_avx2(cls, NIBBLE_END) << i;
+  }
+  *c = r;
+}
+#endif
+
+static void (* const classifiers[JAMLISP_SIMD_LEVELS])(const u8 * p, lex_classes * c) = {
+  [JAMLISP_SIMD_SCALAR] = classify_scalar,
+#if LEXER_X86
+  [JAMLISP_SIMD_SSE] = classify_sse,
+  [JAMLISP_SIMD_AVX2] = classify_avx2,
+#endif
+};
+
+void jamlisp_lexer_init(jamlisp_lexer * lx, const char * source, size_t size, jamlisp_simd_level level){
+  if(size > UINT32_MAX){
+    ERROR("The lexer takes at most 4 GB of source\n");
+    size = UINT32_MAX;
+  }
+  *lx = (jamlisp_lexer){.source = source, .size = size, .level = level};
+}
+
+// bit i is set if there is an odd number of bits at or below i.
+static inline u64 prefix_xor(u64 x){
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
+
+static void lexer_done(jamlisp_lexer * lx, size_t end){
+  lx->done = true;
+  lx->offset = end;
+  if(lx->in_string)
+    lx->error = true;
+}
+
+// the end of the source, an atom running up to it is a token.
+static size_t lexer_finish(jamlisp_lexer * lx, jamlisp_token * tokens){
+  size_t count = 0;
+  if(lx->in_atom)
+    tokens[count++] = (jamlisp_token){.offset = lx->atom_start, .length = lx->size - lx->atom_start};
+  lx->in_atom = false;
+  lexer_done(lx, lx->size);
+  return count;
+}
+
+// reads the tokens of the block at lx->offset into 'tokens', at most
+// LEX_BLOCK + 1 of them. A block at the end of the source is only the bytes
+// up to it, an atom or string still open there goes on in the next block.
+static size_t lex_block(jamlisp_lexer * lx, jamlisp_token * tokens){
+  size_t base = lx->offset;
+  size_t n = MIN(lx->size - base, (size_t)LEX_BLOCK);
+  const u8 * p = (const u8 *) lx->source + base;
+  u8 padded[LEX_BLOCK];
+  if(n < LEX_BLOCK){
+    memset(padded, 0, sizeof(padded));
+    memcpy(padded, p, n);
+    p = padded;
+  }
+  u64 valid = n == LEX_BLOCK ? ~0ULL : (1ULL << n) - 1;
+  lex_classes c;
+  classifiers[lx->level](p, &c);
+  // from an opening quote up to the closing one.
+  u64 string = prefix_xor(c.quote) ^ (lx->in_string ? ~0ULL : 0);
+  u64 delimiter = (c.whitespace | c.paren | c.end) & ~string;
+  u64 atom = ~delimiter & valid;
+  u64 before = (atom << 1) | lx->in_atom;
+  u64 starts = atom & ~before;
+  u64 ends = delimiter & before & valid;
+  u64 parens = c.paren & ~string & valid;
+  u64 stops = c.end & ~string & valid;
+  lx->in_string = (string >> (n - 1)) & 1;
+  lx->in_atom = (atom >> (n - 1)) & 1;
+  size_t count = 0;
+  u64 events = starts | ends | parens | stops;
+  while(events != 0){
+    int i = __builtin_ctzll(events);
+    u64 bit = 1ULL << i;
+    events &= events - 1;
+    size_t offset = base + i;
+    if(starts & bit){
+      lx->atom_start = offset;
+      continue;
+    }
+    if(ends & bit)
+      tokens[count++] = (jamlisp_token){.offset = lx->atom_start, .length = offset - lx->atom_start};
+    if(parens & bit)
+      tokens[count++] = (jamlisp_token){.offset = offset, .length = 1};
+    if(stops & bit){
+      lx->in_atom = false;
+      lx->in_string = false;
+      if(lx->source[offset] == 0){
+	lexer_done(lx, offset);
+      }else{
+	// a comment, skipped by jamlisp_lex up to the end of the line.
+	lx->in_comment = true;
+	lx->offset = offset + 1;
+      }
+      return count;
+    }
+  }
+  lx->offset = base + n;
+  return count;
+}
+
+size_t jamlisp_lex(jamlisp_lexer * lx, jamlisp_token * tokens, size_t capacity){
+  ASSERT(capacity >= JAMLISP_LEX_MIN_TOKENS);
+  size_t count = 0;
+  while(!lx->done && capacity - count >= JAMLISP_LEX_MIN_TOKENS){
+    if(lx->in_comment){
+      const char * line = memchr(lx->source + lx->offset, '\n', lx->size - lx->offset);
+      lx->in_comment = line == NULL;
+      lx->offset = line == NULL ? lx->size : (size_t)(line - lx->source);
+    }
+    if(lx->offset == lx->size){
+      // more source may follow a partial one.
+      if(!lx->partial)
+	count += lexer_finish(lx, tokens + count);
+      break;
+    }
+    count += lex_block(lx, tokens + count);
+  }
+  return count;
+}
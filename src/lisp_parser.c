@@ -13,339 +13,697 @@
 #include "jamlisp.h"
 
 
+// tokens read from the lexer at a time.
+#define LISP_TOKENS 512
+// parse_sub recurses once per nested form.
+#define LISP_MAX_NESTING 10000
+
+// The tokens of the source are read from the lexer in batches, an atom is
+// read in place from the source.
 typedef struct{
-  io_reader * rd;
+  jamlisp_lexer lexer;
+  jamlisp_token tokens[LISP_TOKENS];
+  size_t count;
+  size_t next;
+  // the end of the last token read.
   size_t offset;
   int error;
-}string_reader;
+}lisp_reader;
 
-void fix_reader(string_reader rd){
-  ASSERT(rd.error == 0);
-  var rd2 = rd.rd;
-  size_t loc = io_offset(rd2);
-  if(loc > rd.offset){
-    io_rewind(rd2, loc -rd.offset);
-  }else if(loc < rd.offset){
-    io_advance(rd2, rd.offset - loc);
+static inline bool is_digit(char c){
+  return c >= '0' && c <= '9';
+}
+
+io_reader io_from_bytes(const void * bytes, size_t size){
+  io_reader rd = {.data = (void *) bytes, .offset = 0, .size = size}; 
+  return rd;
+}
+
+static const jamlisp_token * peek_token(lisp_reader * rd){
+  if(rd->next == rd->count){
+    rd->count = jamlisp_lex(&rd->lexer, rd->tokens, LISP_TOKENS);
+    rd->next = 0;
+    if(rd->lexer.error)
+      rd->error = 1;
+    if(rd->count == 0)
+      return NULL;
   }
-  ASSERT(rd.offset == io_offset(rd2));
+  return rd->tokens + rd->next;
 }
 
-string_reader read_until(string_reader rd, io_writer * writer, bool (* f)(char c)){
-  var rd2 = rd.rd;
-  fix_reader(rd);
-  
-  while(true){
-    var ch = io_peek_u8(rd2);
-    if(f(ch)) break;
-    if(writer != NULL)
-      io_write_u8(writer, ch);
-    io_advance(rd.rd, 1);
-    rd.offset += 1;
+// the first character of the next token, 0 at the end.
+static char peek_char(lisp_reader * rd){
+  var token = peek_token(rd);
+  return token == NULL ? 0 : rd->lexer.source[token->offset];
+}
+
+static void next_token(lisp_reader * rd){
+  var token = rd->tokens[rd->next++];
+  rd->offset = token.offset + token.length;
+}
+
+// reads the next atom, a paren or the end is not one and gives 0.
+static size_t read_token(lisp_reader * rd, const char ** token){
+  char c = peek_char(rd);
+  if(c == 0 || c == '(' || c == ')'){
+    *token = NULL;
+    return 0;
   }
-  return rd;
+  var t = rd->tokens[rd->next];
+  *token = rd->lexer.source + t.offset;
+  next_token(rd);
+  return t.length;
 }
 
+static bool token_is(const char * token, size_t length, const char * name){
+  return strlen(name) == length && memcmp(token, name, length) == 0;
+}
 
-static __thread bool (* current_f)(char c);
-bool not_current_f(char c){
-  return !current_f(c);
+// a decimal integer token. Sets overflow when it does not fit in an i64.
+static bool parse_integer(const char * token, size_t length, i64 * out, bool * overflow){
+  bool negative = length > 0 && token[0] == '-';
+  if(length == (size_t)negative)
+    return false;
+  u64 r = 0;
+  *overflow = false;
+  for(size_t i = negative; i < length; i++){
+    char c = token[i];
+    if(!is_digit(c))
+      return false;
+    if(__builtin_mul_overflow(r, 10, &r) || __builtin_add_overflow(r, (u64)(c - '0'), &r))
+      *overflow = true;
+  }
+  if(r > (u64)INT64_MAX + negative)
+    *overflow = true;
+  *out = negative ? (i64)(0 - r) : (i64)r;
+  return true;
 }
 
-string_reader read_while(string_reader rd, io_writer * writer, bool (* f)(char c)){
-  current_f = f;
-  return read_until(rd, writer, not_current_f);
+static void write_node(io_writer * write, jamlisp_insn insn){
+  jamlisp_write_prefix_node(write, &insn);
 }
 
-static __thread char selected_char;
-bool check_selected_char(char c){
-  return selected_char == c;
+// digits per INT in an integer literal that does not fit in an INT64.
+#define LITERAL_CHUNK_DIGITS 12
+
+// a literal too large for INT64 is computed from chunks of 12 digits:
+// c0 * 10^12 + c1 is ADD MUL INT c0 INT 10^12 INT c1, which the numeric tower
+// turns into a bignum.
+static void write_big_integer(io_writer * write, const char * digits, size_t length){
+  bool negative = digits[0] == '-';
+  if(negative){
+    digits += 1;
+    length -= 1;
+  }
+  size_t chunks = (length + LITERAL_CHUNK_DIGITS - 1) / LITERAL_CHUNK_DIGITS;
+  for(size_t i = 1; i < chunks; i++){
+    io_write_u8(write, JAMLISP_OPCODE_ADD);
+    io_write_u8(write, JAMLISP_OPCODE_MUL);
+  }
+  size_t offset = 0;
+  for(size_t i = 0; i < chunks; i++){
+    size_t len = i == 0 ? length - (chunks - 1) * LITERAL_CHUNK_DIGITS : LITERAL_CHUNK_DIGITS;
+    i64 chunk = 0;
+    for(size_t j = 0; j < len; j++)
+      chunk = chunk * 10 + (digits[offset + j] - '0');
+    offset += len;
+    if(i > 0)
+      write_node(write, (jamlisp_insn){.opcode = JAMLISP_OPCODE_INT, .int64 = 1000000000000LL});
+    write_node(write, (jamlisp_insn){.opcode = JAMLISP_OPCODE_INT, .int64 = negative ? -chunk : chunk});
+  }
 }
 
-string_reader read_untilc(string_reader rd, io_writer * writer, char c){
-  selected_char = c;
-  return read_until(rd, writer, check_selected_char);
+typedef struct{
+  // offset in code the header goes in front of.
+  size_t position;
+  // the header bytes in headers.
+  u32 offset;
+  u32 length;
+}lisp_header;
+
+// The code of a function or a top level form. Nodes are written to 'code' as
+// they are read. A node that depends on its children, a call on its argument
+// count and an IF on the size of its branches, opens a header before them and
+// writes it to 'headers' when it is closed. lisp_code_finish then splices the
+// headers in, so every byte is copied once however deep the code is nested.
+typedef struct{
+  io_writer code;
+  io_writer headers;
+  // in the order they were opened, which is the order of their positions.
+  lisp_header * slots;
+  size_t slot_count;
+  size_t slot_capacity;
+  // bytes in the closed headers.
+  size_t header_bytes;
+  // the CALL headers in tail position of the form being compiled, they are
+  // made TAILCALLs when it turns out to be the last form of the function.
+  u32 * tail_calls;
+  size_t tail_count;
+  size_t tail_capacity;
+  // the arena of the context while a checkpoint is active, see scratch_grow.
+  jamlisp_arena * arena;
+}lisp_code;
+
+// The scratch arrays of the parser are bump allocated from the arena while a
+// checkpoint is active and dropped by its rewind, otherwise they are malloc'd.
+static void scratch_grow(jamlisp_arena * arena, void ** data, size_t elem_size, size_t * capacity, size_t count){
+  if(arena == NULL){
+    ensure_size2(data, elem_size, capacity, count, 1.5);
+    return;
+  }
+  if(count < *capacity)
+    return;
+  size_t new_capacity = MAX(8, *capacity * 2);
+  void * grown = jamlisp_block_alloc(arena, new_capacity * elem_size);
+  if(count > 0)
+    memcpy(grown, *data, count * elem_size);
+  *data = grown;
+  *capacity = new_capacity;
 }
 
-string_reader skip_until(string_reader rd, bool (*f)(char c)){
-  return read_until(rd, NULL, f);
+static void scratch_free(jamlisp_arena * arena, void * data){
+  if(arena == NULL)
+    free(data);
 }
 
-string_reader skip_untilc(string_reader rd, char c){
-  return read_untilc(rd, NULL, c);
+// the byte writers can not be bump allocated, they grow with realloc. While a
+// checkpoint is active they are kept in ctx->parser_writers for the next load
+// instead of being freed.
+static io_writer writer_take(jamlisp_context * ctx, jamlisp_arena * arena){
+  if(arena != NULL && ctx->parser_writer_count > 0)
+    return ctx->parser_writers[--ctx->parser_writer_count];
+  return (io_writer){0};
 }
 
-string_reader skip_while(string_reader rd, bool (*f)(char c)){
-  return read_while(rd, NULL, f);
+static void writer_give(jamlisp_context * ctx, jamlisp_arena * arena, io_writer * writer){
+  if(arena == NULL){
+    io_writer_clear(writer);
+    return;
+  }
+  io_reset(writer);
+  *(io_writer *) alloc_elems((void **) &ctx->parser_writers, sizeof(ctx->parser_writers[0]), &ctx->parser_writer_count, &ctx->parser_writer_capacity, 1) = *writer;
+  *writer = (io_writer){0};
 }
 
-bool is_digit(char c){
-  return c >= '0' && c <= '9';
+// a point in the code, the distance between two is the size of the code
+// compiled between them.
+typedef struct{
+  size_t code;
+  size_t headers;
+}lisp_mark;
+
+static u32 header_open(lisp_code * code){
+  scratch_grow(code->arena, (void **) &code->slots, sizeof(code->slots[0]), &code->slot_capacity, code->slot_count);
+  code->slots[code->slot_count] = (lisp_header){.position = code->code.offset};
+  return code->slot_count++;
 }
 
-bool is_alpha(char c){
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+// the header of the slot is what is written to the returned writer until
+// header_close.
+static io_writer * header_begin(lisp_code * code, u32 slot){
+  code->slots[slot].offset = code->headers.offset;
+  return &code->headers;
 }
 
-bool is_alphanum(char c){
-  return is_digit(c) || is_alpha(c);
+static void header_close(lisp_code * code, u32 slot){
+  var header = &code->slots[slot];
+  header->length = code->headers.offset - header->offset;
+  code->header_bytes += header->length;
 }
 
-bool is_whitespace(char c){
-  return c == ' ' || c == '\t' || c == '\n';
+static lisp_mark code_mark(const lisp_code * code){
+  return (lisp_mark){.code = code->code.offset, .headers = code->header_bytes};
 }
 
-bool is_hex(char c){
-  return is_digit(c) || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+static u32 code_size(const lisp_code * code, lisp_mark from){
+  return (code->code.offset - from.code) + (code->header_bytes - from.headers);
 }
 
-bool is_endexpr(char c){
-  return c == ')' || c == '(' || is_whitespace(c) || c == 0 || c ==';';
+static void write_bytes(io_writer * write, const void * data, size_t size){
+  if(size > 0)
+    io_write(write, data, size);
 }
 
-u8 next_byte(string_reader rd){
-  fix_reader(rd);
-  
-  var rd2 = rd.rd;
-  return io_peek_u8(rd2);  
+static void lisp_code_finish(lisp_code * code, io_writer * write){
+  const u8 * data = code->code.data;
+  const u8 * headers = code->headers.data;
+  size_t position = 0;
+  for(size_t i = 0; i < code->slot_count; i++){
+    var slot = code->slots[i];
+    write_bytes(write, data + position, slot.position - position);
+    write_bytes(write, headers + slot.offset, slot.length);
+    position = slot.position;
+  }
+  write_bytes(write, data + position, code->code.offset - position);
 }
 
-io_reader io_from_bytes(const void * bytes, size_t size){
-  io_reader rd = {.data = (void *) bytes, .offset = 0, .size = size}; 
-  return rd;
+static void lisp_code_init(jamlisp_context * ctx, lisp_code * code, jamlisp_arena * arena){
+  *code = (lisp_code){.arena = arena};
+  code->code = writer_take(ctx, arena);
+  code->headers = writer_take(ctx, arena);
+}
+
+static void lisp_code_clear(jamlisp_context * ctx, lisp_code * code){
+  writer_give(ctx, code->arena, &code->code);
+  writer_give(ctx, code->arena, &code->headers);
+  scratch_free(code->arena, code->slots);
+  scratch_free(code->arena, code->tail_calls);
+}
+
+// Lexical scope of the code being compiled. Every node leaves one value on the
+// value stack, so a variable lives in the slot at the stack depth where its
+// init value was pushed and is read with LOCAL slot.
+typedef struct{
+  u32 symbol;
+  u32 slot;
+}lisp_local;
+
+typedef struct{
+  lisp_code code;
+  lisp_local * locals;
+  size_t count;
+  size_t capacity;
+  // values pushed above local_base before the current node.
+  u32 depth;
+  // the next node may be the last thing done by a function, so a call there
+  // can be a TAILCALL. parse_sub clears it.
+  bool tail;
+}lisp_scope;
+
+typedef struct{
+  jamlisp_context * ctx;
+  lisp_reader rd;
+  // the name of the symbol being interned.
+  io_writer name;
+  // the symbol nil, interned when it is first needed.
+  u32 nil;
+  jamlisp_arena * arena;
+  // forms parse_sub is inside of.
+  u32 nesting;
+  // the error was reported where it was found, the enclosing forms only
+  // stop.
+  bool reported;
+}lisp_parser;
+
+static void parse_sub(lisp_parser * ps, lisp_scope * scope);
+
+// *name* variables are special, they are bound dynamically in symbol_values.
+static bool is_special_name(const char * name, size_t len){
+  return len > 2 && name[0] == '*' && name[len - 1] == '*';
+}
+
+static void scope_add(lisp_scope * scope, u32 symbol, u32 slot){
+  scratch_grow(scope->code.arena, (void **) &scope->locals, sizeof(scope->locals[0]), &scope->capacity, scope->count);
+  scope->locals[scope->count++] = (lisp_local){.symbol = symbol, .slot = slot};
+}
+
+static void write_variable(lisp_scope * scope, u32 symbol){
+  for(size_t i = scope->count; i > 0; i--){
+    if(scope->locals[i - 1].symbol == symbol){
+      write_node(&scope->code.code, (jamlisp_insn){.opcode = JAMLISP_OPCODE_LOCAL, .local = scope->locals[i - 1].slot});
+      return;
+    }
+  }
+  write_node(&scope->code.code, (jamlisp_insn){.opcode = JAMLISP_OPCODE_GLOBAL, .call = symbol});
+}
+
+static void write_nil(lisp_parser * ps, lisp_scope * scope){
+  if(ps->nil == 0)
+    ps->nil = JAMLISP_SYMBOL_ID(jamlisp_symbol(ps->ctx, "nil"));
+  write_variable(scope, ps->nil);
+}
+
+// interns a token, jamlisp_symbol takes a NUL terminated name.
+static u32 token_symbol(lisp_parser * ps, const char * token, size_t length){
+  io_reset(&ps->name);
+  io_write(&ps->name, token, length);
+  io_write_u8(&ps->name, 0);
+  return JAMLISP_SYMBOL_ID(jamlisp_symbol(ps->ctx, ps->name.data));
+}
+
+static size_t read_name(lisp_parser * ps, const char ** name){
+  size_t length = read_token(&ps->rd, name);
+  if(length == 0)
+    ps->rd.error = 1;
+  return length;
+}
+
+static void expect_char(lisp_parser * ps, char c){
+  if(peek_char(&ps->rd) != c)
+    ps->rd.error = 1;
+  else
+    next_token(&ps->rd);
+}
+
+// true if the next token is the ')' closing the current form.
+static bool at_close(lisp_parser * ps){
+  return peek_char(&ps->rd) == ')';
 }
 
-string_reader read_str(string_reader rd, io_writer * writeto){
-  rd = skip_while(rd, is_whitespace);
-  var rd2 = rd.rd;
-  var ch1 = io_peek_u8(rd2);
-  if(ch1 != '"'){
-    rd.error = 1;
-    return rd;
+// compiles the body forms up to the closing ')'. The variables in 'specials'
+// have their value in the given slots and are bound around the body, more
+// than one form is wrapped in a LET without variables. With 'tail' the last
+// form is in tail position, unless there are specials to unbind after it.
+static void parse_body(lisp_parser * ps, lisp_scope * scope, const lisp_local * specials, size_t special_count, bool tail){
+  var code = &scope->code;
+  u32 depth = scope->depth;
+  for(size_t i = 0; i < special_count; i++){
+    write_node(&code->code, (jamlisp_insn){.opcode = JAMLISP_OPCODE_BIND, .call = specials[i].symbol});
+    write_node(&code->code, (jamlisp_insn){.opcode = JAMLISP_OPCODE_LOCAL, .local = specials[i].slot});
   }
-  io_advance(rd2, 1);
+  u32 header = header_open(code);
+  u32 form_count = 0;
   while(true){
-    var ch = io_read_u8(rd2);
-    if(ch == '"'){
-      if(io_peek_u8(rd2) == '"'){
-	io_advance(rd2, 1);
-      }else{
-	break;
-      }
+    if(at_close(ps)){
+      next_token(&ps->rd);
+      break;
     }
-    io_write_u8(writeto, ch);
+    // the calls in tail position are kept if this is the last form.
+    size_t tail_count = code->tail_count;
+    scope->tail = tail && special_count == 0;
+    parse_sub(ps, scope);
+    if(ps->rd.error)
+      break;
+    if(!at_close(ps))
+      code->tail_count = tail_count;
+    form_count += 1;
+    scope->depth += 1;
   }
-  rd.offset = io_offset(rd2);
-  
-  return rd;
+  scope->depth = depth;
+  if(form_count == 0)
+    write_nil(ps, scope);
+  var write = header_begin(code, header);
+  if(form_count > 1)
+    write_node(write, (jamlisp_insn){.opcode = JAMLISP_OPCODE_LET, .child_count = form_count});
+  header_close(code, header);
 }
 
-
-string_reader read_hex(string_reader rd, io_writer * buffer, u64 * out){
-  u64 r = 0;
-  io_reset(buffer);
-  rd = read_until(rd, buffer, is_endexpr);
-  char * str = buffer->data;
-  
-  for(size_t i = 0; i < buffer->offset; i++){
-    var c = str[i];
-    if(i == 0 && c == '0' && str[1] == 'x'){
-      i++;
-      continue;
+// (let ((var init) ...) body...). The init values are the slots of the
+// variables, the LET drops them when the body is done.
+static void parse_let(lisp_parser * ps, lisp_scope * scope, bool tail){
+  var code = &scope->code;
+  size_t scope_count = scope->count;
+  u32 depth = scope->depth;
+  u32 header = header_open(code);
+  lisp_local * vars = NULL;
+  size_t var_count = 0, var_capacity = 0;
+  lisp_local * specials = NULL;
+  size_t special_count = 0, special_capacity = 0;
+  expect_char(ps, '(');
+  while(ps->rd.error == 0){
+    if(at_close(ps)){
+      next_token(&ps->rd);
+      break;
     }
-    if(!is_hex(str[i])){
-      rd.error = 1;
+    bool has_init = peek_char(&ps->rd) == '(';
+    if(has_init)
+      next_token(&ps->rd);
+    const char * name;
+    size_t length = read_name(ps, &name);
+    if(ps->rd.error)
       break;
+    u32 symbol = token_symbol(ps, name, length);
+    bool special = is_special_name(name, length);
+    // the init values are compiled in the outer scope.
+    if(has_init && !at_close(ps)){
+      parse_sub(ps, scope);
+    }else{
+      write_nil(ps, scope);
     }
-    u64 v = 0;
-    if(c >= '0' && c <= '9'){
-      v = c - '0';
-    }else if(c >= 'a' && c <= 'f'){
-      v = c - 'a' + 10;
-    }else if(c >= 'A' && c <= 'F'){
-      v = c - 'A' + 10;    
+    if(has_init)
+      expect_char(ps, ')');
+    lisp_local local = {.symbol = symbol, .slot = scope->depth};
+    if(special){
+      scratch_grow(ps->arena, (void **) &specials, sizeof(specials[0]), &special_capacity, special_count);
+      specials[special_count++] = local;
     }else{
-      ERROR("This is impossible!");
+      scratch_grow(ps->arena, (void **) &vars, sizeof(vars[0]), &var_capacity, var_count);
+      vars[var_count++] = local;
     }
-    r = (r << 4) | v;
+    scope->depth += 1;
   }
-  *out = r;
-  return rd;
+  for(size_t i = 0; i < var_count; i++)
+    scope_add(scope, vars[i].symbol, vars[i].slot);
+  if(ps->rd.error == 0)
+    parse_body(ps, scope, specials, special_count, tail);
+  write_node(header_begin(code, header), (jamlisp_insn){.opcode = JAMLISP_OPCODE_LET, .child_count = var_count + special_count + 1});
+  header_close(code, header);
+  scope->count = scope_count;
+  scope->depth = depth;
+  scratch_free(ps->arena, vars);
+  scratch_free(ps->arena, specials);
 }
 
-string_reader read_f64(string_reader rd, io_writer * buffer, f64 * out){
-  io_reset(buffer);
-  rd = skip_while(rd, is_whitespace);
-  rd = read_until(rd, buffer, is_endexpr);
-  io_write_u8(buffer, 0);
-  char * str = buffer->data;
-  char * tail = NULL;
-  
-  *out = strtod(str, &tail);
-  if(*str == 0 || tail != (str + buffer->offset - 1)){
-    logd("Done!\n");
-    rd.error = 1;
-  }
-  return rd;
-}
-
-
-string_reader read_integer(string_reader rd, io_writer * buffer, i64 * out){
-  i64 r = 0;
-  bool negative = false;
-  io_reset(buffer);
-  rd = skip_while(rd, is_whitespace);
-  rd = read_until(rd, buffer, is_endexpr);
-  if(buffer->offset == 0){
-    rd.error = 1;
-    return rd;
-  }
-  char * str = buffer->data;
-  for(size_t i = 0; i < buffer->offset; i++){
-    var c = str[i];
-
-    if(c == '-'){
-      negative = true;
-      continue;
+// (defun name (args...) body...). The arguments are the first slots of the
+// function, the code is bound to the symbol with jamlisp_load_fcn_bytecode.
+static void parse_defun(lisp_parser * ps, lisp_scope * outer){
+  const char * name;
+  size_t length = read_name(ps, &name);
+  if(ps->rd.error)
+    return;
+  u32 function = token_symbol(ps, name, length);
+  lisp_scope scope = {0};
+  lisp_code_init(ps->ctx, &scope.code, ps->arena);
+  lisp_local * specials = NULL;
+  size_t special_count = 0, special_capacity = 0;
+  expect_char(ps, '(');
+  while(ps->rd.error == 0){
+    if(at_close(ps)){
+      next_token(&ps->rd);
+      break;
     }
-    if(!is_digit(str[i])){
-      //ERROR("CANNOT read integer");
-      rd.error = 1;
+    length = read_name(ps, &name);
+    if(ps->rd.error)
       break;
+    u32 symbol = token_symbol(ps, name, length);
+    if(is_special_name(name, length)){
+      scratch_grow(ps->arena, (void **) &specials, sizeof(specials[0]), &special_capacity, special_count);
+      specials[special_count++] = (lisp_local){.symbol = symbol, .slot = scope.depth};
+    }else{
+      scope_add(&scope, symbol, scope.depth);
     }
-    u64 v = 0;
-    if(c >= '0' && c <= '9'){
-      v = c - '0';
+    scope.depth += 1;
+  }
+  if(ps->rd.error == 0)
+    parse_body(ps, &scope, specials, special_count, true);
+  if(ps->rd.error == 0){
+    var code = &scope.code;
+    // the opcode byte of a CALL is turned into the TAILCALL of the same size.
+    for(size_t i = 0; i < code->tail_count; i++){
+      u8 * opcode = (u8 *) code->headers.data + code->slots[code->tail_calls[i]].offset;
+      if(*opcode == JAMLISP_OPCODE_CALL)
+	*opcode = JAMLISP_OPCODE_TAILCALL;
+      else
+	*opcode += JAMLISP_CODE_TAILCALL_SMALL - JAMLISP_CODE_CALL_SMALL;
+    }
+    io_writer bytecode = writer_take(ps->ctx, ps->arena);
+    lisp_code_finish(code, &bytecode);
+    jamlisp_load_fcn_bytecode(ps->ctx, JAMLISP_MAKE_SYMBOL(function), bytecode.data, bytecode.offset);
+    writer_give(ps->ctx, ps->arena, &bytecode);
+  }
+  // the value of a defun is the function.
+  write_node(&outer->code.code, (jamlisp_insn){.opcode = JAMLISP_OPCODE_GLOBAL, .call = function});
+  scratch_free(ps->arena, scope.locals);
+  scratch_free(ps->arena, specials);
+  lisp_code_clear(ps->ctx, &scope.code);
+}
+
+// (if cond then else). The condition is popped before the branch runs, so
+// both branches start at the same depth.
+static void parse_if(lisp_parser * ps, lisp_scope * scope, bool tail){
+  var code = &scope->code;
+  u32 header = header_open(code);
+  u32 branch_size[3] = {0};
+  for(int i = 0; i < 3 && ps->rd.error == 0; i++){
+    lisp_mark mark = code_mark(code);
+    if(i > 0 && at_close(ps)){
+      write_nil(ps, scope);
     }else{
-      ERROR("This is impossible!");
+      scope->tail = tail && i > 0;
+      parse_sub(ps, scope);
     }
-    r = (r * 10) + v;
+    branch_size[i] = code_size(code, mark);
   }
-  *out = negative ? -r : r;
-  return rd;
+  if(ps->rd.error == 0)
+    expect_char(ps, ')');
+  var write = header_begin(code, header);
+  write_node(write, (jamlisp_insn){.opcode = JAMLISP_OPCODE_IF, .then_size = branch_size[1], .else_size = branch_size[2]});
+  header_close(code, header);
 }
 
+// a call to a primitive becomes its opcode when it has one for this number of
+// arguments, a variadic call to a binary opcode is folded from the left:
+// (+ a b c) is ADD ADD a b c. Otherwise it is a PRIMITIVE node. Primitives are
+// resolved here, so redefining one does not change already compiled code.
+static void write_primitive_call(jamlisp_context * ctx, io_writer * write, const jamlisp_primitive * p, u32 index, u32 arg_count){
+  if(p->opcode != JAMLISP_OPCODE_NONE && arg_count >= p->min_args && arg_count <= p->max_args){
+    var arg_count2 = jamlisp_get_opcodedef(ctx, p->opcode).arg_count;
+    u32 nodes = 0;
+    if(arg_count == arg_count2)
+      nodes = 1;
+    else if(arg_count2 == 2 && arg_count > 2 && p->max_args == JAMLISP_VARIADIC)
+      nodes = arg_count - 1;
+    for(u32 i = 0; i < nodes; i++)
+      io_write_u8(write, p->opcode);
+    if(nodes > 0)
+      return;
+  }
+  write_node(write, (jamlisp_insn){.opcode = JAMLISP_OPCODE_PRIMITIVE, .call = index, .child_count = arg_count});
+}
 
-string_reader parse_sub(jamlisp_context * ctx, string_reader rd, io_writer * write){
-  rd = skip_while(rd, is_whitespace);
-  io_writer name_buffer = {0};
-  {
+// true if every call to 'p' with more than two arguments is folded into its
+// binary opcode, so only one argument before the current one is on the stack.
+static bool primitive_folds(jamlisp_context * ctx, const jamlisp_primitive * p){
+  return p != NULL && p->opcode != JAMLISP_OPCODE_NONE && p->max_args == JAMLISP_VARIADIC && p->min_args <= 3
+    && jamlisp_get_opcodedef(ctx, p->opcode).arg_count == 2;
+}
+
+static void parse_form(lisp_parser * ps, lisp_scope * scope){
+  var rd = &ps->rd;
+  var code = &scope->code;
+  bool tail = scope->tail;
+  scope->tail = false;
+  if(peek_char(rd) != '('){
+    const char * token;
+    size_t length = read_name(ps, &token);
+    if(rd->error)
+      return;
     i64 integer;
-    string_reader rd_int = read_integer(rd, &name_buffer, &integer);
-    if(rd_int.error == 0){
-      logd("LOAD int: %i\n", integer);
-      io_write_u8(write, JAMLISP_OPCODE_INT);
-      io_write_i64_leb(write, integer);
-
-      io_writer_clear(&name_buffer);
-      io_write_u32_leb(write, JAMLISP_MAGIC);
-      return rd_int;
+    bool overflow;
+    if(parse_integer(token, length, &integer, &overflow)){
+      JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "LOAD int: %i\n", integer);
+      if(overflow || !JAMLISP_INT64_FITS(integer)){
+        write_big_integer(&code->code, token, length);
+      }else{
+        write_node(&code->code, (jamlisp_insn){.opcode = JAMLISP_OPCODE_INT, .int64 = integer});
+      }
+      return;
     }
+    // a variable.
+    write_variable(scope, token_symbol(ps, token, length));
+    return;
+  }
+  next_token(rd);
+
+  const char * head;
+  size_t head_length = read_name(ps, &head);
+  if(rd->error)
+    return;
+  if(token_is(head, head_length, "let")){
+    parse_let(ps, scope, tail);
+    return;
+  }
+  if(token_is(head, head_length, "if")){
+    parse_if(ps, scope, tail);
+    return;
+  }
+  if(token_is(head, head_length, "defun")){
+    parse_defun(ps, scope);
+    return;
   }
-  rd = skip_untilc(rd, '(');
-  rd.offset += 1;
-  
-
-  var rd4 = read_until(rd, &name_buffer, is_endexpr);
-  ASSERT(!rd4.error);
-  io_write_u8(&name_buffer, 0);
 
-  jamlisp_object sym = jamlisp_symbol(ctx, name_buffer.data);
-  logd("SYMBOL: %s\n", name_buffer.data);
-  io_reset(&name_buffer);
-  string_reader rd_after;
-  rd4 = skip_while(rd4, is_whitespace);
-  
-  rd_after = rd4;
-  io_reset(&name_buffer);
+  u32 sym = token_symbol(ps, head, head_length);
+  JAMLISP_TRACE(JAMLISP_TRACE_VERBOSE, "SYMBOL: %s\n", ps->name.data);
+  u32 header = header_open(code);
   u32 child_count = 0;
+  u32 depth = scope->depth;
+  u32 primitive_index;
+  var primitive = jamlisp_symbol_primitive(ps->ctx, JAMLISP_MAKE_SYMBOL(sym), &primitive_index);
+  bool folds = primitive_folds(ps->ctx, primitive);
   while(true){
-    var rd2 = skip_while(rd_after, is_whitespace);
-    
-    char next = next_byte(rd2);
-    if(next == ')'){
-      rd2.offset += 1;
-      rd_after = rd2;
+    if(at_close(ps)){
+      next_token(rd);
       break;
     }
-    rd2 = parse_sub(ctx, rd2, &name_buffer);
-    if(rd2.error != 0){
-      ERROR("could not parse sub expression\n");
+    parse_sub(ps, scope);
+    if(rd->error != 0){
+      if(!ps->reported)
+	ERROR("could not parse sub expression\n");
+      ps->reported = true;
       break;
     }
-    rd_after = rd2;
     child_count += 1;
+    // the arguments before this one are on the stack, for a folded call
+    // only the value of the ones before.
+    scope->depth = folds ? depth + 1 : scope->depth + 1;
   }
-  io_write_u32_leb(write, JAMLISP_OPCODE_CALL);
-  io_write_u32_leb(write, sym.symbol);
-  io_write_u32_leb(write, child_count);
-  io_write_u32_leb(write, JAMLISP_MAGIC);
-  
-  io_write(write, name_buffer.data, name_buffer.offset);
-  io_writer_clear(&name_buffer);
-  return rd_after;
+  scope->depth = depth;
+  var write = header_begin(code, header);
+  if(primitive != NULL){
+    write_primitive_call(ps->ctx, write, primitive, primitive_index, child_count);
+  }else{
+    if(tail){
+      scratch_grow(code->arena, (void **) &code->tail_calls, sizeof(code->tail_calls[0]), &code->tail_capacity, code->tail_count);
+      code->tail_calls[code->tail_count++] = header;
+    }
+    write_node(write, (jamlisp_insn){.opcode = JAMLISP_OPCODE_CALL, .call = sym, .child_count = child_count});
+  }
+  header_close(code, header);
+}
+
+// code nested deeper than LISP_MAX_NESTING is a parse error instead of a
+// stack overflow.
+static void parse_sub(lisp_parser * ps, lisp_scope * scope){
+  if(ps->nesting >= LISP_MAX_NESTING){
+    ERROR("Lisp code nested deeper than %i\n", LISP_MAX_NESTING);
+    ps->reported = true;
+    ps->rd.error = 1;
+    return;
+  }
+  ps->nesting += 1;
+  parse_form(ps, scope);
+  ps->nesting -= 1;
 }
 
+// compiles one form from the reader and advances it to the end of the form.
 void jamlisp_load_lisp(jamlisp_context * ctx, io_reader * rd, io_writer * write){
-  string_reader r = {.rd = rd, .offset = io_offset(rd)};
-  r = parse_sub(ctx, r, write);
-  if(r.error){
-    ERROR("ERROR!\n");
+  lisp_parser ps = {.ctx = ctx, .arena = ctx->arena.depth > 0 ? &ctx->arena : NULL};
+  ps.name = writer_take(ctx, ps.arena);
+  jamlisp_lexer_init(&ps.rd.lexer, (const char *) rd->data + rd->offset, rd->size - rd->offset, ctx->simd_level);
+  lisp_scope scope = {0};
+  lisp_code_init(ctx, &scope.code, ps.arena);
+  parse_sub(&ps, &scope);
+  if(ps.rd.error){
+    if(!ps.reported)
+      ERROR("ERROR!\n");
+  }else{
+    lisp_code_finish(&scope.code, write);
   }
+  io_advance(rd, ps.rd.offset);
+  scratch_free(ps.arena, scope.locals);
+  lisp_code_clear(ctx, &scope.code);
+  writer_give(ctx, ps.arena, &ps.name);
   io_write_i8(write, JAMLISP_OPCODE_NONE);
 }
 
 
 void test_jamlisp_string_reader(){
   logd("TEST Jamlisp String Reader\n");
-  const char * target = "   \n (color #112233fFff -123)";
+  const char * target = "   \n (color #112233fFff -123 \"a \"\"b\"\"\")";
 
-  io_reader rd = io_from_bytes(target, strlen(target) + 1);
-  string_reader rd2 = {.rd = &rd, .offset = 0};
-  var rd3 = skip_untilc(rd2, '(');
-  rd3.offset += 1;
-  
-  var next = next_byte(rd3);
-  ASSERT(next == 'c');
+  lisp_reader rd = {0};
+  jamlisp_lexer_init(&rd.lexer, target, strlen(target) + 1, jamlisp_simd_detect());
+  ASSERT(peek_char(&rd) == '(');
+  next_token(&rd);
 
-  next = next_byte(rd2);
-  ASSERT(next == ' ');
+  const char * token;
+  size_t length = read_token(&rd, &token);
+  ASSERT(token_is(token, length, "color"));
 
-  next = next_byte(rd3);
-  ASSERT(next == 'c');
+  length = read_token(&rd, &token);
+  ASSERT(token_is(token, length, "#112233fFff"));
   
-  io_writer symbol_writer = {0};
-  var rd4 = read_until(rd3, &symbol_writer, is_endexpr);
-  ASSERT(symbol_writer.offset == strlen("color"));
-  ASSERT(strncmp(symbol_writer.data, "color", symbol_writer.offset) == 0);
-   
-  var rd5 = skip_while(rd4, is_whitespace); 
-  var next2 = next_byte(rd5);
-  
-  ASSERT(next2 == '#');
-  rd5.offset += 1;
-  io_reset(&symbol_writer);
-  u64 hexv = 0;
-  var rd6 = read_hex(rd5, &symbol_writer, &hexv);
-  ASSERT(rd6.error == 0);
-  ASSERT(hexv == 0x112233ffff);
-
-  logd("Hex: %p\n", hexv);
-  
-  var next3 = next_byte(rd6);
-  ASSERT(next3 == ' ');
-  var rd7 = skip_while(rd6, is_whitespace);
   i64 i = 0;
-  var rd8 = read_integer(rd7, &symbol_writer, &i);
-  ASSERT(i == -123);
-  rd8 = skip_while(rd8, is_whitespace);
-  var next5 = next_byte(rd8);
-  logd("next5: '%c'\n", next5);
-  ASSERT(next5 == ')');
-  var next4 = next_byte(rd3);
-  ASSERT(next4 == 'c');
-
-  io_writer_clear(&symbol_writer);
+  bool overflow;
+  ASSERT(!parse_integer(token, length, &i, &overflow));
+  length = read_token(&rd, &token);
+  ASSERT(parse_integer(token, length, &i, &overflow));
+  ASSERT(i == -123 && !overflow);
+
+  length = read_token(&rd, &token);
+  ASSERT(token_is(token, length, "\"a \"\"b\"\"\""));
+  ASSERT(rd.error == 0);
+  ASSERT(peek_char(&rd) == ')');
   logd("OK\n");
 }
 
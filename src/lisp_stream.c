@@ -0,0 +1,127 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Streaming parser.
+// The source is given in chunks of any size. The lexer reads what has
+// arrived and the parens of its tokens are counted, when a top level form is
+// closed it is compiled with jamlisp_load_lisp and its bytecode is given to
+// the callback. Only the source of the unfinished form is kept.
+
+void jamlisp_stream_init(jamlisp_stream * stream, jamlisp_context * ctx, jamlisp_form_callback form, void * userdata){
+  *stream = (jamlisp_stream){.ctx = ctx, .form = form, .userdata = userdata};
+  jamlisp_lexer_init(&stream->lexer, NULL, 0, ctx->simd_level);
+  stream->lexer.partial = true;
+}
+
+void jamlisp_stream_clear(jamlisp_stream * stream){
+  io_writer_clear(&stream->source);
+  io_writer_clear(&stream->code);
+}
+
+static void stream_form(jamlisp_stream * stream, size_t end){
+  io_reader rd = io_from_bytes((const char *) stream->source.data + stream->form_start, end - stream->form_start);
+  io_reset(&stream->code);
+  jamlisp_load_lisp(stream->ctx, &rd, &stream->code);
+  stream->forms += 1;
+  stream->form(stream->userdata, stream->code.data, stream->code.offset);
+}
+
+static void stream_lex(jamlisp_stream * stream){
+  jamlisp_token tokens[256];
+  var lx = &stream->lexer;
+  while(!stream->error){
+    // the buffer may have moved since the last call.
+    lx->source = stream->source.data;
+    lx->size = stream->source.offset;
+    size_t count = jamlisp_lex(lx, tokens, array_count(tokens));
+    if(count == 0)
+      break;
+    for(size_t i = 0; i < count; i++){
+      var token = tokens[i];
+      char c = lx->source[token.offset];
+      if(stream->depth == 0)
+	stream->form_start = token.offset;
+      if(c == '('){
+	stream->depth += 1;
+      }else if(c == ')'){
+	if(stream->depth == 0){
+	  ERROR("Unexpected ')' in stream\n");
+	  stream->error = true;
+	  break;
+	}
+	stream->depth -= 1;
+      }
+      if(stream->depth == 0)
+	stream_form(stream, token.offset + token.length);
+    }
+  }
+  if(lx->error)
+    stream->error = true;
+}
+
+// drops the source before the unfinished form, when that is more than what
+// is kept, so every byte is moved at most once on average.
+static void stream_compact(jamlisp_stream * stream){
+  var lx = &stream->lexer;
+  size_t keep = lx->offset;
+  if(stream->depth > 0)
+    keep = stream->form_start;
+  else if(lx->in_atom)
+    keep = lx->atom_start;
+  size_t rest = stream->source.offset - keep;
+  if(keep == 0 || keep < rest)
+    return;
+  u8 * data = stream->source.data;
+  memmove(data, data + keep, rest);
+  stream->source.offset = rest;
+  lx->offset -= keep;
+  lx->atom_start -= MIN(lx->atom_start, keep);
+  stream->form_start -= MIN(stream->form_start, keep);
+}
+
+bool jamlisp_stream_feed(jamlisp_stream * stream, const void * data, size_t size){
+  if(stream->error || stream->lexer.done)
+    return !stream->error;
+  if(size > 0)
+    io_write(&stream->source, data, size);
+  stream_lex(stream);
+  stream_compact(stream);
+  return !stream->error;
+}
+
+bool jamlisp_stream_end(jamlisp_stream * stream){
+  stream->lexer.partial = false;
+  if(!stream->lexer.done)
+    stream_lex(stream);
+  if(stream->depth > 0){
+    ERROR("Unclosed form at the end of the stream\n");
+    stream->error = true;
+  }
+  return !stream->error;
+}
+
+bool jamlisp_stream_fd(jamlisp_stream * stream, int fd){
+  char buffer[1 << 16];
+  while(true){
+    ssize_t size = read(fd, buffer, sizeof(buffer));
+    if(size < 0){
+      ERROR("Unable to read the stream\n");
+      return false;
+    }
+    if(size == 0)
+      return jamlisp_stream_end(stream);
+    if(!jamlisp_stream_feed(stream, buffer, size))
+      return false;
+  }
+}
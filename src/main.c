@@ -5,6 +5,10 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #include<microio.h>
 #include <iron/full.h>
@@ -13,7 +17,100 @@
 
 void run_tests();
 
+// prints the value of each top level form.
+static void eval_form(void * userdata, const void * code, size_t size){
+  jamlisp_context * ctx = userdata;
+  io_reader rd = io_from_bytes(code, size);
+  jamlisp_iterate(ctx, &rd);
+  jamlisp_print(jamlisp_pop(ctx));
+  logd("\n");
+}
+
+// runs the forms of a file, or of stdin, as they are read.
+static int run_eval(int argc, char ** argv){
+  int fd = argc > 0 ? open(argv[0], O_RDONLY) : 0;
+  if(fd < 0){
+    ERROR("Unable to open %s\n", argv[0]);
+    return 1;
+  }
+  jamlisp_context * ctx = jamlisp_new();
+  jamlisp_stream stream;
+  jamlisp_stream_init(&stream, ctx, eval_form, ctx);
+  bool ok = jamlisp_stream_fd(&stream, fd);
+  jamlisp_stream_clear(&stream);
+  if(fd != 0)
+    close(fd);
+  return ok ? 0 : 1;
+}
+
+static void module_form(void * userdata, const void * code, size_t size){
+  io_write(userdata, code, size);
+}
+
+// compiles a lisp file to a module.
+static int run_module(int argc, char ** argv){
+  if(argc < 2){
+    ERROR("Usage: run module <file.lisp> <file.jlm>\n");
+    return 1;
+  }
+  int fd = open(argv[0], O_RDONLY);
+  if(fd < 0){
+    ERROR("Unable to open %s\n", argv[0]);
+    return 1;
+  }
+  jamlisp_context * ctx = jamlisp_new();
+  io_writer main = {0}, module = {0};
+  jamlisp_stream stream;
+  jamlisp_stream_init(&stream, ctx, module_form, &main);
+  bool ok = jamlisp_stream_fd(&stream, fd) && jamlisp_module_write(ctx, &module, main.data, main.offset);
+  jamlisp_stream_clear(&stream);
+  close(fd);
+  if(ok){
+    FILE * f = fopen(argv[1], "wb");
+    ok = f != NULL && fwrite(module.data, 1, module.offset, f) == module.offset;
+    if(f != NULL)
+      fclose(f);
+  }
+  io_writer_clear(&main);
+  io_writer_clear(&module);
+  return ok ? 0 : 1;
+}
+
+// runs the top level forms of a module and prints their values.
+static int run_load(int argc, char ** argv){
+  if(argc < 1){
+    ERROR("Usage: run load <file.jlm>\n");
+    return 1;
+  }
+  jamlisp_context * ctx = jamlisp_new();
+  jamlisp_module module;
+  if(!jamlisp_module_map(ctx, &module, argv[0]))
+    return 1;
+  io_reader rd = jamlisp_module_main(&module);
+  while(rd.offset < rd.size){
+    jamlisp_iterate(ctx, &rd);
+    jamlisp_print(jamlisp_pop(ctx));
+    logd("\n");
+  }
+  jamlisp_module_unload(ctx, &module);
+  return 0;
+}
+
 int main(int argc, char ** argv){
+  if(argc > 1 && strcmp(argv[1], "eval") == 0)
+    return run_eval(argc - 2, argv + 2);
+  if(argc > 1 && strcmp(argv[1], "module") == 0)
+    return run_module(argc - 2, argv + 2);
+  if(argc > 1 && strcmp(argv[1], "load") == 0)
+    return run_load(argc - 2, argv + 2);
+  if(argc > 1 && strcmp(argv[1], "bench") == 0){
+    run_benchmarks(argc - 2, argv + 2);
+    return 0;
+  }
+  if(argc > 1 && strcmp(argv[1], "bench-gen") == 0){
+    run_bench_gen(argc - 2, argv + 2);
+    return 0;
+  }
   run_tests();
 
   jamlisp_context * ctx = jamlisp_new();
@@ -22,7 +119,7 @@ int main(int argc, char ** argv){
     jamlisp_object indexes[32];
     for(int i =0 ; i < 32; i++){
       indexes[i] = jamlisp_new_cons(ctx);
-      ASSERT(indexes[i].cons < 50);
+      ASSERT(JAMLISP_CONS_INDEX(indexes[i]) < 50);
     }
     for(int i =0 ; i < 32; i++){
       jamlisp_free_cons(ctx, &indexes[i]);
@@ -51,12 +148,24 @@ void test_heap_objects(){
     jamlisp_object indexes[32];
     for(int i =0 ; i < 32; i++){
       indexes[i] = jamlisp_new_cons(ctx);
-      ASSERT(indexes[i].cons < 50);
+      ASSERT(JAMLISP_CONS_INDEX(indexes[i]) < 50);
     }
     for(int i =0 ; i < 32; i++){
       jamlisp_free_cons(ctx, &indexes[i]);
     }
   }
+  // car and cdr keep their own type and value in every heap layout.
+  var sym = jamlisp_symbol(ctx, "car");
+  var c = jamlisp_cons(ctx, sym, jamlisp_f64(-2.5));
+  jamlisp_set_cdr(ctx, c, jamlisp_cons(ctx, jamlisp_i64(-7), c));
+  ASSERT(JAMLISP_SYMBOL_ID(jamlisp_car(ctx, c)) == JAMLISP_SYMBOL_ID(sym));
+  var rest = jamlisp_cdr(ctx, c);
+  ASSERT(JAMLISP_INT64(jamlisp_car(ctx, rest)) == -7);
+  ASSERT(JAMLISP_CONS_INDEX(jamlisp_cdr(ctx, rest)) == JAMLISP_CONS_INDEX(c));
+  jamlisp_set_car(ctx, rest, jamlisp_f64(-2.5));
+  ASSERT(JAMLISP_IS(jamlisp_car(ctx, rest), JAMLISP_F64));
+  ASSERT(JAMLISP_FLOAT64(jamlisp_car(ctx, rest)) == -2.5);
+  ASSERT(jamlisp_consp(jamlisp_cdr(ctx, rest)));
   jamlisp_push_i64(ctx, 1000);
   jamlisp_push_i64(ctx, 10000000000001L);
   jamlisp_push_i64(ctx, 10);
@@ -72,11 +181,11 @@ void test_lisp_symbols(){
   var sym1 = jamlisp_symbol(ctx, "test1");
   var sym2 = jamlisp_symbol(ctx, "test1");
   var sym3 = jamlisp_symbol(ctx, "test");
-  ASSERT(sym3.type == JAMLISP_SYMBOL);
-  ASSERT(sym2.type == JAMLISP_SYMBOL);
-  ASSERT(sym1.type == JAMLISP_SYMBOL);
-  ASSERT(sym1.symbol == sym2.symbol);
-  ASSERT(sym1.symbol != sym3.symbol);
+  ASSERT(jamlisp_symbolp(sym3));
+  ASSERT(jamlisp_symbolp(sym2));
+  ASSERT(jamlisp_symbolp(sym1));
+  ASSERT(JAMLISP_SYMBOL_ID(sym1) == JAMLISP_SYMBOL_ID(sym2));
+  ASSERT(JAMLISP_SYMBOL_ID(sym1) != JAMLISP_SYMBOL_ID(sym3));
 }
 
 void test_lisp_symbol_values(){
@@ -88,8 +197,8 @@ void test_lisp_symbol_values(){
   ASSERT(jamlisp_nilp(symbol_get_value(ctx, sym2)));
   symbol_set_value(ctx, sym1, jamlisp_i64(5));
   symbol_set_value(ctx, sym2, jamlisp_i64(50));
-  ASSERT(symbol_get_value(ctx, sym1).int64 == 5);
-  ASSERT(symbol_get_value(ctx, sym2).int64 == 50);
+  ASSERT(JAMLISP_INT64(symbol_get_value(ctx, sym1)) == 5);
+  ASSERT(JAMLISP_INT64(symbol_get_value(ctx, sym2)) == 50);
   
   symbol_set_value(ctx, sym2, jamlisp_nil());
   ASSERT(jamlisp_nilp(symbol_get_value(ctx, sym2)));
@@ -100,16 +209,16 @@ void test_lisp_symbol_values(){
     
   for(int i = 11; i < 20; i++){
     jamlisp_push_symbol_value(ctx, sym1, jamlisp_i64(i));
-    ASSERT(symbol_get_value(ctx, sym1).int64 == i);
+    ASSERT(JAMLISP_INT64(symbol_get_value(ctx, sym1)) == i);
   }
   for(int i = 19; i >= 11; i--){
-    ASSERT(symbol_get_value(ctx, sym1).int64 == i);
+    ASSERT(JAMLISP_INT64(symbol_get_value(ctx, sym1)) == i);
     jamlisp_pop_symbol_value(ctx, sym1);
   }
   
-  ASSERT(symbol_get_value(ctx, sym2).int64 == 1111);
+  ASSERT(JAMLISP_INT64(symbol_get_value(ctx, sym2)) == 1111);
   jamlisp_pop_symbol_value(ctx, sym2);
-  ASSERT(symbol_get_value(ctx, sym1).int64 == 5);
+  ASSERT(JAMLISP_INT64(symbol_get_value(ctx, sym1)) == 5);
   
 }
 
@@ -130,6 +239,1489 @@ void test_run_lisp(){
   ASSERT(result == 3);
 }
 
+// (ADD (ADD 1 2) (ADD 3 -4))
+void write_test_add_tree(io_writer * wd){
+  io_write_u8(wd, JAMLISP_OPCODE_ADD);
+  for(int i = 0; i < 2; i++){
+    io_write_u8(wd, JAMLISP_OPCODE_ADD);
+    io_write_u8(wd, JAMLISP_OPCODE_INT);
+    io_write_i64_leb(wd, 1 + i * 2);
+    io_write_u8(wd, JAMLISP_OPCODE_INT);
+    io_write_i64_leb(wd, i == 0 ? 2 : -4);
+  }
+}
+
+void test_threaded_code(){
+  logd("test_threaded_code\n");
+  jamlisp_context * ctx = jamlisp_new();
+  io_writer wd = {0};
+  write_test_add_tree(&wd);
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  jamlisp_iterate(ctx, &rd);
+  i64 result1 = jamlisp_pop_i64(ctx);
+
+  jamlisp_code code = {0};
+  rd = io_from_bytes(wd.data, wd.offset);
+  ASSERT(jamlisp_code_load(ctx, &code, &rd));
+  ASSERT(code.count == 8);
+  jamlisp_code_iterate(ctx, &code);
+  jamlisp_code_iterate(ctx, &code);
+  i64 result2 = jamlisp_pop_i64(ctx);
+  i64 result3 = jamlisp_pop_i64(ctx);
+  ASSERT(result1 == 2);
+  ASSERT(result2 == result1);
+  ASSERT(result3 == result1);
+  ASSERT(ctx->value_stack.count == 0);
+  jamlisp_code_free(&code);
+  io_writer_clear(&wd);
+}
+
+void test_postfix(){
+  logd("test_postfix\n");
+  jamlisp_context * ctx = jamlisp_new();
+  io_writer wd = {0};
+  write_test_add_tree(&wd);
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  io_writer postfix = {0};
+  ASSERT(jamlisp_compile_postfix(ctx, &rd, &postfix));
+  u8 expected[] = {JAMLISP_OPCODE_INT, 1, JAMLISP_OPCODE_INT, 2, JAMLISP_OPCODE_ADD,
+		   JAMLISP_OPCODE_INT, 3, JAMLISP_OPCODE_INT, 0x7c, JAMLISP_OPCODE_ADD,
+		   JAMLISP_OPCODE_ADD, JAMLISP_OPCODE_NONE};
+  ASSERT(postfix.offset == sizeof(expected));
+  ASSERT(memcmp(postfix.data, expected, sizeof(expected)) == 0);
+  rd = io_from_bytes(postfix.data, postfix.offset);
+  jamlisp_iterate_postfix(ctx, &rd);
+  ASSERT(jamlisp_pop_i64(ctx) == 2);
+  ASSERT(ctx->value_stack.count == 0);
+
+  // truncated input is rejected.
+  rd = io_from_bytes(wd.data, 4);
+  io_reset(&postfix);
+  ASSERT(!jamlisp_compile_postfix(ctx, &rd, &postfix));
+  io_writer_clear(&postfix);
+  io_writer_clear(&wd);
+}
+
+// evaluates the compiled lisp with the walker, checked and verified, the
+// postfix format, threaded code and register code.
+typedef enum{
+  EVAL_PREFIX,
+  EVAL_VERIFIED,
+  EVAL_POSTFIX,
+  EVAL_THREADED,
+  EVAL_REGISTERS,
+  EVAL_MODES
+}eval_mode;
+
+// runs compiled top level code in one execution mode and pops its value.
+static jamlisp_object eval_in_mode(jamlisp_context * ctx, const io_writer * wd, eval_mode mode){
+  io_reader rd = io_from_bytes(wd->data, wd->offset);
+  switch(mode){
+  case EVAL_PREFIX:
+    jamlisp_iterate(ctx, &rd);
+    break;
+  case EVAL_VERIFIED:{
+    jamlisp_verify_info info;
+    ASSERT(jamlisp_verify(ctx, wd->data, wd->offset, &info));
+    jamlisp_iterate_verified(ctx, &rd, &info);
+    break;
+  }
+  case EVAL_POSTFIX:{
+    io_writer postfix = {0};
+    ASSERT(jamlisp_compile_postfix(ctx, &rd, &postfix));
+    rd = io_from_bytes(postfix.data, postfix.offset);
+    jamlisp_iterate_postfix(ctx, &rd);
+    io_writer_clear(&postfix);
+    break;
+  }
+  case EVAL_THREADED:{
+    jamlisp_code threaded = {0};
+    ASSERT(jamlisp_code_load(ctx, &threaded, &rd));
+    jamlisp_code_iterate(ctx, &threaded);
+    jamlisp_code_free(&threaded);
+    break;
+  }
+  case EVAL_REGISTERS:{
+    jamlisp_reg_code registers = {0};
+    ASSERT(jamlisp_reg_compile(ctx, &registers, &rd));
+    jamlisp_reg_iterate(ctx, &registers);
+    jamlisp_reg_code_free(&registers);
+    break;
+  }
+  default:
+    ASSERT(false);
+  }
+  return jamlisp_pop(ctx);
+}
+
+static i64 eval_lisp_modes(jamlisp_context * ctx, const char * code){
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, code);
+  var value = eval_in_mode(ctx, &wd, EVAL_PREFIX);
+  ASSERT(JAMLISP_IS(value, JAMLISP_INT64));
+  i64 result = JAMLISP_INT64(value);
+  for(eval_mode mode = EVAL_VERIFIED; mode < EVAL_MODES; mode++){
+    value = eval_in_mode(ctx, &wd, mode);
+    ASSERT(JAMLISP_IS(value, JAMLISP_INT64) && JAMLISP_INT64(value) == result);
+  }
+  ASSERT(ctx->value_stack.count == 0);
+  ASSERT(ctx->local_base == 0);
+  io_writer_clear(&wd);
+  return result;
+}
+
+// runs 'fcn' in a child process and returns how often 'message' is in what
+// it wrote to stderr. ERROR can abort, so errors are tested in a child. It
+// exits with the value of 'fcn' if it gets that far.
+static int child_errors(int (* fcn)(void * userdata), void * userdata, const char * message, int * status){
+  int fds[2];
+  ASSERT(pipe(fds) == 0);
+  pid_t pid = fork();
+  if(pid == 0){
+    close(fds[0]);
+    dup2(fds[1], STDERR_FILENO);
+    _exit(fcn(userdata));
+  }
+  close(fds[1]);
+  io_writer output = {0};
+  char buffer[4096];
+  ssize_t n;
+  while((n = read(fds[0], buffer, sizeof(buffer))) > 0)
+    io_write(&output, buffer, n);
+  close(fds[0]);
+  io_write_u8(&output, 0);
+  int count = 0;
+  for(const char * p = output.data; (p = strstr(p, message)) != NULL; p += strlen(message))
+    count += 1;
+  io_writer_clear(&output);
+  ASSERT(waitpid(pid, status, 0) == pid);
+  return count;
+}
+
+// the child either died in the ERROR it reported or returned 0.
+static bool child_stopped_at_error(int status){
+  return WIFSIGNALED(status) ? WTERMSIG(status) == SIGABRT : WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+void test_variables(){
+  logd("test_variables\n");
+  jamlisp_context * ctx = jamlisp_new();
+  ASSERT(eval_lisp_modes(ctx, "(let ((x 5) (y 7)) x)") == 5);
+  ASSERT(eval_lisp_modes(ctx, "(let ((x 5) (y 7)) (let ((x y)) x))") == 7);
+  // let is parallel, y gets the outer x.
+  ASSERT(eval_lisp_modes(ctx, "(let ((x 1)) (let ((x 2) (y x)) y))") == 1);
+  ASSERT(eval_lisp_modes(ctx, "(let ((x 1)) 5 (let ((z 3)) z) x)") == 1);
+  // a variadic call folded to binary opcodes only keeps one value below the
+  // argument.
+  ASSERT(eval_lisp_modes(ctx, "(+ 1 2 (let ((x 5)) x))") == 8);
+  ASSERT(eval_lisp_modes(ctx, "(- 100 1 (let ((x 5)) x))") == 94);
+  ASSERT(eval_lisp_modes(ctx, "(let ((y 2)) (* y 3 (let ((x 5)) (+ x y)) (let ((z 1)) (- z y 1))))") == -84);
+
+  // special variables are bound while the body runs.
+  var special = jamlisp_symbol(ctx, "*s*");
+  symbol_set_value(ctx, special, jamlisp_i64(10));
+  ASSERT(eval_lisp_modes(ctx, "(let ((x 2) (*s* 3)) *s*)") == 3);
+  ASSERT(eval_lisp_modes(ctx, "*s*") == 10);
+  ASSERT(JAMLISP_INT64(symbol_get_value(ctx, special)) == 10);
+  ASSERT(ctx->symbol_value_stack.count == 0);
+  // the saved value goes to the binding stack, the locals of the body follow
+  // the locals of the let on the value stack.
+  ASSERT(eval_lisp_modes(ctx, "(let ((*s* 3)) (let ((y 4)) (+ *s* y)))") == 7);
+  jamlisp_push_symbol_value(ctx, special, jamlisp_i64(4));
+  ASSERT(JAMLISP_INT64(symbol_get_value(ctx, special)) == 4);
+  ASSERT(ctx->value_stack.count == 0 && ctx->symbol_value_stack.count == sizeof(jamlisp_symbol_value));
+  jamlisp_pop_symbol_value(ctx, special);
+  ASSERT(JAMLISP_INT64(symbol_get_value(ctx, special)) == 10);
+
+  // function arguments are the first slots.
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, "(defun second (a b) b)");
+  var function = symbol_get_value(ctx, jamlisp_symbol(ctx, "second"));
+  ASSERT(JAMLISP_IS(function, JAMLISP_ARRAY));
+  u8 expected[] = {JAMLISP_CODE_LOCAL_SMALL + 1};
+  ASSERT(JAMLISP_PTR(function)->size == sizeof(expected));
+  ASSERT(memcmp(JAMLISP_PTR(function)->data, expected, sizeof(expected)) == 0);
+  io_writer_clear(&wd);
+}
+
+void test_value_stack(){
+  logd("test_value_stack\n");
+  jamlisp_context * ctx = jamlisp_new();
+  // the value stack is mapped once and never moves.
+  var objects = ctx->value_stack.objects;
+  ASSERT(ctx->value_stack.capacity >= JAMLISP_VALUE_STACK_SIZE);
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, "(defun depth (n) (if (< n 1) 0 (+ 1 (depth (- n 1)))))");
+  ASSERT(eval_lisp_modes(ctx, "(depth 20000)") == 20000);
+  ASSERT(ctx->value_stack.objects == objects);
+  ASSERT(ctx->value_stack.count == 0);
+  io_writer_clear(&wd);
+
+  // a push past the end faults on the guard page and reports it.
+  int fds[2];
+  ASSERT(pipe(fds) == 0);
+  pid_t pid = fork();
+  if(pid == 0){
+    dup2(fds[1], STDERR_FILENO);
+    jamlisp_value_stack stk;
+    jamlisp_value_stack_init(&stk, 16);
+    ((volatile jamlisp_object *) stk.objects)[stk.capacity] = jamlisp_i64(1);
+    _exit(0);
+  }
+  close(fds[1]);
+  char msg[64] = {0};
+  ssize_t n = read(fds[0], msg, sizeof(msg) - 1);
+  close(fds[0]);
+  int status;
+  ASSERT(waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+  ASSERT(n > 0 && strstr(msg, "value stack overflow") != NULL);
+
+  jamlisp_value_stack stk;
+  jamlisp_value_stack_init(&stk, 16);
+  stk.objects[stk.count++] = jamlisp_i64(1);
+  jamlisp_value_stack_free(&stk);
+  ASSERT(stk.objects == NULL && stk.capacity == 0);
+}
+
+static u64 test_random(u64 * state){
+  u64 x = *state;
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  *state = x;
+  return x;
+}
+
+// writes a random program with an integer value. It uses + - * with two to
+// four arguments, if, let, the special variable *s*, lists of conses read by
+// list-sum and the functions of test_registers, which are sometimes called
+// with an argument more than they take. churn allocates enough conses for
+// collections while the lists of the enclosing lets are in registers.
+static void write_random_program(io_writer * wd, u64 * rnd, int depth, int vars, int lists){
+  u64 r = test_random(rnd);
+  char buf[32];
+  if(depth == 0 || r % 8 == 0){
+    r /= 8;
+    if(r % 5 == 0 && vars > 0)
+      snprintf(buf, sizeof(buf), "v%i", (int)(r / 5 % vars));
+    else if(r % 5 == 1)
+      snprintf(buf, sizeof(buf), "*s*");
+    else if(r % 5 == 3)
+      snprintf(buf, sizeof(buf), "%lli", (long long)(r / 5 % 1000000007));
+    else if(r % 5 == 4 && lists > 0)
+      snprintf(buf, sizeof(buf), "(list-sum l%i)", (int)(r / 5 % lists));
+    else
+      snprintf(buf, sizeof(buf), "%i", (int)(r / 5 % 64) - 16);
+    io_write(wd, buf, strlen(buf));
+    return;
+  }
+  r /= 8;
+  static const char * ops[] = {"(+ ", "(- ", "(* ", "(twice ", "(diff "};
+  switch(r % 10){
+  case 0 ... 4:{
+    const char * op = ops[r % 10];
+    io_write(wd, op, strlen(op));
+    u32 args = r % 10 < 3 ? 2 + r / 10 % 3 : 2 + r / 10 % 2;
+    for(u32 i = 0; i < args; i++){
+      if(i > 0)
+        io_write_u8(wd, ' ');
+      if(r % 10 == 3 && i == 1)
+        io_write(wd, "1", 1);
+      else
+        write_random_program(wd, rnd, depth - 1, vars, lists);
+    }
+    io_write_u8(wd, ')');
+    return;
+  }
+  case 5:
+    io_write(wd, "(if (< ", 7);
+    for(int i = 0; i < 4; i++){
+      write_random_program(wd, rnd, depth - 1, vars, lists);
+      io_write(wd, i == 1 ? ") " : " ", i == 1 ? 2 : 1);
+    }
+    io_write_u8(wd, ')');
+    return;
+  case 6:
+    snprintf(buf, sizeof(buf), "(let ((v%i ", vars);
+    io_write(wd, buf, strlen(buf));
+    write_random_program(wd, rnd, depth - 1, vars, lists);
+    io_write(wd, ")) ", 3);
+    write_random_program(wd, rnd, depth - 1, vars + 1, lists);
+    io_write_u8(wd, ')');
+    return;
+  case 7:
+    io_write(wd, "(let ((*s* ", 11);
+    write_random_program(wd, rnd, depth - 1, vars, lists);
+    io_write(wd, ")) ", 3);
+    write_random_program(wd, rnd, depth - 1, vars, lists);
+    io_write_u8(wd, ')');
+    return;
+  case 8:
+    snprintf(buf, sizeof(buf), "(let ((l%i (cons ", lists);
+    io_write(wd, buf, strlen(buf));
+    write_random_program(wd, rnd, depth - 1, vars, lists);
+    io_write(wd, " (cons ", 7);
+    write_random_program(wd, rnd, depth - 1, vars, lists);
+    io_write_u8(wd, ' ');
+    write_random_program(wd, rnd, depth - 1, vars, lists);
+    io_write(wd, ")))) (- ", 8);
+    write_random_program(wd, rnd, depth - 1, vars, lists + 1);
+    snprintf(buf, sizeof(buf), " (list-sum l%i)))", lists);
+    io_write(wd, buf, strlen(buf));
+    return;
+  default:
+    io_write(wd, "(churn 300 ", 11);
+    write_random_program(wd, rnd, depth - 1, vars, lists);
+    io_write_u8(wd, ')');
+    return;
+  }
+}
+
+// (list-sum l) is the sum of the cars of l and its last cdr, if that is not nil.
+static jamlisp_object prim_list_sum(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  var list = args[0];
+  var sum = jamlisp_i64(0);
+  while(jamlisp_consp(list)){
+    sum = jamlisp_add(ctx, sum, jamlisp_car(ctx, list));
+    list = jamlisp_cdr(ctx, list);
+  }
+  if(!jamlisp_nilp(list))
+    sum = jamlisp_add(ctx, sum, list);
+  return sum;
+}
+
+void test_registers(){
+  logd("test_registers\n");
+  jamlisp_context * ctx = jamlisp_new();
+  io_writer wd = {0};
+  jamlisp_reg_code code = {0};
+  // arithmetic on constants is done by the compiler, and only the branch
+  // taken of a constant condition is compiled.
+  const char * constant_programs[] = {"(+ 1 (* 2 (- 7 4)))", "(if (< 2 1) (print 5) 7)"};
+  for(size_t i = 0; i < array_count(constant_programs); i++){
+    io_reset(&wd);
+    jamlisp_load_lisp2(ctx, &wd, constant_programs[i]);
+    io_reader rd = io_from_bytes(wd.data, wd.offset);
+    ASSERT(jamlisp_reg_compile(ctx, &code, &rd));
+    ASSERT(code.count == 2 && code.insns[0].opcode == JAMLISP_REG_MOVE && code.insns[1].opcode == JAMLISP_REG_END);
+    ASSERT(JAMLISP_INT64(code.constants[code.insns[0].a & ~JAMLISP_REG_CONSTANT]) == 7);
+  }
+  jamlisp_reg_code_free(&code);
+
+  // the operands are read from the argument registers, the products go to
+  // the registers after them.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun madd (a b c d) (+ (* a b) (* c d)))");
+  ctx->registers = true;
+  ASSERT(eval_lisp_modes(ctx, "(madd 2 3 4 5)") == 26);
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(madd 2 3 4 5)");
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  jamlisp_iterate(ctx, &rd);
+  ASSERT(jamlisp_pop_i64(ctx) == 26);
+  var madd = jamlisp_function_registers(ctx, JAMLISP_SYMBOL_ID(jamlisp_symbol(ctx, "madd")), 4);
+  jamlisp_reg_insn expected[] = {
+    {.opcode = JAMLISP_REG_MUL, .dst = 4, .a = 0, .b = 1},
+    {.opcode = JAMLISP_REG_MUL, .dst = 5, .a = 2, .b = 3},
+    {.opcode = JAMLISP_REG_ADD, .dst = 4, .a = 4, .b = 5},
+    {.opcode = JAMLISP_REG_RETURN, .a = 4}
+  };
+  ASSERT(madd->count == array_count(expected) && madd->frame_size == 6);
+  ASSERT(memcmp(madd->insns, expected, sizeof(expected)) == 0);
+  // variables initialized from another variable or a constant are not copied.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun pick (a) (let ((b a) (c 2)) (+ b c)))");
+  ASSERT(eval_lisp_modes(ctx, "(pick 5)") == 7);
+  var pick = jamlisp_function_registers(ctx, JAMLISP_SYMBOL_ID(jamlisp_symbol(ctx, "pick")), 1);
+  ASSERT(pick->count == 3 && pick->insns[0].opcode == JAMLISP_REG_ADD && pick->insns[0].a == 0);
+
+  // a call with more arguments than the function uses gets its own register
+  // code, the code of the running frames is not compiled again.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun h (n) (if (< n 1) 0 (+ 1 (h (- n 1)))))");
+  ASSERT(eval_lisp_modes(ctx, "(h 3 9)") == 3);
+  ASSERT(eval_lisp_modes(ctx, "(+ (h 2) (h 3 9) (h 4 9 9))") == 9);
+  var h = JAMLISP_SYMBOL_ID(jamlisp_symbol(ctx, "h"));
+  ASSERT(jamlisp_function_get(ctx, h)->register_count == 3);
+  var h1 = jamlisp_function_registers(ctx, h, 1);
+  ASSERT(eval_lisp_modes(ctx, "(+ (h 5 1) (h 5))") == 10);
+  ASSERT(jamlisp_function_registers(ctx, h, 1) == h1 && jamlisp_function_get(ctx, h)->register_count == 3);
+
+  // the register machine gives the same values as the stack machine.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun twice (x n) (if (< n 1) x (twice (+ x x) (- n 1))))");
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun diff (a b) (let ((d (- a b))) (if (< d 0) (- 0 d) d)))");
+  jamlisp_load_primitive(ctx, "list-sum", prim_list_sum, 1, 1, JAMLISP_OPCODE_NONE);
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun churn (n x) (if (< n 1) x (churn (- n 1) (- (list-sum (cons x (cons n 0))) n))))");
+  symbol_set_value(ctx, jamlisp_symbol(ctx, "*s*"), jamlisp_i64(3));
+  jamlisp_gc_set_mode(ctx, JAMLISP_GC_MARK_SWEEP);
+  u64 collections = ctx->gc.collections;
+  u64 rnd = 7;
+  io_writer source = {0};
+  for(int i = 0; i < 500; i++){
+    if(i == 250)
+      jamlisp_gc_set_mode(ctx, JAMLISP_GC_GENERATIONAL);
+    io_reset(&source);
+    write_random_program(&source, &rnd, 1 + i % 6, 0, 0);
+    io_write_u8(&source, 0);
+    io_reset(&wd);
+    jamlisp_load_lisp2(ctx, &wd, source.data);
+    // every other program is compiled without constant folding.
+    ctx->register_fold = i % 2;
+    // the first value stays on the stack, it can be a bignum.
+    for(int registers = 0; registers < 2; registers++){
+      ctx->registers = registers;
+      rd = io_from_bytes(wd.data, wd.offset);
+      jamlisp_iterate(ctx, &rd);
+      ASSERT(rd.offset == wd.offset);
+      ASSERT(ctx->value_stack.count == (size_t) registers + 1 && ctx->symbol_value_stack.count == 0);
+    }
+    var objects = ctx->value_stack.objects;
+    if(jamlisp_integer_compare(objects[0], objects[1]) != 0)
+      ERROR("Register code differs for %s\n", (const char *) source.data);
+    ctx->value_stack.count = 0;
+  }
+  ASSERT(JAMLISP_INT64(symbol_get_value(ctx, jamlisp_symbol(ctx, "*s*"))) == 3);
+  ASSERT(ctx->gc.collections > collections);
+  io_writer_clear(&source);
+  io_writer_clear(&wd);
+}
+
+void test_encoding(){
+  logd("test_encoding\n");
+  jamlisp_context * ctx = jamlisp_new();
+  struct{
+    jamlisp_insn insn;
+    size_t size;
+  }nodes[] = {
+    {{.opcode = JAMLISP_OPCODE_INT, .int64 = JAMLISP_SMALL_INT_MIN}, 1},
+    {{.opcode = JAMLISP_OPCODE_INT, .int64 = JAMLISP_SMALL_INT_MAX}, 1},
+    {{.opcode = JAMLISP_OPCODE_INT, .int64 = JAMLISP_SMALL_INT_MAX + 1}, 2},
+    {{.opcode = JAMLISP_OPCODE_INT, .int64 = INT64_MIN}, 11},
+    {{.opcode = JAMLISP_OPCODE_LOCAL, .local = 3}, 1},
+    {{.opcode = JAMLISP_OPCODE_LOCAL, .local = 4}, 2},
+    {{.opcode = JAMLISP_OPCODE_CALL, .call = 5, .child_count = 3}, 2},
+    {{.opcode = JAMLISP_OPCODE_CALL, .call = 5, .child_count = 4}, 3},
+    {{.opcode = JAMLISP_OPCODE_TAILCALL, .call = 200, .child_count = 0}, 3},
+    {{.opcode = JAMLISP_OPCODE_ADD, .child_count = 2}, 1},
+    {{.opcode = JAMLISP_OPCODE_IF, .then_size = 1, .else_size = 300, .child_count = 3}, 4},
+  };
+  io_writer wd = {0};
+  for(size_t i = 0; i < array_count(nodes); i++){
+    io_reset(&wd);
+    jamlisp_write_prefix_node(&wd, &nodes[i].insn);
+    ASSERT(wd.offset == nodes[i].size);
+    io_reader rd = io_from_bytes(wd.data, wd.offset);
+    jamlisp_insn insn;
+    ASSERT(jamlisp_read_prefix_node(ctx, &rd, &insn));
+    ASSERT(rd.offset == wd.offset);
+    ASSERT(memcmp(&insn, &nodes[i].insn, sizeof(insn)) == 0);
+  }
+
+  // (if 1 2 3) with the right and the wrong branch sizes.
+  u8 code[] = {JAMLISP_OPCODE_IF, 1, 1, JAMLISP_CODE_INT_SMALL + 17, JAMLISP_CODE_INT_SMALL + 18,
+	       JAMLISP_CODE_INT_SMALL + 19, JAMLISP_OPCODE_NONE};
+  ASSERT(jamlisp_verify(ctx, code, sizeof(code), NULL));
+  ASSERT(jamlisp_verify(ctx, code, sizeof(code) - 1, NULL));
+  code[1] = 2;
+  ASSERT(!jamlisp_verify(ctx, code, sizeof(code), NULL));
+  code[1] = 1;
+  // an unfinished form, an operand cut off and an unknown opcode.
+  ASSERT(!jamlisp_verify(ctx, code, 5, NULL));
+  ASSERT(!jamlisp_verify(ctx, code, 2, NULL));
+  code[4] = 0xff;
+  ASSERT(!jamlisp_verify(ctx, code, sizeof(code), NULL));
+  u8 primitive[] = {JAMLISP_OPCODE_PRIMITIVE, 0x7f, 0};
+  ASSERT(!jamlisp_verify(ctx, primitive, sizeof(primitive), NULL));
+  // what the loader writes is valid.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun f (a b c d) (if (< a 2) (f b c d a) (let ((x 1000)) (+ x b))))");
+  ASSERT(jamlisp_verify(ctx, wd.data, wd.offset, NULL));
+  var function = symbol_get_value(ctx, jamlisp_symbol(ctx, "f"));
+  ASSERT(jamlisp_verify(ctx, JAMLISP_PTR(function)->data, JAMLISP_PTR(function)->size, NULL));
+  io_writer_clear(&wd);
+}
+
+static jamlisp_verify_info verify_lisp(jamlisp_context * ctx, const char * code){
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, code);
+  jamlisp_verify_info info;
+  ASSERT(jamlisp_verify(ctx, wd.data, wd.offset, &info));
+  io_writer_clear(&wd);
+  return info;
+}
+
+void test_verify(){
+  logd("test_verify\n");
+  jamlisp_context * ctx = jamlisp_new();
+  // the depths are the most values and frames used at once.
+  var info = verify_lisp(ctx, "(+ 1 (* 2 3))");
+  ASSERT(info.max_stack == 3 && info.max_frames == 3);
+  info = verify_lisp(ctx, "(if (< 1 2) 3 (+ 4 5))");
+  ASSERT(info.max_stack == 2 && info.max_frames == 3);
+  // each top level form leaves its value.
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, "1");
+  jamlisp_load_lisp2(ctx, &wd, "2");
+  jamlisp_load_lisp2(ctx, &wd, "(+ 3 4)");
+  ASSERT(jamlisp_verify(ctx, wd.data, wd.offset, &info));
+  ASSERT(info.max_stack == 4 && info.max_frames == 2);
+  // a binding is kept on the binding stack, only the local holding its value
+  // stays on the value stack while the body runs.
+  symbol_set_value(ctx, jamlisp_symbol(ctx, "*v*"), jamlisp_i64(1));
+  info = verify_lisp(ctx, "(let ((*v* 2)) (+ *v* 1))");
+  ASSERT(info.max_stack == 3);
+
+  // primitives and LET get the number of children they take.
+  u32 index;
+  ASSERT(jamlisp_symbol_primitive(ctx, jamlisp_symbol(ctx, "bigfloat"), &index) != NULL);
+  u8 primitive[] = {JAMLISP_OPCODE_PRIMITIVE, index, 2, JAMLISP_CODE_INT_SMALL, JAMLISP_CODE_INT_SMALL};
+  ASSERT(!jamlisp_verify(ctx, primitive, sizeof(primitive), NULL));
+  primitive[2] = 1;
+  ASSERT(jamlisp_verify(ctx, primitive, sizeof(primitive) - 1, NULL));
+  u8 let[] = {JAMLISP_OPCODE_LET, 0};
+  ASSERT(!jamlisp_verify(ctx, let, sizeof(let), NULL));
+
+  // a LOCAL past the values of the frame reads an argument.
+  info = verify_lisp(ctx, "(let ((x 1) (y 2)) (+ x y))");
+  ASSERT(info.arg_count == 0);
+  u8 local[] = {JAMLISP_OPCODE_ADD, JAMLISP_CODE_LOCAL_SMALL + 1, JAMLISP_OPCODE_LOCAL, 4};
+  ASSERT(jamlisp_verify(ctx, local, sizeof(local), &info));
+  ASSERT(info.arg_count == 4);
+  // it is the fewest arguments that keep every read in the frame.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun second (a b) (+ b 1))");
+  var second = symbol_get_value(ctx, jamlisp_symbol(ctx, "second"));
+  ASSERT(jamlisp_verify(ctx, JAMLISP_PTR(second)->data, JAMLISP_PTR(second)->size, &info));
+  ASSERT(info.arg_count == 2);
+
+  // functions are verified when they are loaded and when they are cached.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun add3 (a b c) (+ a (+ b c)))");
+  var f = jamlisp_function_get(ctx, JAMLISP_SYMBOL_ID(jamlisp_symbol(ctx, "add3")));
+  ASSERT(f != NULL && f->verified);
+  ASSERT(f->info.max_stack == 3 && f->info.max_frames == 3);
+  ASSERT(eval_lisp_modes(ctx, "(add3 1 2 3)") == 6);
+  var bad = jamlisp_symbol(ctx, "bad");
+  jamlisp_load_fcn_bytecode(ctx, bad, let, sizeof(let));
+  ASSERT(jamlisp_nilp(symbol_get_value(ctx, bad)));
+
+  // deep recursion grows the reserved stacks from inside verified code.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun sum (n) (if (< n 1) 0 (+ n (sum (- n 1)))))");
+  ASSERT(eval_lisp_modes(ctx, "(sum 5000)") == 12502500);
+  io_writer_clear(&wd);
+}
+
+static eval_mode too_few_arguments_mode;
+
+static int too_few_arguments(void * userdata){
+  jamlisp_context * ctx = userdata;
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, "(let ((x 1) (y 777)) (+ x y))");
+  eval_in_mode(ctx, &wd, too_few_arguments_mode);
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(second 1)");
+  var value = eval_in_mode(ctx, &wd, too_few_arguments_mode);
+  return jamlisp_nilp(value) && ctx->value_stack.count == 0 ? 0 : 1;
+}
+
+void test_calls(){
+  logd("test_calls\n");
+  jamlisp_context * ctx = jamlisp_new();
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, "(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))");
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun ack (m n) (if (< m 1) (+ n 1) (if (< n 1) (ack (- m 1) 1) (ack (- m 1) (ack m (- n 1))))))");
+  ASSERT(eval_lisp_modes(ctx, "(fib 15)") == 610);
+  ASSERT(eval_lisp_modes(ctx, "(ack 2 3)") == 9);
+  ASSERT(eval_lisp_modes(ctx, "(let ((x 3)) (if (< x 2) 10 (- x 1)))") == 2);
+  // a function that rebinds its own symbol while it runs keeps running the
+  // code it was compiled to.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun g () 1)");
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun *f* (x) (if (< x 1) (+ 100 (let ((*f* g)) (*f*))) (+ 1000 (*f* (- x 1)))))");
+  ASSERT(eval_lisp_modes(ctx, "(*f* 2)") == 2101);
+  ASSERT(eval_lisp_modes(ctx, "(*f* 1)") == 1101);
+
+  // a call with fewer arguments than the function reads is reported once in
+  // every mode, and its value is nil instead of what is above the stack.
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun second (a b) b)");
+  for(eval_mode mode = 0; mode < EVAL_MODES; mode++){
+    too_few_arguments_mode = mode;
+    int status;
+    ASSERT(child_errors(too_few_arguments, ctx, "Too few arguments", &status) == 1);
+    ASSERT(child_stopped_at_error(status));
+  }
+
+  // call sites are resolved once, until a function is defined.
+  jamlisp_code code = {0};
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(fib 10)");
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  ASSERT(jamlisp_code_load(ctx, &code, &rd));
+  jamlisp_code_iterate(ctx, &code);
+  ctx->call_stats = (jamlisp_call_stats){0};
+  jamlisp_code_iterate(ctx, &code);
+  ASSERT(ctx->call_stats.cache_misses == 0);
+  // 177 calls to fib, < - and + are primitives and not calls.
+  ASSERT(ctx->call_stats.cache_hits == 177);
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun one () 1)");
+  jamlisp_code_iterate(ctx, &code);
+  ASSERT(ctx->call_stats.cache_misses > 0 && ctx->call_stats.cache_misses < 10);
+  ASSERT(jamlisp_pop_i64(ctx) == 55);
+  ASSERT(jamlisp_pop_i64(ctx) == 55);
+  ASSERT(jamlisp_pop_i64(ctx) == 55);
+  jamlisp_code_free(&code);
+
+  // the recursive call to count is a tail call, so it runs in constant space.
+  ctx = jamlisp_new();
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(defun count (n acc) (if (< n 1) acc (count (- n 1) (+ acc 1))))");
+  ASSERT(eval_lisp_modes(ctx, "(count 100000 0)") == 100000);
+  ASSERT(ctx->cframes_capacity < 16);
+  ASSERT(ctx->frames_capacity < 64);
+  ASSERT(ctx->cframe_count == 0);
+  io_writer_clear(&wd);
+}
+
+// loads code nested 200000 deep, 0 if it failed to parse.
+static int parse_too_deep(void * userdata){
+  jamlisp_context * ctx = userdata;
+  io_writer code = {0};
+  for(int i = 0; i < 200000; i++)
+    io_write(&code, "(+ 1 ", 5);
+  io_write_u8(&code, '0');
+  for(int i = 0; i < 200000; i++)
+    io_write_u8(&code, ')');
+  io_write_u8(&code, 0);
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, code.data);
+  // a failed form is only the NONE after it.
+  return wd.offset == 1 ? 0 : 1;
+}
+
+void test_parser(){
+  logd("test_parser\n");
+  jamlisp_context * ctx = jamlisp_new();
+  io_writer code = {0};
+  // deeply nested calls and branches.
+  for(int i = 0; i < 2000; i++)
+    io_write(&code, "(+ 1 ", 5);
+  io_write_u8(&code, '0');
+  for(int i = 0; i < 2000; i++)
+    io_write_u8(&code, ')');
+  io_write_u8(&code, 0);
+  ASSERT(eval_lisp_modes(ctx, code.data) == 2000);
+  io_reset(&code);
+  for(int i = 0; i < 500; i++)
+    io_write(&code, "(if (< 0 1) (let ((x 1)) 2 ", 27);
+  io_write_u8(&code, '7');
+  for(int i = 0; i < 500; i++)
+    io_write(&code, ") 3)", 4);
+  io_write_u8(&code, 0);
+  ASSERT(eval_lisp_modes(ctx, code.data) == 7);
+  io_writer_clear(&code);
+
+  // nesting past the limit is a parse error and not a stack overflow. It
+  // is reported once, the enclosing forms only stop.
+  int status;
+  ASSERT(child_errors(parse_too_deep, ctx, "nested deeper than", &status) == 1);
+  ASSERT(child_stopped_at_error(status));
+  ASSERT(child_errors(parse_too_deep, ctx, "could not parse", &status) == 0);
+  ASSERT(child_stopped_at_error(status));
+
+  // the tail call after a let with two forms in the body.
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, "(defun down (n) (let ((m (- n 1))) m (if (< m 1) 0 (down m))))");
+  ASSERT(eval_lisp_modes(ctx, "(down 100000)") == 0);
+  ASSERT(ctx->cframes_capacity < 16);
+  ASSERT(eval_lisp_modes(ctx, "(let ((x 1)\r\n\t(y \"a b\"))\r\n (+ x 2))") == 3);
+
+  // each load reads one form and leaves the reader after it.
+  const char * forms = " (+ 1 2)\n(* 3 4) ";
+  io_reader rd = io_from_bytes(forms, strlen(forms) + 1);
+  for(i64 expected = 3; expected <= 12; expected *= 4){
+    io_reset(&wd);
+    jamlisp_load_lisp(ctx, &rd, &wd);
+    io_reader code_rd = io_from_bytes(wd.data, wd.offset);
+    jamlisp_iterate(ctx, &code_rd);
+    ASSERT(jamlisp_pop_i64(ctx) == expected);
+  }
+  ASSERT(rd.offset == strlen(" (+ 1 2)\n(* 3 4)"));
+  io_writer_clear(&wd);
+}
+
+// the tokens of the source one character at a time, returns the count.
+static size_t reference_lex(const char * src, size_t size, jamlisp_token * tokens, bool * error){
+  size_t count = 0, i = 0;
+  *error = false;
+  while(i < size && src[i] != 0){
+    char c = src[i];
+    if(c == ' ' || c == '\t' || c == '\n' || c == '\r'){
+      i++;
+    }else if(c == '(' || c == ')'){
+      tokens[count++] = (jamlisp_token){.offset = i, .length = 1};
+      i++;
+    }else if(c == ';'){
+      while(i < size && src[i] != '\n')
+	i++;
+    }else{
+      size_t start = i;
+      bool string = false;
+      for(; i < size; i++){
+	c = src[i];
+	if(c == '"')
+	  string = !string;
+	else if(!string && (c == 0 || c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '(' || c == ')' || c == ';'))
+	  break;
+      }
+      *error = string;
+      tokens[count++] = (jamlisp_token){.offset = start, .length = i - start};
+    }
+  }
+  return count;
+}
+
+void test_lexer(){
+  logd("test_lexer\n");
+  const char * code = "(a \"b c\";x y\n\t12)";
+  jamlisp_token expected[] = {{0, 1}, {1, 1}, {3, 5}, {14, 2}, {16, 1}};
+  enum { N = 300 };
+  jamlisp_token tokens[N + 1], reference[N + 1];
+  u64 rnd = 11;
+  for(jamlisp_simd_level level = 0; level <= jamlisp_simd_detect(); level++){
+    logd("  %s\n", jamlisp_simd_name(level));
+    jamlisp_lexer lx;
+    jamlisp_lexer_init(&lx, code, strlen(code), level);
+    ASSERT(jamlisp_lex(&lx, tokens, N) == array_count(expected));
+    ASSERT(lx.done && !lx.error);
+    ASSERT(memcmp(tokens, expected, sizeof(expected)) == 0);
+
+    // random sources of every length around the block size, read with the
+    // smallest token buffer, give the tokens of the reference lexer.
+    static const char alphabet[] = "(  )\n\t\"\";a1b2xyz";
+    char src[N];
+    for(int iteration = 0; iteration < 3000; iteration++){
+      size_t size = iteration % 200;
+      for(size_t i = 0; i < size; i++){
+	rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+	src[i] = alphabet[(rnd >> 33) % (sizeof(alphabet) - 1)];
+      }
+      // sometimes a NUL ends the source early.
+      if(size > 0 && iteration % 7 == 0)
+	src[(rnd >> 20) % size] = 0;
+      bool error;
+      size_t expected_count = reference_lex(src, size, reference, &error);
+      jamlisp_lexer_init(&lx, src, size, level);
+      size_t count = 0;
+      while(!lx.done)
+	count += jamlisp_lex(&lx, tokens + count, JAMLISP_LEX_MIN_TOKENS);
+      ASSERT(count == expected_count);
+      ASSERT(memcmp(tokens, reference, count * sizeof(tokens[0])) == 0);
+      ASSERT(lx.error == error);
+
+      // the same when the source arrives in pieces.
+      jamlisp_lexer_init(&lx, src, 0, level);
+      lx.partial = true;
+      count = 0;
+      while(!lx.done){
+	lx.size = MIN(size, lx.size + (rnd >> 40) % 70);
+	lx.partial = lx.size < size;
+	count += jamlisp_lex(&lx, tokens + count, JAMLISP_LEX_MIN_TOKENS);
+	rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+      }
+      ASSERT(count == expected_count);
+      ASSERT(memcmp(tokens, reference, count * sizeof(tokens[0])) == 0);
+      ASSERT(lx.error == error);
+    }
+  }
+}
+
+typedef struct{
+  jamlisp_context * ctx;
+  i64 results[16];
+  size_t count;
+}stream_test;
+
+// runs each form as soon as it is read.
+static void stream_test_form(void * userdata, const void * code, size_t size){
+  stream_test * t = userdata;
+  io_reader rd = io_from_bytes(code, size);
+  jamlisp_iterate(t->ctx, &rd);
+  jamlisp_object result = jamlisp_pop(t->ctx);
+  if(t->count < array_count(t->results))
+    t->results[t->count] = JAMLISP_IS(result, JAMLISP_INT64) ? JAMLISP_INT64(result) : -1;
+  t->count += 1;
+}
+
+void test_stream(){
+  logd("test_stream\n");
+  const char * code = "(defun sq (x) (* x x)) ; squares\n(sq 12)\n  (let ((a \"s (\") (b 2)) (+ b 1)) 42 (sq\n (sq 3))";
+  const i64 expected[] = {-1, 144, 3, 42, 81};
+  size_t size = strlen(code);
+  // chunks of 1 to 7 bytes.
+  for(size_t step = 1; step < 8; step++){
+    stream_test t = {.ctx = jamlisp_new()};
+    jamlisp_stream stream;
+    jamlisp_stream_init(&stream, t.ctx, stream_test_form, &t);
+    for(size_t i = 0; i < size; i += step)
+      ASSERT(jamlisp_stream_feed(&stream, code + i, MIN(step, size - i)));
+    // every form is run as soon as it is closed.
+    ASSERT(t.count == array_count(expected));
+    ASSERT(jamlisp_stream_end(&stream));
+    ASSERT(t.count == array_count(expected));
+    ASSERT(memcmp(t.results, expected, sizeof(expected)) == 0);
+    jamlisp_stream_clear(&stream);
+  }
+
+  // the memory is bounded by the size of a form.
+  {
+    stream_test t = {.ctx = jamlisp_new()};
+    jamlisp_stream stream;
+    jamlisp_stream_init(&stream, t.ctx, stream_test_form, &t);
+    const char * form = "(+ 1 2) ";
+    for(int i = 0; i < 20000; i++)
+      ASSERT(jamlisp_stream_feed(&stream, form, strlen(form)));
+    ASSERT(jamlisp_stream_end(&stream));
+    ASSERT(t.count == 20000 && t.results[0] == 3);
+    ASSERT(stream.source.size < 256);
+    jamlisp_stream_clear(&stream);
+  }
+
+  // read from a pipe.
+  int fds[2];
+  ASSERT(pipe(fds) == 0);
+  ASSERT(write(fds[1], code, size) == (ssize_t)size);
+  close(fds[1]);
+  stream_test t = {.ctx = jamlisp_new()};
+  jamlisp_stream stream;
+  jamlisp_stream_init(&stream, t.ctx, stream_test_form, &t);
+  ASSERT(jamlisp_stream_fd(&stream, fds[0]));
+  close(fds[0]);
+  ASSERT(t.count == array_count(expected));
+  jamlisp_stream_clear(&stream);
+}
+
+static void module_test_form(void * userdata, const void * code, size_t size){
+  io_write(userdata, code, size);
+}
+
+// runs the top level forms of a module, the value of each is in 'results'.
+static void module_test_run(jamlisp_context * ctx, const jamlisp_module * module, i64 * results, size_t count){
+  io_reader rd = jamlisp_module_main(module);
+  for(size_t i = 0; i < count; i++){
+    jamlisp_iterate(ctx, &rd);
+    jamlisp_object result = jamlisp_pop(ctx);
+    results[i] = JAMLISP_IS(result, JAMLISP_INT64) ? JAMLISP_INT64(result) : -1;
+  }
+  ASSERT(rd.offset == rd.size);
+  ASSERT(ctx->value_stack.count == 0);
+}
+
+void test_module(){
+  logd("test_module\n");
+  const char * code =
+    "(defun fib (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))"
+    "(defun count (n acc) (if (< n 1) acc (count (- n 1) (+ acc 1))))"
+    "(defun get-s () *s*)"
+    "(defun big (x) (bigfloat x))"
+    "(fib 15) (count 1000 0) (let ((*s* 5)) (get-s)) (if (< (big 2) 3) 1 2)";
+  const i64 expected[] = {-1, -1, -1, -1, 610, 1000, 5, 1};
+  jamlisp_context * ctx = jamlisp_new();
+  io_writer main = {0};
+  jamlisp_stream stream;
+  jamlisp_stream_init(&stream, ctx, module_test_form, &main);
+  ASSERT(jamlisp_stream_feed(&stream, code, strlen(code)));
+  ASSERT(jamlisp_stream_end(&stream));
+  jamlisp_stream_clear(&stream);
+  io_writer wd = {0};
+  ASSERT(jamlisp_module_write(ctx, &wd, main.data, main.offset));
+  io_writer_clear(&main);
+  i64 results[array_count(expected)];
+
+  // a fresh context has the same symbol ids, the code is used as it is.
+  u8 * data = iron_clone(wd.data, wd.offset);
+  ctx = jamlisp_new();
+  jamlisp_module module;
+  ASSERT(jamlisp_module_load(ctx, &module, data, wd.offset));
+  ASSERT(module.patched == 0);
+  ASSERT(memcmp(data, wd.data, wd.offset) == 0);
+  module_test_run(ctx, &module, results, array_count(results));
+  ASSERT(memcmp(results, expected, sizeof(expected)) == 0);
+  // the other execution modes compile the module code.
+  ASSERT(eval_lisp_modes(ctx, "(fib 12)") == 144);
+  ASSERT(eval_lisp_modes(ctx, "(count 100 5)") == 105);
+  jamlisp_module_unload(ctx, &module);
+  ASSERT(jamlisp_nilp(symbol_get_value(ctx, jamlisp_symbol(ctx, "fib"))));
+  free(data);
+
+  // the symbols get other ids, the operands are rewritten.
+  data = iron_clone(wd.data, wd.offset);
+  ctx = jamlisp_new();
+  jamlisp_symbol(ctx, "unrelated");
+  jamlisp_symbol(ctx, "symbols");
+  ASSERT(jamlisp_module_load(ctx, &module, data, wd.offset));
+  ASSERT(module.patched > 0);
+  module_test_run(ctx, &module, results, array_count(results));
+  ASSERT(memcmp(results, expected, sizeof(expected)) == 0);
+  jamlisp_module_unload(ctx, &module);
+
+  // a damaged module is rejected.
+  memcpy(data, wd.data, wd.offset);
+  ASSERT(!jamlisp_module_load(ctx, &module, data, wd.offset - 1));
+  ((jamlisp_module_header *) data)->relocations += 4096;
+  ASSERT(!jamlisp_module_load(ctx, &module, data, wd.offset));
+  ((jamlisp_module_header *) data)->magic = 0;
+  ASSERT(!jamlisp_module_load(ctx, &module, data, wd.offset));
+  // bytecode that is not a complete form is found by the verifier.
+  memcpy(data, wd.data, wd.offset);
+  var header = (jamlisp_module_header *) data;
+  data[header->code + header->main] = 0xff;
+  ASSERT(!jamlisp_module_load(ctx, &module, data, wd.offset));
+  free(data);
+  // and so is top level code that reads a local it does not have.
+  u8 local[] = {JAMLISP_CODE_LOCAL_SMALL + 3, JAMLISP_OPCODE_NONE};
+  io_writer bad = {0};
+  ASSERT(jamlisp_module_write(ctx, &bad, local, sizeof(local)));
+  ASSERT(!jamlisp_module_load(ctx, &module, bad.data, bad.offset));
+  io_writer_clear(&bad);
+
+  // mapped from a file.
+  char path[] = "/tmp/jamlisp-module-XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(fd >= 0);
+  ASSERT(write(fd, wd.data, wd.offset) == (ssize_t)wd.offset);
+  close(fd);
+  ctx = jamlisp_new();
+  ASSERT(jamlisp_module_map(ctx, &module, path));
+  ASSERT(module.mapped && module.patched == 0);
+  module_test_run(ctx, &module, results, array_count(results));
+  ASSERT(memcmp(results, expected, sizeof(expected)) == 0);
+  jamlisp_module_unload(ctx, &module);
+  ASSERT(!jamlisp_module_map(ctx, &module, "/tmp/jamlisp-no-such-module"));
+  unlink(path);
+  io_writer_clear(&wd);
+}
+
+void test_primitives(){
+  logd("test_primitives\n");
+  jamlisp_context * ctx = jamlisp_new();
+  ASSERT(eval_lisp_modes(ctx, "(+ 1 2 3)") == 6);
+  ASSERT(eval_lisp_modes(ctx, "(+)") == 0);
+  ASSERT(eval_lisp_modes(ctx, "(- 5)") == -5);
+  ASSERT(eval_lisp_modes(ctx, "(- 10 3 2)") == 5);
+  ASSERT(eval_lisp_modes(ctx, "(* 2 3 4)") == 24);
+  ASSERT(eval_lisp_modes(ctx, "(/ 20 2 5)") == 2);
+  ASSERT(eval_lisp_modes(ctx, "(let ((x 3)) (* x (print (+ x 1))))") == 12);
+
+  // the known arity case is the opcode itself, there is no CALL.
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, "(let ((x 3)) (+ x 1))");
+  ASSERT(memchr(wd.data, JAMLISP_OPCODE_CALL, wd.offset) == NULL);
+  ASSERT(memchr(wd.data, JAMLISP_OPCODE_PRIMITIVE, wd.offset) == NULL);
+  io_reset(&wd);
+  jamlisp_load_lisp2(ctx, &wd, "(- 5)");
+  ASSERT(((u8 *) wd.data)[0] == JAMLISP_OPCODE_PRIMITIVE);
+
+  // a primitive can still be called through a symbol without byte code.
+  io_reset(&wd);
+  io_write_u8(&wd, JAMLISP_OPCODE_CALL);
+  io_write_u32_leb(&wd, JAMLISP_SYMBOL_ID(jamlisp_symbol(ctx, "cons")));
+  io_write_u32_leb(&wd, 2);
+  for(int i = 0; i < 2; i++){
+    io_write_u8(&wd, JAMLISP_OPCODE_INT);
+    io_write_i64_leb(&wd, i + 1);
+  }
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  jamlisp_iterate(ctx, &rd);
+  var cons = jamlisp_pop(ctx);
+  ASSERT(JAMLISP_IS(cons, JAMLISP_CONS));
+  ASSERT(JAMLISP_INT64(jamlisp_car(ctx, cons)) == 1);
+  ASSERT(JAMLISP_INT64(jamlisp_cdr(ctx, cons)) == 2);
+  ASSERT(ctx->value_stack.count == 0);
+  io_writer_clear(&wd);
+}
+
+void test_numbers(){
+  logd("test_numbers\n");
+  jamlisp_context * ctx = jamlisp_new();
+  var r = jamlisp_add(ctx, jamlisp_i64(1), jamlisp_f64(0.5));
+  ASSERT(JAMLISP_IS(r, JAMLISP_F64) && JAMLISP_FLOAT64(r) == 1.5);
+  r = jamlisp_add(ctx, jamlisp_f32(1.5f), jamlisp_i64(1));
+  ASSERT(JAMLISP_IS(r, JAMLISP_F32) && JAMLISP_FLOAT32(r) == 2.5f);
+  r = jamlisp_mul(ctx, jamlisp_f32(2.0f), jamlisp_f64(0.25));
+  ASSERT(JAMLISP_IS(r, JAMLISP_F64) && JAMLISP_FLOAT64(r) == 0.5);
+  r = jamlisp_sub(ctx, jamlisp_i32(10), jamlisp_i64(3));
+  ASSERT(JAMLISP_IS(r, JAMLISP_INT64) && JAMLISP_INT64(r) == 7);
+  r = jamlisp_div(ctx, jamlisp_i64(7), jamlisp_f64(2.0));
+  ASSERT(JAMLISP_IS(r, JAMLISP_F64) && JAMLISP_FLOAT64(r) == 3.5);
+  ASSERT(!jamlisp_nilp(jamlisp_less(ctx, jamlisp_i64(1), jamlisp_f64(1.5))));
+  ASSERT(jamlisp_nilp(jamlisp_less(ctx, jamlisp_f32(2.0f), jamlisp_i32(1))));
+  // an overflowing integer result is promoted.
+  r = jamlisp_mul(ctx, jamlisp_i64(1LL << 40), jamlisp_i64(1LL << 40));
+  ASSERT(JAMLISP_IS(r, JAMLISP_BIGNUM) && jamlisp_to_f64(r) == 0x1p80);
+
+  // threaded code quickens ADD for integers and goes back when it sees a float.
+  var x = jamlisp_symbol(ctx, "*x*");
+  symbol_set_value(ctx, x, jamlisp_i64(2));
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, "(+ *x* 1)");
+  jamlisp_code code = {0};
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  ASSERT(jamlisp_code_load(ctx, &code, &rd));
+  var add = code.insns + code.count - 2;
+  ASSERT(add->opcode == JAMLISP_OPCODE_ADD);
+  jamlisp_code_iterate(ctx, &code);
+  ASSERT(jamlisp_pop_i64(ctx) == 3);
+  ASSERT(add->opcode == JAMLISP_OPCODE_ADD_I64);
+  jamlisp_code_iterate(ctx, &code);
+  ASSERT(jamlisp_pop_i64(ctx) == 3);
+  symbol_set_value(ctx, x, jamlisp_f64(0.5));
+  jamlisp_code_iterate(ctx, &code);
+  r = jamlisp_pop(ctx);
+  ASSERT(JAMLISP_IS(r, JAMLISP_F64) && JAMLISP_FLOAT64(r) == 1.5);
+  ASSERT(add->opcode == JAMLISP_OPCODE_ADD);
+  jamlisp_code_free(&code);
+  io_writer_clear(&wd);
+}
+
+static bool number_equals(jamlisp_object obj, const char * expected){
+  io_writer w = {0};
+  jamlisp_number_write(&w, obj);
+  bool eq = w.offset == strlen(expected) && memcmp(w.data, expected, w.offset) == 0;
+  if(!eq)
+    logd("got %.*s expected %s\n", (int)w.offset, (char *)w.data, expected);
+  io_writer_clear(&w);
+  return eq;
+}
+
+// like eval_lisp_modes for a result that is printed as 'expected'.
+static bool eval_lisp_number(jamlisp_context * ctx, const char * code, const char * expected){
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, code);
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  jamlisp_iterate(ctx, &rd);
+  bool eq = number_equals(jamlisp_pop(ctx), expected);
+
+  io_writer postfix = {0};
+  rd = io_from_bytes(wd.data, wd.offset);
+  ASSERT(jamlisp_compile_postfix(ctx, &rd, &postfix));
+  rd = io_from_bytes(postfix.data, postfix.offset);
+  jamlisp_iterate_postfix(ctx, &rd);
+  eq = number_equals(jamlisp_pop(ctx), expected) && eq;
+
+  jamlisp_code threaded = {0};
+  rd = io_from_bytes(wd.data, wd.offset);
+  ASSERT(jamlisp_code_load(ctx, &threaded, &rd));
+  jamlisp_code_iterate(ctx, &threaded);
+  eq = number_equals(jamlisp_pop(ctx), expected) && eq;
+  ASSERT(ctx->value_stack.count == 0);
+
+  jamlisp_code_free(&threaded);
+  io_writer_clear(&postfix);
+  io_writer_clear(&wd);
+  return eq;
+}
+
+static jamlisp_object parse_number(jamlisp_context * ctx, const char * digits){
+  return jamlisp_integer_parse(ctx, digits, strlen(digits));
+}
+
+void test_bignums(){
+  logd("test_bignums\n");
+  jamlisp_context * ctx = jamlisp_new();
+  const char * big = "-123456789012345678901234567890123456789";
+  var a = parse_number(ctx, big);
+  ASSERT(JAMLISP_IS(a, JAMLISP_BIGNUM) && number_equals(a, big));
+  ASSERT(JAMLISP_IS(parse_number(ctx, "12345"), JAMLISP_INT64));
+
+  // results that fit are INT64 again.
+  var b = jamlisp_add(ctx, a, parse_number(ctx, "123456789012345678901234567890123456788"));
+  ASSERT(JAMLISP_IS(b, JAMLISP_INT64) && JAMLISP_INT64(b) == -1);
+  b = jamlisp_sub(ctx, jamlisp_i64(-5), a);
+  ASSERT(number_equals(b, "123456789012345678901234567890123456784"));
+  ASSERT(!jamlisp_nilp(jamlisp_less(ctx, a, jamlisp_i64(0))));
+  ASSERT(jamlisp_nilp(jamlisp_less(ctx, b, a)));
+
+  // large enough for Karatsuba.
+  io_writer digits = {0};
+  for(int i = 0; i < 2000; i++)
+    io_write(&digits, "9", 1);
+  var nines = jamlisp_integer_parse(ctx, digits.data, digits.offset);
+  var square = jamlisp_mul(ctx, nines, nines);
+  io_reset(&digits);
+  for(int i = 0; i < 1999; i++)
+    io_write(&digits, "9", 1);
+  io_write(&digits, "8", 1);
+  for(int i = 0; i < 1999; i++)
+    io_write(&digits, "0", 1);
+  io_write(&digits, "1", 2);
+  ASSERT(number_equals(square, digits.data));
+  io_writer_clear(&digits);
+
+  // (a b + c) / b = a for |c| < b, the quotient is truncated towards 0.
+  var c = parse_number(ctx, "-98765432109876543210987654321");
+  var q = jamlisp_div(ctx, jamlisp_add(ctx, jamlisp_mul(ctx, nines, a), c), nines);
+  ASSERT(jamlisp_integer_compare(q, a) == 0);
+  q = jamlisp_div(ctx, square, nines);
+  ASSERT(jamlisp_integer_compare(q, nines) == 0);
+
+  io_writer wd = {0};
+  jamlisp_load_lisp2(ctx, &wd, "(defun fact (n) (if (< n 2) 1 (* n (fact (- n 1)))))");
+  io_writer_clear(&wd);
+  ASSERT(eval_lisp_number(ctx, "(fact 30)", "265252859812191058636308480000000"));
+  ASSERT(eval_lisp_number(ctx, "(/ (fact 30) (fact 28))", "870"));
+  ASSERT(eval_lisp_number(ctx, "(+ 123456789012345678901234567890 1)", "123456789012345678901234567891"));
+  ASSERT(eval_lisp_number(ctx, "(- -123456789012345678901234567890 1)", "-123456789012345678901234567891"));
+
+  // bigfloats.
+  var third = jamlisp_div(ctx, jamlisp_bigfloat(ctx, jamlisp_i64(1)), jamlisp_i64(3));
+  ASSERT(JAMLISP_IS(third, JAMLISP_BIGFLOAT) && jamlisp_to_f64(third) == 1.0 / 3.0);
+  io_writer w = {0};
+  jamlisp_number_write(&w, third);
+  ASSERT(w.offset > 70 && memcmp(w.data, "0.33333333333333333333333333333333333333333333333333333333333333333333", 70) == 0);
+  io_writer_clear(&w);
+  var sum = jamlisp_add(ctx, third, jamlisp_f64(0.5));
+  ASSERT(JAMLISP_IS(sum, JAMLISP_BIGFLOAT));
+  ASSERT(!jamlisp_nilp(jamlisp_less(ctx, third, sum)));
+  ASSERT(jamlisp_to_f64(jamlisp_mul(ctx, sum, jamlisp_i64(6))) == 5.0);
+  ASSERT(number_equals(jamlisp_sub(ctx, jamlisp_bigfloat(ctx, jamlisp_f64(2.5)), jamlisp_i64(4)), "-1.5"));
+  ASSERT(eval_lisp_number(ctx, "(* (bigfloat 3) 1000000000000000000000000)", "3000000000000000000000000.0"));
+
+  // outside an arena bignums are collected, the ones still referenced survive.
+  jamlisp_gc_set_mode(ctx, JAMLISP_GC_MARK_SWEEP);
+  var held = jamlisp_symbol(ctx, "held");
+  symbol_set_value(ctx, held, a);
+  var held_list = jamlisp_symbol(ctx, "held-list");
+  symbol_set_value(ctx, held_list, jamlisp_cons(ctx, nines, jamlisp_nil()));
+  u64 major_collections = ctx->gc.major_collections;
+  jamlisp_load_lisp2(ctx, &wd, "(defun churn-big (n x) (if (< n 1) x (churn-big (- n 1) (- (* x 3) (* x 2)))))");
+  io_writer_clear(&wd);
+  ASSERT(eval_lisp_number(ctx, "(churn-big 20000 123456789012345678901234567890)", "123456789012345678901234567890"));
+  ASSERT(ctx->gc.major_collections > major_collections);
+  ASSERT(ctx->gc.bignum_count < 20000);
+  ASSERT(number_equals(symbol_get_value(ctx, held), big));
+  ASSERT(jamlisp_integer_compare(jamlisp_car(ctx, symbol_get_value(ctx, held_list)), nines) == 0);
+
+  // a value replaced in an arena is kept for the rewind.
+  var cp = jamlisp_arena_begin(ctx);
+  symbol_set_value(ctx, held, jamlisp_i64(0));
+  jamlisp_gc_collect(ctx);
+  jamlisp_arena_rewind(ctx, &cp);
+  jamlisp_arena_end(ctx, &cp);
+  ASSERT(number_equals(symbol_get_value(ctx, held), big));
+}
+
+static jamlisp_object test_array(jamlisp_context * ctx, jamlisp_type type, const void * data, size_t size){
+  return JAMLISP_MAKE_ARRAY(jamlisp_array_new(ctx, type, (void *) data, size));
+}
+
+void test_arrays(){
+  logd("test_arrays\n");
+  jamlisp_context * ctx = jamlisp_new();
+  // 19 elements, so the vector loops and the scalar tails both run.
+  i64 ints[19];
+  f32 floats[19];
+  f64 doubles[19];
+  for(int i = 0; i < 19; i++){
+    ints[i] = i + 1;
+    floats[i] = i + 1;
+    doubles[i] = i % 2 ? -(i + 1) : i + 1;
+  }
+  symbol_set_value(ctx, jamlisp_symbol(ctx, "ints"), test_array(ctx, JAMLISP_INT64, ints, sizeof(ints)));
+  symbol_set_value(ctx, jamlisp_symbol(ctx, "floats"), test_array(ctx, JAMLISP_F32, floats, sizeof(floats)));
+  symbol_set_value(ctx, jamlisp_symbol(ctx, "doubles"), test_array(ctx, JAMLISP_F64, doubles, sizeof(doubles)));
+  // translates by (10 20 30).
+  f32 translate[16] = {1, 0, 0, 10, 0, 1, 0, 20, 0, 0, 1, 30, 0, 0, 0, 1};
+  symbol_set_value(ctx, jamlisp_symbol(ctx, "translate"), test_array(ctx, JAMLISP_F32, translate, sizeof(translate)));
+
+  for(jamlisp_simd_level level = 0; level <= jamlisp_simd_detect(); level++){
+    ASSERT(jamlisp_simd_set(ctx, level));
+    logd("  %s\n", jamlisp_simd_name(level));
+    ASSERT(eval_lisp_modes(ctx, "(array-length ints)") == 19);
+    ASSERT(eval_lisp_modes(ctx, "(array-sum ints)") == 190);
+    ASSERT(eval_lisp_modes(ctx, "(array-dot ints ints)") == 2470);
+    ASSERT(eval_lisp_modes(ctx, "(array-ref (array-mul ints ints) 18)") == 361);
+    ASSERT(eval_lisp_modes(ctx, "(array-sum (array-fma ints ints ints))") == 2660);
+    ASSERT(eval_lisp_modes(ctx, "(array-min (i64-array 5 -3 8 2 9 -7 1 0 4))") == -7);
+    ASSERT(eval_lisp_modes(ctx, "(array-max (i64-array 5 -3 8 2 9 -7 1 0 4))") == 9);
+    ASSERT(eval_lisp_number(ctx, "(array-sum (array-add floats floats))", "380.000000"));
+    ASSERT(eval_lisp_number(ctx, "(array-dot floats floats)", "2470.000000"));
+    ASSERT(eval_lisp_number(ctx, "(array-min doubles)", "-18.000000"));
+    ASSERT(eval_lisp_number(ctx, "(array-max doubles)", "19.000000"));
+    ASSERT(eval_lisp_number(ctx, "(array-sum doubles)", "10.000000"));
+    ASSERT(eval_lisp_number(ctx, "(array-ref (array-transform translate (f32-array 1 2 3 4 5 6) 3) 4)", "25.000000"));
+    ASSERT(eval_lisp_number(ctx, "(array-sum (array-transform translate (f32-array 1 2 3 4 5 6) 3))", "141.000000"));
+    ASSERT(eval_lisp_number(ctx, "(array-ref (array-transform translate (f32-array 1 2 3 0 4 5 6 2)) 6)", "66.000000"));
+    ASSERT(eval_lisp_number(ctx, "(array-ref (array-transform (f64-array 2 0 0 0 0 2 0 0 0 0 2 0 0 0 0 1) (f64-array 1 2 3 1)) 2)", "6.000000"));
+  }
+
+  // every level gives the same results as the scalar kernels.
+  enum { N = 1003 };
+  i64 * a = malloc(N * sizeof(i64)), * b = malloc(N * sizeof(i64)), * r = malloc(N * sizeof(i64)), * expected = malloc(N * sizeof(i64));
+  u64 rnd = 7;
+  for(int i = 0; i < N; i++){
+    rnd = rnd * 6364136223846793005ULL + 1442695040888963407ULL;
+    a[i] = (i64)(rnd >> 20) - (1LL << 43);
+    b[i] = (i64)(rnd % 2001) - 1000;
+  }
+  jamlisp_simd_set(ctx, JAMLISP_SIMD_SCALAR);
+  var scalar = ctx->array_kernels[JAMLISP_ARRAY_I64];
+  for(jamlisp_simd_level level = 1; level <= jamlisp_simd_detect(); level++){
+    jamlisp_simd_set(ctx, level);
+    var k = ctx->array_kernels[JAMLISP_ARRAY_I64];
+    for(int n = 0; n < 40; n++){
+      scalar.fma(expected, a, b, a, n);
+      k.fma(r, a, b, a, n);
+      ASSERT(memcmp(expected, r, n * sizeof(i64)) == 0);
+    }
+    i64 x, y;
+    scalar.dot(&x, a, b, N);
+    k.dot(&y, a, b, N);
+    ASSERT(x == y);
+    scalar.min(&x, a, N);
+    k.min(&y, a, N);
+    ASSERT(x == y);
+    scalar.max(&x, b, N);
+    k.max(&y, b, N);
+    ASSERT(x == y);
+  }
+  free(a);
+  free(b);
+  free(r);
+  free(expected);
+}
+
+void test_trace(){
+  logd("test_trace\n");
+  jamlisp_context * ctx = jamlisp_new();
+  io_writer wd = {0};
+  write_test_add_tree(&wd);
+  io_reader rd = io_from_bytes(wd.data, wd.offset);
+  jamlisp_code code = {0};
+  ASSERT(jamlisp_code_load(ctx, &code, &rd));
+  // the records are compared with the instructions, so they must not be quickened.
+  ctx->quicken = false;
+  jamlisp_trace_enable(ctx, 3);
+  ASSERT(ctx->trace.capacity == 4);
+  jamlisp_code_iterate(ctx, &code);
+  ASSERT(jamlisp_pop_i64(ctx) == 2);
+  ASSERT(ctx->trace.count == code.count);
+
+  jamlisp_trace_record records[8];
+  size_t count = jamlisp_trace_read(ctx, records, array_count(records));
+  ASSERT(count == 4);
+  u32 depths[] = {2, 3, 2, 1};
+  for(size_t i = 0; i < count; i++){
+    ASSERT(records[i].node_id == 4 + i);
+    ASSERT(JAMLISP_TRACE_OPCODE(records[i]) == code.insns[4 + i].opcode);
+    ASSERT(JAMLISP_TRACE_DEPTH(records[i]) == depths[i]);
+  }
+  io_writer trace = {0};
+  jamlisp_trace_write(ctx, &trace);
+  ASSERT(trace.offset == 1 + 4 * 8);
+  // the words are little endian, the opcode is the low byte of the second.
+  const u8 * first = (const u8 *) trace.data + 1;
+  ASSERT(first[0] == 4 && first[1] == 0 && first[2] == 0 && first[3] == 0);
+  ASSERT(first[4] == code.insns[4].opcode && first[5] == depths[0] && first[6] == 0 && first[7] == 0);
+  jamlisp_trace_disable(ctx);
+  jamlisp_code_iterate(ctx, &code);
+  ASSERT(jamlisp_pop_i64(ctx) == 2);
+  ASSERT(ctx->trace.count == 0);
+  io_writer_clear(&trace);
+  jamlisp_code_free(&code);
+  io_writer_clear(&wd);
+}
+
+jamlisp_object make_test_list(jamlisp_context * ctx, int count){
+  jamlisp_object list = jamlisp_nil();
+  for(int i = count; i > 0; i--)
+    list = jamlisp_cons(ctx, jamlisp_i64(i), list);
+  return list;
+}
+
+i64 sum_test_list(jamlisp_context * ctx, jamlisp_object list){
+  i64 sum = 0;
+  for(; !jamlisp_nilp(list); list = jamlisp_cdr(ctx, list))
+    sum += JAMLISP_INT64(jamlisp_car(ctx, list));
+  return sum;
+}
+
+void test_gc(){
+  logd("test_gc\n");
+  jamlisp_context * ctx = jamlisp_new();
+  jamlisp_gc_set_mode(ctx, JAMLISP_GC_MARK_SWEEP);
+  var keep = jamlisp_symbol(ctx, "keep");
+  symbol_set_value(ctx, keep, make_test_list(ctx, 100));
+  for(int i = 0; i < 100; i++)
+    make_test_list(ctx, 50);
+  jamlisp_push(ctx, make_test_list(ctx, 10));
+  jamlisp_gc_collect(ctx);
+  ASSERT(sum_test_list(ctx, symbol_get_value(ctx, keep)) == 5050);
+  ASSERT(sum_test_list(ctx, jamlisp_top(ctx)) == 55);
+  ASSERT(jamlisp_heap_free_count(&ctx->heap) == ctx->heap.heap_size - 1 - 110);
+  // automatic collections keep the heap from growing with garbage.
+  size_t heap_size = ctx->heap.heap_size;
+  for(int i = 0; i < 1000; i++)
+    make_test_list(ctx, 50);
+  ASSERT(ctx->gc.collections > 1);
+  ASSERT(ctx->heap.heap_size <= heap_size * 2);
+  ASSERT(sum_test_list(ctx, symbol_get_value(ctx, keep)) == 5050);
+  jamlisp_pop(ctx);
+  symbol_set_value(ctx, keep, jamlisp_nil());
+  jamlisp_gc_collect(ctx);
+  ASSERT(jamlisp_heap_free_count(&ctx->heap) == ctx->heap.heap_size - 1);
+
+  // an old cons pointing to a young one through the write barrier.
+  jamlisp_gc_set_mode(ctx, JAMLISP_GC_GENERATIONAL);
+  var old = make_test_list(ctx, 3);
+  symbol_set_value(ctx, keep, old);
+  jamlisp_gc_minor(ctx);
+  ASSERT(jamlisp_gc_marked(&ctx->heap, JAMLISP_CONS_INDEX(old)));
+  var young = make_test_list(ctx, 4);
+  var garbage = make_test_list(ctx, 5);
+  jamlisp_set_car(ctx, old, young);
+  ASSERT(ctx->gc.remembered_count == 1);
+  jamlisp_gc_minor(ctx);
+  ASSERT(ctx->gc.remembered_count == 0);
+  ASSERT(jamlisp_gc_marked(&ctx->heap, JAMLISP_CONS_INDEX(young)));
+  ASSERT(!jamlisp_gc_marked(&ctx->heap, JAMLISP_CONS_INDEX(garbage)));
+  ASSERT(sum_test_list(ctx, jamlisp_car(ctx, old)) == 10);
+  ASSERT(jamlisp_heap_free_count(&ctx->heap) == ctx->heap.heap_size - 1 - 7);
+  for(int i = 0; i < 1000; i++)
+    make_test_list(ctx, 50);
+  ASSERT(sum_test_list(ctx, jamlisp_car(ctx, old)) == 10);
+  ASSERT(ctx->gc.major_collections > 2);
+}
+
+void test_heap_pages(){
+  logd("test_heap_pages\n");
+  jamlisp_context * ctx = jamlisp_new();
+  var heap = &ctx->heap;
+  var keep = jamlisp_symbol(ctx, "keep");
+  symbol_set_value(ctx, keep, make_test_list(ctx, 10));
+  // growing the heap does not move the existing conses.
+  var page0 = heap->pages[0];
+  for(int i = 0; i < 8; i++)
+    make_test_list(ctx, JAMLISP_HEAP_PAGE_SIZE);
+  ASSERT(heap->pages[0] == page0);
+  ASSERT(heap->page_count == 9);
+
+  // the empty pages are released.
+  jamlisp_gc_collect(ctx);
+  ASSERT(heap->released_pages == 7);
+  ASSERT(sum_test_list(ctx, symbol_get_value(ctx, keep)) == 55);
+  size_t free_count = jamlisp_heap_free_count(heap);
+  ASSERT(free_count == heap->heap_size - 1 - 10);
+
+  // and used again before the heap grows.
+  for(size_t i = 0; i < free_count; i++)
+    jamlisp_new_cons(ctx);
+  ASSERT(heap->released_pages == 0);
+  ASSERT(heap->page_count == 9);
+  ASSERT(sum_test_list(ctx, symbol_get_value(ctx, keep)) == 55);
+}
+
+void test_arena(){
+  logd("test_arena\n");
+  jamlisp_context * ctx = jamlisp_new();
+  jamlisp_gc_set_mode(ctx, JAMLISP_GC_MARK_SWEEP);
+  var x = jamlisp_symbol(ctx, "x");
+  symbol_set_value(ctx, x, jamlisp_i64(1));
+  var keep = make_test_list(ctx, 3);
+  jamlisp_push(ctx, keep);
+
+  u64 collections = ctx->gc.collections;
+  var cp = jamlisp_arena_begin(ctx);
+  jamlisp_object_index first = 0;
+  for(int i = 0; i < 10; i++){
+    // every evaluation starts from the same state and reuses the same memory.
+    var list = make_test_list(ctx, 1000);
+    if(i == 0)
+      first = JAMLISP_CONS_INDEX(list);
+    ASSERT(JAMLISP_CONS_INDEX(list) == first);
+    symbol_set_value(ctx, x, list);
+    symbol_set_value(ctx, jamlisp_symbol(ctx, "y"), list);
+    jamlisp_push(ctx, list);
+    u8 * mem = jamlisp_arena_alloc(ctx, 10000);
+    memset(mem, i, 10000);
+    ASSERT(sum_test_list(ctx, symbol_get_value(ctx, x)) == 500500);
+    jamlisp_arena_rewind(ctx, &cp);
+    ASSERT(JAMLISP_INT64(symbol_get_value(ctx, x)) == 1);
+    ASSERT(jamlisp_nilp(symbol_get_value(ctx, jamlisp_symbol(ctx, "y"))));
+    ASSERT(JAMLISP_CONS_INDEX(jamlisp_top(ctx)) == JAMLISP_CONS_INDEX(keep));
+  }
+  // nothing is collected inside the arena.
+  ASSERT(ctx->gc.collections == collections);
+
+  // a symbol is saved once however often it changes, a nested checkpoint
+  // saves it again and restores the value at its own checkpoint.
+  var z = jamlisp_symbol(ctx, "z");
+  size_t undo_count = ctx->symbol_undo_count;
+  for(int i = 0; i < 1000; i++)
+    symbol_set_value(ctx, z, jamlisp_i64(i));
+  ASSERT(ctx->symbol_undo_count == undo_count + 1);
+  var inner = jamlisp_arena_begin(ctx);
+  symbol_set_value(ctx, z, jamlisp_i64(-1));
+  symbol_set_value(ctx, x, jamlisp_i64(-1));
+  jamlisp_arena_end(ctx, &inner);
+  ASSERT(JAMLISP_INT64(symbol_get_value(ctx, z)) == 999 && JAMLISP_INT64(symbol_get_value(ctx, x)) == 1);
+  // saved again, the nested checkpoint changed it.
+  symbol_set_value(ctx, z, jamlisp_i64(5));
+  ASSERT(ctx->symbol_undo_count == undo_count + 2);
+  jamlisp_arena_rewind(ctx, &cp);
+  ASSERT(jamlisp_nilp(symbol_get_value(ctx, z)) && ctx->symbol_undo_count == 0);
+
+  // the parser takes its arrays from the arena and keeps its writers.
+  io_writer wd = {0};
+  u64 array_generation;
+  // each add3 is another function at the same address, its cached code is
+  // not reused.
+  array_generation = 0;
+  for(int i = 0; i < 3; i++){
+    char defun[100];
+    snprintf(defun, sizeof(defun), "(defun add3 (a b c) (let ((d (+ a b)) (*e* c)) (+ d *e* %i)))", i);
+    io_reset(&wd);
+    jamlisp_load_lisp2(ctx, &wd, defun);
+    io_reset(&wd);
+    jamlisp_load_lisp2(ctx, &wd, "(add3 1 2 (let ((x 3)) x))");
+    io_reader rd = io_from_bytes(wd.data, wd.offset);
+    jamlisp_iterate(ctx, &rd);
+    ASSERT(jamlisp_pop_i64(ctx) == 6 + i);
+    jamlisp_code threaded = {0};
+    rd = io_from_bytes(wd.data, wd.offset);
+    ASSERT(jamlisp_code_load(ctx, &threaded, &rd));
+    jamlisp_code_iterate(ctx, &threaded);
+    ASSERT(jamlisp_pop_i64(ctx) == 6 + i);
+    jamlisp_code_free(&threaded);
+    var f = jamlisp_function_get(ctx, JAMLISP_SYMBOL_ID(jamlisp_symbol(ctx, "add3")));
+    ASSERT(f->generation > array_generation);
+    array_generation = f->generation;
+    // the name, code and headers of the form and of the defun, and the
+    // function bytecode.
+    ASSERT(ctx->parser_writer_count == 6);
+    jamlisp_arena_rewind(ctx, &cp);
+    ASSERT(jamlisp_nilp(symbol_get_value(ctx, jamlisp_symbol(ctx, "add3"))));
+  }
+  io_writer_clear(&wd);
+  jamlisp_arena_end(ctx, &cp);
+  ASSERT(ctx->parser_writer_count == 0);
+  ASSERT(ctx->heap.arena_base == 0);
+  ASSERT(ctx->arena.depth == 0);
+
+  for(int i = 0; i < 100; i++)
+    make_test_list(ctx, 50);
+  ASSERT(ctx->gc.collections > collections);
+  ASSERT(sum_test_list(ctx, jamlisp_top(ctx)) == 6);
+}
 
 void test_alloc_alg(){
   logd("test_alloc_alg\n");
@@ -159,6 +1751,28 @@ void run_tests(){
   test_heap_objects();
   test_lisp_symbols();
   test_lisp_symbol_values();
+  test_gc();
+  test_heap_pages();
+  test_arena();
+  test_threaded_code();
+  test_postfix();
+  test_variables();
+  test_value_stack();
+  test_encoding();
+  test_verify();
+  test_calls();
+  test_registers();
+  test_lexer();
+  test_parser();
+  test_stream();
+  test_module();
+  test_primitives();
+  test_numbers();
+  test_bignums();
+  test_arrays();
+#if JAMLISP_TRACE_RING
+  test_trace();
+#endif
   test_run_lisp();
   
 }
@@ -0,0 +1,390 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Modules.
+// The bytecode of a module is the prefix bytecode of the loader, except that
+// symbol and primitive operands and the branch sizes of IF are written as 5
+// byte LEBs. The symbol and primitive operands are listed as relocations, so
+// a module is loaded by interning the names of its symbols and rewriting only
+// the operands whose id is different in the loading context. The symbol table
+// holds every symbol of the writing context in the order they were made, a
+// fresh context loading it gets the same ids and nothing is rewritten, the
+// code runs from the pages of the file. Integer constants are immediates in
+// the bytecode, the names are the only constants that need a pool.
+
+#define MODULE_OPERAND_SIZE 5
+
+static void operand_set(u8 * p, u32 value){
+  for(int i = 0; i < MODULE_OPERAND_SIZE - 1; i++){
+    p[i] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  p[MODULE_OPERAND_SIZE - 1] = value;
+}
+
+static u32 operand_get(const u8 * p){
+  u32 value = 0;
+  for(int i = 0; i < MODULE_OPERAND_SIZE; i++)
+    value |= (u32)(p[i] & 0x7f) << (7 * i);
+  return value;
+}
+
+static void write_operand(io_writer * write, u32 value){
+  u8 bytes[MODULE_OPERAND_SIZE];
+  operand_set(bytes, value);
+  io_write(write, bytes, sizeof(bytes));
+}
+
+typedef struct{
+  jamlisp_context * ctx;
+  io_writer code;
+  jamlisp_module_relocation * relocations;
+  size_t relocation_count;
+  size_t relocation_capacity;
+}module_writer;
+
+static void write_relocation(module_writer * w, jamlisp_relocation_kind kind, u32 symbol, u32 value){
+  ensure_size2((void **) &w->relocations, sizeof(w->relocations[0]), &w->relocation_capacity, w->relocation_count, 1.5);
+  w->relocations[w->relocation_count++] = (jamlisp_module_relocation){.offset = w->code.offset, .kind = kind, .symbol = symbol};
+  write_operand(&w->code, value);
+}
+
+typedef struct{
+  jamlisp_opcode opcode;
+  u32 child_count;
+  // the branch sizes of an IF and where the current branch started.
+  size_t sizes;
+  size_t start;
+}module_pending;
+
+// rewrites prefix bytecode with fixed size operands. The IF branch sizes are
+// filled in when each branch is done, so this is a single pass.
+static bool module_encode(module_writer * w, const void * code, size_t size){
+  io_reader rd = io_from_bytes(code, size);
+  var out = &w->code;
+  module_pending * pending = NULL;
+  size_t pending_capacity = 0;
+  size_t depth = 0;
+  bool ok = true;
+  while(rd.offset < rd.size){
+    jamlisp_insn insn;
+    if(!jamlisp_read_prefix_node(w->ctx, &rd, &insn)){
+      // a NONE ends each top level form.
+      if(insn.opcode == JAMLISP_OPCODE_NONE && depth == 0){
+	io_write_u8(out, JAMLISP_OPCODE_NONE);
+	continue;
+      }
+      ok = false;
+      break;
+    }
+    size_t sizes = 0;
+    switch(insn.opcode){
+    case JAMLISP_OPCODE_CALL:
+    case JAMLISP_OPCODE_TAILCALL:
+      if(insn.child_count < JAMLISP_CODE_SMALL_COUNT){
+	u8 base = insn.opcode == JAMLISP_OPCODE_CALL ? JAMLISP_CODE_CALL_SMALL : JAMLISP_CODE_TAILCALL_SMALL;
+	io_write_u8(out, base + insn.child_count);
+	write_relocation(w, JAMLISP_RELOCATION_SYMBOL, insn.call, insn.call);
+	break;
+      }
+      io_write_u8(out, insn.opcode);
+      write_relocation(w, JAMLISP_RELOCATION_SYMBOL, insn.call, insn.call);
+      io_write_u32_leb(out, insn.child_count);
+      break;
+    case JAMLISP_OPCODE_PRIMITIVE:{
+      if(insn.call >= w->ctx->primitive_count){
+	ok = false;
+	break;
+      }
+      var symbol = jamlisp_symbol(w->ctx, w->ctx->primitives[insn.call].name);
+      io_write_u8(out, insn.opcode);
+      write_relocation(w, JAMLISP_RELOCATION_PRIMITIVE, JAMLISP_SYMBOL_ID(symbol), insn.call);
+      io_write_u32_leb(out, insn.child_count);
+      break;
+    }
+    case JAMLISP_OPCODE_GLOBAL:
+    case JAMLISP_OPCODE_BIND:
+      io_write_u8(out, insn.opcode);
+      write_relocation(w, JAMLISP_RELOCATION_SYMBOL, insn.call, insn.call);
+      break;
+    case JAMLISP_OPCODE_IF:
+      io_write_u8(out, insn.opcode);
+      sizes = out->offset;
+      write_operand(out, 0);
+      write_operand(out, 0);
+      break;
+    default:
+      jamlisp_write_prefix_node(out, &insn);
+      break;
+    }
+    if(!ok)
+      break;
+    if(insn.child_count > 0){
+      ensure_size2((void **) &pending, sizeof(pending[0]), &pending_capacity, depth, 1.5);
+      pending[depth++] = (module_pending){.opcode = insn.opcode, .child_count = insn.child_count, .sizes = sizes};
+      continue;
+    }
+    // the node is done, and so is every parent it was the last child of.
+    while(depth > 0){
+      var parent = pending + depth - 1;
+      parent->child_count -= 1;
+      if(parent->opcode == JAMLISP_OPCODE_IF){
+	// after the condition the then branch starts, after it the else branch.
+	if(parent->child_count < 2){
+	  u8 * field = (u8 *) out->data + parent->sizes + (parent->child_count == 0 ? MODULE_OPERAND_SIZE : 0);
+	  operand_set(field, out->offset - parent->start);
+	}
+	parent->start = out->offset;
+      }
+      if(parent->child_count > 0)
+	break;
+      depth -= 1;
+    }
+  }
+  if(depth > 0)
+    ok = false;
+  free(pending);
+  return ok;
+}
+
+// appends a table at a 4 byte aligned offset from 'base', returns the offset.
+static u32 write_table(io_writer * module, size_t base, const void * data, size_t size){
+  while((module->offset - base) % 4 != 0)
+    io_write_u8(module, 0);
+  u32 offset = module->offset - base;
+  if(size > 0)
+    io_write(module, data, size);
+  return offset;
+}
+
+bool jamlisp_module_write(jamlisp_context * ctx, io_writer * module, const void * main, size_t main_size){
+  module_writer w = {.ctx = ctx};
+  jamlisp_module_function * functions = NULL;
+  size_t function_count = 0, function_capacity = 0;
+  bool ok = true;
+  for(u32 id = 1; ok && id <= ctx->symbol_counter; id++){
+    var code = jamlisp_function_code(ctx, id);
+    if(code == NULL)
+      continue;
+    ensure_size2((void **) &functions, sizeof(functions[0]), &function_capacity, function_count, 1.5);
+    size_t offset = w.code.offset;
+    ok = module_encode(&w, code->data, code->size);
+    functions[function_count++] = (jamlisp_module_function){.symbol = id, .offset = offset, .size = w.code.offset - offset};
+  }
+  size_t main_offset = w.code.offset;
+  if(ok)
+    ok = module_encode(&w, main, main_size);
+  if(!ok){
+    logd("Invalid byte code\n");
+  }else{
+    // the ids start at 1, entry 0 is an empty name.
+    u32 symbol_count = ctx->symbol_counter + 1;
+    u32 * name_offsets = alloc0(symbol_count * sizeof(name_offsets[0]));
+    io_writer names = {0};
+    for(u32 id = 0; id < symbol_count; id++){
+      const char * name = id == 0 ? "" : jamlisp_symbol_name(ctx, id);
+      name_offsets[id] = names.offset;
+      io_write(&names, name, strlen(name) + 1);
+    }
+    size_t base = module->offset;
+    jamlisp_module_header header = {
+      .magic = JAMLISP_MODULE_MAGIC,
+      .version = JAMLISP_MODULE_VERSION,
+      .symbol_count = symbol_count,
+      .function_count = function_count,
+      .relocation_count = w.relocation_count,
+      .main = main_offset,
+      .main_size = w.code.offset - main_offset
+    };
+    io_write(module, &header, sizeof(header));
+    header.symbols = write_table(module, base, name_offsets, symbol_count * sizeof(name_offsets[0]));
+    header.names = write_table(module, base, names.data, names.offset);
+    header.names_size = names.offset;
+    header.functions = write_table(module, base, functions, function_count * sizeof(functions[0]));
+    header.relocations = write_table(module, base, w.relocations, w.relocation_count * sizeof(w.relocations[0]));
+    header.code = write_table(module, base, w.code.data, w.code.offset);
+    header.code_size = w.code.offset;
+    header.size = module->offset - base;
+    memcpy((u8 *) module->data + base, &header, sizeof(header));
+    free(name_offsets);
+    io_writer_clear(&names);
+  }
+  free(functions);
+  free(w.relocations);
+  io_writer_clear(&w.code);
+  return ok;
+}
+
+static bool module_range(const jamlisp_module_header * header, u32 offset, u64 size){
+  return (u64) offset + size <= header->size;
+}
+
+// every offset and index is checked, so a damaged file can not make the
+// loader read outside of it.
+static bool module_check(const u8 * data, size_t size){
+  if(size < sizeof(jamlisp_module_header) || (uintptr_t) data % 4 != 0)
+    return false;
+  const jamlisp_module_header * h = (const void *) data;
+  if(h->magic != JAMLISP_MODULE_MAGIC || h->version != JAMLISP_MODULE_VERSION || h->size > size)
+    return false;
+  if((h->symbols | h->functions | h->relocations) % 4 != 0)
+    return false;
+  if(!module_range(h, h->symbols, (u64) h->symbol_count * sizeof(u32))
+     || !module_range(h, h->names, h->names_size)
+     || !module_range(h, h->functions, (u64) h->function_count * sizeof(jamlisp_module_function))
+     || !module_range(h, h->relocations, (u64) h->relocation_count * sizeof(jamlisp_module_relocation))
+     || !module_range(h, h->code, h->code_size)
+     || (u64) h->main + h->main_size > h->code_size)
+    return false;
+  if(h->names_size == 0 || data[h->names + h->names_size - 1] != 0)
+    return false;
+  const u32 * symbols = (const void *)(data + h->symbols);
+  for(u32 i = 0; i < h->symbol_count; i++)
+    if(symbols[i] >= h->names_size)
+      return false;
+  const jamlisp_module_function * functions = (const void *)(data + h->functions);
+  for(u32 i = 0; i < h->function_count; i++){
+    var f = functions[i];
+    if(f.symbol == 0 || f.symbol >= h->symbol_count || (u64) f.offset + f.size > h->code_size)
+      return false;
+  }
+  const jamlisp_module_relocation * relocations = (const void *)(data + h->relocations);
+  for(u32 i = 0; i < h->relocation_count; i++){
+    var r = relocations[i];
+    if(r.symbol == 0 || r.symbol >= h->symbol_count || r.kind > JAMLISP_RELOCATION_PRIMITIVE
+       || (u64) r.offset + MODULE_OPERAND_SIZE > h->code_size)
+      return false;
+  }
+  return true;
+}
+
+bool jamlisp_module_load(jamlisp_context * ctx, jamlisp_module * module, void * data, size_t size){
+  *module = (jamlisp_module){.data = data, .size = size};
+  if(!module_check(data, size)){
+    logd("Invalid module\n");
+    return false;
+  }
+  u8 * bytes = data;
+  const jamlisp_module_header * h = data;
+  const u32 * symbols = (const void *)(bytes + h->symbols);
+  const char * names = (const char *) bytes + h->names;
+  u32 * ids = alloc0(h->symbol_count * sizeof(ids[0]));
+  for(u32 i = 1; i < h->symbol_count; i++)
+    ids[i] = JAMLISP_SYMBOL_ID(jamlisp_symbol(ctx, names + symbols[i]));
+
+  u8 * code = bytes + h->code;
+  const jamlisp_module_relocation * relocations = (const void *)(bytes + h->relocations);
+  bool ok = true;
+  for(u32 i = 0; i < h->relocation_count; i++){
+    var r = relocations[i];
+    u32 value = ids[r.symbol];
+    if(r.kind == JAMLISP_RELOCATION_PRIMITIVE && jamlisp_symbol_primitive(ctx, JAMLISP_MAKE_SYMBOL(value), &value) == NULL){
+      logd("Undefined primitive %s\n", names + symbols[r.symbol]);
+      ok = false;
+      break;
+    }
+    // only the operands that differ are written, so the pages of a module
+    // loaded by a context like the one that wrote it are never copied.
+    if(operand_get(code + r.offset) != value){
+      operand_set(code + r.offset, value);
+      module->patched += 1;
+    }
+  }
+
+  // checked once here, the interpreter trusts the code.
+  const jamlisp_module_function * functions = (const void *)(bytes + h->functions);
+  for(u32 i = 0; ok && i <= h->function_count; i++){
+    bool main = i == h->function_count;
+    jamlisp_verify_info info;
+    bool valid = jamlisp_verify(ctx, code + (main ? h->main : functions[i].offset), main ? h->main_size : functions[i].size, &info);
+    // the top level code runs without a frame to read locals from.
+    if(!valid || (main && info.arg_count > 0)){
+      logd("Invalid module\n");
+      ok = false;
+    }
+  }
+
+  if(ok){
+    module->function_count = h->function_count;
+    module->functions = alloc0(h->function_count * sizeof(module->functions[0]));
+    module->function_symbols = alloc0(h->function_count * sizeof(module->function_symbols[0]));
+    for(u32 i = 0; i < h->function_count; i++){
+      var f = functions[i];
+      jamlisp_array * array = alloc0(sizeof(array[0]));
+      *array = (jamlisp_array){.type = JAMLISP_BYTE, .size = f.size, .data = code + f.offset, .generation = ++ctx->array_generation};
+      module->functions[i] = array;
+      module->function_symbols[i] = ids[f.symbol];
+      symbol_set_value(ctx, JAMLISP_MAKE_SYMBOL(ids[f.symbol]), JAMLISP_MAKE_ARRAY(array));
+    }
+  }
+  free(ids);
+  return ok;
+}
+
+bool jamlisp_module_map(jamlisp_context * ctx, jamlisp_module * module, const char * path){
+  *module = (jamlisp_module){0};
+  int fd = open(path, O_RDONLY);
+  if(fd < 0){
+    logd("Unable to open %s\n", path);
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size == 0){
+    close(fd);
+    return false;
+  }
+  // a private mapping, a page is only copied if a relocation is written to it.
+  void * data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(data == MAP_FAILED){
+    logd("Unable to map %s\n", path);
+    return false;
+  }
+  if(!jamlisp_module_load(ctx, module, data, st.st_size)){
+    jamlisp_module_unload(ctx, module);
+    munmap(data, st.st_size);
+    return false;
+  }
+  module->mapped = true;
+  return true;
+}
+
+io_reader jamlisp_module_main(const jamlisp_module * module){
+  const jamlisp_module_header * h = (const void *) module->data;
+  return io_from_bytes(module->data + h->code + h->main, h->main_size);
+}
+
+void jamlisp_module_unload(jamlisp_context * ctx, jamlisp_module * module){
+  for(u32 i = 0; i < module->function_count; i++){
+    var array = module->functions[i];
+    u32 symbol = module->function_symbols[i];
+    var value = symbol_get_value(ctx, JAMLISP_MAKE_SYMBOL(symbol));
+    if(JAMLISP_IS(value, JAMLISP_ARRAY) && JAMLISP_PTR(value) == array)
+      symbol_set_value(ctx, JAMLISP_MAKE_SYMBOL(symbol), jamlisp_nil());
+    // the compiled forms of the function are dropped with it.
+    if(symbol < ctx->functions_capacity && ctx->functions[symbol].source == array && ctx->functions[symbol].generation == array->generation){
+      jamlisp_function_clear(ctx, ctx->functions + symbol);
+      ctx->functions[symbol].source = NULL;
+    }
+    free(array);
+  }
+  free(module->functions);
+  free(module->function_symbols);
+  if(module->mapped)
+    munmap(module->data, module->size);
+  *module = (jamlisp_module){0};
+}
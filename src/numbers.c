@@ -0,0 +1,228 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Numbers.
+// Every number type has a kind, integer, bignum, f32, f64 or bigfloat. An
+// operation converts both operands to the larger kind of the two (float
+// contagion) and runs the function for that kind from a table. Two INT64
+// operands skip the tables. Integer results that overflow become bignums.
+
+typedef enum{
+  NUM_NONE = 0,
+  NUM_INT,
+  NUM_BIGNUM,
+  NUM_F32,
+  NUM_F64,
+  NUM_BIGFLOAT,
+  NUM_KINDS
+}num_kind;
+
+typedef enum{
+  ARITH_ADD,
+  ARITH_SUB,
+  ARITH_MUL,
+  ARITH_DIV,
+  ARITH_LESS,
+  ARITH_OPS
+}arith_op;
+
+static const u8 num_kinds[JAMLISP_TYPE_NONE + 1] = {
+  [JAMLISP_FIXNUM] = NUM_INT,
+  [JAMLISP_INT32] = NUM_INT,
+  [JAMLISP_INT64] = NUM_INT,
+  [JAMLISP_F32] = NUM_F32,
+  [JAMLISP_F64] = NUM_F64,
+  [JAMLISP_BIGNUM] = NUM_BIGNUM,
+  [JAMLISP_BIGFLOAT] = NUM_BIGFLOAT,
+};
+
+// the kind of the result for each pair of kinds.
+static const u8 contagion[NUM_KINDS][NUM_KINDS] = {
+  [NUM_INT] = {[NUM_INT] = NUM_INT, [NUM_BIGNUM] = NUM_BIGNUM, [NUM_F32] = NUM_F32, [NUM_F64] = NUM_F64, [NUM_BIGFLOAT] = NUM_BIGFLOAT},
+  [NUM_BIGNUM] = {[NUM_INT] = NUM_BIGNUM, [NUM_BIGNUM] = NUM_BIGNUM, [NUM_F32] = NUM_F32, [NUM_F64] = NUM_F64, [NUM_BIGFLOAT] = NUM_BIGFLOAT},
+  [NUM_F32] = {[NUM_INT] = NUM_F32, [NUM_BIGNUM] = NUM_F32, [NUM_F32] = NUM_F32, [NUM_F64] = NUM_F64, [NUM_BIGFLOAT] = NUM_BIGFLOAT},
+  [NUM_F64] = {[NUM_INT] = NUM_F64, [NUM_BIGNUM] = NUM_F64, [NUM_F32] = NUM_F64, [NUM_F64] = NUM_F64, [NUM_BIGFLOAT] = NUM_BIGFLOAT},
+  [NUM_BIGFLOAT] = {[NUM_INT] = NUM_BIGFLOAT, [NUM_BIGNUM] = NUM_BIGFLOAT, [NUM_F32] = NUM_BIGFLOAT, [NUM_F64] = NUM_BIGFLOAT, [NUM_BIGFLOAT] = NUM_BIGFLOAT},
+};
+
+static const char * arith_names[ARITH_OPS] = {"ADD", "SUB", "MUL", "DIV", "LESS"};
+
+static inline num_kind kind_of(jamlisp_object obj){
+  return num_kinds[JAMLISP_TYPE(obj)];
+}
+
+bool jamlisp_numberp(jamlisp_object obj){
+  return kind_of(obj) != NUM_NONE;
+}
+
+static i64 to_i64(jamlisp_object obj){
+  if(JAMLISP_IS(obj, JAMLISP_INT64))
+    return JAMLISP_INT64(obj);
+  return JAMLISP_FIXNUM(obj);
+}
+
+f64 jamlisp_to_f64(jamlisp_object obj){
+  switch(kind_of(obj)){
+  case NUM_INT:
+    return (f64)to_i64(obj);
+  case NUM_F32:
+    return JAMLISP_FLOAT32(obj);
+  case NUM_F64:
+    return JAMLISP_FLOAT64(obj);
+  case NUM_BIGNUM:
+  case NUM_BIGFLOAT:
+    return jamlisp_bignum_to_f64(obj);
+  default:
+    return 0.0;
+  }
+}
+
+static f32 to_f32(jamlisp_object obj){
+  if(JAMLISP_IS(obj, JAMLISP_F32))
+    return JAMLISP_FLOAT32(obj);
+  return (f32)jamlisp_to_f64(obj);
+}
+
+static jamlisp_object truth(bool v){
+  return v ? JAMLISP_MAKE_SYMBOL(JAMLISP_SYMBOL_T) : jamlisp_nil();
+}
+
+static jamlisp_object arith_bignum(jamlisp_context * ctx, arith_op op, jamlisp_object a, jamlisp_object b){
+  switch(op){
+  case ARITH_ADD: return jamlisp_integer_add(ctx, a, b);
+  case ARITH_SUB: return jamlisp_integer_sub(ctx, a, b);
+  case ARITH_MUL: return jamlisp_integer_mul(ctx, a, b);
+  case ARITH_DIV: return jamlisp_integer_div(ctx, a, b);
+  case ARITH_LESS: return truth(jamlisp_integer_compare(a, b) < 0);
+  default: return jamlisp_nil();
+  }
+}
+
+static jamlisp_object arith_int(jamlisp_context * ctx, arith_op op, jamlisp_object a, jamlisp_object b){
+  i64 x = to_i64(a), y = to_i64(b), r;
+  bool overflow;
+  switch(op){
+  case ARITH_ADD:
+    overflow = __builtin_add_overflow(x, y, &r);
+    break;
+  case ARITH_SUB:
+    overflow = __builtin_sub_overflow(x, y, &r);
+    break;
+  case ARITH_MUL:
+    overflow = __builtin_mul_overflow(x, y, &r);
+    break;
+  case ARITH_DIV:
+    if(y == 0){
+      ERROR("Division by zero\n");
+      return jamlisp_nil();
+    }
+    // INT64_MIN / -1 is the only quotient that overflows.
+    overflow = y == -1 && x == INT64_MIN;
+    r = overflow ? 0 : x / y;
+    break;
+  case ARITH_LESS:
+    return truth(x < y);
+  default:
+    return jamlisp_nil();
+  }
+  if(overflow || !JAMLISP_INT64_FITS(r))
+    return arith_bignum(ctx, op, a, b);
+  return JAMLISP_MAKE_INT64(r);
+}
+
+static jamlisp_object arith_f32(jamlisp_context * ctx, arith_op op, jamlisp_object a, jamlisp_object b){
+  UNUSED(ctx);
+  f32 x = to_f32(a), y = to_f32(b);
+  switch(op){
+  case ARITH_ADD: return jamlisp_f32(x + y);
+  case ARITH_SUB: return jamlisp_f32(x - y);
+  case ARITH_MUL: return jamlisp_f32(x * y);
+  case ARITH_DIV: return jamlisp_f32(x / y);
+  case ARITH_LESS: return truth(x < y);
+  default: return jamlisp_nil();
+  }
+}
+
+static jamlisp_object arith_f64(jamlisp_context * ctx, arith_op op, jamlisp_object a, jamlisp_object b){
+  UNUSED(ctx);
+  f64 x = jamlisp_to_f64(a), y = jamlisp_to_f64(b);
+  switch(op){
+  case ARITH_ADD: return jamlisp_f64(x + y);
+  case ARITH_SUB: return jamlisp_f64(x - y);
+  case ARITH_MUL: return jamlisp_f64(x * y);
+  case ARITH_DIV: return jamlisp_f64(x / y);
+  case ARITH_LESS: return truth(x < y);
+  default: return jamlisp_nil();
+  }
+}
+
+static jamlisp_object arith_bigfloat(jamlisp_context * ctx, arith_op op, jamlisp_object a, jamlisp_object b){
+  switch(op){
+  case ARITH_ADD: return jamlisp_bigfloat_add(ctx, a, b);
+  case ARITH_SUB: return jamlisp_bigfloat_sub(ctx, a, b);
+  case ARITH_MUL: return jamlisp_bigfloat_mul(ctx, a, b);
+  case ARITH_DIV: return jamlisp_bigfloat_div(ctx, a, b);
+  case ARITH_LESS: return truth(jamlisp_bigfloat_compare(ctx, a, b) < 0);
+  default: return jamlisp_nil();
+  }
+}
+
+typedef jamlisp_object (* arith_fcn)(jamlisp_context * ctx, arith_op op, jamlisp_object a, jamlisp_object b);
+
+static const arith_fcn arith_fcns[NUM_KINDS] = {
+  [NUM_INT] = arith_int,
+  [NUM_BIGNUM] = arith_bignum,
+  [NUM_F32] = arith_f32,
+  [NUM_F64] = arith_f64,
+  [NUM_BIGFLOAT] = arith_bigfloat,
+};
+
+static jamlisp_object arith(jamlisp_context * ctx, arith_op op, jamlisp_object a, jamlisp_object b){
+  var kind = contagion[kind_of(a)][kind_of(b)];
+  if(kind == NUM_NONE){
+    ERROR("Unsupported %s of %i and %i\n", arith_names[op], JAMLISP_TYPE(a), JAMLISP_TYPE(b));
+    return jamlisp_nil();
+  }
+  return arith_fcns[kind](ctx, op, a, b);
+}
+
+jamlisp_object jamlisp_add(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  i64 r;
+  if(JAMLISP_BOTH_INT64(a, b) && !__builtin_add_overflow(JAMLISP_INT64(a), JAMLISP_INT64(b), &r) && JAMLISP_INT64_FITS(r))
+    return JAMLISP_MAKE_INT64(r);
+  return arith(ctx, ARITH_ADD, a, b);
+}
+
+jamlisp_object jamlisp_sub(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  i64 r;
+  if(JAMLISP_BOTH_INT64(a, b) && !__builtin_sub_overflow(JAMLISP_INT64(a), JAMLISP_INT64(b), &r) && JAMLISP_INT64_FITS(r))
+    return JAMLISP_MAKE_INT64(r);
+  return arith(ctx, ARITH_SUB, a, b);
+}
+
+jamlisp_object jamlisp_mul(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  i64 r;
+  if(JAMLISP_BOTH_INT64(a, b) && !__builtin_mul_overflow(JAMLISP_INT64(a), JAMLISP_INT64(b), &r) && JAMLISP_INT64_FITS(r))
+    return JAMLISP_MAKE_INT64(r);
+  return arith(ctx, ARITH_MUL, a, b);
+}
+
+jamlisp_object jamlisp_div(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  return arith(ctx, ARITH_DIV, a, b);
+}
+
+jamlisp_object jamlisp_less(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b){
+  if(JAMLISP_BOTH_INT64(a, b))
+    return truth(JAMLISP_INT64(a) < JAMLISP_INT64(b));
+  return arith(ctx, ARITH_LESS, a, b);
+}
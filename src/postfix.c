@@ -0,0 +1,443 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Postfix compilation.
+// The prefix byte code is the interchange format written by the lisp loader.
+// Here it is reordered so every node comes after its children, which lets it
+// run in a single linear pass on the value stack. See jamlisp.md.
+
+bool jamlisp_read_prefix_node(jamlisp_context * ctx, io_reader * reader, jamlisp_insn * insn){
+  *insn = (jamlisp_insn){0};
+  if(reader->offset >= reader->size)
+    return false;
+  u8 byte = io_read_u8(reader);
+  insn->opcode = byte;
+  switch(byte){
+  case JAMLISP_OPCODE_NONE:
+    return false;
+  case JAMLISP_OPCODE_ADD:
+  case JAMLISP_OPCODE_SUB:
+  case JAMLISP_OPCODE_MUL:
+  case JAMLISP_OPCODE_DIV:
+  case JAMLISP_OPCODE_CONS:
+  case JAMLISP_OPCODE_PRINT:
+  case JAMLISP_OPCODE_LESS:
+    insn->child_count = jamlisp_get_opcodedef(ctx, insn->opcode).arg_count;
+    break;
+  case JAMLISP_OPCODE_INT:
+    insn->int64 = io_read_i64_leb(reader);
+    break;
+  case JAMLISP_CODE_INT_SMALL ... JAMLISP_CODE_INT_SMALL + JAMLISP_SMALL_INT_MAX - JAMLISP_SMALL_INT_MIN:
+    insn->opcode = JAMLISP_OPCODE_INT;
+    insn->int64 = JAMLISP_SMALL_INT_MIN + (byte - JAMLISP_CODE_INT_SMALL);
+    break;
+  case JAMLISP_OPCODE_CALL:
+  case JAMLISP_OPCODE_TAILCALL:
+  case JAMLISP_OPCODE_PRIMITIVE:
+    insn->call = io_read_u32_leb(reader);
+    insn->child_count = io_read_u32_leb(reader);
+    break;
+  case JAMLISP_CODE_CALL_SMALL ... JAMLISP_CODE_CALL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+    insn->opcode = JAMLISP_OPCODE_CALL;
+    insn->call = io_read_u32_leb(reader);
+    insn->child_count = byte - JAMLISP_CODE_CALL_SMALL;
+    break;
+  case JAMLISP_CODE_TAILCALL_SMALL ... JAMLISP_CODE_TAILCALL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+    insn->opcode = JAMLISP_OPCODE_TAILCALL;
+    insn->call = io_read_u32_leb(reader);
+    insn->child_count = byte - JAMLISP_CODE_TAILCALL_SMALL;
+    break;
+  case JAMLISP_OPCODE_LOCAL:
+    insn->local = io_read_u32_leb(reader);
+    break;
+  case JAMLISP_CODE_LOCAL_SMALL ... JAMLISP_CODE_LOCAL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+    insn->opcode = JAMLISP_OPCODE_LOCAL;
+    insn->local = byte - JAMLISP_CODE_LOCAL_SMALL;
+    break;
+  case JAMLISP_OPCODE_GLOBAL:
+    insn->call = io_read_u32_leb(reader);
+    break;
+  case JAMLISP_OPCODE_LET:
+    insn->child_count = io_read_u32_leb(reader);
+    break;
+  case JAMLISP_OPCODE_BIND:
+    insn->call = io_read_u32_leb(reader);
+    insn->child_count = 2;
+    break;
+  case JAMLISP_OPCODE_IF:
+    insn->then_size = io_read_u32_leb(reader);
+    insn->else_size = io_read_u32_leb(reader);
+    insn->child_count = 3;
+    break;
+  default:
+    logd("No Handler for opcode %i\n", insn->opcode);
+    return false;
+  }
+  return true;
+}
+
+// writes the shortest encoding of a prefix node.
+void jamlisp_write_prefix_node(io_writer * writer, const jamlisp_insn * insn){
+  switch(insn->opcode){
+  case JAMLISP_OPCODE_INT:
+    if(insn->int64 >= JAMLISP_SMALL_INT_MIN && insn->int64 <= JAMLISP_SMALL_INT_MAX){
+      io_write_u8(writer, JAMLISP_CODE_INT_SMALL + (insn->int64 - JAMLISP_SMALL_INT_MIN));
+      return;
+    }
+    io_write_u8(writer, insn->opcode);
+    io_write_i64_leb(writer, insn->int64);
+    return;
+  case JAMLISP_OPCODE_CALL:
+  case JAMLISP_OPCODE_TAILCALL:
+    if(insn->child_count < JAMLISP_CODE_SMALL_COUNT){
+      u8 base = insn->opcode == JAMLISP_OPCODE_CALL ? JAMLISP_CODE_CALL_SMALL : JAMLISP_CODE_TAILCALL_SMALL;
+      io_write_u8(writer, base + insn->child_count);
+      io_write_u32_leb(writer, insn->call);
+      return;
+    }
+    // fall through
+  case JAMLISP_OPCODE_PRIMITIVE:
+    io_write_u8(writer, insn->opcode);
+    io_write_u32_leb(writer, insn->call);
+    io_write_u32_leb(writer, insn->child_count);
+    return;
+  case JAMLISP_OPCODE_LOCAL:
+    if(insn->local < JAMLISP_CODE_SMALL_COUNT){
+      io_write_u8(writer, JAMLISP_CODE_LOCAL_SMALL + insn->local);
+      return;
+    }
+    io_write_u8(writer, insn->opcode);
+    io_write_u32_leb(writer, insn->local);
+    return;
+  case JAMLISP_OPCODE_GLOBAL:
+  case JAMLISP_OPCODE_BIND:
+    io_write_u8(writer, insn->opcode);
+    io_write_u32_leb(writer, insn->call);
+    return;
+  case JAMLISP_OPCODE_LET:
+    io_write_u8(writer, insn->opcode);
+    io_write_u32_leb(writer, insn->child_count);
+    return;
+  case JAMLISP_OPCODE_IF:
+    io_write_u8(writer, insn->opcode);
+    io_write_u32_leb(writer, insn->then_size);
+    io_write_u32_leb(writer, insn->else_size);
+    return;
+  default:
+    io_write_u8(writer, insn->opcode);
+    return;
+  }
+}
+
+typedef struct{
+  jamlisp_insn insn;
+  u32 child_count;
+  // the IF or JUMP waiting for the end of the current branch.
+  size_t jump;
+}postfix_pending;
+
+typedef struct{
+  jamlisp_insn * insns;
+  size_t count;
+  size_t capacity;
+}postfix_insns;
+
+static size_t postfix_append(postfix_insns * out, const jamlisp_insn * insn){
+  *(jamlisp_insn *) alloc_elems((void **) &out->insns, sizeof(out->insns[0]), &out->count, &out->capacity, 1) = *insn;
+  return out->count - 1;
+}
+
+// An IF becomes: cond, IF, then, JUMP, else. The IF skips to the else branch
+// and the JUMP over it, their targets are filled in when the branch is done.
+// Since the jumps need fixing up, the instructions are collected before they
+// are emitted.
+bool jamlisp_prefix_to_postfix(jamlisp_context * ctx, io_reader * reader, void (* emit)(void * userdata, const jamlisp_insn * insn), void * userdata){
+  postfix_pending * pending = NULL;
+  size_t pending_capacity = 0;
+  size_t depth = 0;
+  postfix_insns out = {0};
+  bool ok = true;
+  jamlisp_insn insn;
+  while(jamlisp_read_prefix_node(ctx, reader, &insn)){
+    if(insn.child_count > 0){
+      ensure_size2((void **) &pending, sizeof(pending[0]), &pending_capacity, depth, 1.5);
+      pending[depth++] = (postfix_pending){.insn = insn, .child_count = insn.child_count};
+      continue;
+    }
+    postfix_append(&out, &insn);
+    while(depth > 0 && --pending[depth - 1].child_count == 0){
+      depth -= 1;
+      var done = pending[depth];
+      if(done.insn.opcode == JAMLISP_OPCODE_IF){
+	out.insns[done.jump].jump = out.count - done.jump - 1;
+	continue;
+      }
+      // the BIND itself was emitted after its value, this ends the body.
+      if(done.insn.opcode == JAMLISP_OPCODE_BIND)
+	done.insn.opcode = JAMLISP_OPCODE_UNBIND;
+      postfix_append(&out, &done.insn);
+    }
+    if(depth == 0)
+      continue;
+    var parent = pending + depth - 1;
+    if(parent->insn.opcode == JAMLISP_OPCODE_BIND && parent->child_count == 1)
+      postfix_append(&out, &parent->insn);
+    if(parent->insn.opcode == JAMLISP_OPCODE_IF && parent->child_count == 2)
+      parent->jump = postfix_append(&out, &(jamlisp_insn){.opcode = JAMLISP_OPCODE_IF});
+    if(parent->insn.opcode == JAMLISP_OPCODE_IF && parent->child_count == 1){
+      out.insns[parent->jump].jump = out.count - parent->jump;
+      parent->jump = postfix_append(&out, &(jamlisp_insn){.opcode = JAMLISP_OPCODE_JUMP});
+    }
+  }
+  
+  // reading stopped on a bad node or in the middle of a tree.
+  if(insn.opcode != JAMLISP_OPCODE_NONE || depth > 0){
+    logd("Invalid byte code\n");
+    ok = false;
+  }
+  for(size_t i = 0; i < out.count; i++)
+    emit(userdata, out.insns + i);
+  free(out.insns);
+  free(pending);
+  return ok;
+}
+
+void jamlisp_write_postfix_node(io_writer * writer, const jamlisp_insn * insn){
+  io_write_u8(writer, insn->opcode);
+  switch(insn->opcode){
+  case JAMLISP_OPCODE_INT:
+    io_write_i64_leb(writer, insn->int64);
+    break;
+  case JAMLISP_OPCODE_CALL:
+  case JAMLISP_OPCODE_TAILCALL:
+  case JAMLISP_OPCODE_PRIMITIVE:
+    io_write_u32_leb(writer, insn->call);
+    io_write_u32_leb(writer, insn->child_count);
+    break;
+  case JAMLISP_OPCODE_LOCAL:
+    io_write_u32_leb(writer, insn->local);
+    break;
+  case JAMLISP_OPCODE_IF:
+  case JAMLISP_OPCODE_JUMP:
+    // fixed width so it can be patched, see postfix_writer.
+    io_write_u32(writer, insn->jump);
+    break;
+  case JAMLISP_OPCODE_GLOBAL:
+  case JAMLISP_OPCODE_BIND:
+  case JAMLISP_OPCODE_UNBIND:
+    io_write_u32_leb(writer, insn->call);
+    break;
+  case JAMLISP_OPCODE_LET:
+    io_write_u32_leb(writer, insn->child_count);
+    break;
+  default:
+    break;
+  }
+}
+
+bool jamlisp_read_postfix_node(io_reader * reader, jamlisp_insn * insn){
+  *insn = (jamlisp_insn){0};
+  if(reader->offset >= reader->size)
+    return false;
+  insn->opcode = io_read_u8(reader);
+  switch(insn->opcode){
+  case JAMLISP_OPCODE_NONE:
+    return false;
+  case JAMLISP_OPCODE_INT:
+    insn->int64 = io_read_i64_leb(reader);
+    break;
+  case JAMLISP_OPCODE_CALL:
+  case JAMLISP_OPCODE_TAILCALL:
+  case JAMLISP_OPCODE_PRIMITIVE:
+    insn->call = io_read_u32_leb(reader);
+    insn->child_count = io_read_u32_leb(reader);
+    break;
+  case JAMLISP_OPCODE_LOCAL:
+    insn->local = io_read_u32_leb(reader);
+    break;
+  case JAMLISP_OPCODE_IF:
+  case JAMLISP_OPCODE_JUMP:
+    insn->jump = io_read_u32(reader);
+    break;
+  case JAMLISP_OPCODE_GLOBAL:
+  case JAMLISP_OPCODE_BIND:
+  case JAMLISP_OPCODE_UNBIND:
+    insn->call = io_read_u32_leb(reader);
+    break;
+  case JAMLISP_OPCODE_LET:
+    insn->child_count = io_read_u32_leb(reader);
+    break;
+  default:
+    break;
+  }
+  return true;
+}
+
+// In the postfix format IF and JUMP skip a number of bytes instead of
+// instructions. The byte offset of a jump target is known once the target is
+// written, then the jump is patched.
+typedef struct{
+  u32 target;
+  size_t offset;
+}postfix_patch;
+
+typedef struct{
+  io_writer * writer;
+  u32 index;
+  postfix_patch * patches;
+  size_t patch_count;
+  size_t patch_capacity;
+}postfix_writer;
+
+static void emit_postfix_node(void * userdata, const jamlisp_insn * insn){
+  postfix_writer * w = userdata;
+  for(size_t i = 0; i < w->patch_count; i++){
+    var patch = w->patches[i];
+    if(patch.target != w->index)
+      continue;
+    u32 skip = w->writer->offset - patch.offset - sizeof(u32);
+    memcpy((u8 *) w->writer->data + patch.offset, &skip, sizeof(skip));
+    w->patches[i--] = w->patches[--w->patch_count];
+  }
+  jamlisp_write_postfix_node(w->writer, insn);
+  if(insn->opcode == JAMLISP_OPCODE_IF || insn->opcode == JAMLISP_OPCODE_JUMP){
+    postfix_patch * patch = alloc_elems((void **) &w->patches, sizeof(w->patches[0]), &w->patch_count, &w->patch_capacity, 1);
+    *patch = (postfix_patch){.target = w->index + 1 + insn->jump, .offset = w->writer->offset - sizeof(u32)};
+  }
+  w->index += 1;
+}
+
+bool jamlisp_compile_postfix(jamlisp_context * ctx, io_reader * prefix, io_writer * postfix){
+  postfix_writer w = {.writer = postfix};
+  bool ok = jamlisp_prefix_to_postfix(ctx, prefix, emit_postfix_node, &w);
+  emit_postfix_node(&w, &(jamlisp_insn){.opcode = JAMLISP_OPCODE_NONE});
+  ASSERT(w.patch_count == 0);
+  free(w.patches);
+  return ok;
+}
+
+void jamlisp_iterate_postfix(jamlisp_context * ctx, io_reader * reader){
+  size_t prev_locals = jamlisp_enter_locals(ctx);
+  int cframe_base = ctx->cframe_count;
+  jamlisp_insn insn;
+  u32 node_id = reader->offset;
+  while(true){
+    if(!jamlisp_read_postfix_node(reader, &insn)){
+      // end of a function body.
+      if(ctx->cframe_count == cframe_base)
+	break;
+      *reader = jamlisp_call_return(ctx)->reader;
+      node_id = reader->offset;
+      continue;
+    }
+    JAMLISP_TRACE_NODE(ctx, node_id, insn.opcode);
+    node_id = reader->offset;
+    switch(insn.opcode){
+    case JAMLISP_OPCODE_INT:
+      jamlisp_push_i64(ctx, insn.int64);
+      break;
+    case JAMLISP_OPCODE_ADD:
+      {
+	var a = jamlisp_pop(ctx);
+	var b = jamlisp_pop(ctx);
+	jamlisp_push(ctx, jamlisp_add(ctx, a, b));
+      }
+      break;
+    case JAMLISP_OPCODE_PRINT:
+      jamlisp_print(jamlisp_top(ctx));
+      break;
+    case JAMLISP_OPCODE_SUB:
+      {
+	var b = jamlisp_pop(ctx);
+	var a = jamlisp_pop(ctx);
+	jamlisp_push(ctx, jamlisp_sub(ctx, a, b));
+      }
+      break;
+    case JAMLISP_OPCODE_LESS:
+      {
+	var b = jamlisp_pop(ctx);
+	var a = jamlisp_pop(ctx);
+	jamlisp_push(ctx, jamlisp_less(ctx, a, b));
+      }
+      break;
+    case JAMLISP_OPCODE_MUL:
+      {
+	var b = jamlisp_pop(ctx);
+	var a = jamlisp_pop(ctx);
+	jamlisp_push(ctx, jamlisp_mul(ctx, a, b));
+      }
+      break;
+    case JAMLISP_OPCODE_DIV:
+      {
+	var b = jamlisp_pop(ctx);
+	var a = jamlisp_pop(ctx);
+	jamlisp_push(ctx, jamlisp_div(ctx, a, b));
+      }
+      break;
+    case JAMLISP_OPCODE_CONS:
+      {
+	var cdr = jamlisp_pop(ctx);
+	var car = jamlisp_pop(ctx);
+	jamlisp_push(ctx, jamlisp_cons(ctx, car, cdr));
+      }
+      break;
+    case JAMLISP_OPCODE_PRIMITIVE:
+      jamlisp_call_primitive(ctx, insn.call, insn.child_count);
+      break;
+    case JAMLISP_OPCODE_IF:
+      if(jamlisp_nilp(jamlisp_pop(ctx)))
+	reader->offset += insn.jump;
+      break;
+    case JAMLISP_OPCODE_JUMP:
+      reader->offset += insn.jump;
+      break;
+    case JAMLISP_OPCODE_CALL:
+    case JAMLISP_OPCODE_TAILCALL:
+      {
+	io_reader code;
+	if(!jamlisp_function_postfix(ctx, insn.call, insn.child_count, &code)){
+	  jamlisp_call_native(ctx, insn.call, insn.child_count);
+	  break;
+	}
+	if(insn.opcode == JAMLISP_OPCODE_TAILCALL && ctx->cframe_count > cframe_base){
+	  jamlisp_tail_call(ctx, insn.child_count);
+	}else{
+	  jamlisp_call_enter(ctx, insn.child_count)->reader = *reader;
+	}
+	*reader = code;
+	node_id = reader->offset;
+      }
+      break;
+    case JAMLISP_OPCODE_LOCAL:
+      jamlisp_push(ctx, JAMLISP_LOCAL(ctx, insn.local));
+      break;
+    case JAMLISP_OPCODE_GLOBAL:
+      jamlisp_push_global(ctx, insn.call);
+      break;
+    case JAMLISP_OPCODE_LET:
+      jamlisp_let_exit(ctx, insn.child_count - 1);
+      break;
+    case JAMLISP_OPCODE_BIND:
+      jamlisp_bind(ctx, insn.call);
+      break;
+    case JAMLISP_OPCODE_UNBIND:
+      jamlisp_unbind(ctx, insn.call);
+      break;
+    default:
+      ERROR("No Handler for opcode!");
+      ctx->local_base = prev_locals;
+      return;
+    }
+  }
+  ctx->local_base = prev_locals;
+}
@@ -0,0 +1,115 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Primitives.
+// Native functions bound to symbols. The compiler turns a call to one of them
+// into its opcode or a PRIMITIVE node, so it never goes through CALL.
+
+u32 jamlisp_load_primitive(jamlisp_context * ctx, const char * name, jamlisp_primitive_fcn fcn, u32 min_args, u32 max_args, jamlisp_opcode opcode){
+  u32 index = ctx->primitive_count;
+  jamlisp_primitive * p = alloc_elems((void **) &ctx->primitives, sizeof(ctx->primitives[0]), &ctx->primitive_count, &ctx->primitive_capacity, 1);
+  *p = (jamlisp_primitive){.name = name, .fcn = fcn, .min_args = min_args, .max_args = max_args, .opcode = opcode};
+  symbol_set_value(ctx, jamlisp_symbol(ctx, name), JAMLISP_MAKE_PRIMITIVE(index));
+  return index;
+}
+
+const jamlisp_primitive * jamlisp_symbol_primitive(jamlisp_context * ctx, jamlisp_object symbol, u32 * index){
+  var value = symbol_get_value(ctx, symbol);
+  if(!JAMLISP_IS(value, JAMLISP_FUNCTION))
+    return NULL;
+  if(index != NULL)
+    *index = JAMLISP_PRIMITIVE_INDEX(value);
+  return ctx->primitives + JAMLISP_PRIMITIVE_INDEX(value);
+}
+
+// the result replaces the arguments on the stack.
+void jamlisp_call_primitive(jamlisp_context * ctx, u32 index, u32 arg_count){
+  ASSERT(index < ctx->primitive_count);
+  var p = ctx->primitives + index;
+  jamlisp_object result = jamlisp_nil();
+  if(arg_count < p->min_args || arg_count > p->max_args){
+    ERROR("Wrong number of arguments to %s: %i\n", p->name, arg_count);
+  }else{
+    const jamlisp_object * args = ctx->value_stack.objects + ctx->value_stack.count - arg_count;
+    result = p->fcn(ctx, args, arg_count);
+  }
+  ctx->value_stack.count -= arg_count;
+  jamlisp_push(ctx, result);
+}
+
+typedef jamlisp_object (* binary_op)(jamlisp_context * ctx, jamlisp_object a, jamlisp_object b);
+
+static jamlisp_object fold(jamlisp_context * ctx, const jamlisp_object * args, u32 count, jamlisp_object init, binary_op op){
+  var acc = init;
+  for(u32 i = 0; i < count; i++)
+    acc = op(ctx, acc, args[i]);
+  return acc;
+}
+
+static jamlisp_object prim_add(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  return fold(ctx, args, count, jamlisp_i64(0), jamlisp_add);
+}
+
+static jamlisp_object prim_mul(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  return fold(ctx, args, count, jamlisp_i64(1), jamlisp_mul);
+}
+
+// (- x) is the negation of x.
+static jamlisp_object prim_sub(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  if(count == 1)
+    return jamlisp_sub(ctx, jamlisp_i64(0), args[0]);
+  return fold(ctx, args + 1, count - 1, args[0], jamlisp_sub);
+}
+
+static jamlisp_object prim_div(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  if(count == 1)
+    return jamlisp_div(ctx, jamlisp_i64(1), args[0]);
+  return fold(ctx, args + 1, count - 1, args[0], jamlisp_div);
+}
+
+static jamlisp_object prim_less(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  return jamlisp_less(ctx, args[0], args[1]);
+}
+
+static jamlisp_object prim_bigfloat(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  return jamlisp_bigfloat(ctx, args[0]);
+}
+
+static jamlisp_object prim_cons(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(count);
+  // copied first, jamlisp_cons can push to the value stack.
+  var car = args[0];
+  var cdr = args[1];
+  return jamlisp_cons(ctx, car, cdr);
+}
+
+static jamlisp_object prim_print(jamlisp_context * ctx, const jamlisp_object * args, u32 count){
+  UNUSED(ctx);
+  UNUSED(count);
+  jamlisp_print(args[0]);
+  return args[0];
+}
+
+void jamlisp_load_primitives(jamlisp_context * ctx){
+  jamlisp_load_primitive(ctx, "+", prim_add, 0, JAMLISP_VARIADIC, JAMLISP_OPCODE_ADD);
+  jamlisp_load_primitive(ctx, "-", prim_sub, 1, JAMLISP_VARIADIC, JAMLISP_OPCODE_SUB);
+  jamlisp_load_primitive(ctx, "*", prim_mul, 0, JAMLISP_VARIADIC, JAMLISP_OPCODE_MUL);
+  jamlisp_load_primitive(ctx, "/", prim_div, 1, JAMLISP_VARIADIC, JAMLISP_OPCODE_DIV);
+  jamlisp_load_primitive(ctx, "<", prim_less, 2, 2, JAMLISP_OPCODE_LESS);
+  jamlisp_load_primitive(ctx, "bigfloat", prim_bigfloat, 1, 1, JAMLISP_OPCODE_NONE);
+  jamlisp_load_primitive(ctx, "cons", prim_cons, 2, 2, JAMLISP_OPCODE_CONS);
+  jamlisp_load_primitive(ctx, "print", prim_print, 1, 1, JAMLISP_OPCODE_PRINT);
+  jamlisp_load_array_primitives(ctx);
+}
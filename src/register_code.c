@@ -0,0 +1,484 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Register code.
+// The prefix bytecode is compiled to three address instructions that read
+// their operands from registers or constants and write one register, so an
+// expression like (+ (* a b) (* c d)) is three instructions instead of seven
+// pushes and pops. The registers of a frame are the value stack slots from
+// local_base and a node gets the register at the stack depth it would be
+// pushed to by jamlisp_iterate. That keeps the slots of the variables, the
+// arguments of a call in a row for jamlisp_call_enter, and the registers
+// visible to the collector. A LOCAL or an INT is not copied to a register,
+// the instruction using it reads the variable or the constant directly, and
+// so does a variable initialized from one. With ctx->register_fold
+// arithmetic on constants is done here and an IF with a constant condition
+// only keeps the branch taken.
+
+// the compiler recurses once per nested node.
+#define REG_MAX_NESTING 10000
+
+typedef struct{
+  jamlisp_context * ctx;
+  io_reader * reader;
+  jamlisp_reg_code * code;
+  // the operand read by LOCAL slot, slots from slot_count are their own register.
+  u32 * slots;
+  size_t slot_count;
+  size_t slot_capacity;
+  u32 nesting;
+  bool error;
+}reg_compiler;
+
+static size_t reg_emit(reg_compiler * c, jamlisp_reg_insn insn){
+  var code = c->code;
+  if(insn.opcode == JAMLISP_REG_CALL || insn.opcode == JAMLISP_REG_TAILCALL){
+    insn.c = code->cache_count;
+    *(jamlisp_reg_cache *) alloc_elems((void **) &code->caches, sizeof(code->caches[0]), &code->cache_count, &code->cache_capacity, 1) = (jamlisp_reg_cache){0};
+  }
+  *(jamlisp_reg_insn *) alloc_elems((void **) &code->insns, sizeof(code->insns[0]), &code->count, &code->capacity, 1) = insn;
+  return code->count - 1;
+}
+
+static u32 reg_use(reg_compiler * c, u32 reg){
+  c->code->frame_size = MAX(c->code->frame_size, reg + 1);
+  return reg;
+}
+
+static u32 reg_constant(reg_compiler * c, jamlisp_object value){
+  var code = c->code;
+  *(jamlisp_object *) alloc_elems((void **) &code->constants, sizeof(code->constants[0]), &code->constant_count, &code->constant_capacity, 1) = value;
+  return (code->constant_count - 1) | JAMLISP_REG_CONSTANT;
+}
+
+static bool reg_is_constant(u32 operand){
+  return (operand & JAMLISP_REG_CONSTANT) != 0;
+}
+
+static jamlisp_object reg_constant_value(reg_compiler * c, u32 operand){
+  return c->code->constants[operand & ~JAMLISP_REG_CONSTANT];
+}
+
+// puts the value of an operand in 'reg', where a call or a variable needs it.
+static u32 reg_move(reg_compiler * c, u32 reg, u32 operand){
+  if(operand != reg)
+    reg_emit(c, (jamlisp_reg_insn){.opcode = JAMLISP_REG_MOVE, .dst = reg, .a = operand});
+  return reg_use(c, reg);
+}
+
+static u32 reg_slot(reg_compiler * c, u32 slot){
+  return slot < c->slot_count ? c->slots[slot] : slot;
+}
+
+static void reg_set_slot(reg_compiler * c, u32 slot, u32 operand){
+  if(slot >= c->slot_count){
+    if(slot >= c->slot_capacity)
+      ensure_size((void **) &c->slots, sizeof(c->slots[0]), &c->slot_capacity, MAX(slot + 1, c->slot_capacity * 2));
+    for(size_t i = c->slot_count; i < slot; i++)
+      c->slots[i] = i;
+    c->slot_count = slot + 1;
+  }
+  c->slots[slot] = operand;
+}
+
+// the value of an operation on two INT64 constants, as long as it does not
+// need a bignum.
+static bool reg_fold(u32 opcode, jamlisp_object a, jamlisp_object b, jamlisp_object * result){
+  if(!JAMLISP_BOTH_INT64(a, b))
+    return false;
+  i64 x = JAMLISP_INT64(a), y = JAMLISP_INT64(b), r;
+  bool overflow;
+  switch(opcode){
+  case JAMLISP_REG_ADD:
+    overflow = __builtin_add_overflow(x, y, &r);
+    break;
+  case JAMLISP_REG_SUB:
+    overflow = __builtin_sub_overflow(x, y, &r);
+    break;
+  case JAMLISP_REG_MUL:
+    overflow = __builtin_mul_overflow(x, y, &r);
+    break;
+  case JAMLISP_REG_LESS:
+    *result = x < y ? JAMLISP_MAKE_SYMBOL(JAMLISP_SYMBOL_T) : jamlisp_nil();
+    return true;
+  default:
+    return false;
+  }
+  if(overflow || !JAMLISP_INT64_FITS(r))
+    return false;
+  *result = JAMLISP_MAKE_INT64(r);
+  return true;
+}
+
+static u32 reg_binary_opcode(u32 opcode){
+  switch(opcode){
+  case JAMLISP_OPCODE_ADD: return JAMLISP_REG_ADD;
+  case JAMLISP_OPCODE_SUB: return JAMLISP_REG_SUB;
+  case JAMLISP_OPCODE_MUL: return JAMLISP_REG_MUL;
+  case JAMLISP_OPCODE_DIV: return JAMLISP_REG_DIV;
+  case JAMLISP_OPCODE_LESS: return JAMLISP_REG_LESS;
+  default: return JAMLISP_REG_CONS;
+  }
+}
+
+// points the IF or JUMP at 'index' to the next instruction emitted.
+static void reg_patch(reg_compiler * c, size_t index){
+  c->code->insns[index].b = c->code->count - index - 1;
+}
+
+static u32 reg_node(reg_compiler * c, u32 depth);
+
+static u32 reg_node_inner(reg_compiler * c, u32 depth, const jamlisp_insn * insn){
+  switch(insn->opcode){
+  case JAMLISP_OPCODE_INT:
+    return reg_constant(c, jamlisp_i64(insn->int64));
+  case JAMLISP_OPCODE_LOCAL:
+    return reg_slot(c, insn->local);
+  case JAMLISP_OPCODE_GLOBAL:
+    reg_emit(c, (jamlisp_reg_insn){.opcode = JAMLISP_REG_GLOBAL, .dst = reg_use(c, depth), .a = insn->call});
+    return depth;
+  case JAMLISP_OPCODE_ADD:
+  case JAMLISP_OPCODE_SUB:
+  case JAMLISP_OPCODE_MUL:
+  case JAMLISP_OPCODE_DIV:
+  case JAMLISP_OPCODE_LESS:
+  case JAMLISP_OPCODE_CONS:{
+    u32 opcode = reg_binary_opcode(insn->opcode);
+    u32 a = reg_node(c, depth);
+    u32 b = reg_node(c, depth + 1);
+    jamlisp_object folded;
+    if(c->ctx->register_fold && reg_is_constant(a) && reg_is_constant(b) && reg_fold(opcode, reg_constant_value(c, a), reg_constant_value(c, b), &folded))
+      return reg_constant(c, folded);
+    reg_emit(c, (jamlisp_reg_insn){.opcode = opcode, .dst = reg_use(c, depth), .a = a, .b = b});
+    return depth;
+  }
+  case JAMLISP_OPCODE_PRINT:{
+    // the value of print is its argument.
+    u32 a = reg_node(c, depth);
+    reg_emit(c, (jamlisp_reg_insn){.opcode = JAMLISP_REG_PRINT, .a = a});
+    return a;
+  }
+  case JAMLISP_OPCODE_CALL:
+  case JAMLISP_OPCODE_TAILCALL:
+  case JAMLISP_OPCODE_PRIMITIVE:{
+    for(u32 i = 0; i < insn->child_count; i++)
+      reg_move(c, depth + i, reg_node(c, depth + i));
+    u32 opcode = insn->opcode == JAMLISP_OPCODE_CALL ? JAMLISP_REG_CALL : insn->opcode == JAMLISP_OPCODE_TAILCALL ? JAMLISP_REG_TAILCALL : JAMLISP_REG_PRIMITIVE;
+    reg_emit(c, (jamlisp_reg_insn){.opcode = opcode, .dst = reg_use(c, depth), .a = insn->call, .b = insn->child_count});
+    return depth;
+  }
+  case JAMLISP_OPCODE_LET:{
+    // the variables read their init operand, the values of body forms
+    // before the last one are not used.
+    u32 vars = insn->child_count - 1;
+    for(u32 i = 0; i < vars; i++)
+      reg_set_slot(c, depth + i, reg_node(c, depth + i));
+    u32 result = reg_node(c, depth + vars);
+    for(u32 i = 0; i < vars; i++)
+      reg_set_slot(c, depth + i, depth + i);
+    // the registers above depth are free after the let.
+    if(!reg_is_constant(result) && result > depth)
+      result = reg_move(c, depth, result);
+    return result;
+  }
+  case JAMLISP_OPCODE_BIND:{
+    u32 value = reg_node(c, depth);
+    reg_emit(c, (jamlisp_reg_insn){.opcode = JAMLISP_REG_BIND, .a = insn->call, .b = value});
+    u32 result = reg_node(c, depth);
+    reg_emit(c, (jamlisp_reg_insn){.opcode = JAMLISP_REG_UNBIND, .a = insn->call});
+    return result;
+  }
+  case JAMLISP_OPCODE_IF:{
+    u32 cond = reg_node(c, depth);
+    if(c->ctx->register_fold && reg_is_constant(cond)){
+      // only the branch taken is compiled.
+      if(jamlisp_nilp(reg_constant_value(c, cond))){
+	c->reader->offset += insn->then_size;
+	return reg_node(c, depth);
+      }
+      u32 result = reg_node(c, depth);
+      c->reader->offset += insn->else_size;
+      return result;
+    }
+    size_t branch = reg_emit(c, (jamlisp_reg_insn){.opcode = JAMLISP_REG_IF, .a = cond});
+    reg_move(c, depth, reg_node(c, depth));
+    size_t jump = reg_emit(c, (jamlisp_reg_insn){.opcode = JAMLISP_REG_JUMP});
+    reg_patch(c, branch);
+    reg_move(c, depth, reg_node(c, depth));
+    reg_patch(c, jump);
+    return depth;
+  }
+  default:
+    c->error = true;
+    return depth;
+  }
+}
+
+// compiles the node at the reader to put its value at 'depth'. Returns the
+// operand holding the value, which is 'depth', a register below it or a
+// constant.
+static u32 reg_node(reg_compiler * c, u32 depth){
+  jamlisp_insn insn;
+  if(c->error || c->nesting >= REG_MAX_NESTING || !jamlisp_read_prefix_node(c->ctx, c->reader, &insn)){
+    c->error = true;
+    return reg_constant(c, jamlisp_nil());
+  }
+  c->nesting += 1;
+  u32 operand = reg_node_inner(c, depth, &insn);
+  c->nesting -= 1;
+  return operand;
+}
+
+static bool reg_compile(jamlisp_context * ctx, jamlisp_reg_code * code, io_reader * reader, u32 arg_count, bool function){
+  code->count = 0;
+  code->constant_count = 0;
+  code->cache_count = 0;
+  code->arg_count = arg_count;
+  code->frame_size = arg_count;
+  reg_compiler c = {.ctx = ctx, .reader = reader, .code = code};
+  if(function){
+    u32 result = reg_node(&c, arg_count);
+    reg_emit(&c, (jamlisp_reg_insn){.opcode = JAMLISP_REG_RETURN, .a = result});
+  }else{
+    // each form leaves its value above the ones before it.
+    u32 forms = 0;
+    while(!c.error && reader->offset < reader->size){
+      if(((const u8 *) reader->data)[reader->offset] == JAMLISP_OPCODE_NONE){
+	reader->offset += 1;
+	break;
+      }
+      reg_move(&c, forms, reg_node(&c, forms));
+      forms += 1;
+    }
+    reg_emit(&c, (jamlisp_reg_insn){.opcode = JAMLISP_REG_END, .a = forms});
+  }
+  free(c.slots);
+  if(c.error)
+    logd("Invalid byte code\n");
+  return !c.error;
+}
+
+bool jamlisp_reg_compile(jamlisp_context * ctx, jamlisp_reg_code * code, io_reader * reader){
+  return reg_compile(ctx, code, reader, 0, false);
+}
+
+bool jamlisp_reg_compile_function(jamlisp_context * ctx, jamlisp_reg_code * code, const void * source, size_t size, u32 arg_count){
+  io_reader rd = io_from_bytes(source, size);
+  return reg_compile(ctx, code, &rd, arg_count, true);
+}
+
+void jamlisp_reg_code_free(jamlisp_reg_code * code){
+  free(code->insns);
+  free(code->constants);
+  free(code->caches);
+  *code = (jamlisp_reg_code){0};
+}
+
+void jamlisp_reg_eval(jamlisp_context * ctx, io_reader * reader){
+  jamlisp_reg_code code = {0};
+  if(jamlisp_reg_compile(ctx, &code, reader))
+    jamlisp_reg_iterate(ctx, &code);
+  jamlisp_reg_code_free(&code);
+}
+
+static inline bool reg_cache_valid(jamlisp_context * ctx, jamlisp_reg_cache * cache, u32 symbol, u32 arg_count){
+  if(__builtin_expect(cache->version == ctx->symbol_version && cache->code->arg_count == arg_count, 1)){
+    ctx->call_stats.cache_hits += 1;
+    return true;
+  }
+  return jamlisp_reg_cache_fill(ctx, cache, symbol, arg_count);
+}
+
+// Runs register code with computed goto dispatch. A call moves local_base to
+// its first argument register and continues in the code of the function, the
+// registers of the new frame above the arguments start out nil. The value
+// stack ends at the last register of the running frame, except around a call
+// where it ends at its last argument.
+void jamlisp_reg_iterate(jamlisp_context * ctx, jamlisp_reg_code * code){
+  static void * dispatch[] = {
+    [JAMLISP_REG_MOVE] = &&op_move,
+    [JAMLISP_REG_ADD] = &&op_add,
+    [JAMLISP_REG_SUB] = &&op_sub,
+    [JAMLISP_REG_MUL] = &&op_mul,
+    [JAMLISP_REG_DIV] = &&op_div,
+    [JAMLISP_REG_LESS] = &&op_less,
+    [JAMLISP_REG_CONS] = &&op_cons,
+    [JAMLISP_REG_PRINT] = &&op_print,
+    [JAMLISP_REG_GLOBAL] = &&op_global,
+    [JAMLISP_REG_IF] = &&op_if,
+    [JAMLISP_REG_JUMP] = &&op_jump,
+    [JAMLISP_REG_BIND] = &&op_bind,
+    [JAMLISP_REG_UNBIND] = &&op_unbind,
+    [JAMLISP_REG_PRIMITIVE] = &&op_primitive,
+    [JAMLISP_REG_CALL] = &&op_call,
+    [JAMLISP_REG_TAILCALL] = &&op_tailcall,
+    [JAMLISP_REG_RETURN] = &&op_return,
+    [JAMLISP_REG_END] = &&op_end,
+  };
+  size_t prev_locals = jamlisp_enter_locals(ctx);
+  int cframe_base = ctx->cframe_count;
+  // the code of the running function.
+  jamlisp_reg_code * current = code;
+  jamlisp_reg_insn * ip;
+  jamlisp_object * regs;
+  const jamlisp_object * constants;
+  jamlisp_reg_cache * caches;
+#define RK(operand) ((operand) & JAMLISP_REG_CONSTANT ? constants[(operand) & ~JAMLISP_REG_CONSTANT] : regs[operand])
+#define FRAME_TOP() ctx->value_stack.count = ctx->local_base + current->frame_size
+#define ENTER()								\
+  if(__builtin_expect(ctx->local_base + current->frame_size > ctx->value_stack.capacity, 0)) \
+    ERROR("Value stack overflow\n");					\
+  regs = ctx->value_stack.objects + ctx->local_base;			\
+  memset(regs + current->arg_count, 0, (current->frame_size - current->arg_count) * sizeof(jamlisp_object)); \
+  FRAME_TOP();								\
+  ip = current->insns;							\
+  constants = current->constants;					\
+  caches = current->caches
+#define DISPATCH() JAMLISP_TRACE_NODE(ctx, ip - current->insns, ip->opcode); goto *dispatch[ip->opcode]
+#define NEXT() ip += 1; DISPATCH()
+#define I64_OP(overflow_op, generic)					\
+  {									\
+    var a = RK(ip->a);							\
+    var b = RK(ip->b);							\
+    i64 r;								\
+    if(__builtin_expect(JAMLISP_BOTH_INT64(a, b) && !overflow_op(JAMLISP_INT64(a), JAMLISP_INT64(b), &r) && JAMLISP_INT64_FITS(r), 1)) \
+      regs[ip->dst] = JAMLISP_MAKE_INT64(r);				\
+    else								\
+      regs[ip->dst] = generic(ctx, a, b);				\
+  }
+  ENTER();
+  DISPATCH();
+
+ op_move:
+  regs[ip->dst] = RK(ip->a);
+  NEXT();
+
+ op_add:
+  I64_OP(__builtin_add_overflow, jamlisp_add);
+  NEXT();
+
+ op_sub:
+  I64_OP(__builtin_sub_overflow, jamlisp_sub);
+  NEXT();
+
+ op_mul:
+  I64_OP(__builtin_mul_overflow, jamlisp_mul);
+  NEXT();
+
+ op_div:
+  regs[ip->dst] = jamlisp_div(ctx, RK(ip->a), RK(ip->b));
+  NEXT();
+
+ op_less:
+  {
+    var a = RK(ip->a);
+    var b = RK(ip->b);
+    if(__builtin_expect(JAMLISP_BOTH_INT64(a, b), 1))
+      regs[ip->dst] = JAMLISP_INT64(a) < JAMLISP_INT64(b) ? JAMLISP_MAKE_SYMBOL(JAMLISP_SYMBOL_T) : jamlisp_nil();
+    else
+      regs[ip->dst] = jamlisp_less(ctx, a, b);
+  }
+  NEXT();
+
+ op_cons:
+  regs[ip->dst] = jamlisp_cons(ctx, RK(ip->a), RK(ip->b));
+  NEXT();
+
+ op_print:
+  jamlisp_print(RK(ip->a));
+  NEXT();
+
+ op_global:
+  regs[ip->dst] = symbol_get_value(ctx, JAMLISP_MAKE_SYMBOL(ip->a));
+  NEXT();
+
+ op_if:
+  if(jamlisp_nilp(RK(ip->a)))
+    ip += ip->b;
+  NEXT();
+
+ op_jump:
+  ip += ip->b;
+  NEXT();
+
+ op_bind:
+  jamlisp_push_symbol_value(ctx, JAMLISP_MAKE_SYMBOL(ip->a), RK(ip->b));
+  NEXT();
+
+ op_unbind:
+  jamlisp_pop_symbol_value(ctx, JAMLISP_MAKE_SYMBOL(ip->a));
+  NEXT();
+
+ op_primitive:
+  ctx->value_stack.count = ctx->local_base + ip->dst + ip->b;
+  jamlisp_call_primitive(ctx, ip->a, ip->b);
+  FRAME_TOP();
+  NEXT();
+
+ op_tailcall:
+  if(ctx->cframe_count > cframe_base){
+    var cache = caches + ip->c;
+    ctx->value_stack.count = ctx->local_base + ip->dst + ip->b;
+    if(!reg_cache_valid(ctx, cache, ip->a, ip->b)){
+      jamlisp_call_native(ctx, ip->a, ip->b);
+      FRAME_TOP();
+      NEXT();
+    }
+    jamlisp_tail_call(ctx, ip->b);
+    current = cache->code;
+    ENTER();
+    DISPATCH();
+  }
+  // not inside a function, this is a normal call.
+ op_call:
+  {
+    var cache = caches + ip->c;
+    ctx->value_stack.count = ctx->local_base + ip->dst + ip->b;
+    if(!reg_cache_valid(ctx, cache, ip->a, ip->b)){
+      jamlisp_call_native(ctx, ip->a, ip->b);
+      FRAME_TOP();
+      NEXT();
+    }
+    var cf = jamlisp_call_enter(ctx, ip->b);
+    cf->reg_code = current;
+    cf->reg_ip = ip;
+    current = cache->code;
+    ENTER();
+  }
+  DISPATCH();
+
+ op_return:
+  {
+    // the result takes the place of the arguments, in the register of the CALL.
+    jamlisp_push(ctx, RK(ip->a));
+    var cf = jamlisp_call_return(ctx);
+    current = cf->reg_code;
+    ip = cf->reg_ip;
+    regs = ctx->value_stack.objects + ctx->local_base;
+    constants = current->constants;
+    caches = current->caches;
+    FRAME_TOP();
+  }
+  NEXT();
+
+ op_end:
+  ctx->value_stack.count = ctx->local_base + ip->a;
+  ctx->local_base = prev_locals;
+  return;
+#undef I64_OP
+#undef NEXT
+#undef DISPATCH
+#undef ENTER
+#undef FRAME_TOP
+#undef RK
+}
@@ -3,6 +3,9 @@
 #include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
 #include <iron/types.h>
 #include <iron/utils.h>
 #include <iron/log.h>
@@ -14,8 +17,9 @@
 #include "jamlisp.h"
 
 void stack_push(stack * stk, const void * data, size_t count){
-  if(stk->count + count >= stk->capacity){
-    size_t newcap = stk->count * 2 + count;
+  if(stk->count + count > stk->capacity){
+    // doubles the capacity, so a run of pushes does not realloc each time.
+    size_t newcap = MAX(stk->capacity * 2, stk->count + count);
     stk->capacity = newcap;
     stk->elements= realloc(stk->elements, newcap);
   }
@@ -33,3 +37,98 @@ void stack_pop(stack * stk, void * data, size_t count){
 void stack_top(stack * stk, void * data, size_t count){  
   memcpy(data, stk->elements + stk->count - count, count);
 }
+
+// guard pages of the mapped value stacks, read by the SIGSEGV handler. A
+// slot is free when begin is 0.
+#define VALUE_STACK_GUARDS 64
+static struct{
+  volatile uintptr_t begin;
+  volatile uintptr_t end;
+}value_stack_guards[VALUE_STACK_GUARDS];
+static struct sigaction value_stack_old_action;
+
+// a fault in a guard page is reported and then raised again without the
+// handler, so the process still dies with SIGSEGV. Other faults go to the
+// handler that was installed before.
+static void value_stack_on_segv(int sig, siginfo_t * info, void * uctx){
+  uintptr_t addr = (uintptr_t) info->si_addr;
+  for(size_t i = 0; i < VALUE_STACK_GUARDS; i++){
+    if(addr >= value_stack_guards[i].begin && addr < value_stack_guards[i].end){
+      static const char msg[] = "value stack overflow\n";
+      ssize_t written = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+      (void) written;
+      signal(SIGSEGV, SIG_DFL);
+      return;
+    }
+  }
+  var old = &value_stack_old_action;
+  if((old->sa_flags & SA_SIGINFO) != 0)
+    old->sa_sigaction(sig, info, uctx);
+  else if(old->sa_handler == SIG_DFL || old->sa_handler == SIG_IGN)
+    signal(SIGSEGV, SIG_DFL);
+  else
+    old->sa_handler(sig);
+}
+
+// the handler runs on an alternate stack, the thread that overflows may have
+// no C stack left. The alternate stack is per thread, it is set once for each
+// thread that maps a value stack.
+static void value_stack_install_handler(){
+  static __thread bool alt_stack;
+  if(!alt_stack){
+    alt_stack = true;
+    stack_t current;
+    if(sigaltstack(NULL, &current) == 0 && (current.ss_flags & SS_DISABLE) != 0){
+      size_t size = MAX((size_t) SIGSTKSZ, (size_t) 1 << 16);
+      stack_t ss = {.ss_sp = malloc(size), .ss_size = size};
+      sigaltstack(&ss, NULL);
+    }
+  }
+  static bool installed;
+  if(__atomic_exchange_n(&installed, true, __ATOMIC_SEQ_CST))
+    return;
+  struct sigaction action = {.sa_sigaction = value_stack_on_segv, .sa_flags = SA_SIGINFO | SA_ONSTACK};
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &value_stack_old_action);
+}
+
+// the value stack is a private anonymous mapping followed by a page that can
+// not be touched, a push past the end faults there instead of writing over
+// the heap and reports "value stack overflow".
+void jamlisp_value_stack_init(jamlisp_value_stack * stk, size_t capacity){
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = (capacity * sizeof(jamlisp_object) + page - 1) / page * page;
+  u8 * data = mmap(NULL, size + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(data == MAP_FAILED){
+    ERROR("Unable to map the value stack\n");
+    *stk = (jamlisp_value_stack){0};
+    return;
+  }
+  mprotect(data + size, page, PROT_NONE);
+  *stk = (jamlisp_value_stack){.objects = (jamlisp_object *) data, .capacity = size / sizeof(jamlisp_object)};
+  value_stack_install_handler();
+  for(size_t i = 0; i < VALUE_STACK_GUARDS; i++){
+    uintptr_t free_slot = 0;
+    if(__atomic_compare_exchange_n(&value_stack_guards[i].begin, &free_slot, (uintptr_t) (data + size), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+      value_stack_guards[i].end = (uintptr_t) (data + size + page);
+      break;
+    }
+  }
+}
+
+// unmaps the stack and its guard page.
+void jamlisp_value_stack_free(jamlisp_value_stack * stk){
+  if(stk->objects == NULL)
+    return;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t size = stk->capacity * sizeof(jamlisp_object);
+  uintptr_t guard = (uintptr_t) stk->objects + size;
+  for(size_t i = 0; i < VALUE_STACK_GUARDS; i++){
+    if(value_stack_guards[i].begin == guard){
+      value_stack_guards[i].end = 0;
+      __atomic_store_n(&value_stack_guards[i].begin, 0, __ATOMIC_SEQ_CST);
+    }
+  }
+  munmap(stk->objects, size + page);
+  *stk = (jamlisp_value_stack){0};
+}
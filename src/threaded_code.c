@@ -0,0 +1,270 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Threaded code.
+// The prefix bytecode is decoded once into an array of fixed width
+// instructions in postfix order. LEB decoding, the magic check and the opcode
+// validation happens here instead of for every node visited by jamlisp_iterate.
+
+static void emit_insn(void * userdata, const jamlisp_insn * insn){
+  jamlisp_code * code = userdata;
+  jamlisp_insn * out = alloc_elems((void **) &code->insns, sizeof(code->insns[0]), &code->count, &code->capacity, 1);
+  *out = *insn;
+  if(insn->opcode == JAMLISP_OPCODE_CALL || insn->opcode == JAMLISP_OPCODE_TAILCALL){
+    out->cache = code->cache_count;
+    jamlisp_call_cache * cache = alloc_elems((void **) &code->caches, sizeof(code->caches[0]), &code->cache_count, &code->cache_capacity, 1);
+    *cache = (jamlisp_call_cache){0};
+  }
+}
+
+bool jamlisp_code_load(jamlisp_context * ctx, jamlisp_code * code, io_reader * reader){
+  code->count = 0;
+  code->cache_count = 0;
+  bool ok = jamlisp_prefix_to_postfix(ctx, reader, emit_insn, code);
+  emit_insn(code, &(jamlisp_insn){.opcode = JAMLISP_OPCODE_NONE});
+  return ok;
+}
+
+void jamlisp_code_free(jamlisp_code * code){
+  free(code->insns);
+  free(code->caches);
+  *code = (jamlisp_code){0};
+}
+
+// a CALL goes straight to the cached threaded code unless a function
+// definition changed since the cache was filled.
+static inline bool call_cache_valid(jamlisp_context * ctx, jamlisp_call_cache * cache, u32 symbol, u32 arg_count){
+  if(__builtin_expect(cache->version == ctx->symbol_version, 1)){
+    ctx->call_stats.cache_hits += 1;
+    return true;
+  }
+  return jamlisp_call_cache_fill(ctx, cache, symbol, arg_count);
+}
+
+// Runs the code with computed goto dispatch. Since the instructions are in
+// postfix order there are no frames per node. A call continues in the threaded
+// code of the function and its NONE returns to the caller.
+void jamlisp_code_iterate(jamlisp_context * ctx, jamlisp_code * code){
+  static void * dispatch[] = {
+    [JAMLISP_OPCODE_NONE] = &&op_none,
+    [JAMLISP_OPCODE_CONS] = &&op_cons,
+    [JAMLISP_OPCODE_ADD] = &&op_add,
+    [JAMLISP_OPCODE_SUB] = &&op_sub,
+    [JAMLISP_OPCODE_MUL] = &&op_mul,
+    [JAMLISP_OPCODE_DIV] = &&op_div,
+    [JAMLISP_OPCODE_INT] = &&op_int,
+    [JAMLISP_OPCODE_PRINT] = &&op_print,
+    [JAMLISP_OPCODE_CALL] = &&op_call,
+    [JAMLISP_OPCODE_LOCAL] = &&op_local,
+    [JAMLISP_OPCODE_LET] = &&op_let,
+    [JAMLISP_OPCODE_GLOBAL] = &&op_global,
+    [JAMLISP_OPCODE_BIND] = &&op_bind,
+    [JAMLISP_OPCODE_UNBIND] = &&op_unbind,
+    [JAMLISP_OPCODE_LESS] = &&op_less,
+    [JAMLISP_OPCODE_IF] = &&op_if,
+    [JAMLISP_OPCODE_TAILCALL] = &&op_tailcall,
+    [JAMLISP_OPCODE_JUMP] = &&op_jump,
+    [JAMLISP_OPCODE_PRIMITIVE] = &&op_primitive,
+    [JAMLISP_OPCODE_ADD_I64] = &&op_add_i64,
+    [JAMLISP_OPCODE_SUB_I64] = &&op_sub_i64,
+    [JAMLISP_OPCODE_MUL_I64] = &&op_mul_i64,
+    [JAMLISP_OPCODE_LESS_I64] = &&op_less_i64,
+  };
+  // the code of the running function.
+  jamlisp_insn * insns = code->insns;
+  jamlisp_call_cache * caches = code->caches;
+  jamlisp_insn * ip = insns;
+  size_t prev_locals = jamlisp_enter_locals(ctx);
+  int cframe_base = ctx->cframe_count;
+#define DISPATCH() JAMLISP_TRACE_NODE(ctx, ip - insns, ip->opcode); goto *dispatch[ip->opcode]
+#define NEXT() ip += 1; DISPATCH()
+  // a generic instruction that sees two INT64 operands is rewritten to the
+  // _I64 form, which goes back to the generic one for any other operands.
+#define QUICKEN(quick) if(ctx->quicken && JAMLISP_BOTH_INT64(a, b)) ip->opcode = quick
+// the quickened forms work on the two top slots of the value stack in place.
+#define I64_OP(overflow_op, generic, generic_opcode)			\
+  {									\
+    jamlisp_object * sp = ctx->value_stack.objects + ctx->value_stack.count - 2; \
+    ctx->value_stack.count -= 1;					\
+    i64 r;								\
+    if(__builtin_expect(JAMLISP_BOTH_INT64(sp[0], sp[1]) && !overflow_op(JAMLISP_INT64(sp[0]), JAMLISP_INT64(sp[1]), &r) && JAMLISP_INT64_FITS(r), 1)){ \
+      sp[0] = JAMLISP_MAKE_INT64(r);					\
+    }else{								\
+      ip->opcode = generic_opcode;					\
+      sp[0] = generic(ctx, sp[0], sp[1]);					\
+    }									\
+  }
+  DISPATCH();
+
+ op_int:
+  jamlisp_push_i64(ctx, ip->int64);
+  NEXT();
+
+ op_add:
+  {
+    var b = jamlisp_pop(ctx);
+    var a = jamlisp_pop(ctx);
+    QUICKEN(JAMLISP_OPCODE_ADD_I64);
+    jamlisp_push(ctx, jamlisp_add(ctx, a, b));
+  }
+  NEXT();
+
+ op_add_i64:
+  I64_OP(__builtin_add_overflow, jamlisp_add, JAMLISP_OPCODE_ADD);
+  NEXT();
+  
+ op_print:
+  jamlisp_print(jamlisp_top(ctx));
+  NEXT();
+
+ op_sub:
+  {
+    var b = jamlisp_pop(ctx);
+    var a = jamlisp_pop(ctx);
+    QUICKEN(JAMLISP_OPCODE_SUB_I64);
+    jamlisp_push(ctx, jamlisp_sub(ctx, a, b));
+  }
+  NEXT();
+
+ op_sub_i64:
+  I64_OP(__builtin_sub_overflow, jamlisp_sub, JAMLISP_OPCODE_SUB);
+  NEXT();
+
+ op_less:
+  {
+    var b = jamlisp_pop(ctx);
+    var a = jamlisp_pop(ctx);
+    QUICKEN(JAMLISP_OPCODE_LESS_I64);
+    jamlisp_push(ctx, jamlisp_less(ctx, a, b));
+  }
+  NEXT();
+
+ op_less_i64:
+  {
+    jamlisp_object * sp = ctx->value_stack.objects + ctx->value_stack.count - 2;
+    ctx->value_stack.count -= 1;
+    if(__builtin_expect(JAMLISP_BOTH_INT64(sp[0], sp[1]), 1)){
+      sp[0] = JAMLISP_INT64(sp[0]) < JAMLISP_INT64(sp[1]) ? JAMLISP_MAKE_SYMBOL(JAMLISP_SYMBOL_T) : jamlisp_nil();
+    }else{
+      ip->opcode = JAMLISP_OPCODE_LESS;
+      sp[0] = jamlisp_less(ctx, sp[0], sp[1]);
+    }
+  }
+  NEXT();
+
+ op_mul:
+  {
+    var b = jamlisp_pop(ctx);
+    var a = jamlisp_pop(ctx);
+    QUICKEN(JAMLISP_OPCODE_MUL_I64);
+    jamlisp_push(ctx, jamlisp_mul(ctx, a, b));
+  }
+  NEXT();
+
+ op_mul_i64:
+  I64_OP(__builtin_mul_overflow, jamlisp_mul, JAMLISP_OPCODE_MUL);
+  NEXT();
+
+ op_div:
+  {
+    var b = jamlisp_pop(ctx);
+    var a = jamlisp_pop(ctx);
+    jamlisp_push(ctx, jamlisp_div(ctx, a, b));
+  }
+  NEXT();
+
+ op_cons:
+  {
+    var cdr = jamlisp_pop(ctx);
+    var car = jamlisp_pop(ctx);
+    jamlisp_push(ctx, jamlisp_cons(ctx, car, cdr));
+  }
+  NEXT();
+
+ op_primitive:
+  jamlisp_call_primitive(ctx, ip->call, ip->child_count);
+  NEXT();
+
+ op_if:
+  if(jamlisp_nilp(jamlisp_pop(ctx)))
+    ip += ip->jump;
+  NEXT();
+
+ op_jump:
+  ip += ip->jump;
+  NEXT();
+
+ op_tailcall:
+  if(ctx->cframe_count > cframe_base){
+    var cache = caches + ip->cache;
+    if(!call_cache_valid(ctx, cache, ip->call, ip->child_count)){
+      jamlisp_call_native(ctx, ip->call, ip->child_count);
+      NEXT();
+    }
+    jamlisp_tail_call(ctx, ip->child_count);
+    insns = ip = cache->insns;
+    caches = cache->caches;
+    DISPATCH();
+  }
+  // not inside a function, this is a normal call.
+ op_call:
+  {
+    var cache = caches + ip->cache;
+    if(!call_cache_valid(ctx, cache, ip->call, ip->child_count)){
+      jamlisp_call_native(ctx, ip->call, ip->child_count);
+      NEXT();
+    }
+    var cf = jamlisp_call_enter(ctx, ip->child_count);
+    cf->ip = ip;
+    cf->insns = insns;
+    cf->caches = caches;
+    insns = ip = cache->insns;
+    caches = cache->caches;
+  }
+  DISPATCH();
+
+ op_local:
+  jamlisp_push(ctx, JAMLISP_LOCAL(ctx, ip->local));
+  NEXT();
+
+ op_let:
+  jamlisp_let_exit(ctx, ip->child_count - 1);
+  NEXT();
+
+ op_global:
+  jamlisp_push_global(ctx, ip->call);
+  NEXT();
+
+ op_bind:
+  jamlisp_bind(ctx, ip->call);
+  NEXT();
+
+ op_unbind:
+  jamlisp_unbind(ctx, ip->call);
+  NEXT();
+
+ op_none:
+  if(ctx->cframe_count > cframe_base){
+    var cf = jamlisp_call_return(ctx);
+    ip = cf->ip;
+    insns = cf->insns;
+    caches = cf->caches;
+    NEXT();
+  }
+  ctx->local_base = prev_locals;
+  return;
+#undef I64_OP
+#undef QUICKEN
+#undef NEXT
+#undef DISPATCH
+}
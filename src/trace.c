@@ -0,0 +1,64 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+void jamlisp_trace_enable(jamlisp_context * ctx, size_t capacity){
+  size_t cap = 1;
+  while(cap < capacity)
+    cap *= 2;
+  jamlisp_trace_disable(ctx);
+  ctx->trace.records = alloc0(sizeof(ctx->trace.records[0]) * cap);
+  ctx->trace.capacity = cap;
+}
+
+void jamlisp_trace_disable(jamlisp_context * ctx){
+  free(ctx->trace.records);
+  ctx->trace = (jamlisp_trace_ring){0};
+}
+
+void jamlisp_trace_node(jamlisp_context * ctx, u32 node_id, u32 opcode){
+  var trace = &ctx->trace;
+  var rec = trace->records + (trace->count & (trace->capacity - 1));
+  rec->node_id = node_id;
+  rec->opcode_depth = JAMLISP_TRACE_PACK(opcode, ctx->value_stack.count);
+  trace->count += 1;
+}
+
+// copies out up to 'count' of the most recent records, oldest first.
+size_t jamlisp_trace_read(jamlisp_context * ctx, jamlisp_trace_record * records, size_t count){
+  var trace = &ctx->trace;
+  size_t available = MIN(trace->count, trace->capacity);
+  count = MIN(count, available);
+  u64 start = trace->count - count;
+  for(size_t i = 0; i < count; i++)
+    records[i] = trace->records[(start + i) & (trace->capacity - 1)];
+  return count;
+}
+
+static void write_u32_le(io_writer * writer, u32 v){
+  u8 bytes[4] = {v, v >> 8, v >> 16, v >> 24};
+  io_write(writer, bytes, sizeof(bytes));
+}
+
+// writes the ring as a record count followed by the records, oldest first.
+// Each is the node id and the packed opcode and depth, little endian.
+void jamlisp_trace_write(jamlisp_context * ctx, io_writer * writer){
+  var trace = &ctx->trace;
+  size_t count = MIN(trace->count, trace->capacity);
+  io_write_u64_leb(writer, count);
+  u64 start = trace->count - count;
+  for(size_t i = 0; i < count; i++){
+    var rec = trace->records + ((start + i) & (trace->capacity - 1));
+    write_u32_le(writer, rec->node_id);
+    write_u32_le(writer, rec->opcode_depth);
+  }
+}
@@ -0,0 +1,231 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <iron/types.h>
+#include <iron/utils.h>
+#include <iron/log.h>
+#include <iron/mem.h>
+#include <microio.h>
+
+#include "jamlisp.h"
+
+// Verifier.
+// Prefix bytecode from outside, like a module file, is checked once before it
+// runs so the interpreter does not have to check every node. Each node is
+// read with the end of the code in view, so nothing is read past it, and the
+// tree is walked to check that every form is complete, that the branch sizes
+// of IF are the sizes of its branches and that opcodes and primitives get the
+// number of arguments they take. The walk follows the value stack of
+// jamlisp_iterate, so the most it holds and the deepest frame are known and
+// the interpreter can reserve them once. It is also the depth of the frame at
+// each LOCAL, a LOCAL past it reads an argument, and the most arguments read
+// is the fewest a call has to pass. Top level code has no arguments.
+
+// the number of LEB operands of an opcode and their longest encoding, -1 for
+// opcodes that are not in prefix bytecode.
+static int operand_count(u8 byte, int * max_length){
+  *max_length = 5;
+  switch(byte){
+  case JAMLISP_OPCODE_NONE:
+  case JAMLISP_OPCODE_ADD:
+  case JAMLISP_OPCODE_SUB:
+  case JAMLISP_OPCODE_MUL:
+  case JAMLISP_OPCODE_DIV:
+  case JAMLISP_OPCODE_CONS:
+  case JAMLISP_OPCODE_PRINT:
+  case JAMLISP_OPCODE_LESS:
+  case JAMLISP_CODE_INT_SMALL ... JAMLISP_CODE_INT_SMALL + JAMLISP_SMALL_INT_MAX - JAMLISP_SMALL_INT_MIN:
+  case JAMLISP_CODE_LOCAL_SMALL ... JAMLISP_CODE_LOCAL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+    return 0;
+  case JAMLISP_OPCODE_INT:
+    *max_length = 10;
+    return 1;
+  case JAMLISP_OPCODE_LOCAL:
+  case JAMLISP_OPCODE_GLOBAL:
+  case JAMLISP_OPCODE_LET:
+  case JAMLISP_OPCODE_BIND:
+  case JAMLISP_CODE_CALL_SMALL ... JAMLISP_CODE_CALL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+  case JAMLISP_CODE_TAILCALL_SMALL ... JAMLISP_CODE_TAILCALL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+    return 1;
+  case JAMLISP_OPCODE_CALL:
+  case JAMLISP_OPCODE_TAILCALL:
+  case JAMLISP_OPCODE_PRIMITIVE:
+  case JAMLISP_OPCODE_IF:
+    return 2;
+  default:
+    return -1;
+  }
+}
+
+// reads the node at 'p' into 'insn', returns its size or 0 if it is cut off
+// or not a node. The LEB operands are read here and not by
+// jamlisp_read_prefix_node, which does not know where the code ends.
+static size_t read_node(jamlisp_context * ctx, const u8 * p, size_t size, jamlisp_insn * insn){
+  u8 byte = p[0];
+  int max_length;
+  int count = operand_count(byte, &max_length);
+  if(count < 0)
+    return 0;
+  u64 operands[2] = {0};
+  size_t offset = 1;
+  for(int i = 0; i < count; i++){
+    int shift = 0;
+    u8 b;
+    do{
+      if(offset >= size || shift == 7 * max_length)
+	return 0;
+      b = p[offset++];
+      operands[i] |= (u64)(b & 0x7f) << shift;
+      shift += 7;
+    }while(b & 0x80);
+  }
+  // only the parts of the node that are checked.
+  *insn = (jamlisp_insn){.opcode = byte};
+  switch(byte){
+  case JAMLISP_OPCODE_ADD:
+  case JAMLISP_OPCODE_SUB:
+  case JAMLISP_OPCODE_MUL:
+  case JAMLISP_OPCODE_DIV:
+  case JAMLISP_OPCODE_CONS:
+  case JAMLISP_OPCODE_PRINT:
+  case JAMLISP_OPCODE_LESS:
+    if(byte >= ctx->opcodedef_count)
+      return 0;
+    insn->child_count = ctx->opcodedefs[byte].arg_count;
+    break;
+  case JAMLISP_OPCODE_CALL:
+  case JAMLISP_OPCODE_TAILCALL:
+  case JAMLISP_OPCODE_PRIMITIVE:
+    insn->call = operands[0];
+    insn->child_count = operands[1];
+    break;
+  case JAMLISP_CODE_CALL_SMALL ... JAMLISP_CODE_CALL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+    insn->child_count = byte - JAMLISP_CODE_CALL_SMALL;
+    break;
+  case JAMLISP_CODE_TAILCALL_SMALL ... JAMLISP_CODE_TAILCALL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+    insn->child_count = byte - JAMLISP_CODE_TAILCALL_SMALL;
+    break;
+  case JAMLISP_OPCODE_LET:
+    insn->child_count = operands[0];
+    break;
+  case JAMLISP_OPCODE_LOCAL:
+    insn->local = operands[0];
+    break;
+  case JAMLISP_CODE_LOCAL_SMALL ... JAMLISP_CODE_LOCAL_SMALL + JAMLISP_CODE_SMALL_COUNT - 1:
+    insn->opcode = JAMLISP_OPCODE_LOCAL;
+    insn->local = byte - JAMLISP_CODE_LOCAL_SMALL;
+    break;
+  case JAMLISP_OPCODE_BIND:
+    insn->child_count = 2;
+    break;
+  case JAMLISP_OPCODE_IF:
+    insn->then_size = operands[0];
+    insn->else_size = operands[1];
+    insn->child_count = 3;
+    break;
+  default:
+    break;
+  }
+  return offset;
+}
+
+typedef struct{
+  u32 opcode;
+  u32 child_count;
+  u32 then_size;
+  u32 else_size;
+  // where the current branch of an IF started.
+  size_t start;
+  // the value stack depth before the node.
+  u32 base;
+}verify_pending;
+
+static bool verify_arguments(jamlisp_context * ctx, const jamlisp_insn * insn){
+  switch(insn->opcode){
+  case JAMLISP_OPCODE_PRIMITIVE:{
+    if(insn->call >= ctx->primitive_count)
+      return false;
+    var p = ctx->primitives + insn->call;
+    return insn->child_count >= p->min_args && insn->child_count <= p->max_args;
+  }
+  case JAMLISP_OPCODE_LET:
+    // the body is the last child.
+    return insn->child_count > 0;
+  default:
+    return true;
+  }
+}
+
+bool jamlisp_verify(jamlisp_context * ctx, const void * code, size_t size, jamlisp_verify_info * info){
+  const u8 * bytes = code;
+  verify_pending * pending = NULL;
+  size_t pending_capacity = 0;
+  size_t depth = 0;
+  size_t offset = 0;
+  // objects on the value stack.
+  u32 stack = 0;
+  jamlisp_verify_info found = {0};
+  bool ok = true;
+  while(ok && offset < size){
+    jamlisp_insn insn;
+    size_t length = read_node(ctx, bytes + offset, size - offset, &insn);
+    if(length == 0){
+      ok = false;
+      break;
+    }
+    offset += length;
+    if(insn.opcode == JAMLISP_OPCODE_NONE){
+      // a NONE ends each top level form.
+      ok = depth == 0;
+      continue;
+    }
+    if(!verify_arguments(ctx, &insn)){
+      ok = false;
+      break;
+    }
+    found.max_frames = MAX(found.max_frames, depth + 1);
+    if(insn.child_count > 0){
+      ensure_size2((void **) &pending, sizeof(pending[0]), &pending_capacity, depth, 1.5);
+      pending[depth++] = (verify_pending){.opcode = insn.opcode, .child_count = insn.child_count,
+					  .then_size = insn.then_size, .else_size = insn.else_size, .base = stack};
+      continue;
+    }
+    // the frame holds the values below this node, the rest of it are arguments.
+    if(insn.opcode == JAMLISP_OPCODE_LOCAL && insn.local >= stack)
+      found.arg_count = MAX(found.arg_count, insn.local - stack + 1);
+    // a leaf pushes its value.
+    stack += 1;
+    found.max_stack = MAX(found.max_stack, stack);
+    // the node is done, and so is every parent it was the last child of.
+    while(depth > 0){
+      var parent = pending + depth - 1;
+      parent->child_count -= 1;
+      if(parent->opcode == JAMLISP_OPCODE_IF){
+	if(parent->child_count == 1 && offset - parent->start != parent->then_size)
+	  ok = false;
+	if(parent->child_count == 0 && offset - parent->start != parent->else_size)
+	  ok = false;
+	parent->start = offset;
+	// the condition is popped, and only one of the branches runs.
+	if(parent->child_count > 0)
+	  stack = parent->base;
+      }
+      // the value of a BIND moves to the binding stack.
+      if(parent->opcode == JAMLISP_OPCODE_BIND && parent->child_count == 1)
+	stack -= 1;
+      if(parent->child_count > 0)
+	break;
+      // the children are replaced by the value of the node.
+      stack = parent->base + 1;
+      depth -= 1;
+    }
+  }
+  if(depth > 0)
+    ok = false;
+  free(pending);
+  if(ok && info != NULL)
+    *info = found;
+  return ok;
+}